@@ -0,0 +1,170 @@
+#include "CodecBenchmark.h"
+
+#include "../networking/EventCodec.h"
+#include "../networking/evtc_rpc_messages.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+constexpr size_t MAX_BATCH_EVENTS = evtc_rpc::messages::MAX_COMBAT_EVENT_BATCH_SIZE;
+constexpr size_t ITERATIONS = 50;
+
+// xevtc layout: version, string count and record count (uint32 each), followed by the strings (uint16 length + bytes)
+// and the records. Every record starts with the cbtevent, records that don't carry an event have it zeroed
+constexpr uint32_t XEVTC_VERSION = 1;
+constexpr size_t XEVTC_RECORD_SIZE = 160;
+
+bool ReadFile(const std::string& pPath, std::vector<uint8_t>& pData)
+{
+	FILE* file = fopen(pPath.c_str(), "rb");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	uint8_t buffer[64 * 1024];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		pData.insert(pData.end(), buffer, buffer + read);
+	}
+
+	bool result = ferror(file) == 0;
+	fclose(file);
+	return result;
+}
+
+bool ParseXevtc(const std::vector<uint8_t>& pData, std::vector<cbtevent>& pEvents)
+{
+	uint32_t header[3];
+	if (pData.size() < sizeof(header))
+	{
+		return false;
+	}
+	memcpy(header, pData.data(), sizeof(header));
+	if (header[0] != XEVTC_VERSION)
+	{
+		return false;
+	}
+
+	size_t position = sizeof(header);
+	for (uint32_t i = 0; i < header[1]; i++)
+	{
+		uint16_t length;
+		if (position + sizeof(length) > pData.size())
+		{
+			return false;
+		}
+		memcpy(&length, pData.data() + position, sizeof(length));
+		position += sizeof(length) + length;
+	}
+
+	if (position + static_cast<size_t>(header[2]) * XEVTC_RECORD_SIZE > pData.size())
+	{
+		return false;
+	}
+
+	static const cbtevent emptyEvent{};
+	for (uint32_t i = 0; i < header[2]; i++, position += XEVTC_RECORD_SIZE)
+	{
+		cbtevent event;
+		memcpy(&event, pData.data() + position, sizeof(event));
+		if (memcmp(&event, &emptyEvent, sizeof(event)) != 0)
+		{
+			pEvents.push_back(event);
+		}
+	}
+
+	return true;
+}
+}; // Anonymous namespace
+
+int RunCodecBenchmark(const std::vector<std::string>& pFiles)
+{
+	int result = 0;
+	for (const std::string& path : pFiles)
+	{
+		std::vector<uint8_t> data;
+		std::vector<cbtevent> events;
+		if (ReadFile(path, data) == false || ParseXevtc(data, events) == false)
+		{
+			fprintf(stderr, "Failed to read %s\n", path.c_str());
+			result = 1;
+			continue;
+		}
+		if (events.size() == 0)
+		{
+			printf("%s: no events\n", path.c_str());
+			continue;
+		}
+
+		// Every batch gets its own slice of the buffer so the decoding pass can run over all of them afterwards
+		std::vector<uint8_t> encoded(events.size() * EventEncoder::MAX_ENCODED_EVENT_SIZE);
+		std::vector<size_t> batchSizes;
+		std::chrono::steady_clock::duration encodeTime{};
+		std::chrono::steady_clock::duration decodeTime{};
+		bool mismatch = false;
+
+		for (size_t iteration = 0; iteration < ITERATIONS; iteration++)
+		{
+			batchSizes.clear();
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (size_t first = 0; first < events.size(); first += MAX_BATCH_EVENTS)
+			{
+				size_t count = std::min(MAX_BATCH_EVENTS, events.size() - first);
+				EventEncoder encoder{encoded.data() + first * EventEncoder::MAX_ENCODED_EVENT_SIZE};
+				for (size_t i = first; i < first + count; i++)
+				{
+					encoder.Encode(events[i]);
+				}
+				batchSizes.push_back(encoder.GetSize());
+			}
+			encodeTime += std::chrono::steady_clock::now() - start;
+
+			start = std::chrono::steady_clock::now();
+			for (size_t batch = 0; batch < batchSizes.size(); batch++)
+			{
+				size_t first = batch * MAX_BATCH_EVENTS;
+				size_t count = std::min(MAX_BATCH_EVENTS, events.size() - first);
+				EventDecoder decoder{encoded.data() + first * EventEncoder::MAX_ENCODED_EVENT_SIZE, batchSizes[batch]};
+				for (size_t i = first; i < first + count; i++)
+				{
+					cbtevent event;
+					if (decoder.Decode(event) == false || memcmp(&event, &events[i], sizeof(event)) != 0)
+					{
+						mismatch = true;
+					}
+				}
+			}
+			decodeTime += std::chrono::steady_clock::now() - start;
+		}
+
+		if (mismatch == true)
+		{
+			fprintf(stderr, "%s: decoded events don't match the input\n", path.c_str());
+			result = 2;
+		}
+
+		size_t encodedSize = 0;
+		for (size_t size : batchSizes)
+		{
+			encodedSize += size;
+		}
+
+		double eventCount = static_cast<double>(events.size() * ITERATIONS);
+		printf("%s: %zu events, %.2f bytes/event (%zu raw, %.1fx smaller), encode %.1f ns/event, decode %.1f ns/event\n",
+			path.c_str(),
+			events.size(),
+			static_cast<double>(encodedSize) / events.size(),
+			sizeof(cbtevent),
+			static_cast<double>(sizeof(cbtevent) * events.size()) / encodedSize,
+			std::chrono::duration<double, std::nano>(encodeTime).count() / eventCount,
+			std::chrono::duration<double, std::nano>(decodeTime).count() / eventCount);
+	}
+
+	return result;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Measures the CombatEventBatch payload codec (see networking/EventCodec.h) on the events of recorded xevtc logs, as
+// found in test/xevtc_logs. Events are encoded in runs of up to MAX_COMBAT_EVENT_BATCH_SIZE, the same as the client
+// sends them when it is behind. Prints bytes per event and encode and decode time per event for every file. Returns the
+// process exit code
+int RunCodecBenchmark(const std::vector<std::string>& pFiles);
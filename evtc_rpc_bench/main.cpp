@@ -0,0 +1,371 @@
+// Throughput and latency benchmark for evtc_rpc_server. Starts a server in-process and drives it with squads of
+// simulated clients over loopback (or a unix domain socket, see --endpoint). Every client sends combat events at a fixed
+// rate, every event is forwarded to the rest of the client's squad.
+// With --codec, the server is not started and the CombatEvent payload codec is measured on recorded logs instead (see
+// CodecBenchmark.h).
+
+#include "CodecBenchmark.h"
+
+#include "../networking/Client.h"
+#include "../networking/Server.h"
+#include "../src/Log.h"
+
+#ifdef LINUX
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace
+{
+struct BenchmarkOptions
+{
+	size_t SquadCount = 10;
+	size_t SquadSize = 10;
+	double EventRate = 100.0; // Events per second sent by every client
+	double Duration = 10.0; // Seconds
+	size_t CompletionQueueCount = 1;
+	std::string Endpoint = "localhost:50091";
+	std::string PrometheusEndpoint = "localhost:50092";
+	std::vector<std::string> CodecFiles;
+};
+
+struct BenchmarkClient
+{
+	std::unique_ptr<evtc_rpc_client> Client;
+	std::thread Thread;
+
+	// Only touched by the client's own serve thread until it is joined
+	std::vector<int64_t> Latencies; // Nanoseconds from queueing on the sender until received here
+};
+
+int64_t NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// CPU time in seconds used by the server's completion queue threads (see evtc_rpc_server::Serve). Work done on grpc's
+// internal threads is not included
+double GetServerCpuTime()
+{
+#ifdef LINUX
+	double result = 0.0;
+	long ticksPerSecond = sysconf(_SC_CLK_TCK);
+
+	DIR* tasks = opendir("/proc/self/task");
+	if (tasks == nullptr)
+	{
+		return 0.0;
+	}
+
+	while (dirent* entry = readdir(tasks))
+	{
+		if (entry->d_name[0] == '.')
+		{
+			continue;
+		}
+
+		char path[64];
+		snprintf(path, sizeof(path), "/proc/self/task/%s/stat", entry->d_name);
+		FILE* file = fopen(path, "r");
+		if (file == nullptr)
+		{
+			continue;
+		}
+
+		char buffer[512];
+		size_t length = fread(buffer, 1, sizeof(buffer) - 1, file);
+		fclose(file);
+		buffer[length] = '\0';
+
+		// Format is "<tid> (<comm>) <state> ..." where utime and stime are the 14th and 15th fields
+		std::string_view stat{buffer, length};
+		size_t commStart = stat.find('(');
+		size_t commEnd = stat.rfind(')');
+		if (commStart == stat.npos || commEnd == stat.npos || stat.substr(commStart + 1, commEnd - commStart - 1).starts_with("evtcrpc-w") == false)
+		{
+			continue;
+		}
+
+		unsigned long long utime = 0;
+		unsigned long long stime = 0;
+		if (sscanf(buffer + commEnd + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) == 2)
+		{
+			result += static_cast<double>(utime + stime) / ticksPerSecond;
+		}
+	}
+
+	closedir(tasks);
+	return result;
+#else
+	return 0.0;
+#endif
+}
+
+bool ParseOptions(int pArgumentCount, char** pArgumentVector, BenchmarkOptions& pOptions)
+{
+	for (int i = 1; i < pArgumentCount; i += 2)
+	{
+		std::string_view name = pArgumentVector[i];
+		if (i + 1 >= pArgumentCount)
+		{
+			fprintf(stderr, "Missing value for %s\n", pArgumentVector[i]);
+			return false;
+		}
+		const char* value = pArgumentVector[i + 1];
+
+		char* end = nullptr;
+		if (name == "--squads")
+		{
+			pOptions.SquadCount = strtoull(value, &end, 10);
+		}
+		else if (name == "--squad-size")
+		{
+			pOptions.SquadSize = strtoull(value, &end, 10);
+		}
+		else if (name == "--rate")
+		{
+			pOptions.EventRate = strtod(value, &end);
+		}
+		else if (name == "--duration")
+		{
+			pOptions.Duration = strtod(value, &end);
+		}
+		else if (name == "--threads")
+		{
+			pOptions.CompletionQueueCount = strtoull(value, &end, 10);
+		}
+		else if (name == "--endpoint")
+		{
+			pOptions.Endpoint = value;
+			continue;
+		}
+		else if (name == "--prometheus")
+		{
+			pOptions.PrometheusEndpoint = value;
+			continue;
+		}
+		else if (name == "--codec")
+		{
+			pOptions.CodecFiles.emplace_back(value);
+			continue;
+		}
+		else
+		{
+			fprintf(stderr, "Unknown argument %s\n", pArgumentVector[i]);
+			return false;
+		}
+
+		if (end == value || *end != '\0')
+		{
+			fprintf(stderr, "Invalid value \"%s\" for %s\n", value, pArgumentVector[i]);
+			return false;
+		}
+	}
+
+	if (pOptions.SquadCount == 0 || pOptions.SquadSize < 2 || pOptions.EventRate <= 0.0 || pOptions.Duration <= 0.0 || pOptions.CompletionQueueCount == 0)
+	{
+		fprintf(stderr, "Squad count, event rate, duration and thread count have to be positive and squads need at least 2 clients\n");
+		return false;
+	}
+
+	return true;
+}
+
+double Percentile(const std::vector<int64_t>& pSortedValues, double pPercentile)
+{
+	if (pSortedValues.size() == 0)
+	{
+		return 0.0;
+	}
+
+	size_t index = static_cast<size_t>(static_cast<double>(pSortedValues.size() - 1) * pPercentile / 100.0);
+	return static_cast<double>(pSortedValues[index]) / 1000.0;
+}
+}; // Anonymous namespace
+
+int main(int pArgumentCount, char** pArgumentVector)
+{
+	BenchmarkOptions options;
+	if (ParseOptions(pArgumentCount, pArgumentVector, options) == false)
+	{
+		fprintf(stderr, "usage: %s [--squads count] [--squad-size count] [--rate events per second per client] [--duration seconds] [--threads server completion queue count] [--endpoint listening endpoint, e.g. unix:/tmp/evtc_rpc_bench.sock] [--prometheus prometheus endpoint]\n", pArgumentVector[0]);
+		fprintf(stderr, "       %s --codec xevtc file [--codec xevtc file...]\n", pArgumentVector[0]);
+		return 1;
+	}
+
+	if (options.CodecFiles.size() > 0)
+	{
+		return RunCodecBenchmark(options.CodecFiles);
+	}
+
+	Log_::Init(false, "logs/evtc_rpc_bench.txt");
+	// Logging in the hot paths would dominate the measurement
+	Log_::SetLevel(spdlog::level::warn);
+
+	const size_t clientCount = options.SquadCount * options.SquadSize;
+	printf("Starting server on %s with %zu completion queues, %zu squads of %zu clients sending %.1f events/s each\n",
+		options.Endpoint.c_str(), options.CompletionQueueCount, options.SquadCount, options.SquadSize, options.EventRate);
+
+	auto server = std::make_unique<evtc_rpc_server>(options.Endpoint.c_str(), options.PrometheusEndpoint.c_str(), nullptr, options.CompletionQueueCount);
+	std::thread serverThread{evtc_rpc_server::ThreadStartServe, server.get()};
+
+	std::vector<BenchmarkClient> clients(clientCount);
+	for (size_t i = 0; i < clientCount; i++)
+	{
+		BenchmarkClient& client = clients[i];
+		auto eventHandler = [&client](cbtevent* pEvent, uint16_t /*pInstanceId*/)
+		{
+			client.Latencies.push_back(NowNs() - static_cast<int64_t>(pEvent->time));
+		};
+
+		client.Client = std::make_unique<evtc_rpc_client>([&options]() { return options.Endpoint; }, []() { return std::string{}; }, std::move(eventHandler));
+		client.Client->SetDisableEncryption(true);
+		client.Thread = std::thread{evtc_rpc_client::ThreadStartServe, client.Client.get()};
+	}
+
+	// Every client registers itself and the rest of its squad. Instance ids are only unique within a squad, as if every
+	// squad was in its own map instance
+	for (size_t squad = 0; squad < options.SquadCount; squad++)
+	{
+		for (size_t i = 0; i < options.SquadSize; i++)
+		{
+			evtc_rpc_client& client = *clients[squad * options.SquadSize + i].Client;
+			for (size_t j = 0; j < options.SquadSize; j++)
+			{
+				std::string name = "bench" + std::to_string(squad) + "." + std::to_string(j);
+
+				ag ag1{};
+				ag ag2{};
+				ag1.prof = static_cast<Prof>(1);
+				ag1.id = 1000 + j;
+				ag2.id = 1 + j;
+				ag2.name = name.c_str();
+				ag2.self = (i == j) ? 1 : 0;
+
+				if (i == j)
+				{
+					client.ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+				}
+				else
+				{
+					client.ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+				}
+			}
+		}
+	}
+
+	// Wait for all registrations to go through
+	std::chrono::steady_clock::time_point setupStart = std::chrono::steady_clock::now();
+	while (true)
+	{
+		ServerStatisticsSample sample = server->GetStatistics();
+		if (sample.RegisteredPlayers == clientCount && sample.RegisteredPeers == clientCount * (options.SquadSize - 1))
+		{
+			break;
+		}
+
+		if (std::chrono::steady_clock::now() - setupStart > std::chrono::seconds(30))
+		{
+			fprintf(stderr, "Timed out waiting for registrations - %zu/%zu players and %zu/%zu peers are registered\n",
+				sample.RegisteredPlayers, clientCount, sample.RegisteredPeers, clientCount * (options.SquadSize - 1));
+			return 1;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	printf("Setup took %.2f s\n", std::chrono::duration<double>(std::chrono::steady_clock::now() - setupStart).count());
+
+	// One thread per squad paces the events of all its clients
+	std::atomic_uint64_t sentEvents = 0;
+	std::vector<std::thread> senders;
+	double serverCpuStart = GetServerCpuTime();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t squad = 0; squad < options.SquadCount; squad++)
+	{
+		senders.emplace_back([&options, &clients, &sentEvents, squad, start]()
+			{
+				uint64_t sent = 0; // Per client
+				while (true)
+				{
+					double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+					if (elapsed >= options.Duration)
+					{
+						break;
+					}
+
+					uint64_t target = static_cast<uint64_t>(elapsed * options.EventRate);
+					for (; sent < target; sent++)
+					{
+						for (size_t i = 0; i < options.SquadSize; i++)
+						{
+							cbtevent event{};
+							event.time = static_cast<uint64_t>(NowNs());
+							event.src_agent = squad * options.SquadSize + i;
+							event.skillid = static_cast<uint32_t>(sent);
+							clients[squad * options.SquadSize + i].Client->ProcessLocalEvent(&event, nullptr, nullptr, nullptr, 0, 0);
+						}
+						sentEvents.fetch_add(options.SquadSize, std::memory_order_relaxed);
+					}
+
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+			});
+	}
+
+	for (std::thread& sender : senders)
+	{
+		sender.join();
+	}
+	for (BenchmarkClient& client : clients)
+	{
+		client.Client->FlushEvents(0, std::chrono::seconds(10));
+	}
+
+	// Give the last events a moment to be delivered before stopping the clients
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+	double serverCpu = GetServerCpuTime() - serverCpuStart;
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() - 0.5;
+
+	for (BenchmarkClient& client : clients)
+	{
+		client.Client->Shutdown();
+	}
+
+	std::vector<int64_t> latencies;
+	for (BenchmarkClient& client : clients)
+	{
+		client.Thread.join();
+		latencies.insert(latencies.end(), client.Latencies.begin(), client.Latencies.end());
+	}
+	std::sort(latencies.begin(), latencies.end());
+
+	server->Shutdown();
+	serverThread.join();
+
+	uint64_t sent = sentEvents.load();
+	uint64_t expectedDeliveries = sent * (options.SquadSize - 1);
+	printf("Sent %llu events in %.2f s (%.0f events/s)\n", static_cast<unsigned long long>(sent), elapsed, sent / elapsed);
+	printf("Delivered %zu/%llu forwarded events (%.0f events/s fan-out)\n",
+		latencies.size(), static_cast<unsigned long long>(expectedDeliveries), latencies.size() / elapsed);
+	printf("End-to-end latency: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+		Percentile(latencies, 50.0), Percentile(latencies, 99.0), Percentile(latencies, 99.9), Percentile(latencies, 100.0));
+#ifdef LINUX
+	printf("Server CPU: %.2f s (%.0f%% of one core), %.2f us per received event, %.2f us per forwarded event\n",
+		serverCpu, serverCpu * 100.0 / elapsed, sent > 0 ? serverCpu * 1e6 / sent : 0.0, latencies.size() > 0 ? serverCpu * 1e6 / latencies.size() : 0.0);
+#endif
+
+	// Clients have to be destroyed before the server, see the comment in SimpleNetworkTestFixture
+	clients.clear();
+	server = nullptr;
+	Log_::Shutdown();
+
+	return latencies.size() == expectedDeliveries ? 0 : 2;
+}
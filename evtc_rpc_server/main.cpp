@@ -8,7 +8,9 @@
 #include <jemalloc/jemalloc.h>
 #endif
 
+#include <algorithm>
 #include <memory>
+#include <string_view>
 #include <thread>
 
 constexpr static auto MALLOC_STATS_INTERVAL = std::chrono::seconds(600);
@@ -82,13 +84,135 @@ int main(int pArgumentCount, char** pArgumentVector)
 	Log_::SetLevel(spdlog::level::debug);
 	LogI("Start. Dependency versions:\n{}", DEPENDENCY_VERSIONS);
 
-	if (pArgumentCount != 3)
+	if (pArgumentCount < 3 || pArgumentCount > 11)
 	{
-		fprintf(stderr, "Invalid argument count\nusage: %s <listening endpoint> <prometheus endpoint>\n", pArgumentVector[0]);
+		fprintf(stderr, "Invalid argument count\nusage: %s <listening endpoint> <prometheus endpoint> [worker thread count] [max queued events per client] [queue overflow policy (drop-oldest|drop-non-healing|disconnect)] [max connections (0 for unlimited)] [events per second per client (0 for unlimited)] [event burst per client] [drain timeout in ms on shutdown] [session resume timeout in ms (0 to disable)]\n", pArgumentVector[0]);
 		return 1;
 	}
 
-	SERVER = std::make_unique<evtc_rpc_server>(pArgumentVector[1], pArgumentVector[2], nullptr);
+	size_t workerThreadCount = std::max(std::thread::hardware_concurrency(), 1U);
+	if (pArgumentCount >= 4)
+	{
+		char* end = nullptr;
+		unsigned long long parsed = strtoull(pArgumentVector[3], &end, 10);
+		if (end == pArgumentVector[3] || *end != '\0' || parsed == 0)
+		{
+			fprintf(stderr, "Invalid worker thread count \"%s\"\n", pArgumentVector[3]);
+			return 1;
+		}
+		workerThreadCount = static_cast<size_t>(parsed);
+	}
+
+	size_t maxQueuedEvents = 0;
+	if (pArgumentCount >= 5)
+	{
+		char* end = nullptr;
+		unsigned long long parsed = strtoull(pArgumentVector[4], &end, 10);
+		if (end == pArgumentVector[4] || *end != '\0' || parsed == 0)
+		{
+			fprintf(stderr, "Invalid max queued events \"%s\"\n", pArgumentVector[4]);
+			return 1;
+		}
+		maxQueuedEvents = static_cast<size_t>(parsed);
+	}
+
+	QueueOverflowPolicy overflowPolicy = QueueOverflowPolicy::DropOldest;
+	if (pArgumentCount >= 6)
+	{
+		std::string_view policy = pArgumentVector[5];
+		if (policy == "drop-oldest")
+		{
+			overflowPolicy = QueueOverflowPolicy::DropOldest;
+		}
+		else if (policy == "drop-non-healing")
+		{
+			overflowPolicy = QueueOverflowPolicy::DropNonHealing;
+		}
+		else if (policy == "disconnect")
+		{
+			overflowPolicy = QueueOverflowPolicy::Disconnect;
+		}
+		else
+		{
+			fprintf(stderr, "Invalid queue overflow policy \"%s\"\n", pArgumentVector[5]);
+			return 1;
+		}
+	}
+
+	size_t maxConnections = 0;
+	if (pArgumentCount >= 7)
+	{
+		char* end = nullptr;
+		unsigned long long parsed = strtoull(pArgumentVector[6], &end, 10);
+		if (end == pArgumentVector[6] || *end != '\0')
+		{
+			fprintf(stderr, "Invalid max connections \"%s\"\n", pArgumentVector[6]);
+			return 1;
+		}
+		maxConnections = static_cast<size_t>(parsed);
+	}
+
+	double eventsPerSecond = 0.0;
+	if (pArgumentCount >= 8)
+	{
+		char* end = nullptr;
+		double parsed = strtod(pArgumentVector[7], &end);
+		if (end == pArgumentVector[7] || *end != '\0' || parsed < 0.0)
+		{
+			fprintf(stderr, "Invalid events per second \"%s\"\n", pArgumentVector[7]);
+			return 1;
+		}
+		eventsPerSecond = parsed;
+	}
+
+	size_t burstEvents = 0;
+	if (pArgumentCount >= 9)
+	{
+		char* end = nullptr;
+		unsigned long long parsed = strtoull(pArgumentVector[8], &end, 10);
+		if (end == pArgumentVector[8] || *end != '\0')
+		{
+			fprintf(stderr, "Invalid event burst \"%s\"\n", pArgumentVector[8]);
+			return 1;
+		}
+		burstEvents = static_cast<size_t>(parsed);
+	}
+
+	std::chrono::milliseconds drainTimeout{0};
+	if (pArgumentCount >= 10)
+	{
+		char* end = nullptr;
+		unsigned long long parsed = strtoull(pArgumentVector[9], &end, 10);
+		if (end == pArgumentVector[9] || *end != '\0')
+		{
+			fprintf(stderr, "Invalid drain timeout \"%s\"\n", pArgumentVector[9]);
+			return 1;
+		}
+		drainTimeout = std::chrono::milliseconds{parsed};
+	}
+
+	std::chrono::milliseconds sessionResumeTimeout{30000};
+	if (pArgumentCount >= 11)
+	{
+		char* end = nullptr;
+		unsigned long long parsed = strtoull(pArgumentVector[10], &end, 10);
+		if (end == pArgumentVector[10] || *end != '\0')
+		{
+			fprintf(stderr, "Invalid session resume timeout \"%s\"\n", pArgumentVector[10]);
+			return 1;
+		}
+		sessionResumeTimeout = std::chrono::milliseconds{parsed};
+	}
+
+	SERVER = std::make_unique<evtc_rpc_server>(pArgumentVector[1], pArgumentVector[2], nullptr, workerThreadCount);
+	if (pArgumentCount >= 5)
+	{
+		SERVER->SetQueueLimit(maxQueuedEvents, overflowPolicy);
+	}
+	SERVER->SetMaxConnections(maxConnections);
+	SERVER->SetRateLimit(eventsPerSecond, burstEvents);
+	SERVER->SetDrainTimeout(drainTimeout);
+	SERVER->SetSessionResumeTimeout(sessionResumeTimeout);
 	SERVER_THREAD = std::thread(evtc_rpc_server::ThreadStartServe, SERVER.get());
 	MONITOR_THREAD = std::thread(monitor_thread_entry);
 
@@ -0,0 +1,124 @@
+#include "AccountNames.h"
+
+#include "../src/Log.h"
+
+#include <cassert>
+
+AccountId AccountNames::Intern(std::string_view pAccountName)
+{
+	size_t shardIndex = StringHash{}(pAccountName) % SHARD_COUNT;
+	Shard& shard = mShards[shardIndex];
+
+	std::lock_guard lock(shard.Lock);
+
+	auto iter = shard.Ids.find(pAccountName);
+	if (iter != shard.Ids.end())
+	{
+		shard.Slots[GetSlotIndex(iter->second)].ReferenceCount++;
+		return iter->second;
+	}
+
+	uint32_t slotIndex;
+	if (shard.FreeSlots.size() > 0)
+	{
+		slotIndex = shard.FreeSlots.back();
+		shard.FreeSlots.pop_back();
+	}
+	else
+	{
+		slotIndex = static_cast<uint32_t>(shard.Slots.size());
+		shard.Slots.emplace_back();
+	}
+
+	NameEntry& entry = shard.Slots[slotIndex];
+	assert(entry.ReferenceCount == 0);
+	entry.Name = pAccountName;
+	entry.ReferenceCount = 1;
+
+	// +1 so that INVALID_ACCOUNT_ID is never handed out
+	AccountId id = static_cast<AccountId>(slotIndex * SHARD_COUNT + shardIndex + 1);
+	shard.Ids.emplace(entry.Name, id);
+
+	LogT("Interned {} as {}", entry.Name, id);
+	return id;
+}
+
+void AccountNames::Release(AccountId pAccountId)
+{
+	assert(pAccountId != INVALID_ACCOUNT_ID);
+	Shard& shard = mShards[GetShardIndex(pAccountId)];
+
+	std::lock_guard lock(shard.Lock);
+
+	uint32_t slotIndex = static_cast<uint32_t>(GetSlotIndex(pAccountId));
+	NameEntry& entry = shard.Slots[slotIndex];
+	assert(entry.ReferenceCount > 0);
+	entry.ReferenceCount--;
+	if (entry.ReferenceCount > 0)
+	{
+		return;
+	}
+
+	LogT("Releasing {} ({})", entry.Name, pAccountId);
+
+	shard.Ids.erase(entry.Name);
+	entry.Name.clear();
+	shard.FreeSlots.push_back(slotIndex);
+}
+
+AccountId AccountNames::Find(std::string_view pAccountName)
+{
+	Shard& shard = mShards[StringHash{}(pAccountName) % SHARD_COUNT];
+
+	std::shared_lock lock(shard.Lock);
+
+	auto iter = shard.Ids.find(pAccountName);
+	if (iter == shard.Ids.end())
+	{
+		return INVALID_ACCOUNT_ID;
+	}
+
+	return iter->second;
+}
+
+std::string AccountNames::GetName(AccountId pAccountId)
+{
+	if (pAccountId == INVALID_ACCOUNT_ID)
+	{
+		return std::string{};
+	}
+
+	Shard& shard = mShards[GetShardIndex(pAccountId)];
+
+	std::shared_lock lock(shard.Lock);
+
+	size_t slotIndex = GetSlotIndex(pAccountId);
+	if (slotIndex >= shard.Slots.size() || shard.Slots[slotIndex].ReferenceCount == 0)
+	{
+		return std::string{};
+	}
+
+	return shard.Slots[slotIndex].Name;
+}
+
+size_t AccountNames::GetCount()
+{
+	size_t result = 0;
+	for (Shard& shard : mShards)
+	{
+		std::shared_lock lock(shard.Lock);
+		result += shard.Ids.size();
+	}
+
+	return result;
+}
+
+size_t AccountNames::GetShardIndex(AccountId pAccountId)
+{
+	return (pAccountId - 1) % SHARD_COUNT;
+}
+
+size_t AccountNames::GetSlotIndex(AccountId pAccountId)
+{
+	return (pAccountId - 1) / SHARD_COUNT;
+}
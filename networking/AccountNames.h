@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+typedef uint32_t AccountId;
+constexpr AccountId INVALID_ACCOUNT_ID = 0;
+
+// Interns account names into small integer ids so that the server can key its tables on integers instead of strings.
+// Ids are reference counted - every holder of an id (a registered agent, a peer entry, ...) owns one reference which it
+// has to give back with Release(). An id is reused only after all references to it are released, so ids held by
+// anyone always map to the same name.
+//
+// The table is sharded on the hash of the name, the shard index is encoded in the low bits of the id so that lookups
+// by id only touch a single shard as well.
+class AccountNames
+{
+public:
+	static constexpr size_t SHARD_COUNT = 16;
+
+	// Returns the id of pAccountName, adding it to the table if it is not known yet. Takes a reference on the returned
+	// id
+	AccountId Intern(std::string_view pAccountName);
+
+	// Gives back a reference on pAccountId. The name is removed from the table when the last reference is released
+	void Release(AccountId pAccountId);
+
+	// Returns the id of pAccountName without adding it or taking a reference, INVALID_ACCOUNT_ID if it is not known
+	AccountId Find(std::string_view pAccountName);
+
+	// Returns the name of pAccountId, or an empty string if the id is not in use
+	std::string GetName(AccountId pAccountId);
+
+	size_t GetCount();
+
+#ifndef TEST
+private:
+#endif
+	struct NameEntry
+	{
+		std::string Name;
+		uint32_t ReferenceCount = 0; // 0 => slot is free
+	};
+
+	struct StringHash
+	{
+		using is_transparent = void;
+		size_t operator()(std::string_view pString) const
+		{
+			return std::hash<std::string_view>{}(pString);
+		}
+	};
+
+	struct Shard
+	{
+		std::shared_mutex Lock;
+		std::unordered_map<std::string, AccountId, StringHash, std::equal_to<>> Ids;
+		std::vector<NameEntry> Slots;
+		std::vector<uint32_t> FreeSlots;
+	};
+
+	static size_t GetShardIndex(AccountId pAccountId);
+	static size_t GetSlotIndex(AccountId pAccountId);
+
+	std::array<Shard, SHARD_COUNT> mShards;
+};
@@ -1,13 +1,11 @@
 #include "Client.h"
 
+#include "EventCodec.h"
 #include "evtc_rpc_messages.h"
 #include "../src/Common.h"
 #include "../src/Log.h"
 
 #include <algorithm>
-#ifndef _WIN32
-#include <unistd.h>
-#endif
 
 bool evtc_rpc_client::CallDataBase::IsWrite()
 {
@@ -18,12 +16,17 @@ bool evtc_rpc_client::CallDataBase::IsWrite()
 	case CallDataType::AddPeer:
 	case CallDataType::RemovePeer:
 	case CallDataType::CombatEvent:
+	case CallDataType::CombatEventBatch:
+	case CallDataType::SetInterest:
+	case CallDataType::ResumeSession:
+	case CallDataType::EndSession:
 		return true;
 
 	case CallDataType::WritesDone:
 	case CallDataType::Finish:
 	case CallDataType::ReadMessage:
 	case CallDataType::Disconnect:
+	case CallDataType::WakeUp:
 		return false;
 
 	default:
@@ -85,12 +88,41 @@ void evtc_rpc_client::CallDataBase::Destruct()
 			delete message;
 			break;
 		}
+		case CallDataType::CombatEventBatch:
+		{
+			CombatEventBatchCallData* message = static_cast<CombatEventBatchCallData*>(this);
+			delete message;
+			break;
+		}
+		case CallDataType::SetInterest:
+		{
+			SetInterestCallData* message = static_cast<SetInterestCallData*>(this);
+			delete message;
+			break;
+		}
+		case CallDataType::ResumeSession:
+		{
+			ResumeSessionCallData* message = static_cast<ResumeSessionCallData*>(this);
+			delete message;
+			break;
+		}
+		case CallDataType::EndSession:
+		{
+			EndSessionCallData* message = static_cast<EndSessionCallData*>(this);
+			delete message;
+			break;
+		}
 		case CallDataType::Disconnect:
 		{
 			DisconnectCallData* message = static_cast<DisconnectCallData*>(this);
 			delete message;
 			break;
 		}
+		case CallDataType::WakeUp:
+		{
+			// Owned by the client (mWakeUpCallData) and reused for every wake up
+			break;
+		}
 
 		default:
 			LOG("Invalid CallDataType %i", Type);
@@ -104,7 +136,6 @@ evtc_rpc_client::evtc_rpc_client(std::function<std::string()>&& pEndpointCallbac
 	: mEndpointCallback{std::move(pEndpointCallback)}
 	, mRootCertificatesCallback{std::move(pRootCertificatesCallback)}
 	, mCombatEventCallback{std::move(pCombatEventCallback)}
-	, mLastConnectionAttempt{std::chrono::steady_clock::time_point(std::chrono::seconds(0))}
 {
 }
 
@@ -124,6 +155,8 @@ void evtc_rpc_client::SetEnabledStatus(bool pEnabledStatus)
 {
 	mDisabled = !pEnabledStatus;
 	LogI("Changed enabled status to {}", pEnabledStatus);
+
+	WakeUp();
 }
 
 void evtc_rpc_client::SetBudgetMode(bool pBudgetMode)
@@ -138,6 +171,31 @@ void evtc_rpc_client::SetDisableEncryption(bool pDisableEncryption)
 	LogI("Changed disable encryption mode to {}", pDisableEncryption);
 }
 
+void evtc_rpc_client::SetInterest(evtc_rpc::messages::InterestedEvents pEvents, std::vector<uint16_t> pPeers)
+{
+	if (pPeers.size() > evtc_rpc::messages::MAX_INTERESTED_PEERS)
+	{
+		LOG("Too many interested peers (%zu), asking for all peers instead", pPeers.size());
+		pPeers.clear();
+	}
+	std::sort(pPeers.begin(), pPeers.end());
+
+	{
+		std::lock_guard lock(mInterestLock);
+		if (mInterestedEvents == pEvents && mInterestedPeers == pPeers)
+		{
+			return;
+		}
+
+		LOG("Setting interest to events %u from %zu peers", static_cast<uint32_t>(pEvents), pPeers.size());
+		mInterestedEvents = pEvents;
+		mInterestedPeers = std::move(pPeers);
+		mInterestGeneration++;
+	}
+
+	WakeUp();
+}
+
 uintptr_t evtc_rpc_client::ProcessLocalEvent(cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* /*pSkillname*/, uint64_t pId, uint64_t /*pRevision*/)
 {
 	if (pEvent == nullptr)
@@ -160,10 +218,14 @@ uintptr_t evtc_rpc_client::ProcessLocalEvent(cbtevent* pEvent, ag* pSourceAgent,
 				assert(pDestinationAgent->id > 0);
 				assert(pDestinationAgent->name != nullptr && pDestinationAgent->name[0] != '\0');
 
-				std::lock_guard lock(mSelfInfoLock);
+				{
+					std::lock_guard lock(mSelfInfoLock);
 
-				mAccountName = pDestinationAgent->name;
-				mInstanceId = static_cast<uint16_t>(pDestinationAgent->id);
+					mAccountName = pDestinationAgent->name;
+					mInstanceId = static_cast<uint16_t>(pDestinationAgent->id);
+				}
+
+				WakeUp();
 			}
 		}
 		else
@@ -192,11 +254,9 @@ uintptr_t evtc_rpc_client::ProcessLocalEvent(cbtevent* pEvent, ag* pSourceAgent,
 
 	if (sendEvent == true)
 	{
-		CombatEventCallData* newEvent = new CombatEventCallData(*pEvent);
-		if (QueueEvent(newEvent, false) == false)
+		if (QueueEvent(*pEvent, false) == false)
 		{
 			DEBUGLOG("Dropping CombatEvent event %llu since queue is full", pId);
-			delete newEvent;
 		}
 	}
 
@@ -226,17 +286,21 @@ uintptr_t evtc_rpc_client::ProcessAreaEvent(cbtevent* pEvent, ag* pSourceAgent,
 				assert(pDestinationAgent->id <= UINT16_MAX);
 				assert(pDestinationAgent->name != nullptr && pDestinationAgent->name[0] != '\0');
 
-				std::lock_guard lock(mPeerInfoLock);
-				auto [iter, inserted] = mPeers.try_emplace(pSourceAgent->id, PeerInfo{static_cast<uint16_t>(pDestinationAgent->id), pDestinationAgent->name});
-				if (inserted == true)
 				{
-					LogD("Added peer {} {} {}", iter->first, iter->second.InstanceId, iter->second.AccountName);
-				}
-				else
-				{
-					LogE("Dropping peer {} {} {} since they're already registered as {} {}",
-						pSourceAgent->id, static_cast<uint16_t>(pDestinationAgent->id), pDestinationAgent->name, iter->second.InstanceId, iter->second.AccountName);
+					std::lock_guard lock(mPeerInfoLock);
+					auto [iter, inserted] = mPeers.try_emplace(pSourceAgent->id, PeerInfo{static_cast<uint16_t>(pDestinationAgent->id), pDestinationAgent->name});
+					if (inserted == true)
+					{
+						LogD("Added peer {} {} {}", iter->first, iter->second.InstanceId, iter->second.AccountName);
+					}
+					else
+					{
+						LogE("Dropping peer {} {} {} since they're already registered as {} {}",
+							pSourceAgent->id, static_cast<uint16_t>(pDestinationAgent->id), pDestinationAgent->name, iter->second.InstanceId, iter->second.AccountName);
+					}
 				}
+
+				WakeUp();
 			}
 		}
 		else
@@ -260,6 +324,8 @@ uintptr_t evtc_rpc_client::ProcessAreaEvent(cbtevent* pEvent, ag* pSourceAgent,
 						pSourceAgent->id, removedCount);
 				}
 			}
+
+			WakeUp();
 		}
 
 		return 0;
@@ -277,6 +343,10 @@ void evtc_rpc_client::Serve()
 {
 	LogD(">>");
 
+	// Set when the state machine below is waiting for time to pass (rather than for a call to complete or a WakeUp()).
+	// Starts out as now so that the first connection is opened right away
+	std::chrono::steady_clock::time_point nextConnectionAttempt = std::chrono::steady_clock::now();
+
 	while (true)
 	{
 		//LOG("LOOP - mShouldShutdown=%s mWritePending=%s", BOOL_STR(mShouldShutdown), mConnectionContext == nullptr ? "null" : BOOL_STR(mConnectionContext->WritePending));
@@ -284,11 +354,18 @@ void evtc_rpc_client::Serve()
 		void* tag = nullptr;
 		bool ok = false;
 
-		gpr_timespec timeout;
-		timeout.tv_sec = 0;
-		timeout.tv_nsec = 1000 * 1000; // 1 ms
-		timeout.clock_type = GPR_TIMESPAN;
-		grpc::CompletionQueue::NextStatus status = mCompletionQueue.AsyncNext(&tag, &ok, timeout);
+		grpc::CompletionQueue::NextStatus status;
+		if (nextConnectionAttempt == std::chrono::steady_clock::time_point::max())
+		{
+			status = mCompletionQueue.AsyncNext(&tag, &ok, gpr_inf_future(GPR_CLOCK_REALTIME));
+		}
+		else
+		{
+			std::chrono::steady_clock::duration timeout = nextConnectionAttempt - std::chrono::steady_clock::now();
+			status = mCompletionQueue.AsyncNext(&tag, &ok, std::chrono::system_clock::now() + timeout);
+			nextConnectionAttempt = std::chrono::steady_clock::time_point::max();
+		}
+
 		if (status == grpc::CompletionQueue::NextStatus::SHUTDOWN)
 		{
 			LOG("Got shutdown status");
@@ -301,6 +378,12 @@ void evtc_rpc_client::Serve()
 			assert(tag != nullptr);
 			CallDataBase* base = static_cast<CallDataBase*>(tag);
 
+			if (base->Type == CallDataType::WakeUp)
+			{
+				// Cleared before running the state machine, so anything changed after this point queues a new wake up
+				mWakeUpPending.store(false, std::memory_order_seq_cst);
+			}
+
 			if (ok == true)
 			{
 				switch (base->Type)
@@ -323,9 +406,11 @@ void evtc_rpc_client::Serve()
 						
 						if (base->Context == mConnectionContext)
 						{
+							base->Context->ConnectedTime = std::chrono::steady_clock::now();
+
 							std::lock_guard lock{mStatusLock};
 							mStatus.Connected = true;
-							mStatus.ConnectTime = std::chrono::steady_clock::now();
+							mStatus.ConnectTime = base->Context->ConnectedTime;
 
 							LOG("(tag %p) Successfully connected to %s", tag, mStatus.Endpoint.c_str());
 						}
@@ -354,6 +439,7 @@ void evtc_rpc_client::Serve()
 
 						if (base->Context == mConnectionContext)
 						{
+							ScheduleReconnect(*mConnectionContext);
 							mConnectionContext = nullptr;
 							
 							{
@@ -368,6 +454,7 @@ void evtc_rpc_client::Serve()
 						LOG("(tag %p) Remote broke connection", tag);
 						if (base->Context == mConnectionContext)
 						{
+							ScheduleReconnect(*mConnectionContext);
 							mConnectionContext = nullptr;
 
 							{
@@ -400,8 +487,15 @@ void evtc_rpc_client::Serve()
 		}
 		else if (mShouldShutdown == true)
 		{
+			// Ends the session first, the same way a disabled client does. mShouldShutdown stays set while waiting for that
+			if (mConnectionContext != nullptr && WaitForEndSession(nextConnectionAttempt) == true)
+			{
+				continue;
+			}
+
 			mShouldShutdown = false;
 			mShutdown = true;
+			NotifyFlushWaiters();
 
 			if (mConnectionContext != nullptr)
 			{
@@ -413,22 +507,31 @@ void evtc_rpc_client::Serve()
 				LOG("ShouldShutdown==true and there is no active connection - shutting down completion queue");
 			}
 
+			std::lock_guard lock(mWakeUpLock);
+			mCompletionQueueShutdown = true;
 			mCompletionQueue.Shutdown();
 		}
-		else if (mDisabled == true)
+		else if (mDisabled == true || (mConnectionContext != nullptr && mConnectionContext->EndSessionSent == true))
 		{
 			if (mConnectionContext != nullptr)
 			{
-				// grpc doesn't give much of an interface to stop the calls, this is the best we can do. Queueing a Finish call
-				// will not do anything, it leaves us at the mercy of the server to actually complete the underlying call.
-				mConnectionContext->ClientContext.TryCancel();
+				if (WaitForEndSession(nextConnectionAttempt) == false)
+				{
+					// grpc doesn't give much of an interface to stop the calls, this is the best we can do. Queueing a Finish call
+					// will not do anything, it leaves us at the mercy of the server to actually complete the underlying call.
+					mConnectionContext->ClientContext.TryCancel();
 
-				LogD("Client was disabled, cancelling calls");
+					LogD("Client was disabled, cancelling calls");
+				}
 			}
 		}
 		else if (mConnectionContext == nullptr)
 		{
-			if ((std::chrono::steady_clock::now() - mLastConnectionAttempt) > std::chrono::seconds{5})
+			if (std::chrono::steady_clock::now() < mNextConnectionAttempt)
+			{
+				nextConnectionAttempt = mNextConnectionAttempt + std::chrono::milliseconds{1};
+			}
+			else
 			{
 				mConnectionContext = std::make_shared<ConnectionContext>();
 
@@ -473,7 +576,6 @@ void evtc_rpc_client::Serve()
 				ReadMessageCallData* queuedData2 = new ReadMessageCallData{std::shared_ptr(mConnectionContext)};
 				queuedData2->Context->Stream->Read(&queuedData2->Message, queuedData2);
 
-				mLastConnectionAttempt = std::chrono::steady_clock::now();
 				LOG("Opening new connection to %s connect_tag=%p, read_tag=%p, root_certs_size=%zu", endpoint.c_str(), queuedData1, queuedData2, options.pem_root_certs.size());
 
 				{
@@ -489,8 +591,13 @@ void evtc_rpc_client::Serve()
 			{
 				std::lock_guard lock(mSelfInfoLock);
 
+				if (mConnectionContext->RegisteredInstanceId == 0 && mInstanceId != 0)
+				{
+					queuedData = TryResumeSession();
+				}
+
 				// Either RegisteredInstanceId is 0 (meaning we aren't registered yet), or mInstanceId has changed because we changed instances
-				if (mConnectionContext->RegisteredInstanceId != mInstanceId)
+				if (queuedData == nullptr && mConnectionContext->RegisteredInstanceId != mInstanceId)
 				{
 					assert(mInstanceId != 0); // mInstanceId should never go back to zero after being set
 					assert(mAccountName.size() > 0);
@@ -502,18 +609,20 @@ void evtc_rpc_client::Serve()
 
 			if (queuedData == nullptr && mConnectionContext->RegisteredInstanceId != 0)
 			{
-				queuedData = TryGetPeerEvent();
+				queuedData = TryGetInterest();
 			}
 
 			if (queuedData == nullptr && mConnectionContext->RegisteredInstanceId != 0)
 			{
-				std::lock_guard lock(mQueuedEventsLock);
+				queuedData = TryGetPeerEvent();
+			}
 
-				if (mQueuedEvents.size() > 0)
+			if (queuedData == nullptr && mConnectionContext->RegisteredInstanceId != 0)
+			{
+				queuedData = TryGetCombatEvents();
+				if (queuedData != nullptr)
 				{
-					queuedData = mQueuedEvents.front();
-					mQueuedEvents.pop();
-					queuedData->Context = std::shared_ptr(mConnectionContext);
+					NotifyFlushWaiters();
 				}
 			}
 
@@ -528,44 +637,134 @@ void evtc_rpc_client::Serve()
 	}
 }
 
+bool evtc_rpc_client::WaitForEndSession(std::chrono::steady_clock::time_point& pWakeUpTime)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (mConnectionContext->DisabledTime == std::chrono::steady_clock::time_point{})
+	{
+		mConnectionContext->DisabledTime = now;
+	}
+	std::chrono::steady_clock::time_point deadline = mConnectionContext->DisabledTime + END_SESSION_TIMEOUT;
+
+	// A registered connection that holds a session token tells the server that it's going away on purpose, so that the
+	// server doesn't keep the session around for resuming. The session is kept if a write doesn't complete in time
+	bool waitForWrite = mConnectionContext->WritePending == true && now < deadline &&
+		((mSessionToken != 0 && mConnectionContext->RegisteredInstanceId != 0) || mConnectionContext->EndSessionSent == true);
+	if (mConnectionContext->WritePending == false && mConnectionContext->EndSessionSent == false &&
+		mSessionToken != 0 && mConnectionContext->RegisteredInstanceId != 0)
+	{
+		CallDataBase* queuedData = new EndSessionCallData{std::shared_ptr(mConnectionContext)};
+		SendEvent(queuedData);
+		mConnectionContext->WritePending = true;
+		mConnectionContext->EndSessionSent = true;
+		mSessionToken = 0;
+		waitForWrite = true;
+	}
+
+	if (waitForWrite == true)
+	{
+		pWakeUpTime = deadline;
+	}
+	return waitForWrite;
+}
+
 void evtc_rpc_client::Shutdown()
 {
 	mShouldShutdown = true;
+	WakeUp();
 }
 
-void evtc_rpc_client::FlushEvents(size_t pAcceptableQueueSize)
+bool evtc_rpc_client::FlushEvents(size_t pAcceptableQueueSize, std::chrono::milliseconds pTimeout)
 {
-	while (true)
+	auto isFlushed = [this, pAcceptableQueueSize]()
+	{
+		return mQueuedEvents.Size() <= pAcceptableQueueSize;
+	};
+
+	// Fast path for producers that call this before every event to apply backpressure
+	if (isFlushed() == true)
 	{
+		return true;
+	}
+
+	// Pairs with the fence in NotifyFlushWaiters - either Serve() sees this waiter, or the wait below sees the events
+	// that Serve() took
+	mFlushWaiters.fetch_add(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	bool flushed;
+	{
+		std::unique_lock lock(mFlushLock);
+
+		auto isDone = [this, &isFlushed]()
 		{
-			std::lock_guard lock(mQueuedEventsLock);
-			if (mQueuedEvents.size() <= pAcceptableQueueSize)
-			{
-				return;
-			}
+			return isFlushed() == true || mShutdown.load(std::memory_order_relaxed) == true;
+		};
+
+		if (pTimeout == std::chrono::milliseconds::max())
+		{
+			mFlushCondition.wait(lock, isDone);
+		}
+		else
+		{
+			mFlushCondition.wait_for(lock, pTimeout, isDone);
 		}
 
-#ifdef _WIN32
-		Sleep(1);
-#else
-		usleep(1000);
-#endif
+		flushed = isFlushed();
+	}
+
+	mFlushWaiters.fetch_sub(1, std::memory_order_relaxed);
+	return flushed;
+}
+
+void evtc_rpc_client::NotifyFlushWaiters()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (mFlushWaiters.load(std::memory_order_relaxed) == 0)
+	{
+		return;
 	}
+
+	std::lock_guard lock(mFlushLock);
+	mFlushCondition.notify_all();
 }
 
-bool evtc_rpc_client::QueueEvent(CallDataBase* pCallData, bool pIsImportant)
+bool evtc_rpc_client::QueueEvent(const cbtevent& pEvent, bool pIsImportant)
 {
-	std::lock_guard lock(mQueuedEventsLock);
+	// The size is only a snapshot with concurrent producers, so these limits are soft. The capacity of the ring is the
+	// hard limit
+	size_t queuedCount = mQueuedEvents.Size();
+	if ((pIsImportant == false && queuedCount > 5000) || queuedCount > 10000)
+	{
+		return false;
+	}
 
-	if ((pIsImportant == false && mQueuedEvents.size() > 5000) || mQueuedEvents.size() > 10000)
+	if (mQueuedEvents.TryPush(pEvent) == false)
 	{
 		return false;
 	}
 
-	mQueuedEvents.push(pCallData);
+	WakeUp();
 	return true;
 }
 
+void evtc_rpc_client::WakeUp()
+{
+	if (mWakeUpPending.exchange(true, std::memory_order_seq_cst) == true)
+	{
+		return;
+	}
+
+	std::lock_guard lock(mWakeUpLock);
+	if (mCompletionQueueShutdown == true)
+	{
+		return;
+	}
+
+	// An alarm with a deadline in the past completes right away, one set to now() has to wait for the timer check
+	mWakeUpCallData.Alarm->Set(&mCompletionQueue, gpr_inf_past(GPR_CLOCK_MONOTONIC), &mWakeUpCallData);
+}
+
 evtc_rpc_client::CallDataBase* evtc_rpc_client::TryGetPeerEvent()
 {
 	std::lock_guard lock(mPeerInfoLock);
@@ -621,6 +820,99 @@ evtc_rpc_client::CallDataBase* evtc_rpc_client::TryGetPeerEvent()
 	return nullptr;
 }
 
+evtc_rpc_client::CallDataBase* evtc_rpc_client::TryGetInterest()
+{
+	std::lock_guard lock(mInterestLock);
+	if (mConnectionContext->SentInterestGeneration == mInterestGeneration)
+	{
+		return nullptr;
+	}
+
+	mConnectionContext->SentInterestGeneration = mInterestGeneration;
+	return new SetInterestCallData(std::shared_ptr(mConnectionContext), mInterestedEvents, std::vector<uint16_t>{mInterestedPeers});
+}
+
+evtc_rpc_client::CallDataBase* evtc_rpc_client::TryGetCombatEvents()
+{
+	cbtevent event;
+	if (mQueuedEvents.TryPop(event) == false)
+	{
+		return nullptr;
+	}
+
+	// Coalesce all queued combat events into one batch, up to the maximum batch size
+	CombatEventBatchCallData* batch = new CombatEventBatchCallData(std::shared_ptr(mConnectionContext));
+	batch->Events.reserve(std::min<size_t>(mQueuedEvents.Size() + 1, evtc_rpc::messages::MAX_COMBAT_EVENT_BATCH_SIZE));
+	batch->Events.push_back(event);
+
+	while (batch->Events.size() < evtc_rpc::messages::MAX_COMBAT_EVENT_BATCH_SIZE && mQueuedEvents.TryPop(event) == true)
+	{
+		batch->Events.push_back(event);
+	}
+
+	return batch;
+}
+
+evtc_rpc_client::CallDataBase* evtc_rpc_client::TryResumeSession()
+{
+	using namespace evtc_rpc::messages;
+
+	if (mSessionToken == 0)
+	{
+		return nullptr;
+	}
+
+	assert(mConnectionContext->RegisteredInstanceId == 0);
+	assert(mAccountName.size() > 0);
+
+	// Peers that don't fit in the message are added with AddPeer afterwards
+	std::vector<PeerInfo> peers;
+	{
+		std::lock_guard lock(mPeerInfoLock);
+		for (auto iter = mPeers.begin(); iter != mPeers.end() && peers.size() < MAX_RESUMED_PEERS; iter++)
+		{
+			mConnectionContext->RegisteredPeers.try_emplace(iter->first, iter->second);
+			peers.emplace_back(iter->second);
+		}
+	}
+
+	// Tokens can only be used once, the server sends a new one in response
+	uint64_t token = mSessionToken;
+	mSessionToken = 0;
+
+	CallDataBase* queuedData = new ResumeSessionCallData{std::shared_ptr(mConnectionContext), token, mInstanceId, std::string(mAccountName), std::move(peers)};
+	LOG("(tag %p) Resuming session as %hu %s", queuedData, mInstanceId, mAccountName.c_str());
+	return queuedData;
+}
+
+void evtc_rpc_client::ScheduleReconnect(const ConnectionContext& pContext)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (pContext.ConnectedTime != std::chrono::steady_clock::time_point{} && now - pContext.ConnectedTime >= STABLE_CONNECTION_TIME)
+	{
+		mFailedConnectionAttempts = 0;
+	}
+
+	std::chrono::milliseconds delay = GetReconnectDelay(mFailedConnectionAttempts);
+	mNextConnectionAttempt = now + delay;
+	mFailedConnectionAttempts++;
+
+	LOG("Connection lost, reconnecting in %lli ms (attempt %u)", static_cast<long long>(delay.count()), mFailedConnectionAttempts);
+}
+
+std::chrono::milliseconds evtc_rpc_client::GetReconnectDelay(uint32_t pFailedAttempts)
+{
+	std::chrono::milliseconds delay = MIN_RECONNECT_DELAY;
+	for (uint32_t i = 0; i < pFailedAttempts && delay < MAX_RECONNECT_DELAY; i++)
+	{
+		delay *= 2;
+	}
+	delay = std::min(delay, MAX_RECONNECT_DELAY);
+
+	std::uniform_int_distribution<std::chrono::milliseconds::rep> jitter{delay.count() / 2, delay.count()};
+	return std::chrono::milliseconds{jitter(mReconnectJitter)};
+}
+
 void evtc_rpc_client::ForceDisconnect(const std::shared_ptr<ConnectionContext>& pContext, const char* /*pErrorMessage*/)
 {
 	if (pContext->ForceDisconnected == true)
@@ -633,6 +925,7 @@ void evtc_rpc_client::ForceDisconnect(const std::shared_ptr<ConnectionContext>&
 	{
 		// Queue finish...
 
+		ScheduleReconnect(*mConnectionContext);
 		mConnectionContext = nullptr;
 		LOG("Cleared existing connection");
 	}
@@ -670,7 +963,7 @@ void evtc_rpc_client::HandleReadMessage(ReadMessageCallData* pCallData)
 	data += sizeof(Header);
 	dataSize -= sizeof(Header);
 
-	if (header.MessageVersion != 1)
+	if (header.MessageVersion < MESSAGE_VERSION_LEGACY || header.MessageVersion > MESSAGE_VERSION_SESSION)
 	{
 		LOG("(tag %p) incorrect version %u", pCallData, header.MessageVersion);
 		ForceDisconnect(pCallData->Context, "incorrect version");
@@ -698,6 +991,152 @@ void evtc_rpc_client::HandleReadMessage(ReadMessageCallData* pCallData)
 			message.Event.src_instid, message.Event.dst_instid, message.Event.skillid, message.Event.value);
 		break;
 
+	case Type::CombatEventBatch:
+	{
+		if (dataSize < sizeof(CombatEventBatch))
+		{
+			LOG("(tag %p) data too short for CombatEventBatch message (%zu vs %zu)",
+				pCallData, dataSize, sizeof(CombatEventBatch));
+			ForceDisconnect(pCallData->Context, "short CombatEventBatch content");
+			return;
+		}
+
+		CombatEventBatch batch;
+		memcpy(&batch, data, sizeof(CombatEventBatch));
+		data += sizeof(CombatEventBatch);
+		dataSize -= sizeof(CombatEventBatch);
+
+		if (dataSize != batch.EventCount * sizeof(CombatEvent))
+		{
+			LOG("(tag %p) incorrect length for CombatEventBatch message (%zu vs %hu events)",
+				pCallData, dataSize, batch.EventCount);
+			ForceDisconnect(pCallData->Context, "mismatched CombatEventBatch length");
+			return;
+		}
+
+		for (uint16_t i = 0; i < batch.EventCount; i++)
+		{
+			CombatEvent event;
+			memcpy(&event, data, sizeof(CombatEvent));
+			data += sizeof(CombatEvent);
+			dataSize -= sizeof(CombatEvent);
+
+			mCombatEventCallback(&event.Event, event.SenderInstanceId);
+		}
+		LOG("Received CombatEventBatch with %hu events", batch.EventCount);
+		break;
+	}
+
+	case Type::CompressedCombatEventBatch:
+	{
+		// One frame per sender that the server combined into this message
+		while (dataSize > 0)
+		{
+			if (dataSize < sizeof(CompressedCombatEventFrame))
+			{
+				LOG("(tag %p) data too short for CompressedCombatEventFrame (%zu vs %zu)",
+					pCallData, dataSize, sizeof(CompressedCombatEventFrame));
+				ForceDisconnect(pCallData->Context, "short CompressedCombatEventBatch content");
+				return;
+			}
+
+			CompressedCombatEventFrame frame;
+			memcpy(&frame, data, sizeof(CompressedCombatEventFrame));
+			data += sizeof(CompressedCombatEventFrame);
+			dataSize -= sizeof(CompressedCombatEventFrame);
+
+			if (frame.EventCount == 0 || frame.EventCount > MAX_COMBAT_EVENT_BATCH_SIZE || frame.EncodedSize > dataSize)
+			{
+				LOG("(tag %p) incorrect length for CompressedCombatEventFrame (%zu vs %u bytes, %hu events)",
+					pCallData, dataSize, frame.EncodedSize, frame.EventCount);
+				ForceDisconnect(pCallData->Context, "mismatched CompressedCombatEventBatch length");
+				return;
+			}
+
+			EventDecoder decoder{data, frame.EncodedSize};
+			for (uint16_t i = 0; i < frame.EventCount; i++)
+			{
+				cbtevent event;
+				if (decoder.Decode(event) == false)
+				{
+					LOG("(tag %p) malformed CompressedCombatEventFrame at event %hu", pCallData, i);
+					ForceDisconnect(pCallData->Context, "malformed CompressedCombatEventBatch content");
+					return;
+				}
+
+				mCombatEventCallback(&event, frame.SenderInstanceId);
+			}
+			data += frame.EncodedSize;
+			dataSize -= frame.EncodedSize;
+
+			LOG("Received CompressedCombatEventFrame with %hu events from %hu", frame.EventCount, frame.SenderInstanceId);
+		}
+		break;
+	}
+
+	case Type::HealingEventBatch:
+	{
+		// One frame per sender that the server combined into this message
+		while (dataSize > 0)
+		{
+			if (dataSize < sizeof(HealingEventFrame))
+			{
+				LOG("(tag %p) data too short for HealingEventFrame (%zu vs %zu)",
+					pCallData, dataSize, sizeof(HealingEventFrame));
+				ForceDisconnect(pCallData->Context, "short HealingEventBatch content");
+				return;
+			}
+
+			HealingEventFrame frame;
+			memcpy(&frame, data, sizeof(HealingEventFrame));
+			data += sizeof(HealingEventFrame);
+			dataSize -= sizeof(HealingEventFrame);
+
+			if (frame.EventCount == 0 || frame.EventCount > MAX_COMBAT_EVENT_BATCH_SIZE || frame.EventCount * sizeof(HealingEvent) > dataSize)
+			{
+				LOG("(tag %p) incorrect length for HealingEventFrame (%zu vs %hu events)",
+					pCallData, dataSize, frame.EventCount);
+				ForceDisconnect(pCallData->Context, "mismatched HealingEventBatch length");
+				return;
+			}
+
+			for (uint16_t i = 0; i < frame.EventCount; i++)
+			{
+				HealingEvent record;
+				memcpy(&record, data, sizeof(HealingEvent));
+				data += sizeof(HealingEvent);
+				dataSize -= sizeof(HealingEvent);
+
+				cbtevent event;
+				FromHealingEvent(record, event);
+				mCombatEventCallback(&event, frame.SenderInstanceId);
+			}
+
+			LOG("Received HealingEventFrame with %hu events from %hu", frame.EventCount, frame.SenderInstanceId);
+		}
+		break;
+	}
+
+	case Type::SessionToken:
+	{
+		if (dataSize != sizeof(SessionToken))
+		{
+			LOG("(tag %p) incorrect length for SessionToken message (%zu vs %zu)",
+				pCallData, dataSize, sizeof(SessionToken));
+			ForceDisconnect(pCallData->Context, "mismatched SessionToken length");
+			return;
+		}
+
+		SessionToken message;
+		memcpy(&message, data, sizeof(SessionToken));
+		data += sizeof(SessionToken);
+		dataSize -= sizeof(SessionToken);
+
+		mSessionToken = message.Token;
+		LOG("Received SessionToken (resumed=%u)", static_cast<uint32_t>(message.Resumed));
+		break;
+	}
+
 	default:
 		LOG("(tag %p) incorrect type %u", pCallData, header.MessageType);
 		return;
@@ -713,8 +1152,10 @@ void evtc_rpc_client::SendEvent(CallDataBase* pCallData)
 	char buffer[1024];
 	char* bufferpos = buffer;
 
+	// Always send the latest version so that the server knows it can forward compressed and healing batches and
+	// session tokens to us
 	Header header;
-	header.MessageVersion = 1;
+	header.MessageVersion = MESSAGE_VERSION_SESSION;
 	bufferpos += sizeof(header); // Reserve space for the header in the buffer
 
 	switch (pCallData->Type)
@@ -793,6 +1234,73 @@ void evtc_rpc_client::SendEvent(CallDataBase* pCallData)
 			LOG("(tag %p) Sending RemovePeer %hu", pCallData, message.PeerId);
 			break;
 		}
+		case CallDataType::SetInterest:
+		{
+			SetInterestCallData* calldata = static_cast<SetInterestCallData*>(pCallData);
+			assert(calldata->Peers.size() <= MAX_INTERESTED_PEERS);
+
+			header.MessageType = Type::SetInterest;
+
+			evtc_rpc::messages::SetInterest message;
+			message.Events = calldata->Events;
+			message.PeerCount = static_cast<uint16_t>(calldata->Peers.size());
+
+			memcpy(bufferpos, &message, sizeof(message));
+			bufferpos += sizeof(message);
+
+			memcpy(bufferpos, calldata->Peers.data(), calldata->Peers.size() * sizeof(uint16_t));
+			bufferpos += calldata->Peers.size() * sizeof(uint16_t);
+
+			LOG("(tag %p) Sending SetInterest %u with %hu peers", pCallData, static_cast<uint32_t>(message.Events), message.PeerCount);
+			break;
+		}
+		case CallDataType::ResumeSession:
+		{
+			// The peer list doesn't necessarily fit in the stack buffer, build the blob directly instead
+			ResumeSessionCallData* calldata = static_cast<ResumeSessionCallData*>(pCallData);
+			assert(calldata->SelfAccountName.size() < UINT8_MAX);
+			assert(calldata->Peers.size() <= MAX_RESUMED_PEERS);
+
+			header.MessageType = Type::ResumeSession;
+
+			ResumeSession message;
+			message.SessionToken = calldata->SessionToken;
+			message.SelfId = calldata->SelfInstanceId;
+			message.SelfAccountNameLength = static_cast<uint8_t>(calldata->SelfAccountName.size());
+			message.PeerCount = static_cast<uint16_t>(calldata->Peers.size());
+
+			std::string blob;
+			blob.reserve(sizeof(header) + sizeof(message) + calldata->SelfAccountName.size() + calldata->Peers.size() * (sizeof(AddPeer) + UINT8_MAX));
+			blob.append(reinterpret_cast<const char*>(&header), sizeof(header));
+			blob.append(reinterpret_cast<const char*>(&message), sizeof(message));
+			blob.append(calldata->SelfAccountName);
+			for (const PeerInfo& peer : calldata->Peers)
+			{
+				assert(peer.AccountName.size() < UINT8_MAX);
+
+				AddPeer peerMessage;
+				peerMessage.PeerId = peer.InstanceId;
+				peerMessage.PeerAccountNameLength = static_cast<uint8_t>(peer.AccountName.size());
+				blob.append(reinterpret_cast<const char*>(&peerMessage), sizeof(peerMessage));
+				blob.append(peer.AccountName);
+			}
+
+			pCallData->Context->RegisteredInstanceId = message.SelfId;
+
+			LOG("(tag %p) Sending ResumeSession %hu %s with %hu peers", pCallData, message.SelfId, calldata->SelfAccountName.c_str(), message.PeerCount);
+
+			evtc_rpc::Message rpc_message;
+			rpc_message.set_blob(std::move(blob));
+			pCallData->Context->Stream->Write(rpc_message, pCallData);
+			return;
+		}
+		case CallDataType::EndSession:
+		{
+			header.MessageType = Type::EndSession;
+
+			LOG("(tag %p) Sending EndSession", pCallData);
+			break;
+		}
 		case CallDataType::CombatEvent:
 		{
 			CombatEventCallData* calldata = static_cast<CombatEventCallData*>(pCallData);
@@ -809,6 +1317,74 @@ void evtc_rpc_client::SendEvent(CallDataBase* pCallData)
 			LOG("(tag %p) Sending CombatEvent source %hu target %hu skill %u value %i", pCallData, message.Event.src_instid, message.Event.dst_instid, message.Event.skillid, message.Event.value);
 			break;
 		}
+		case CallDataType::CombatEventBatch:
+		{
+			// Batches don't fit in the stack buffer, build the blob directly instead
+			CombatEventBatchCallData* calldata = static_cast<CombatEventBatchCallData*>(pCallData);
+			assert(calldata->Events.size() > 0 && calldata->Events.size() <= MAX_COMBAT_EVENT_BATCH_SIZE);
+
+			// Batches that only hold events that peers use in full (always the case in budget mode) are sent as
+			// HealingEvent records, anything else is compressed
+			std::string blob;
+			blob.resize(sizeof(header) + sizeof(HealingEventFrame) + calldata->Events.size() * sizeof(HealingEvent));
+			uint8_t* records = reinterpret_cast<uint8_t*>(blob.data()) + sizeof(header) + sizeof(HealingEventFrame);
+			bool allHealingEvents = true;
+			for (size_t i = 0; i < calldata->Events.size(); i++)
+			{
+				HealingEvent record;
+				if (ToHealingEvent(calldata->Events[i], record) == false)
+				{
+					allHealingEvents = false;
+					break;
+				}
+				memcpy(records + i * sizeof(HealingEvent), &record, sizeof(record));
+			}
+
+			if (allHealingEvents == true)
+			{
+				header.MessageType = Type::HealingEventBatch;
+
+				HealingEventFrame frame;
+				frame.EventCount = static_cast<uint16_t>(calldata->Events.size());
+				frame.SenderInstanceId = 0;
+
+				memcpy(blob.data(), &header, sizeof(header));
+				memcpy(blob.data() + sizeof(header), &frame, sizeof(frame));
+
+				LOG("(tag %p) Sending HealingEventBatch with %hu events", pCallData, frame.EventCount);
+
+				evtc_rpc::Message rpc_message;
+				rpc_message.set_blob(std::move(blob));
+				pCallData->Context->Stream->Write(rpc_message, pCallData);
+				return;
+			}
+
+			header.MessageType = Type::CompressedCombatEventBatch;
+
+			CompressedCombatEventFrame frame;
+			frame.EventCount = static_cast<uint16_t>(calldata->Events.size());
+			frame.SenderInstanceId = 0;
+
+			// Encode straight into the blob and shrink it to the actual size afterwards
+			blob.resize(sizeof(header) + sizeof(frame) + calldata->Events.size() * EventEncoder::MAX_ENCODED_EVENT_SIZE);
+			EventEncoder encoder{reinterpret_cast<uint8_t*>(blob.data()) + sizeof(header) + sizeof(frame)};
+			for (const cbtevent& event : calldata->Events)
+			{
+				encoder.Encode(event);
+			}
+			frame.EncodedSize = static_cast<uint32_t>(encoder.GetSize());
+			blob.resize(sizeof(header) + sizeof(frame) + encoder.GetSize());
+
+			memcpy(blob.data(), &header, sizeof(header));
+			memcpy(blob.data() + sizeof(header), &frame, sizeof(frame));
+
+			LOG("(tag %p) Sending CompressedCombatEventBatch with %hu events in %u bytes", pCallData, frame.EventCount, frame.EncodedSize);
+
+			evtc_rpc::Message rpc_message;
+			rpc_message.set_blob(std::move(blob));
+			pCallData->Context->Stream->Write(rpc_message, pCallData);
+			return;
+		}
 
 		default:
 			LOG("Invalid CallDataType %i", pCallData->Type);
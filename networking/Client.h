@@ -1,5 +1,8 @@
 #pragma once
 
+#include "MpscRing.h"
+#include "evtc_rpc_messages.h"
+
 #include <ArcdpsExtension/arcdps_structs_slim.h>
 
 #ifdef __clang__
@@ -18,6 +21,7 @@
 #include <evtc_rpc.grpc.pb.h>
 
 #include <grpc/grpc.h>
+#include <grpcpp/alarm.h>
 #include <grpcpp/channel.h>
 #include <grpcpp/client_context.h>
 #include <grpcpp/create_channel.h>
@@ -31,8 +35,10 @@
 
 #include <cassert>
 #include <chrono>
-#include <queue>
+#include <condition_variable>
 #include <memory>
+#include <random>
+#include <vector>
 
 struct evtc_rpc_client_status
 {
@@ -58,6 +64,10 @@ class evtc_rpc_client
 		bool WritePending = false;
 		uint16_t RegisteredInstanceId = 0;
 		std::map<uintptr_t /*UniqueId*/, PeerInfo> RegisteredPeers;
+		uint32_t SentInterestGeneration = 0; // mInterestGeneration of the last SetInterest sent on this connection
+		std::chrono::steady_clock::time_point ConnectedTime{}; // When the Connect call completed, default if it didn't
+		std::chrono::steady_clock::time_point DisabledTime{}; // When Serve() first saw the client disabled or shutting down, default if it didn't
+		bool EndSessionSent = false;
 
 		grpc::ClientContext ClientContext;
 		std::shared_ptr<grpc::Channel> Channel;
@@ -75,7 +85,12 @@ class evtc_rpc_client
 		AddPeer,
 		RemovePeer,
 		CombatEvent,
+		CombatEventBatch,
+		SetInterest,
+		ResumeSession,
+		EndSession,
 		Disconnect,
+		WakeUp, // Internal only, see WakeUp()
 
 		Invalid
 	};
@@ -180,6 +195,56 @@ class evtc_rpc_client
 		const cbtevent Event;
 	};
 
+	// Built when sending, out of whatever events are queued in mQueuedEvents at the time
+	struct CombatEventBatchCallData : public CallDataBase
+	{
+		CombatEventBatchCallData(std::shared_ptr<ConnectionContext>&& pContext)
+			: CallDataBase{CallDataType::CombatEventBatch, std::move(pContext)}
+		{
+		}
+
+		std::vector<cbtevent> Events;
+	};
+
+	struct SetInterestCallData : public CallDataBase
+	{
+		SetInterestCallData(std::shared_ptr<ConnectionContext>&& pContext, evtc_rpc::messages::InterestedEvents pEvents, std::vector<uint16_t>&& pPeers)
+			: CallDataBase{CallDataType::SetInterest, std::move(pContext)}
+			, Events{pEvents}
+			, Peers{std::move(pPeers)}
+		{
+		}
+
+		const evtc_rpc::messages::InterestedEvents Events;
+		const std::vector<uint16_t> Peers;
+	};
+
+	// Replaces RegisterSelf and the AddPeer calls on a new connection if the previous one left a session token
+	struct ResumeSessionCallData : public CallDataBase
+	{
+		ResumeSessionCallData(std::shared_ptr<ConnectionContext>&& pContext, uint64_t pSessionToken, uint16_t pSelfInstanceId, std::string&& pSelfAccountName, std::vector<PeerInfo>&& pPeers)
+			: CallDataBase{CallDataType::ResumeSession, std::move(pContext)}
+			, SessionToken{pSessionToken}
+			, SelfInstanceId{pSelfInstanceId}
+			, SelfAccountName{std::move(pSelfAccountName)}
+			, Peers{std::move(pPeers)}
+		{
+		}
+
+		const uint64_t SessionToken;
+		const uint16_t SelfInstanceId;
+		const std::string SelfAccountName;
+		const std::vector<PeerInfo> Peers;
+	};
+
+	struct EndSessionCallData : public CallDataBase
+	{
+		EndSessionCallData(std::shared_ptr<ConnectionContext>&& pContext)
+			: CallDataBase{CallDataType::EndSession, std::move(pContext)}
+		{
+		}
+	};
+
 	struct DisconnectCallData : public CallDataBase
 	{
 		DisconnectCallData(std::shared_ptr<ConnectionContext>&& pContext)
@@ -188,6 +253,17 @@ class evtc_rpc_client
 		}
 	};
 
+	struct WakeUpCallData : public CallDataBase
+	{
+		WakeUpCallData()
+			: CallDataBase{CallDataType::WakeUp, nullptr}
+			, Alarm{new grpc::Alarm}
+		{
+		}
+
+		std::unique_ptr<grpc::Alarm> Alarm;
+	};
+
 public:
 	evtc_rpc_client(std::function<std::string()>&& pEndpointCallback, std::function<std::string()>&& pRootCertsCallback, std::function<void(cbtevent*, uint16_t)>&& pCombatEventCallback);
 
@@ -195,6 +271,9 @@ public:
 	void SetEnabledStatus(bool pEnabledStatus);
 	void SetBudgetMode(bool pBudgetMode);
 	void SetDisableEncryption(bool pDisableEncryption);
+	// Asks the server to only forward the given events from the given peers (instance ids, empty means all peers) to
+	// this client. Applies to the current connection and all later ones. Cheap if nothing changed
+	void SetInterest(evtc_rpc::messages::InterestedEvents pEvents, std::vector<uint16_t> pPeers = {});
 
 	uintptr_t ProcessLocalEvent(cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* pSkillname, uint64_t pId, uint64_t pRevision);
 	uintptr_t ProcessAreaEvent(cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* pSkillname, uint64_t pId, uint64_t pRevision);
@@ -203,35 +282,87 @@ public:
 	void Serve();
 	void Shutdown();
 
-	void FlushEvents(size_t pAcceptableQueueSize = 0);
+	// Blocks until at most pAcceptableQueueSize events are queued, i.e. the rest have been taken by Serve() to be sent.
+	// Returns false if that didn't happen within pTimeout, or if the client was shut down in the meantime
+	bool FlushEvents(size_t pAcceptableQueueSize = 0, std::chrono::milliseconds pTimeout = std::chrono::milliseconds::max());
 
 #ifndef TEST
 private:
 #endif
-	bool QueueEvent(CallDataBase* pCallData, bool pIsImportant);
+	// Called from the arcdps callbacks, returns false if the event was dropped because the queue is full. Queueing the
+	// event doesn't allocate, but the first event queued while no wake up is pending takes mWakeUpLock to arm the wake up
+	// alarm (see WakeUp()), so it can briefly block on Serve() or another producer doing the same
+	bool QueueEvent(const cbtevent& pEvent, bool pIsImportant);
+	// Makes Serve() run its state machine. Has to be called after changing anything that Serve() could act on, since
+	// Serve() otherwise blocks until a call completes. Cheap if a wake up is already pending
+	void WakeUp();
+	// Called by Serve() after taking events out of mQueuedEvents. Wakes up FlushEvents() callers, if there are any
+	void NotifyFlushWaiters();
 	CallDataBase* TryGetPeerEvent();
+	CallDataBase* TryGetInterest();
+	// Has to be called with mSelfInfoLock held, on a connection that isn't registered yet
+	CallDataBase* TryResumeSession();
+	CallDataBase* TryGetCombatEvents();
 
 	void ForceDisconnect(const std::shared_ptr<ConnectionContext>& pContext, const char* pErrorMessage);
+	// Called by Serve() when pContext is dropped as the current connection. Decides when the next connection is opened
+	void ScheduleReconnect(const ConnectionContext& pContext);
+	// Random delay in [d/2, d] where d doubles with every failed attempt, from MIN_RECONNECT_DELAY up to
+	// MAX_RECONNECT_DELAY. The jitter keeps clients that lost their connection at the same time from reconnecting at
+	// the same time
+	std::chrono::milliseconds GetReconnectDelay(uint32_t pFailedAttempts);
 	void HandleReadMessage(ReadMessageCallData* pCallData);
 	void SendEvent(CallDataBase* pCallData);
+	// Called by Serve() on a connection that is going away because the client was disabled or shut down. Sends
+	// EndSession if there is a session to end, then returns true (and sets pWakeUpTime) for as long as Serve() should
+	// wait for that and any pending write to be sent, at most END_SESSION_TIMEOUT. Once it returns false the call can be
+	// cancelled
+	bool WaitForEndSession(std::chrono::steady_clock::time_point& pWakeUpTime);
 
 	const std::function<std::string()> mEndpointCallback;
 	const std::function<std::string()> mRootCertificatesCallback;
 	const std::function<void(cbtevent*, uint16_t)> mCombatEventCallback;
 
-	std::mutex mQueuedEventsLock;
-	std::queue<CallDataBase*> mQueuedEvents;
+	// Combat events waiting to be sent. Produced by the arcdps callbacks, consumed by Serve()
+	MpscRing<cbtevent, 16384> mQueuedEvents;
+
+	// mFlushCondition is only signalled when mFlushWaiters is non-zero, so that Serve() doesn't take mFlushLock for
+	// every batch
+	std::mutex mFlushLock;
+	std::condition_variable mFlushCondition;
+	std::atomic_uint32_t mFlushWaiters{0};
 
 	std::atomic_bool mDisabled{false};
 	std::atomic_bool mBudgetMode{false};
 	std::atomic_bool mDisableEncryption{false};
 	std::atomic_bool mShouldShutdown{false};
-	bool mShutdown = false;
-	std::chrono::steady_clock::time_point mLastConnectionAttempt;
+	std::atomic_bool mShutdown{false}; // Only written by Serve()
+
+	static constexpr std::chrono::milliseconds MIN_RECONNECT_DELAY{1000};
+	static constexpr std::chrono::milliseconds MAX_RECONNECT_DELAY{60000};
+	// A connection that stayed up at least this long resets the backoff
+	static constexpr std::chrono::milliseconds STABLE_CONNECTION_TIME{10000};
+	// How long a disabled or shutting down client waits for its pending write and EndSession to be sent before cancelling
+	// the call
+	static constexpr std::chrono::milliseconds END_SESSION_TIMEOUT{1000};
+	// Only used by Serve()
+	std::chrono::steady_clock::time_point mNextConnectionAttempt{};
+	uint32_t mFailedConnectionAttempts = 0;
+	std::minstd_rand mReconnectJitter{std::random_device{}()};
+	// The token from the last SessionToken message, 0 if there is none. Consumed by the next ResumeSession. Only used
+	// by Serve()
+	uint64_t mSessionToken = 0;
 
 	std::shared_ptr<ConnectionContext> mConnectionContext;
 	grpc::CompletionQueue mCompletionQueue;
 
+	// At most one wake up is queued at a time, so the same alarm is reused for all of them. mWakeUpPending is cleared
+	// by Serve() when it receives mWakeUpCallData
+	WakeUpCallData mWakeUpCallData;
+	std::atomic_bool mWakeUpPending{false};
+	std::mutex mWakeUpLock;
+	bool mCompletionQueueShutdown = false; // Protected by mWakeUpLock, no alarms can be set once it's true
+
 	std::mutex mSelfInfoLock;
 	std::string mAccountName;
 	uint16_t mInstanceId = 0;
@@ -239,6 +370,11 @@ private:
 	std::mutex mPeerInfoLock;
 	std::map<uintptr_t /*UniqueId*/, PeerInfo> mPeers;
 
+	std::mutex mInterestLock;
+	evtc_rpc::messages::InterestedEvents mInterestedEvents = evtc_rpc::messages::InterestedEvents::All;
+	std::vector<uint16_t> mInterestedPeers;
+	uint32_t mInterestGeneration = 0; // Incremented on every change, 0 is the server's default (everything)
+
 	std::mutex mStatusLock;
 	evtc_rpc_client_status mStatus;
 };
\ No newline at end of file
@@ -0,0 +1,457 @@
+#include "EventCodec.h"
+
+#include "../src/Common.h"
+
+#include <cstring>
+#include <utility>
+
+namespace
+{
+uint64_t ZigzagEncode(int64_t pValue)
+{
+	return (static_cast<uint64_t>(pValue) << 1) ^ static_cast<uint64_t>(pValue >> 63);
+}
+
+int64_t ZigzagDecode(uint64_t pValue)
+{
+	return static_cast<int64_t>(pValue >> 1) ^ -static_cast<int64_t>(pValue & 1);
+}
+}; // anonymous namespace
+
+size_t EventCodecState::RecentValues::Find(uint64_t pValue) const
+{
+	for (size_t i = 0; i < Values.size(); i++)
+	{
+		if (Values[i] == pValue)
+		{
+			return i;
+		}
+	}
+	return RECENT_VALUE_COUNT;
+}
+
+void EventCodecState::RecentValues::Use(size_t pIndex)
+{
+	uint64_t value = Values[pIndex];
+	for (size_t i = pIndex; i > 0; i--)
+	{
+		Values[i] = Values[i - 1];
+	}
+	Values[0] = value;
+}
+
+void EventCodecState::RecentValues::Insert(uint64_t pValue)
+{
+	for (size_t i = Values.size() - 1; i > 0; i--)
+	{
+		Values[i] = Values[i - 1];
+	}
+	Values[0] = pValue;
+}
+
+EventEncoder::EventEncoder(uint8_t* pBuffer)
+	: mBuffer{pBuffer}
+	, mPosition{pBuffer}
+{
+}
+
+void EventEncoder::Encode(const cbtevent& pEvent)
+{
+	std::array<uint8_t, FLAG_BYTES_COUNT> flagBytes;
+	memcpy(flagBytes.data(), reinterpret_cast<const uint8_t*>(&pEvent) + FLAG_BYTES_OFFSET, FLAG_BYTES_COUNT);
+
+	uint32_t changedFlagBytes = 0;
+	for (size_t i = 0; i < FLAG_BYTES_COUNT; i++)
+	{
+		if (flagBytes[i] != mPreviousFlagBytes[i])
+		{
+			changedFlagBytes |= 1 << i;
+		}
+	}
+
+	uint32_t fields = 0;
+	fields |= pEvent.time != mPreviousTime ? FIELD_TIME : 0;
+	fields |= pEvent.src_agent != 0 ? FIELD_SRC_AGENT : 0;
+	fields |= pEvent.dst_agent != 0 ? FIELD_DST_AGENT : 0;
+	fields |= pEvent.value != 0 ? FIELD_VALUE : 0;
+	fields |= pEvent.buff_dmg != 0 ? FIELD_BUFF_DMG : 0;
+	fields |= pEvent.overstack_value != 0 ? FIELD_OVERSTACK_VALUE : 0;
+	fields |= pEvent.skillid != 0 ? FIELD_SKILLID : 0;
+	fields |= pEvent.src_instid != 0 ? FIELD_SRC_INSTID : 0;
+	fields |= pEvent.dst_instid != 0 ? FIELD_DST_INSTID : 0;
+	fields |= pEvent.src_master_instid != 0 ? FIELD_SRC_MASTER_INSTID : 0;
+	fields |= pEvent.dst_master_instid != 0 ? FIELD_DST_MASTER_INSTID : 0;
+	fields |= changedFlagBytes != 0 ? FIELD_FLAG_BYTES : 0;
+	WriteVarint(fields);
+
+	if ((fields & FIELD_TIME) != 0)
+	{
+		WriteVarint(ZigzagEncode(static_cast<int64_t>(pEvent.time - mPreviousTime)));
+		mPreviousTime = pEvent.time;
+	}
+	if ((fields & FIELD_SRC_AGENT) != 0)
+	{
+		WriteRecentValue(mRecentAgents, pEvent.src_agent);
+	}
+	if ((fields & FIELD_DST_AGENT) != 0)
+	{
+		WriteRecentValue(mRecentAgents, pEvent.dst_agent);
+	}
+	if ((fields & FIELD_VALUE) != 0)
+	{
+		WriteVarint(ZigzagEncode(pEvent.value));
+	}
+	if ((fields & FIELD_BUFF_DMG) != 0)
+	{
+		WriteVarint(ZigzagEncode(pEvent.buff_dmg));
+	}
+	if ((fields & FIELD_OVERSTACK_VALUE) != 0)
+	{
+		WriteVarint(pEvent.overstack_value);
+	}
+	if ((fields & FIELD_SKILLID) != 0)
+	{
+		WriteRecentValue(mRecentSkills, pEvent.skillid);
+	}
+	if ((fields & FIELD_SRC_INSTID) != 0)
+	{
+		WriteRecentValue(mRecentInstances, pEvent.src_instid);
+	}
+	if ((fields & FIELD_DST_INSTID) != 0)
+	{
+		WriteRecentValue(mRecentInstances, pEvent.dst_instid);
+	}
+	if ((fields & FIELD_SRC_MASTER_INSTID) != 0)
+	{
+		WriteRecentValue(mRecentInstances, pEvent.src_master_instid);
+	}
+	if ((fields & FIELD_DST_MASTER_INSTID) != 0)
+	{
+		WriteRecentValue(mRecentInstances, pEvent.dst_master_instid);
+	}
+	if ((fields & FIELD_FLAG_BYTES) != 0)
+	{
+		WriteVarint(changedFlagBytes);
+		for (size_t i = 0; i < FLAG_BYTES_COUNT; i++)
+		{
+			if ((changedFlagBytes & (1 << i)) != 0)
+			{
+				*mPosition++ = flagBytes[i];
+			}
+		}
+		mPreviousFlagBytes = flagBytes;
+	}
+}
+
+size_t EventEncoder::GetSize() const
+{
+	return mPosition - mBuffer;
+}
+
+void EventEncoder::WriteVarint(uint64_t pValue)
+{
+	while (pValue >= 0x80)
+	{
+		*mPosition++ = static_cast<uint8_t>(pValue | 0x80);
+		pValue >>= 7;
+	}
+	*mPosition++ = static_cast<uint8_t>(pValue);
+}
+
+void EventEncoder::WriteRecentValue(RecentValues& pTable, uint64_t pValue)
+{
+	size_t index = pTable.Find(pValue);
+	if (index < RECENT_VALUE_COUNT)
+	{
+		*mPosition++ = static_cast<uint8_t>(index);
+		pTable.Use(index);
+	}
+	else
+	{
+		*mPosition++ = static_cast<uint8_t>(RECENT_VALUE_COUNT);
+		WriteVarint(pValue);
+		pTable.Insert(pValue);
+	}
+}
+
+EventDecoder::EventDecoder(const void* pData, size_t pSize)
+	: mPosition{static_cast<const uint8_t*>(pData)}
+	, mEnd{static_cast<const uint8_t*>(pData) + pSize}
+{
+}
+
+bool EventDecoder::Decode(cbtevent& pEvent)
+{
+	uint64_t fields;
+	if (ReadVarint(fields) == false || (fields & ~static_cast<uint64_t>(FIELD_ALL)) != 0)
+	{
+		return false;
+	}
+
+	uint64_t value = 0;
+	if ((fields & FIELD_TIME) != 0)
+	{
+		if (ReadVarint(value) == false)
+		{
+			return false;
+		}
+		mPreviousTime += static_cast<uint64_t>(ZigzagDecode(value));
+	}
+	pEvent.time = mPreviousTime;
+
+	pEvent.src_agent = 0;
+	if ((fields & FIELD_SRC_AGENT) != 0 && ReadRecentValue(mRecentAgents, pEvent.src_agent) == false)
+	{
+		return false;
+	}
+	pEvent.dst_agent = 0;
+	if ((fields & FIELD_DST_AGENT) != 0 && ReadRecentValue(mRecentAgents, pEvent.dst_agent) == false)
+	{
+		return false;
+	}
+
+	value = 0;
+	if ((fields & FIELD_VALUE) != 0 && ReadVarint(value) == false)
+	{
+		return false;
+	}
+	pEvent.value = static_cast<int32_t>(ZigzagDecode(value));
+
+	value = 0;
+	if ((fields & FIELD_BUFF_DMG) != 0 && ReadVarint(value) == false)
+	{
+		return false;
+	}
+	pEvent.buff_dmg = static_cast<int32_t>(ZigzagDecode(value));
+
+	value = 0;
+	if ((fields & FIELD_OVERSTACK_VALUE) != 0 && ReadVarint(value) == false)
+	{
+		return false;
+	}
+	pEvent.overstack_value = static_cast<uint32_t>(value);
+
+	value = 0;
+	if ((fields & FIELD_SKILLID) != 0 && ReadRecentValue(mRecentSkills, value) == false)
+	{
+		return false;
+	}
+	pEvent.skillid = static_cast<uint32_t>(value);
+
+	constexpr std::array<std::pair<uint32_t, uint16_t cbtevent::*>, 4> instanceFields = {{
+		{FIELD_SRC_INSTID, &cbtevent::src_instid},
+		{FIELD_DST_INSTID, &cbtevent::dst_instid},
+		{FIELD_SRC_MASTER_INSTID, &cbtevent::src_master_instid},
+		{FIELD_DST_MASTER_INSTID, &cbtevent::dst_master_instid}}};
+	for (const auto& [field, member] : instanceFields)
+	{
+		value = 0;
+		if ((fields & field) != 0 && ReadRecentValue(mRecentInstances, value) == false)
+		{
+			return false;
+		}
+		pEvent.*member = static_cast<uint16_t>(value);
+	}
+
+	if ((fields & FIELD_FLAG_BYTES) != 0)
+	{
+		uint64_t changedFlagBytes;
+		if (ReadVarint(changedFlagBytes) == false || changedFlagBytes >= (1ULL << FLAG_BYTES_COUNT))
+		{
+			return false;
+		}
+
+		for (size_t i = 0; i < FLAG_BYTES_COUNT; i++)
+		{
+			if ((changedFlagBytes & (1ULL << i)) != 0)
+			{
+				if (mPosition == mEnd)
+				{
+					return false;
+				}
+				mPreviousFlagBytes[i] = *mPosition++;
+			}
+		}
+	}
+	memcpy(reinterpret_cast<uint8_t*>(&pEvent) + FLAG_BYTES_OFFSET, mPreviousFlagBytes.data(), FLAG_BYTES_COUNT);
+
+	return true;
+}
+
+bool EventDecoder::IsAtEnd() const
+{
+	return mPosition == mEnd;
+}
+
+bool EventDecoder::ReadVarint(uint64_t& pValue)
+{
+	pValue = 0;
+	for (uint32_t shift = 0; shift < 64; shift += 7)
+	{
+		if (mPosition == mEnd)
+		{
+			return false;
+		}
+
+		uint8_t byte = *mPosition++;
+		pValue |= static_cast<uint64_t>(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false; // More than 10 bytes
+}
+
+bool EventDecoder::ReadRecentValue(RecentValues& pTable, uint64_t& pValue)
+{
+	if (mPosition == mEnd)
+	{
+		return false;
+	}
+
+	uint8_t index = *mPosition++;
+	if (index < RECENT_VALUE_COUNT)
+	{
+		pValue = pTable.Values[index];
+		pTable.Use(index);
+		return true;
+	}
+	else if (index == RECENT_VALUE_COUNT)
+	{
+		if (ReadVarint(pValue) == false)
+		{
+			return false;
+		}
+		pTable.Insert(pValue);
+		return true;
+	}
+
+	return false;
+}
+
+bool ToHealingEvent(const cbtevent& pEvent, evtc_rpc::messages::HealingEvent& pResult)
+{
+	using namespace evtc_rpc::messages;
+
+	if (pEvent.time > UINT32_MAX)
+	{
+		return false;
+	}
+
+	pResult.Time = static_cast<uint32_t>(pEvent.time);
+	pResult.SkillId = pEvent.skillid;
+	pResult.SourceInstanceId = pEvent.src_instid;
+	pResult.DestinationInstanceId = pEvent.dst_instid;
+	pResult.SourceMasterInstanceId = pEvent.src_master_instid;
+	pResult.DestinationMasterInstanceId = pEvent.dst_master_instid;
+	pResult.IsOffcycle = pEvent.is_offcycle;
+	pResult.State = 0;
+
+	if (pEvent.is_statechange == CBTS_ENTERCOMBAT)
+	{
+		if (pEvent.dst_agent > UINT32_MAX)
+		{
+			return false;
+		}
+
+		pResult.Value = static_cast<int32_t>(static_cast<uint32_t>(pEvent.dst_agent));
+		pResult.Flags = static_cast<uint8_t>(HealingEventKind::EnterCombat);
+		return true;
+	}
+	else if (pEvent.is_statechange == CBTS_EXITCOMBAT)
+	{
+		// The time of the last damage event is stored from iff onwards, see EventProcessor::LocalCombat
+		uint64_t lastDamageEventTime;
+		memcpy(&lastDamageEventTime, &pEvent.iff, sizeof(lastDamageEventTime));
+		if (lastDamageEventTime > UINT32_MAX)
+		{
+			return false;
+		}
+
+		pResult.Value = static_cast<int32_t>(static_cast<uint32_t>(lastDamageEventTime));
+		pResult.Flags = static_cast<uint8_t>(HealingEventKind::ExitCombat);
+		return true;
+	}
+
+	if (GetEventType(&pEvent, true) != EventType::Healing || pEvent.iff > 3 || pEvent.result > 3 || pEvent.is_shields > 1)
+	{
+		return false;
+	}
+
+	// Only one of value and buff_dmg is set, depending on whether it's a buff event (see GetEventType)
+	if ((pEvent.buff == 0 && pEvent.buff_dmg != 0) || (pEvent.buff != 0 && pEvent.value != 0))
+	{
+		return false;
+	}
+
+	// Peers log the event as it is, so anything that the record would lose has to be zero
+	if (pEvent.is_ninety > 1 || pEvent.is_fifty > 1 || pEvent.is_flanking > 1 || pEvent.is_moving > 3 ||
+		pEvent.overstack_value != 0 || pEvent.is_activation != 0 || pEvent.is_buffremove != 0 ||
+		pEvent.pad61 != 0 || pEvent.pad62 != 0 || pEvent.pad63 != 0 || pEvent.pad64 != 0)
+	{
+		return false;
+	}
+	pResult.State |= pEvent.is_ninety != 0 ? HEALING_EVENT_STATE_NINETY : 0;
+	pResult.State |= pEvent.is_fifty != 0 ? HEALING_EVENT_STATE_FIFTY : 0;
+	pResult.State |= pEvent.is_flanking != 0 ? HEALING_EVENT_STATE_FLANKING : 0;
+	pResult.State |= static_cast<uint8_t>(pEvent.is_moving << HEALING_EVENT_STATE_MOVING_SHIFT);
+
+	pResult.Value = pEvent.buff != 0 ? pEvent.buff_dmg : pEvent.value;
+	pResult.Flags = static_cast<uint8_t>(HealingEventKind::Healing);
+	pResult.Flags |= pEvent.buff != 0 ? HEALING_EVENT_FLAG_BUFF : 0;
+	pResult.Flags |= pEvent.is_shields != 0 ? HEALING_EVENT_FLAG_SHIELDS : 0;
+	pResult.Flags |= static_cast<uint8_t>(pEvent.iff << HEALING_EVENT_IFF_SHIFT);
+	pResult.Flags |= static_cast<uint8_t>(pEvent.result << HEALING_EVENT_RESULT_SHIFT);
+	return true;
+}
+
+void FromHealingEvent(const evtc_rpc::messages::HealingEvent& pEvent, cbtevent& pResult)
+{
+	using namespace evtc_rpc::messages;
+
+	memset(&pResult, 0, sizeof(pResult));
+	pResult.time = pEvent.Time;
+	pResult.skillid = pEvent.SkillId;
+	pResult.src_instid = pEvent.SourceInstanceId;
+	pResult.dst_instid = pEvent.DestinationInstanceId;
+	pResult.src_master_instid = pEvent.SourceMasterInstanceId;
+	pResult.dst_master_instid = pEvent.DestinationMasterInstanceId;
+	pResult.is_offcycle = pEvent.IsOffcycle;
+
+	switch (static_cast<HealingEventKind>(pEvent.Flags & HEALING_EVENT_KIND_MASK))
+	{
+	case HealingEventKind::EnterCombat:
+		pResult.is_statechange = CBTS_ENTERCOMBAT;
+		pResult.dst_agent = static_cast<uint32_t>(pEvent.Value);
+		break;
+
+	case HealingEventKind::ExitCombat:
+	{
+		pResult.is_statechange = CBTS_EXITCOMBAT;
+		uint64_t lastDamageEventTime = static_cast<uint32_t>(pEvent.Value);
+		memcpy(&pResult.iff, &lastDamageEventTime, sizeof(lastDamageEventTime));
+		break;
+	}
+
+	default:
+		pResult.buff = (pEvent.Flags & HEALING_EVENT_FLAG_BUFF) != 0 ? 1 : 0;
+		if (pResult.buff != 0)
+		{
+			pResult.buff_dmg = pEvent.Value;
+		}
+		else
+		{
+			pResult.value = pEvent.Value;
+		}
+		pResult.is_shields = (pEvent.Flags & HEALING_EVENT_FLAG_SHIELDS) != 0 ? 1 : 0;
+		pResult.iff = (pEvent.Flags >> HEALING_EVENT_IFF_SHIFT) & 0x03;
+		pResult.result = (pEvent.Flags >> HEALING_EVENT_RESULT_SHIFT) & 0x03;
+		pResult.is_ninety = (pEvent.State & HEALING_EVENT_STATE_NINETY) != 0 ? 1 : 0;
+		pResult.is_fifty = (pEvent.State & HEALING_EVENT_STATE_FIFTY) != 0 ? 1 : 0;
+		pResult.is_flanking = (pEvent.State & HEALING_EVENT_STATE_FLANKING) != 0 ? 1 : 0;
+		pResult.is_moving = (pEvent.State >> HEALING_EVENT_STATE_MOVING_SHIFT) & 0x03;
+		break;
+	}
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "evtc_rpc_messages.h"
+
+#include <ArcdpsExtension/arcdps_structs_slim.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Compact encoding for a run of cbtevents, used by CompressedCombatEventBatch (see evtc_rpc_messages.h). A raw cbtevent
+// is 64 bytes, but most of it is zero, ids repeat from one event to the next and time only grows by a little. Every
+// event is encoded as a varint mask of the fields that are present, followed by those fields:
+// - time as a zigzag varint delta from the previous event (present if it changed)
+// - agents, skill ids and instance ids as an index into a small move-to-front table of recently used values, or a
+//   miss marker followed by the literal value (present if non-zero)
+// - value and buff_dmg as zigzag varints, overstack_value as a varint (present if non-zero)
+// - the trailing byte fields (iff through pad64) as a varint mask of the bytes that changed since the previous event,
+//   followed by those bytes (present if any of them changed)
+// The state starts out empty for every encoder and decoder, so every run can be decoded on its own.
+class EventCodecState
+{
+protected:
+	static constexpr size_t RECENT_VALUE_COUNT = 8;
+	static constexpr size_t FLAG_BYTES_OFFSET = offsetof(cbtevent, iff);
+	static constexpr size_t FLAG_BYTES_COUNT = sizeof(cbtevent) - FLAG_BYTES_OFFSET;
+	static_assert(FLAG_BYTES_COUNT == 16, "cbtevent layout changed");
+
+	static constexpr uint32_t FIELD_TIME = 1 << 0;
+	static constexpr uint32_t FIELD_SRC_AGENT = 1 << 1;
+	static constexpr uint32_t FIELD_DST_AGENT = 1 << 2;
+	static constexpr uint32_t FIELD_VALUE = 1 << 3;
+	static constexpr uint32_t FIELD_BUFF_DMG = 1 << 4;
+	static constexpr uint32_t FIELD_OVERSTACK_VALUE = 1 << 5;
+	static constexpr uint32_t FIELD_SKILLID = 1 << 6;
+	static constexpr uint32_t FIELD_SRC_INSTID = 1 << 7;
+	static constexpr uint32_t FIELD_DST_INSTID = 1 << 8;
+	static constexpr uint32_t FIELD_SRC_MASTER_INSTID = 1 << 9;
+	static constexpr uint32_t FIELD_DST_MASTER_INSTID = 1 << 10;
+	static constexpr uint32_t FIELD_FLAG_BYTES = 1 << 11;
+	static constexpr uint32_t FIELD_ALL = (1 << 12) - 1;
+
+	// Most recently used first. Zero is never looked up (zero fields are simply not present), so the unused entries
+	// don't need to be tracked
+	struct RecentValues
+	{
+		std::array<uint64_t, RECENT_VALUE_COUNT> Values = {};
+
+		// Returns RECENT_VALUE_COUNT if pValue is not in the table
+		size_t Find(uint64_t pValue) const;
+		// Moves the entry at pIndex to the front
+		void Use(size_t pIndex);
+		// Adds pValue at the front, evicting the least recently used value
+		void Insert(uint64_t pValue);
+	};
+
+	uint64_t mPreviousTime = 0;
+	std::array<uint8_t, FLAG_BYTES_COUNT> mPreviousFlagBytes = {};
+	RecentValues mRecentAgents; // src_agent and dst_agent
+	RecentValues mRecentSkills;
+	RecentValues mRecentInstances; // All four instance id fields
+};
+
+class EventEncoder : private EventCodecState
+{
+public:
+	// Mask (2) + time (10) + agents (2 * 11) + value, buff_dmg, overstack_value (3 * 5) + skillid (6) + instance ids
+	// (4 * 4) + flag bytes (3 + 16)
+	static constexpr size_t MAX_ENCODED_EVENT_SIZE = 90;
+
+	// pBuffer has to have room for MAX_ENCODED_EVENT_SIZE bytes for every event that is going to be encoded
+	explicit EventEncoder(uint8_t* pBuffer);
+
+	void Encode(const cbtevent& pEvent);
+
+	// Amount of bytes written to the buffer so far
+	size_t GetSize() const;
+
+private:
+	void WriteVarint(uint64_t pValue);
+	void WriteRecentValue(RecentValues& pTable, uint64_t pValue);
+
+	uint8_t* const mBuffer;
+	uint8_t* mPosition;
+};
+
+class EventDecoder : private EventCodecState
+{
+public:
+	EventDecoder(const void* pData, size_t pSize);
+
+	// Returns false if the data is truncated or malformed, pEvent is undefined in that case
+	bool Decode(cbtevent& pEvent);
+
+	bool IsAtEnd() const;
+
+private:
+	bool ReadVarint(uint64_t& pValue);
+	bool ReadRecentValue(RecentValues& pTable, uint64_t& pValue);
+
+	const uint8_t* mPosition;
+	const uint8_t* const mEnd;
+};
+
+// Converts pEvent to the compact record used by HealingEventBatch. Returns false if pEvent is not a healing, barrier
+// generation, combat enter or combat exit event, or if one of its fields doesn't fit in the record (or isn't carried by
+// it, but is set). Such events have to be sent in full
+bool ToHealingEvent(const cbtevent& pEvent, evtc_rpc::messages::HealingEvent& pResult);
+// Rebuilds the event that pEvent was made from. The agent ids aren't carried by HealingEvent, they are zero
+void FromHealingEvent(const evtc_rpc::messages::HealingEvent& pEvent, cbtevent& pResult);
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+// Bounded lock-free multi-producer single-consumer FIFO queue. Every slot carries a sequence number that tells
+// producers and the consumer whose turn it is, so neither side ever waits on the other - a push into a full ring and a
+// pop from an empty ring simply fail. Values are stored inline and storage is allocated once on construction, pushing
+// and popping never allocate.
+template <typename T, size_t Capacity>
+class MpscRing
+{
+	static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity has to be a power of two");
+	static_assert(std::is_trivially_copyable_v<T> == true, "Values are copied in and out of the slots");
+
+public:
+	MpscRing()
+		: mSlots{new Slot[Capacity]}
+	{
+		for (size_t i = 0; i < Capacity; i++)
+		{
+			mSlots[i].Sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	// Can be called from any thread. Returns false if the ring is full
+	bool TryPush(const T& pValue)
+	{
+		size_t position = mTail.load(std::memory_order_relaxed);
+		while (true)
+		{
+			Slot& slot = mSlots[position & (Capacity - 1)];
+			size_t sequence = slot.Sequence.load(std::memory_order_acquire);
+			intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+			if (difference == 0)
+			{
+				// Slot is free for this position, claim it
+				if (mTail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed) == true)
+				{
+					slot.Value = pValue;
+					slot.Sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+				// position was reloaded by compare_exchange_weak
+			}
+			else if (difference < 0)
+			{
+				// Slot still holds the value from one lap ago, the consumer hasn't caught up
+				return false;
+			}
+			else
+			{
+				// Another producer claimed this position
+				position = mTail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Has to be called from the consumer thread only. Returns false if the ring is empty (or the oldest claimed slot is
+	// still being written by its producer)
+	bool TryPop(T& pValue)
+	{
+		size_t position = mHead.load(std::memory_order_relaxed);
+		Slot& slot = mSlots[position & (Capacity - 1)];
+		if (slot.Sequence.load(std::memory_order_acquire) != position + 1)
+		{
+			return false;
+		}
+
+		pValue = slot.Value;
+		slot.Sequence.store(position + Capacity, std::memory_order_release);
+		mHead.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Can be called from any thread, the result is only a snapshot
+	size_t Size() const
+	{
+		size_t head = mHead.load(std::memory_order_acquire);
+		size_t tail = mTail.load(std::memory_order_acquire);
+		return tail > head ? tail - head : 0;
+	}
+
+	static constexpr size_t GetCapacity()
+	{
+		return Capacity;
+	}
+
+private:
+	struct Slot
+	{
+		std::atomic<size_t> Sequence;
+		T Value;
+	};
+
+	std::unique_ptr<Slot[]> mSlots;
+
+	// Producers and the consumer write different positions, keep them on separate cache lines
+	alignas(64) std::atomic<size_t> mTail{0}; // Next position to push to
+	alignas(64) std::atomic<size_t> mHead{0}; // Next position to pop from, only written by the consumer
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// FIFO queue stored in a ring buffer. Storage is allocated on first use and grows in powers of two, it is never shrunk.
+// Bounding the amount of entries is up to the user - the queue itself never drops anything.
+template <typename T>
+class RingQueue
+{
+public:
+	size_t Size() const
+	{
+		return mSize;
+	}
+
+	T& Front()
+	{
+		assert(mSize > 0);
+		return *mSlots[mHead];
+	}
+
+	void PushBack(T&& pValue)
+	{
+		if (mSize == mSlots.size())
+		{
+			Grow();
+		}
+
+		mSlots[Index(mSize)].emplace(std::move(pValue));
+		mSize++;
+	}
+
+	void PopFront()
+	{
+		assert(mSize > 0);
+
+		mSlots[mHead].reset();
+		mHead = Index(1);
+		mSize--;
+	}
+
+	void Clear()
+	{
+		while (mSize > 0)
+		{
+			PopFront();
+		}
+	}
+
+	// Removes all entries that pPredicate returns true for, the remaining entries keep their order. pPredicate is
+	// called exactly once per entry, oldest entry first. Returns the amount of removed entries
+	template <typename Predicate>
+	size_t RemoveIf(Predicate&& pPredicate)
+	{
+		size_t kept = 0;
+		for (size_t i = 0; i < mSize; i++)
+		{
+			std::optional<T>& entry = mSlots[Index(i)];
+			if (pPredicate(*entry) == false)
+			{
+				if (kept != i)
+				{
+					mSlots[Index(kept)] = std::move(entry);
+				}
+				kept++;
+			}
+		}
+
+		for (size_t i = kept; i < mSize; i++)
+		{
+			mSlots[Index(i)].reset();
+		}
+
+		size_t removed = mSize - kept;
+		mSize = kept;
+		return removed;
+	}
+
+private:
+	static constexpr size_t INITIAL_CAPACITY = 16;
+
+	size_t Index(size_t pOffset) const
+	{
+		return (mHead + pOffset) & (mSlots.size() - 1);
+	}
+
+	void Grow()
+	{
+		std::vector<std::optional<T>> slots(std::max(mSlots.size() * 2, INITIAL_CAPACITY));
+		for (size_t i = 0; i < mSize; i++)
+		{
+			slots[i] = std::move(mSlots[Index(i)]);
+		}
+
+		mSlots = std::move(slots);
+		mHead = 0;
+	}
+
+	std::vector<std::optional<T>> mSlots; // Size is always 0 or a power of two, only the slots in use are engaged
+	size_t mHead = 0;
+	size_t mSize = 0;
+};
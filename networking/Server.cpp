@@ -1,10 +1,76 @@
 #include "Server.h"
 
+#include "EventCodec.h"
+
+#include "../src/Common.h"
 #include "../src/Log.h"
 
+#include <algorithm>
+
 const auto STATISTICS_DUMP_INTERVAL = std::chrono::minutes(5);
 
-evtc_rpc_server::evtc_rpc_server(const char* pListeningEndpoint, const char* pPrometheusEndpoint, const grpc::SslServerCredentialsOptions* pCredentialsOptions)
+// Protobuf key of evtc_rpc::Message::blob (field number 1, wire type 2 - length delimited)
+constexpr uint8_t MESSAGE_BLOB_KEY = (1 << 3) | 2;
+
+static size_t EncodeVarint(uint64_t pValue, uint8_t* pBuffer)
+{
+	size_t length = 0;
+	while (pValue >= 0x80)
+	{
+		pBuffer[length++] = static_cast<uint8_t>(pValue | 0x80);
+		pValue >>= 7;
+	}
+	pBuffer[length++] = static_cast<uint8_t>(pValue);
+	return length;
+}
+
+// Builds a CompressedCombatEventFrame for pEventCount packed CombatEvent structs. pEncodedEvents is used as the frame
+// content if the events already arrived encoded, otherwise they are encoded here
+static grpc::Slice BuildCompressedFrame(const uint8_t* pEvents, uint16_t pEventCount, uint16_t pSenderInstanceId, std::string_view pEncodedEvents)
+{
+	using namespace evtc_rpc::messages;
+
+	std::vector<uint8_t> encoded;
+	if (pEncodedEvents.empty() == true)
+	{
+		encoded.resize(pEventCount * EventEncoder::MAX_ENCODED_EVENT_SIZE);
+		EventEncoder encoder{encoded.data()};
+		for (size_t i = 0; i < pEventCount; i++)
+		{
+			CombatEvent event;
+			memcpy(&event, pEvents + i * sizeof(CombatEvent), sizeof(event));
+			encoder.Encode(event.Event);
+		}
+		pEncodedEvents = std::string_view{reinterpret_cast<const char*>(encoded.data()), encoder.GetSize()};
+	}
+
+	CompressedCombatEventFrame frame;
+	frame.EventCount = pEventCount;
+	frame.SenderInstanceId = pSenderInstanceId;
+	frame.EncodedSize = static_cast<uint32_t>(pEncodedEvents.size());
+
+	grpc_slice slice = grpc_slice_malloc(sizeof(frame) + pEncodedEvents.size());
+	memcpy(GRPC_SLICE_START_PTR(slice), &frame, sizeof(frame));
+	memcpy(GRPC_SLICE_START_PTR(slice) + sizeof(frame), pEncodedEvents.data(), pEncodedEvents.size());
+	return grpc::Slice{slice, grpc::Slice::STEAL_REF};
+}
+
+// Builds a HealingEventFrame out of pEventCount HealingEvent structs
+static grpc::Slice BuildHealingFrame(uint16_t pEventCount, uint16_t pSenderInstanceId, std::string_view pHealingEvents)
+{
+	using namespace evtc_rpc::messages;
+
+	HealingEventFrame frame;
+	frame.EventCount = pEventCount;
+	frame.SenderInstanceId = pSenderInstanceId;
+
+	grpc_slice slice = grpc_slice_malloc(sizeof(frame) + pHealingEvents.size());
+	memcpy(GRPC_SLICE_START_PTR(slice), &frame, sizeof(frame));
+	memcpy(GRPC_SLICE_START_PTR(slice) + sizeof(frame), pHealingEvents.data(), pHealingEvents.size());
+	return grpc::Slice{slice, grpc::Slice::STEAL_REF};
+}
+
+evtc_rpc_server::evtc_rpc_server(const char* pListeningEndpoint, const char* pPrometheusEndpoint, const grpc::SslServerCredentialsOptions* pCredentialsOptions, size_t pCompletionQueueCount)
 	: mPrometheusExposer(pPrometheusEndpoint)
 {
 	grpc::ServerBuilder builder;
@@ -27,40 +93,38 @@ evtc_rpc_server::evtc_rpc_server(const char* pListeningEndpoint, const char* pPr
 
 	builder.RegisterService(&mService);
 
-	mCompletionQueue = builder.AddCompletionQueue();
+	if (pCompletionQueueCount == 0)
+	{
+		pCompletionQueueCount = 1;
+	}
+	for (size_t i = 0; i < pCompletionQueueCount; i++)
+	{
+		mCompletionQueues.emplace_back(builder.AddCompletionQueue());
+	}
+
 	mServer = builder.BuildAndStart();
 	mStatistics = std::make_shared<ServerStatistics>(*this);
 	mPrometheusExposer.RegisterCollectable(mStatistics->PrometheusRegistry);
 	mPrometheusExposer.RegisterCollectable(mStatistics);
 
-	LogI("Started listening - pListeningEndpoint={} pPrometheusEndpoint={}", pListeningEndpoint, pPrometheusEndpoint);
+	LogI("Started listening - pListeningEndpoint={} pPrometheusEndpoint={} completionQueues={}", pListeningEndpoint, pPrometheusEndpoint, mCompletionQueues.size());
 }
 
 evtc_rpc_server::~evtc_rpc_server()
 {
-	assert(mRegisteredAgents.size() == 0);
+	assert(GetRegisteredAgentCount() == 0);
+	assert(mAccountNames.GetCount() == 0);
 }
 
 ServerStatisticsSample evtc_rpc_server::GetStatistics()
 {
 	ServerStatisticsSample result = {};
-
-	std::lock_guard agents_lock{ mRegisteredAgentsLock };
-	result.RegisteredPlayers = mRegisteredAgents.size();
-
-	for (const auto& agent : mRegisteredAgents)
-	{
-		result.KnownPeers += agent.second->Peers.size();
-		for (const auto& peer : agent.second->Peers)
-		{
-			const auto iter = mRegisteredAgents.find(peer.first);
-			if (iter != mRegisteredAgents.end())
-			{
-				result.RegisteredPeers += 1;
-			}
-		}
-	}
-
+	result.RegisteredPlayers = mRegisteredPlayers.load(std::memory_order_relaxed);
+	result.KnownPeers = mKnownPeers.load(std::memory_order_relaxed);
+	result.RegisteredPeers = mRegisteredPeers.load(std::memory_order_relaxed);
+	result.QueuedEvents = static_cast<size_t>(std::max<int64_t>(mQueuedEventTotal.load(std::memory_order_relaxed), 0));
+	result.MaxQueuedEvents = mQueuedEventPeak.exchange(0, std::memory_order_relaxed);
+	result.Connections = mConnectionCount.load(std::memory_order_relaxed);
 	return result;
 }
 
@@ -77,24 +141,83 @@ void evtc_rpc_server::ThreadStartServe(void* pThis)
 
 void evtc_rpc_server::Serve()
 {
-	ConnectCallData* queuedData = new ConnectCallData{std::make_shared<ConnectionContext>()};
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < mCompletionQueues.size(); i++)
+	{
+		threads.emplace_back([this, i]()
+			{
+#ifdef LINUX
+				char threadName[16];
+				snprintf(threadName, sizeof(threadName), "evtcrpc-wrk%zu", i);
+				pthread_setname_np(pthread_self(), threadName);
+#elif defined(_WIN32)
+				SetThreadDescription(GetCurrentThread(), L"evtcrpc-worker");
+#endif
+
+				ServeQueue(i);
+			});
+	}
+
+	ServeQueue(0);
+
+	for (auto& thread : threads)
 	{
-		std::lock_guard lock(mRegisteredAgentsLock);
-		queuedData->Context->Iterator = mRegisteredAgents.end();
+		thread.join();
 	}
-	mService.RequestConnect(&queuedData->Context->ServerContext, &queuedData->Context->Stream, mCompletionQueue.get(), mCompletionQueue.get(), queuedData);
 
-	LogT("(tag {}) Queued Connect", fmt::ptr(queuedData));
+	LogI("All {} completion queues are shut down. {} events were flushed and {} dropped during shutdown",
+		mCompletionQueues.size(), mStatistics->ShutdownEventsFlushed->Value(), mStatistics->ShutdownEventsDropped->Value());
+}
+
+void evtc_rpc_server::ServeQueue(size_t pQueueIndex)
+{
+	grpc::ServerCompletionQueue* completionQueue = mCompletionQueues[pQueueIndex].get();
+
+	ConnectCallData* queuedData = new ConnectCallData{std::make_shared<ConnectionContext>()};
+	RequestConnect(queuedData, pQueueIndex);
+
+	LogT("(tag {}) Queued Connect on queue {}", fmt::ptr(queuedData), pQueueIndex);
 
 	while (true)
 	{
 		void* tag;
 		bool ok;
-		if (mCompletionQueue->Next(&tag, &ok) == false)
+		if (completionQueue->Next(&tag, &ok) == false)
 		{
-			LogI("mCompletionQueue->Next returned false, returning");
+			LogI("completionQueue->Next returned false on queue {}, returning", pQueueIndex);
 			return;
 		}
+		std::chrono::steady_clock::time_point completionTime = std::chrono::steady_clock::now();
+
+		ScopedLatency iterationLatency{mStatistics->LoopIteration};
+
+		if (mShutdownState.load(std::memory_order_relaxed) == ShutdownState::ShouldDrain)
+		{
+			std::unique_lock lock{mShutdownLock};
+			ShutdownState expected = ShutdownState::ShouldDrain;
+			if (mShutdownState.compare_exchange_strong(expected, ShutdownState::Draining, std::memory_order_relaxed) == true)
+			{
+				LogI("Set mShutdownState to Draining");
+				StartDrain();
+			}
+		}
+
+		if (mShutdownState.load(std::memory_order_relaxed) == ShutdownState::Draining)
+		{
+			// Registered connections leave the table as they are finished. Unregistered connections have nothing queued
+			// for them, they are cancelled by the shutdown
+			size_t remainingConnections = mRegisteredPlayers.load(std::memory_order_relaxed);
+			bool timedOut = std::chrono::steady_clock::now() >= mDrainDeadline.load(std::memory_order_relaxed);
+			if (remainingConnections == 0 || timedOut == true)
+			{
+				ShutdownState expected = ShutdownState::Draining;
+				if (mShutdownState.compare_exchange_strong(expected, ShutdownState::ShouldShutdown, std::memory_order_relaxed) == true)
+				{
+					LogI("Drain {}, {} registered connections and {} queued events left. Set mShutdownState to ShouldShutdown",
+						timedOut == true ? "timed out" : "completed", remainingConnections, mQueuedEventTotal.load(std::memory_order_relaxed));
+				}
+			}
+		}
 
 		if (mShutdownState.load(std::memory_order_relaxed) == ShutdownState::ShouldShutdown)
 		{
@@ -102,9 +225,17 @@ void evtc_rpc_server::Serve()
 			if (mShutdownState.load(std::memory_order_relaxed) == ShutdownState::ShouldShutdown)
 			{
 				LogI("Starting shutdown");
+				// Detached sessions are dropped, their pending alarms would keep the completion queues from shutting down
+				for (const auto& session : CancelSessionExpiries())
+				{
+					ForceDisconnect("server is shutting down", session);
+				}
 				// Wait a few milliseconds so we get a chance to flush out all pending messages
 				mServer->Shutdown(std::chrono::system_clock::now() + std::chrono::milliseconds(100));
-				mCompletionQueue->Shutdown();
+				for (const auto& queue : mCompletionQueues)
+				{
+					queue->Shutdown();
+				}
 
 				ShutdownState expected = ShutdownState::ShouldShutdown;
 				if (mShutdownState.compare_exchange_strong(expected, ShutdownState::ShuttingDown, std::memory_order_relaxed) == false)
@@ -145,6 +276,11 @@ void evtc_rpc_server::Serve()
 				ReadMessageCallData* message = static_cast<ReadMessageCallData*>(tag);
 				LogI("(client {} tag {}) ReadMessage got not-ok, closing connection", fmt::ptr(message->Context.get()), fmt::ptr(tag));
 
+				if (ok == false && TryDetachSession(message->Context) == true)
+				{
+					delete message;
+					break;
+				}
 				ForceDisconnect("shutdown by client", message->Context);
 
 				delete message;
@@ -165,7 +301,14 @@ void evtc_rpc_server::Serve()
 			case CallDataType::WakeUp:
 			{
 				WakeUpCallData* message = static_cast<WakeUpCallData*>(tag);
-				delete message;
+				if (message->Context != nullptr)
+				{
+					HandleSessionExpiry(message, false);
+				}
+				else
+				{
+					delete message;
+				}
 				break;
 			}
 			default:
@@ -184,17 +327,13 @@ void evtc_rpc_server::Serve()
 			HandleConnect(message);
 
 			queuedData->Context = std::make_shared<ConnectionContext>();
-			{
-				std::lock_guard agents_lock{mRegisteredAgentsLock};
-				queuedData->Context->Iterator = mRegisteredAgents.end();
-			}
-			mService.RequestConnect(&queuedData->Context->ServerContext, &queuedData->Context->Stream, mCompletionQueue.get(), mCompletionQueue.get(), queuedData);
+			RequestConnect(queuedData, pQueueIndex);
 			break;
 		}
 		case CallDataType::ReadMessage:
 		{
 			ReadMessageCallData* message = static_cast<ReadMessageCallData*>(tag);
-			HandleReadMessage(message);
+			HandleReadMessage(message, completionTime);
 
 			// Requeue the same tag for a new read. This has to be done after the the handler is done to ensure there isn't a race between two ReadMessages
 			message->Context->Stream.Read(&message->Message, message);
@@ -215,7 +354,18 @@ void evtc_rpc_server::Serve()
 		case CallDataType::WakeUp:
 		{
 			WakeUpCallData* message = static_cast<WakeUpCallData*>(tag);
-			delete message;
+			if (message->Context != nullptr)
+			{
+				HandleSessionExpiry(message, true);
+			}
+			else if (message->DrainCheck == true && shutdown_state == ShutdownState::Draining)
+			{
+				message->Alarm->Set(completionQueue, std::chrono::system_clock::now() + DRAIN_CHECK_INTERVAL, message);
+			}
+			else
+			{
+				delete message;
+			}
 			break;
 		}
 		default:
@@ -225,23 +375,165 @@ void evtc_rpc_server::Serve()
 	}
 }
 
+void evtc_rpc_server::RequestConnect(ConnectCallData* pCallData, size_t pQueueIndex)
+{
+	// The connection is bound to the completion queue it was accepted on, all its further events are handled by the
+	// thread serving that queue
+	grpc::ServerCompletionQueue* completionQueue = mCompletionQueues[pQueueIndex].get();
+	mService.RequestConnect(&pCallData->Context->ServerContext, &pCallData->Context->Stream, completionQueue, completionQueue, pCallData);
+}
+
 void evtc_rpc_server::Shutdown()
 {
+	ShutdownState newState = mDrainTimeout.load(std::memory_order_relaxed).count() > 0 ? ShutdownState::ShouldDrain : ShutdownState::ShouldShutdown;
+
 	ShutdownState expected = ShutdownState::Online;
-	if (mShutdownState.compare_exchange_strong(expected, ShutdownState::ShouldShutdown, std::memory_order_relaxed) == false)
+	if (mShutdownState.compare_exchange_strong(expected, newState, std::memory_order_relaxed) == false)
 	{
 		LogI("Not changing mShutdownState since it's {}", static_cast<int>(expected));
 	}
 	else
 	{
-		LogI("Set mShutdownState to ShouldShutdown");
+		LogI("Set mShutdownState to {}", static_cast<int>(newState));
 		WakeUpCallData* calldata = new WakeUpCallData;
-		calldata->Alarm->Set(mCompletionQueue.get(), std::chrono::system_clock::now(), calldata);
+		calldata->Alarm->Set(mCompletionQueues[0].get(), std::chrono::system_clock::now(), calldata);
+	}
+}
+
+void evtc_rpc_server::SetQueueLimit(size_t pMaxQueuedEvents, QueueOverflowPolicy pPolicy)
+{
+	assert(pPolicy < QueueOverflowPolicy::Max);
+
+	size_t maxQueuedEvents = std::max<size_t>(pMaxQueuedEvents, evtc_rpc::messages::MAX_COMBAT_EVENT_BATCH_SIZE);
+	mMaxQueuedEvents.store(maxQueuedEvents, std::memory_order_relaxed);
+	mQueueOverflowPolicy.store(pPolicy, std::memory_order_relaxed);
+
+	LogI("Set queue limit to {} events, overflow policy {}", maxQueuedEvents, static_cast<uint32_t>(pPolicy));
+}
+
+void evtc_rpc_server::SetMaxWriteBytes(size_t pMaxWriteBytes)
+{
+	mMaxWriteBytes.store(pMaxWriteBytes, std::memory_order_relaxed);
+	LogI("Set max write size to {} bytes", pMaxWriteBytes);
+}
+
+void evtc_rpc_server::SetRateLimit(double pEventsPerSecond, size_t pBurstEvents)
+{
+	size_t burstEvents = std::max<size_t>(pBurstEvents, evtc_rpc::messages::MAX_COMBAT_EVENT_BATCH_SIZE);
+	mRateLimitBurstEvents.store(burstEvents, std::memory_order_relaxed);
+	mRateLimitEventsPerSecond.store(std::max(pEventsPerSecond, 0.0), std::memory_order_relaxed);
+
+	LogI("Set rate limit to {} events per second, bursts of {} events", pEventsPerSecond, burstEvents);
+}
+
+void evtc_rpc_server::SetMaxConnections(size_t pMaxConnections)
+{
+	mMaxConnections.store(pMaxConnections, std::memory_order_relaxed);
+	LogI("Set max connections to {}", pMaxConnections);
+}
+
+void evtc_rpc_server::SetDrainTimeout(std::chrono::milliseconds pTimeout)
+{
+	mDrainTimeout.store(pTimeout, std::memory_order_relaxed);
+	LogI("Set drain timeout to {}ms", pTimeout.count());
+}
+
+void evtc_rpc_server::SetSessionResumeTimeout(std::chrono::milliseconds pTimeout)
+{
+	mSessionResumeTimeout.store(pTimeout, std::memory_order_relaxed);
+	LogI("Set session resume timeout to {}ms", pTimeout.count());
+}
+
+void evtc_rpc_server::StartDrain()
+{
+	std::chrono::milliseconds timeout = mDrainTimeout.load(std::memory_order_relaxed);
+	mDrainDeadline.store(std::chrono::steady_clock::now() + timeout, std::memory_order_relaxed);
+
+	// Make sure the deadline is noticed even if nothing else happens. The wake up is rescheduled until the drain is
+	// done, a single alarm at the deadline would keep the completion queue from shutting down until it fires. Other wake
+	// ups (like the one from Shutdown) aren't rescheduled, so there is only ever one of these
+	WakeUpCallData* calldata = new WakeUpCallData;
+	calldata->DrainCheck = true;
+	calldata->Alarm->Set(mCompletionQueues[0].get(), std::chrono::system_clock::now() + DRAIN_CHECK_INTERVAL, calldata);
+
+	std::vector<std::shared_ptr<ConnectionContext>> connections;
+	for (AgentShard& shard : mAgentShards)
+	{
+		std::shared_lock lock(shard.Lock);
+		for (const auto& [accountId, connection] : shard.Agents)
+		{
+			connections.emplace_back(connection);
+		}
+	}
+
+	LogI("Draining {} registered connections with {} queued events, timeout {}ms",
+		connections.size(), mQueuedEventTotal.load(std::memory_order_relaxed), timeout.count());
+
+	// Detached sessions have no stream to flush their queue to
+	for (const auto& session : CancelSessionExpiries())
+	{
+		ForceDisconnect("server is restarting, reconnect", session, grpc::StatusCode::UNAVAILABLE);
+	}
+
+	// The rest are finished from HandleWriteEvent once their queue is empty
+	for (const auto& connection : connections)
+	{
+		FinishIfDrained(connection);
+	}
+}
+
+void evtc_rpc_server::FinishIfDrained(const std::shared_ptr<ConnectionContext>& pClient)
+{
+	{
+		std::lock_guard lock(pClient->WriteLock);
+		if (pClient->ForceDisconnected == true || pClient->WritePending == true || pClient->QueuedEvents.Size() > 0)
+		{
+			return;
+		}
 	}
+
+	// No more combat events are queued for the client (see HandleCombatEvents), so the check can't be outdated by those
+	ForceDisconnect("server is restarting, reconnect", pClient, grpc::StatusCode::UNAVAILABLE);
+}
+
+void evtc_rpc_server::RejectConnection(ConnectCallData* pCallData, grpc::StatusCode pStatusCode, const char* pErrorMessage)
+{
+	std::lock_guard lock(pCallData->Context->WriteLock);
+	pCallData->Context->ForceDisconnected = true;
+
+	DisconnectCallData* queuedData = new DisconnectCallData{std::shared_ptr{pCallData->Context}};
+	pCallData->Context->Stream.Finish(grpc::Status{pStatusCode, pErrorMessage}, queuedData);
+
+	LogW("(client {} tag {}) rejected connection from {} - '{}'",
+		fmt::ptr(pCallData->Context.get()), fmt::ptr(queuedData), pCallData->Context->ServerContext.peer().c_str(), pErrorMessage);
 }
 
 void evtc_rpc_server::HandleConnect(ConnectCallData* pCallData)
 {
+	if (mShutdownState.load(std::memory_order_relaxed) != ShutdownState::Online)
+	{
+		mStatistics->ConnectionsRejectedDraining->Increment();
+		RejectConnection(pCallData, grpc::StatusCode::UNAVAILABLE, "server is restarting, reconnect");
+		return;
+	}
+
+	size_t maxConnections = mMaxConnections.load(std::memory_order_relaxed);
+	size_t connectionCount = mConnectionCount.fetch_add(1, std::memory_order_relaxed) + 1;
+	if (maxConnections != 0 && connectionCount > maxConnections)
+	{
+		mConnectionCount.fetch_sub(1, std::memory_order_relaxed);
+		mStatistics->ConnectionsRejected->Increment();
+
+		LogW("(client {}) already at the limit of {} connections", fmt::ptr(pCallData->Context.get()), maxConnections);
+		RejectConnection(pCallData, grpc::StatusCode::RESOURCE_EXHAUSTED, "server overloaded");
+		return;
+	}
+
+	{
+		std::lock_guard lock(pCallData->Context->WriteLock);
+		pCallData->Context->Admitted = true;
+	}
+
 	// Add a ReadMessageCallData so we can start reading messages on this new connection
 	{
 		ReadMessageCallData* queuedData = new ReadMessageCallData{std::shared_ptr{pCallData->Context}};
@@ -252,11 +544,24 @@ void evtc_rpc_server::HandleConnect(ConnectCallData* pCallData)
 		fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), pCallData->Context->ServerContext.peer().c_str());
 }
 
-void evtc_rpc_server::HandleReadMessage(ReadMessageCallData* pCallData)
+void evtc_rpc_server::HandleReadMessage(ReadMessageCallData* pCallData, std::chrono::steady_clock::time_point pReadTime)
 {
 	using namespace evtc_rpc::messages;
 
-	const std::string& blob = pCallData->Message.blob();
+	size_t messageSize = pCallData->Message.Length();
+	pCallData->Context->BytesReceived.fetch_add(messageSize, std::memory_order_relaxed);
+	mStatistics->BytesReceived->Increment(static_cast<double>(messageSize));
+
+	evtc_rpc::Message rpcMessage;
+	grpc::Status status = grpc::SerializationTraits<evtc_rpc::Message>::Deserialize(&pCallData->Message, &rpcMessage);
+	if (status.ok() == false)
+	{
+		LogE("(client {} tag {}) failed to parse message - {}", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), status.error_message());
+		ForceDisconnect("malformed message", pCallData->Context);
+		return;
+	}
+
+	const std::string& blob = rpcMessage.blob();
 	const char* data = blob.data();
 	size_t dataSize = blob.size();
 
@@ -273,12 +578,13 @@ void evtc_rpc_server::HandleReadMessage(ReadMessageCallData* pCallData)
 	data += sizeof(Header);
 	dataSize -= sizeof(Header);
 
-	if (header.MessageVersion != 1)
+	if (header.MessageVersion < MESSAGE_VERSION_LEGACY || header.MessageVersion > MESSAGE_VERSION_SESSION)
 	{
 		LogE("(client {} tag {}) incorrect version {}", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), header.MessageVersion);
 		ForceDisconnect("incorrect version", pCallData->Context);
 		return;
 	}
+	pCallData->Context->MessageVersion.store(header.MessageVersion, std::memory_order_relaxed);
 
 	if (header.MessageType < evtc_rpc::messages::Type::Max)
 	{
@@ -399,296 +705,1484 @@ void evtc_rpc_server::HandleReadMessage(ReadMessageCallData* pCallData)
 		}
 		break;
 	}
-	case Type::CombatEvent:
+	case Type::SetInterest:
 	{
-		if (dataSize != sizeof(CombatEvent))
+		if (dataSize < sizeof(SetInterest))
 		{
-			LogE("(client {} tag {}) data length mismatch for CombatEvent message ({} vs {})",
-				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), dataSize, sizeof(CombatEvent));
-			ForceDisconnect("CombatEvent size mismatch", pCallData->Context);
+			LogE("(client {} tag {}) data too short for SetInterest message ({} vs {})",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), dataSize, sizeof(SetInterest));
+			ForceDisconnect("short SetInterest content", pCallData->Context);
+			return;
+		}
+
+		SetInterest message;
+		memcpy(&message, data, sizeof(SetInterest));
+		data += sizeof(SetInterest);
+		dataSize -= sizeof(SetInterest);
+
+		if (message.Events >= InterestedEvents::Max || message.PeerCount > MAX_INTERESTED_PEERS || dataSize != message.PeerCount * sizeof(uint16_t))
+		{
+			LogE("(client {} tag {}) invalid SetInterest message ({} {} {})",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), static_cast<uint32_t>(message.Events), message.PeerCount, dataSize);
+			ForceDisconnect("invalid SetInterest content", pCallData->Context);
 			return;
 		}
 
-		CombatEvent message;
-		memcpy(&message, data, sizeof(CombatEvent));
-		data += sizeof(CombatEvent);
-		dataSize -= sizeof(CombatEvent);
+		std::vector<uint16_t> peers(message.PeerCount);
+		memcpy(peers.data(), data, dataSize);
 
-		const char* error = HandleCombatEvent(message.Event, pCallData->Context);
+		const char* error = HandleSetInterest(message.Events, std::move(peers), pCallData->Context);
 		if (error != nullptr)
 		{
-			LogW("(client {} tag {}) HandleCombatEvent failed - {}", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), error);
+			LogW("(client {} tag {}) HandleSetInterest failed - {}", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), error);
 			ForceDisconnect(error, pCallData->Context);
 			return;
 		}
 		break;
 	}
-
-	default:
-		LogE("(client {} tag {}) incorrect type {}", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), static_cast<int>(header.MessageType));
-		return;
-	}
-	
-	pCallData->Context->LastCallTime.store(std::chrono::steady_clock::now(), std::memory_order_relaxed);
-}
-
-void evtc_rpc_server::HandleWriteEvent(WriteEventCallData* pCallData)
-{
-	std::lock_guard lock(pCallData->Context->WriteLock);
-
-	assert(pCallData->Context->WritePending == true);
-	pCallData->Context->WritePending = false;
-	
-	if (pCallData->Context->QueuedEvents.size() > 0)
-	{
-		SendEvent(pCallData->Context->QueuedEvents.front(), pCallData, pCallData->Context);
-		pCallData->Context->QueuedEvents.pop_front();
-	}
-	else
-	{
-		LogT("(client {} tag {}) No more events queued", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData));
-		delete pCallData;
-	}
-}
-
-const char* evtc_rpc_server::HandleRegisterSelf(uint16_t pInstanceId, std::string_view pAccountName, std::shared_ptr<ConnectionContext>& pClient)
-{
-	if (pClient->ForceDisconnected == true)
+	case Type::ResumeSession:
 	{
-		LogD("client is already disconnected");
-		return "client is already disconnected";
-	}
-
-	std::lock_guard lock(mRegisteredAgentsLock);
+		if (header.MessageVersion < MESSAGE_VERSION_SESSION)
+		{
+			LogE("(client {} tag {}) ResumeSession is not valid in version {}",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), header.MessageVersion);
+			ForceDisconnect("ResumeSession in old version", pCallData->Context);
+			return;
+		}
 
-	// Check this under lock, mRegisteredAgentsLock also guards the ReceivedAccountName flag
-	if (pClient->Iterator != mRegisteredAgents.end())
-	{
-		LogE("(client {}) this connection already has a registered account name", fmt::ptr(pClient.get()));
-		return "already registered account name on this connection";
-	}
+		if (dataSize < sizeof(ResumeSession))
+		{
+			LogE("(client {} tag {}) data too short for ResumeSession message ({} vs {})",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), dataSize, sizeof(ResumeSession));
+			ForceDisconnect("short ResumeSession content", pCallData->Context);
+			return;
+		}
 
-	std::string accountName{pAccountName};
-	auto [newEntry, inserted] = mRegisteredAgents.try_emplace(std::move(accountName), std::shared_ptr{pClient});
-	if (inserted == false)
-	{
-		std::chrono::steady_clock::time_point lastCallTime = newEntry->second->LastCallTime.load(std::memory_order_relaxed);
-		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		ResumeSession message;
+		memcpy(&message, data, sizeof(ResumeSession));
+		data += sizeof(ResumeSession);
+		dataSize -= sizeof(ResumeSession);
 
-		uint64_t millisecondsSinceLastCall = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastCallTime).count();
-		LogW("(client {}) account name {} is already registered from another connection {} ({} since last call)",
-			fmt::ptr(pClient.get()), accountName.c_str(), fmt::ptr(newEntry->second.get()), millisecondsSinceLastCall);
-		if (millisecondsSinceLastCall < mConflictingClientDisconnectThresholdMs.load(std::memory_order_relaxed))
+		if (message.PeerCount > MAX_RESUMED_PEERS || dataSize < message.SelfAccountNameLength)
 		{
-			return "account name collision";
+			LogE("(client {} tag {}) invalid ResumeSession message ({} {} {})",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), message.SelfAccountNameLength, message.PeerCount, dataSize);
+			ForceDisconnect("invalid ResumeSession content", pCallData->Context);
+			return;
 		}
 
-		std::shared_ptr<ConnectionContext> oldClient = std::move(newEntry->second);
-		oldClient->Iterator = mRegisteredAgents.end();
-		LogW("Force disconnect of old client {}", fmt::ptr(oldClient.get()));
-		ForceDisconnectInternal("superseded by new client", oldClient, true);
+		std::string_view accountName{data, message.SelfAccountNameLength};
+		data += message.SelfAccountNameLength;
+		dataSize -= message.SelfAccountNameLength;
 
-		newEntry->second = pClient;
-	}
-
-	pClient->Iterator = newEntry;
-	pClient->InstanceId = pInstanceId;
+		// Validate the whole message before registering, so that a malformed message doesn't leave a half resumed session
+		std::vector<std::pair<uint16_t, std::string_view>> peers;
+		peers.reserve(message.PeerCount);
+		for (uint16_t i = 0; i < message.PeerCount; i++)
+		{
+			AddPeer peer;
+			if (dataSize >= sizeof(AddPeer))
+			{
+				memcpy(&peer, data, sizeof(AddPeer));
+			}
+			if (dataSize < sizeof(AddPeer) || dataSize - sizeof(AddPeer) < peer.PeerAccountNameLength)
+			{
+				LogE("(client {} tag {}) ResumeSession peer {} of {} is truncated ({} bytes left)",
+					fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), i, message.PeerCount, dataSize);
+				ForceDisconnect("mismatched ResumeSession length", pCallData->Context);
+				return;
+			}
 
-	LogI("(client {}) registered account {} {}", fmt::ptr(pClient.get()), newEntry->first.c_str(), newEntry->second->InstanceId);
-	return nullptr;
-}
+			peers.emplace_back(peer.PeerId, std::string_view{data + sizeof(AddPeer), peer.PeerAccountNameLength});
+			data += sizeof(AddPeer) + peer.PeerAccountNameLength;
+			dataSize -= sizeof(AddPeer) + peer.PeerAccountNameLength;
+		}
 
-const char* evtc_rpc_server::HandleSetSelfId(uint16_t pInstanceId, std::shared_ptr<ConnectionContext>& pClient)
-{
-	std::lock_guard lock(mRegisteredAgentsLock);
+		if (dataSize != 0)
+		{
+			LogE("(client {} tag {}) {} trailing bytes after ResumeSession peers", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), dataSize);
+			ForceDisconnect("mismatched ResumeSession length", pCallData->Context);
+			return;
+		}
 
-	// Check this under lock, mRegisteredAgentsLock also guards the ReceivedAccountName flag
-	if (pClient->Iterator == mRegisteredAgents.end())
-	{
-		LogE("(client {}) this connection is not registered yet", fmt::ptr(pClient.get()));
-		return "not registered yet";
+		const char* error = HandleRegisterSelf(message.SelfId, accountName, pCallData->Context, message.SessionToken);
+		for (size_t i = 0; i < peers.size() && error == nullptr; i++)
+		{
+			error = HandleAddPeer(peers[i].first, peers[i].second, pCallData->Context);
+		}
+		if (error != nullptr)
+		{
+			LogE("(client {} tag {}) ResumeSession failed - {}", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), error);
+			ForceDisconnect(error, pCallData->Context);
+			return;
+		}
+		break;
 	}
+	case Type::EndSession:
+	{
+		if (header.MessageVersion < MESSAGE_VERSION_SESSION)
+		{
+			LogE("(client {} tag {}) EndSession is not valid in version {}",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), header.MessageVersion);
+			ForceDisconnect("EndSession in old version", pCallData->Context);
+			return;
+		}
 
-	pClient->InstanceId = pInstanceId;
-
-	LogI("(client {}) set self id to {}", fmt::ptr(pClient.get()), pInstanceId);
-	return nullptr;
-}
-
-const char* evtc_rpc_server::HandleAddPeer(uint16_t pInstanceId, std::string_view pAccountName, std::shared_ptr<ConnectionContext>& pClient)
-{
-	std::lock_guard lock(mRegisteredAgentsLock);
+		if (dataSize != 0)
+		{
+			LogE("(client {} tag {}) EndSession has {} bytes of content", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), dataSize);
+			ForceDisconnect("mismatched EndSession length", pCallData->Context);
+			return;
+		}
 
-	// Check this under lock, mRegisteredAgentsLock also guards the ReceivedAccountName flag
-	if (pClient->Iterator == mRegisteredAgents.end())
-	{
-		LogE("(client {}) this connection is not registered yet", fmt::ptr(pClient.get()));
-		return "not registered yet";
+		// The client cancels the call after this. Without a token the connection isn't detached when that happens (see
+		// TryDetachSession), and nothing can resume the session anymore
+		pCallData->Context->SessionToken.store(0, std::memory_order_relaxed);
+		LogI("(client {} tag {}) client ended its session", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData));
+		break;
 	}
+	case Type::CombatEvent:
+	{
+		if (dataSize != sizeof(CombatEvent))
+		{
+			LogE("(client {} tag {}) data length mismatch for CombatEvent message ({} vs {})",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), dataSize, sizeof(CombatEvent));
+			ForceDisconnect("CombatEvent size mismatch", pCallData->Context);
+			return;
+		}
+
+		const char* error = HandleCombatEvents(data, 1, pCallData->Context, pReadTime);
+		if (error != nullptr)
+		{
+			LogW("(client {} tag {}) HandleCombatEvents failed - {}", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), error);
+			ForceDisconnect(error, pCallData->Context);
+			return;
+		}
+		break;
+	}
+	case Type::CombatEventBatch:
+	{
+		if (header.MessageVersion < MESSAGE_VERSION_BATCH)
+		{
+			LogE("(client {} tag {}) CombatEventBatch is not valid in version {}",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), header.MessageVersion);
+			ForceDisconnect("CombatEventBatch in legacy version", pCallData->Context);
+			return;
+		}
+
+		if (dataSize < sizeof(CombatEventBatch))
+		{
+			LogE("(client {} tag {}) data too short for CombatEventBatch message ({} vs {})",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), dataSize, sizeof(CombatEventBatch));
+			ForceDisconnect("short CombatEventBatch content", pCallData->Context);
+			return;
+		}
+
+		CombatEventBatch message;
+		memcpy(&message, data, sizeof(CombatEventBatch));
+		data += sizeof(CombatEventBatch);
+		dataSize -= sizeof(CombatEventBatch);
+
+		if (message.EventCount == 0 || message.EventCount > MAX_COMBAT_EVENT_BATCH_SIZE || dataSize != message.EventCount * sizeof(CombatEvent))
+		{
+			LogE("(client {} tag {}) incorrect CombatEventBatch length ({} vs {} events)",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), dataSize, message.EventCount);
+			ForceDisconnect("mismatched CombatEventBatch length", pCallData->Context);
+			return;
+		}
+
+		const char* error = HandleCombatEvents(data, message.EventCount, pCallData->Context, pReadTime);
+		if (error != nullptr)
+		{
+			LogW("(client {} tag {}) HandleCombatEvents failed - {}", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), error);
+			ForceDisconnect(error, pCallData->Context);
+			return;
+		}
+		break;
+	}
+	case Type::CompressedCombatEventBatch:
+	{
+		if (header.MessageVersion < MESSAGE_VERSION_COMPRESSED)
+		{
+			LogE("(client {} tag {}) CompressedCombatEventBatch is not valid in version {}",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), header.MessageVersion);
+			ForceDisconnect("CompressedCombatEventBatch in old version", pCallData->Context);
+			return;
+		}
+
+		if (dataSize < sizeof(CompressedCombatEventFrame))
+		{
+			LogE("(client {} tag {}) data too short for CompressedCombatEventBatch message ({} vs {})",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), dataSize, sizeof(CompressedCombatEventFrame));
+			ForceDisconnect("short CompressedCombatEventBatch content", pCallData->Context);
+			return;
+		}
+
+		CompressedCombatEventFrame frame;
+		memcpy(&frame, data, sizeof(CompressedCombatEventFrame));
+		data += sizeof(CompressedCombatEventFrame);
+		dataSize -= sizeof(CompressedCombatEventFrame);
+
+		// Clients send a single frame per message
+		if (frame.EventCount == 0 || frame.EventCount > MAX_COMBAT_EVENT_BATCH_SIZE || dataSize != frame.EncodedSize)
+		{
+			LogE("(client {} tag {}) incorrect CompressedCombatEventBatch length ({} vs {} bytes, {} events)",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), dataSize, frame.EncodedSize, frame.EventCount);
+			ForceDisconnect("mismatched CompressedCombatEventBatch length", pCallData->Context);
+			return;
+		}
+
+		// The events are decoded once for peers that don't accept compressed batches (and to classify them), peers that
+		// do get the encoded events as they were received
+		std::vector<CombatEvent> events(frame.EventCount);
+		EventDecoder decoder{data, dataSize};
+		bool valid = true;
+		for (size_t i = 0; i < events.size() && valid == true; i++)
+		{
+			valid = decoder.Decode(events[i].Event);
+			events[i].SenderInstanceId = 0;
+		}
+		if (valid == false || decoder.IsAtEnd() == false)
+		{
+			LogE("(client {} tag {}) malformed CompressedCombatEventBatch content", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData));
+			ForceDisconnect("malformed CompressedCombatEventBatch content", pCallData->Context);
+			return;
+		}
+
+		const char* error = HandleCombatEvents(reinterpret_cast<const char*>(events.data()), frame.EventCount, pCallData->Context, pReadTime, header.MessageType, std::string_view{data, dataSize});
+		if (error != nullptr)
+		{
+			LogW("(client {} tag {}) HandleCombatEvents failed - {}", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), error);
+			ForceDisconnect(error, pCallData->Context);
+			return;
+		}
+		break;
+	}
+	case Type::HealingEventBatch:
+	{
+		if (header.MessageVersion < MESSAGE_VERSION_HEALING_EVENT)
+		{
+			LogE("(client {} tag {}) HealingEventBatch is not valid in version {}",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), header.MessageVersion);
+			ForceDisconnect("HealingEventBatch in old version", pCallData->Context);
+			return;
+		}
+
+		if (dataSize < sizeof(HealingEventFrame))
+		{
+			LogE("(client {} tag {}) data too short for HealingEventBatch message ({} vs {})",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), dataSize, sizeof(HealingEventFrame));
+			ForceDisconnect("short HealingEventBatch content", pCallData->Context);
+			return;
+		}
+
+		HealingEventFrame frame;
+		memcpy(&frame, data, sizeof(HealingEventFrame));
+		data += sizeof(HealingEventFrame);
+		dataSize -= sizeof(HealingEventFrame);
+
+		// Clients send a single frame per message
+		if (frame.EventCount == 0 || frame.EventCount > MAX_COMBAT_EVENT_BATCH_SIZE || dataSize != frame.EventCount * sizeof(HealingEvent))
+		{
+			LogE("(client {} tag {}) incorrect HealingEventBatch length ({} vs {} events)",
+				fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), dataSize, frame.EventCount);
+			ForceDisconnect("mismatched HealingEventBatch length", pCallData->Context);
+			return;
+		}
+
+		// Rebuilt for peers that don't accept HealingEventBatch (and to classify them), peers that do get the records as
+		// they were received
+		std::vector<CombatEvent> events(frame.EventCount);
+		for (size_t i = 0; i < events.size(); i++)
+		{
+			HealingEvent event;
+			memcpy(&event, data + i * sizeof(HealingEvent), sizeof(event));
+			FromHealingEvent(event, events[i].Event);
+			events[i].SenderInstanceId = 0;
+		}
+
+		const char* error = HandleCombatEvents(reinterpret_cast<const char*>(events.data()), frame.EventCount, pCallData->Context, pReadTime, header.MessageType, std::string_view{data, dataSize});
+		if (error != nullptr)
+		{
+			LogW("(client {} tag {}) HandleCombatEvents failed - {}", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), error);
+			ForceDisconnect(error, pCallData->Context);
+			return;
+		}
+		break;
+	}
+
+	default:
+		LogE("(client {} tag {}) incorrect type {}", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData), static_cast<int>(header.MessageType));
+		return;
+	}
+	
+	pCallData->Context->LastCallTime.store(std::chrono::steady_clock::now(), std::memory_order_relaxed);
+}
+
+void evtc_rpc_server::HandleWriteEvent(WriteEventCallData* pCallData)
+{
+	mStatistics->WriteCompletion.Observe(std::chrono::steady_clock::now() - pCallData->WriteTime);
+
+	// Keeps the context alive after pCallData is deleted
+	std::shared_ptr<ConnectionContext> client = pCallData->Context;
+	bool drained = false;
+	{
+		std::lock_guard lock(client->WriteLock);
+
+		assert(client->WritePending == true);
+		client->WritePending = false;
+
+		if (client->ForceDisconnected == true)
+		{
+			LogD("(client {} tag {}) Dropping {} queued events since client is disconnected",
+				fmt::ptr(client.get()), fmt::ptr(pCallData), client->QueuedEventCount);
+			UpdateQueuedEventTotal(client->QueuedEventCount, 0);
+			client->QueuedEvents.Clear();
+			client->QueuedEventCount = 0;
+			delete pCallData;
+		}
+		else if (client->Detached == true)
+		{
+			// The stream is finished, whatever is queued is kept for the connection that resumes the session
+			LogD("(client {} tag {}) Keeping {} queued events since client is detached",
+				fmt::ptr(client.get()), fmt::ptr(pCallData), client->QueuedEventCount);
+			delete pCallData;
+		}
+		else if (client->QueuedEvents.Size() > 0)
+		{
+			// Everything that queued up while the previous write was in flight is sent in one message (up to the byte
+			// budget), so a peer that fell behind catches up in a few round trips
+			SendQueuedEvents(pCallData, client);
+		}
+		else
+		{
+			LogT("(client {} tag {}) No more events queued", fmt::ptr(client.get()), fmt::ptr(pCallData));
+			delete pCallData;
+			drained = mShutdownState.load(std::memory_order_relaxed) == ShutdownState::Draining;
+		}
+	}
+
+	// Disconnecting takes the agent shard lock, so it can't be done with WriteLock held
+	if (drained == true)
+	{
+		FinishIfDrained(client);
+	}
+}
+
+const char* evtc_rpc_server::HandleRegisterSelf(uint16_t pInstanceId, std::string_view pAccountName, std::shared_ptr<ConnectionContext>& pClient, uint64_t pSessionToken)
+{
+	// Account is only ever set by the thread serving this connection, so there is no race between checking and setting
+	// it. Other threads can clear it when superseding this client, but they mark the client as disconnected before
+	// doing so
+	if (pClient->Account.load(std::memory_order_acquire) != INVALID_ACCOUNT_ID)
+	{
+		LogE("(client {}) this connection already has a registered account name", fmt::ptr(pClient.get()));
+		return "already registered account name on this connection";
+	}
+
+	if (pClient->ForceDisconnected == true)
+	{
+		LogD("client is already disconnected");
+		return "client is already disconnected";
+	}
+
+	// The drain only finishes the connections that were registered when it started (see StartDrain), one that registers
+	// later would keep it waiting until it times out. Called with mShutdownLock held shared, so a registration that
+	// passes this check is in the table before StartDrain looks at it
+	if (mShutdownState.load(std::memory_order_relaxed) != ShutdownState::Online)
+	{
+		mStatistics->ConnectionsRejectedDraining->Increment();
+		ForceDisconnect("server is restarting, reconnect", pClient, grpc::StatusCode::UNAVAILABLE);
+		return "server is draining";
+	}
+
+	AccountId accountId = mAccountNames.Intern(pAccountName);
+
+	std::shared_ptr<ConnectionContext> oldClient;
+	bool resumed = false;
+	{
+		AgentShard& shard = GetAgentShard(accountId);
+		std::lock_guard lock(shard.Lock);
+
+		auto [newEntry, inserted] = shard.Agents.try_emplace(accountId, std::shared_ptr{pClient});
+		if (inserted == false)
+		{
+			resumed = pSessionToken != 0 && newEntry->second->SessionToken.load(std::memory_order_relaxed) == pSessionToken;
+			if (resumed == true)
+			{
+				LogI("(client {}) resuming session of connection {} for account name {}",
+					fmt::ptr(pClient.get()), fmt::ptr(newEntry->second.get()), pAccountName);
+			}
+			else if (newEntry->second->Detached == true)
+			{
+				// The old connection is known to be gone, no need to wait for it
+				LogW("(client {}) account name {} is registered from detached connection {}, superseding it",
+					fmt::ptr(pClient.get()), pAccountName, fmt::ptr(newEntry->second.get()));
+			}
+			else
+			{
+				std::chrono::steady_clock::time_point lastCallTime = newEntry->second->LastCallTime.load(std::memory_order_relaxed);
+				std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+				uint64_t millisecondsSinceLastCall = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastCallTime).count();
+				LogW("(client {}) account name {} is already registered from another connection {} ({} since last call)",
+					fmt::ptr(pClient.get()), pAccountName, fmt::ptr(newEntry->second.get()), millisecondsSinceLastCall);
+				if (millisecondsSinceLastCall < mConflictingClientDisconnectThresholdMs.load(std::memory_order_relaxed))
+				{
+					mAccountNames.Release(accountId);
+					return "account name collision";
+				}
+			}
+
+			oldClient = std::move(newEntry->second);
+
+			// Take over the events that are still queued for the old connection. They stay counted in
+			// mQueuedEventTotal, they are only moved
+			RingQueue<ForwardedEvents> resumedEvents;
+			size_t resumedEventCount = 0;
+			if (resumed == true)
+			{
+				std::lock_guard writeLock(oldClient->WriteLock);
+				std::swap(resumedEvents, oldClient->QueuedEvents);
+				std::swap(resumedEventCount, oldClient->QueuedEventCount);
+			}
+
+			LogW("Force disconnect of old client {}", fmt::ptr(oldClient.get()));
+			ForceDisconnectInternal(resumed == true ? "session resumed from another connection" : "superseded by new client", oldClient, true);
+
+			assert(oldClient->Account.load(std::memory_order_relaxed) == accountId);
+			oldClient->Account.store(INVALID_ACCOUNT_ID, std::memory_order_release);
+
+			newEntry->second = pClient;
+
+			if (resumed == true)
+			{
+				// pClient isn't routed to yet, so the old events are queued before any new ones
+				std::lock_guard writeLock(pClient->WriteLock);
+				size_t previousCount = pClient->QueuedEventCount;
+				for (; resumedEvents.Size() > 0; resumedEvents.PopFront())
+				{
+					// The client is getting a new token anyway
+					if (resumedEvents.Front().Format != evtc_rpc::messages::Type::SessionToken)
+					{
+						pClient->QueuedEvents.PushBack(std::move(resumedEvents.Front()));
+					}
+				}
+				pClient->QueuedEventCount += resumedEventCount;
+				pClient->QueuedEventPeak = std::max(pClient->QueuedEventPeak, pClient->QueuedEventCount);
+				UpdateQueuedEventTotal(previousCount + resumedEventCount, pClient->QueuedEventCount);
+
+				if (pClient->ForceDisconnected == false && pClient->WritePending == false && pClient->QueuedEvents.Size() > 0)
+				{
+					SendQueuedEvents(new WriteEventCallData(std::shared_ptr{pClient}), pClient);
+				}
+
+				mStatistics->SessionsResumed->Increment();
+				LogI("(client {}) resumed session with {} queued events", fmt::ptr(pClient.get()), resumedEventCount);
+			}
+		}
+
+		else
+		{
+			mRegisteredPlayers.fetch_add(1, std::memory_order_relaxed);
+			mRegisteredPeers.fetch_add(GetWatcherCount(shard, accountId), std::memory_order_relaxed);
+		}
+
+		pClient->InstanceId.store(pInstanceId, std::memory_order_relaxed);
+		pClient->Account.store(accountId, std::memory_order_release);
+
+		UpdateWatcherRoutes(shard, accountId, pClient);
+	}
+
+	if (oldClient != nullptr)
+	{
+		// Peers have to be released without holding the shard lock since it takes the locks of the peers' shards
+		ReportForwardedEvents(*oldClient, accountId, true);
+		mAccountNames.Release(accountId); // The reference held by oldClient
+		ReleasePeers(oldClient);
+	}
+
+	IssueSessionToken(pClient, resumed);
+
+	LogI("(client {}) registered account {} {} ({})", fmt::ptr(pClient.get()), pAccountName, pInstanceId, accountId);
+	return nullptr;
+}
+
+const char* evtc_rpc_server::HandleSetSelfId(uint16_t pInstanceId, std::shared_ptr<ConnectionContext>& pClient)
+{
+	AccountId accountId = pClient->Account.load(std::memory_order_acquire);
+	if (accountId == INVALID_ACCOUNT_ID)
+	{
+		LogE("(client {}) this connection is not registered yet", fmt::ptr(pClient.get()));
+		return "not registered yet";
+	}
+
+	AgentShard& shard = GetAgentShard(accountId);
+	std::lock_guard lock(shard.Lock);
+
+	// The client might have been superseded while we were waiting for the lock
+	if (pClient->Account.load(std::memory_order_relaxed) != accountId)
+	{
+		LogE("(client {}) this connection is not registered anymore", fmt::ptr(pClient.get()));
+		return "not registered yet";
+	}
+
+	pClient->InstanceId.store(pInstanceId, std::memory_order_relaxed);
+	UpdateWatcherRoutes(shard, accountId, pClient);
+
+	LogI("(client {}) set self id to {}", fmt::ptr(pClient.get()), pInstanceId);
+	return nullptr;
+}
+
+const char* evtc_rpc_server::HandleAddPeer(uint16_t pInstanceId, std::string_view pAccountName, std::shared_ptr<ConnectionContext>& pClient)
+{
+	AccountId peerId = mAccountNames.Intern(pAccountName);
+
+	AgentShard& shard = GetAgentShard(peerId);
+	std::lock_guard shardLock(shard.Lock);
+	std::lock_guard lock(pClient->PeersLock);
+
+	// Check this under PeersLock - a disconnect clears Account before clearing Peers under the same lock, so this makes
+	// sure that no peers are added after that
+	if (pClient->Account.load(std::memory_order_acquire) == INVALID_ACCOUNT_ID)
+	{
+		LogE("(client {}) this connection is not registered yet", fmt::ptr(pClient.get()));
+		mAccountNames.Release(peerId);
+		return "not registered yet";
+	}
+
+	auto [newEntry, inserted] = pClient->Peers.try_emplace(peerId, pInstanceId);
+	if (inserted == false)
+	{
+		LogW("(client {}) peer {} is already registered (instance id {}, new instance id is {}). Overriding existing peer.", fmt::ptr(pClient.get()), pAccountName, newEntry->second, pInstanceId);
+		newEntry->second = pInstanceId;
+		mAccountNames.Release(peerId); // The existing entry already holds a reference
+	}
+	else
+	{
+		shard.Watchers[peerId].emplace_back(pClient);
+	}
+
+	auto peer = shard.Agents.find(peerId);
+	if (inserted == true)
+	{
+		mKnownPeers.fetch_add(1, std::memory_order_relaxed);
+		if (peer != shard.Agents.end())
+		{
+			mRegisteredPeers.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	UpdateRoute(*pClient, peerId, peer != shard.Agents.end() ? peer->second : nullptr);
+
+	LogI("(client {}) added peer {} {}", fmt::ptr(pClient.get()), pAccountName, newEntry->second);
+	return nullptr;
+}
+
+const char* evtc_rpc_server::HandleRemovePeer(uint16_t pInstanceId, std::shared_ptr<ConnectionContext>& pClient)
+{
+	AccountId removedId = INVALID_ACCOUNT_ID;
+	{
+		std::lock_guard lock(pClient->PeersLock);
+
+		if (pClient->Account.load(std::memory_order_acquire) == INVALID_ACCOUNT_ID)
+		{
+			LogE("(client {}) this connection is not registered yet", fmt::ptr(pClient.get()));
+			return "not registered yet";
+		}
+
+		for (const auto& [peerId, peerInstanceId] : pClient->Peers)
+		{
+			if (peerInstanceId == pInstanceId)
+			{
+				removedId = peerId;
+				break;
+			}
+		}
+	}
+	
+	if (removedId == INVALID_ACCOUNT_ID)
+	{
+		LogI("(client {}) can't find peer with instance id {}", fmt::ptr(pClient.get()), pInstanceId);
+		return nullptr;
+	}
+
+	{
+		// Relock in the correct order. Only this thread adds peers, but a disconnect might have released them meanwhile
+		AgentShard& shard = GetAgentShard(removedId);
+		std::lock_guard shardLock(shard.Lock);
+		std::lock_guard lock(pClient->PeersLock);
+
+		if (pClient->Peers.erase(removedId) == 0)
+		{
+			LogI("(client {}) peer {} was released while removing it", fmt::ptr(pClient.get()), removedId);
+			return nullptr;
+		}
+
+		RemoveWatcher(shard, removedId, pClient.get());
+		UpdateRoute(*pClient, removedId, nullptr);
+	}
+
+	LogI("(client {}) removed peer {} {}", fmt::ptr(pClient.get()), removedId, pInstanceId);
+	mAccountNames.Release(removedId);
+	return nullptr;
+}
+
+const char* evtc_rpc_server::HandleSetInterest(evtc_rpc::messages::InterestedEvents pEvents, std::vector<uint16_t>&& pPeers, std::shared_ptr<ConnectionContext>& pClient)
+{
+	std::sort(pPeers.begin(), pPeers.end());
+	size_t peerCount = pPeers.size();
+
+	{
+		std::lock_guard lock(pClient->WriteLock);
+		pClient->InterestedPeers = std::move(pPeers);
+	}
+	pClient->InterestedEvents.store(pEvents, std::memory_order_relaxed);
+
+	LogI("(client {}) interested in events {} from {} peers", fmt::ptr(pClient.get()), static_cast<uint32_t>(pEvents), peerCount);
+	return nullptr;
+}
+
+const char* evtc_rpc_server::HandleCombatEvents(const char* pEvents, uint16_t pEventCount, std::shared_ptr<ConnectionContext>& pClient, std::chrono::steady_clock::time_point pReadTime, evtc_rpc::messages::Type pReceivedFormat, std::string_view pReceivedEvents)
+{
+	using namespace evtc_rpc::messages;
+
+	if (pClient->Account.load(std::memory_order_acquire) == INVALID_ACCOUNT_ID)
+	{
+		LogE("(client {}) this connection is not registered yet", fmt::ptr(pClient.get()));
+		return "not registered yet";
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	pClient->EventsReceived.fetch_add(pEventCount, std::memory_order_relaxed);
+	mStatistics->EventsReceived->Increment(pEventCount);
+
+	// Nothing new is forwarded once the drain started, so queues only shrink and every connection is finished once its
+	// backlog is written. StartDrain runs with mShutdownLock held exclusively, so anything that passed this check while
+	// the server was online is queued before it
+	if (mShutdownState.load(std::memory_order_relaxed) != ShutdownState::Online)
+	{
+		mStatistics->ShutdownEventsDropped->Increment(pEventCount);
+		return nullptr;
+	}
+
+	if (ConsumeRateLimitTokens(*pClient, pEventCount, start) == false)
+	{
+		// Logged once per connection, a client that is over its limit is usually over it for a while
+		if (pClient->EventsThrottled.fetch_add(pEventCount, std::memory_order_relaxed) == 0)
+		{
+			LogW("(client {}) exceeded its rate limit, dropping events", fmt::ptr(pClient.get()));
+		}
+		mStatistics->EventsThrottled->Increment(pEventCount);
+		return nullptr;
+	}
+
+	// Serialize the events once, every peer gets a reference to the same buffer
+	uint16_t instanceId = pClient->InstanceId.load(std::memory_order_relaxed);
+	grpc_slice slice = grpc_slice_malloc(pEventCount * sizeof(CombatEvent));
+	uint8_t* eventData = GRPC_SLICE_START_PTR(slice);
+	memcpy(eventData, pEvents, pEventCount * sizeof(CombatEvent));
+	for (size_t i = 0; i < pEventCount; i++)
+	{
+		memcpy(eventData + i * sizeof(CombatEvent) + offsetof(CombatEvent, SenderInstanceId), &instanceId, sizeof(instanceId));
+	}
+
+	auto isImportant = [eventData](size_t pIndex)
+	{
+		CombatEvent event;
+		memcpy(&event, eventData + pIndex * sizeof(CombatEvent), sizeof(event));
+		return GetEventType(&event.Event, true) == EventType::Healing || event.Event.is_statechange == CBTS_ENTERCOMBAT || event.Event.is_statechange == CBTS_EXITCOMBAT;
+	};
+
+	std::vector<uint16_t> importantIndices;
+	for (uint16_t i = 0; i < pEventCount; i++)
+	{
+		if (isImportant(i) == true)
+		{
+			importantIndices.push_back(i);
+		}
+	}
+	bool anyImportant = importantIndices.size() > 0;
+
+	// The events in the formats that peers accept. Formats other than the CombatEvent array are built the first time
+	// they're forwarded to a peer that accepts them, and shared between all of them. The important events are only
+	// copied out if a peer is interested in nothing else and there is something to leave out
+	struct EventSet
+	{
+		grpc::Slice Events;
+		uint16_t EventCount = 0;
+		grpc::Slice CompressedEvents;
+		grpc::Slice HealingEvents;
+	};
+	EventSet allEvents;
+	allEvents.Events = grpc::Slice{slice, grpc::Slice::STEAL_REF};
+	allEvents.EventCount = pEventCount;
+	EventSet importantEvents;
+
+	// Peers that overflowed their queue with the Disconnect policy. They are disconnected after RoutesLock is released
+	// since disconnecting takes the agent shard lock
+	std::vector<std::shared_ptr<ConnectionContext>> overflowedPeers;
+
+	uint64_t forwardedEvents = 0;
+	uint64_t filteredEvents = 0;
+	{
+		std::lock_guard routesLock(pClient->RoutesLock);
+		for (const Route& route : pClient->Routes)
+		{
+			ConnectionContext& peer = *route.Connection;
+			uint32_t peerVersion = peer.MessageVersion.load(std::memory_order_relaxed);
+			InterestedEvents interest = peer.InterestedEvents.load(std::memory_order_relaxed);
+			if (interest == InterestedEvents::None || (interest == InterestedEvents::Important && anyImportant == false))
+			{
+				filteredEvents += pEventCount;
+				continue;
+			}
+
+			bool importantOnly = interest == InterestedEvents::Important && importantIndices.size() < pEventCount;
+			if (importantOnly == true && importantEvents.EventCount == 0)
+			{
+				grpc_slice importantSlice = grpc_slice_malloc(importantIndices.size() * sizeof(CombatEvent));
+				for (size_t i = 0; i < importantIndices.size(); i++)
+				{
+					memcpy(GRPC_SLICE_START_PTR(importantSlice) + i * sizeof(CombatEvent), eventData + importantIndices[i] * sizeof(CombatEvent), sizeof(CombatEvent));
+				}
+				importantEvents.Events = grpc::Slice{importantSlice, grpc::Slice::STEAL_REF};
+				importantEvents.EventCount = static_cast<uint16_t>(importantIndices.size());
+			}
+			EventSet& set = importantOnly == true ? importantEvents : allEvents;
+
+			// Encoded before taking the peer's lock. What the client sent is reused if it's what the peer accepts
+			bool forwardHealingEvents = importantOnly == false && pReceivedFormat == Type::HealingEventBatch && peerVersion >= MESSAGE_VERSION_HEALING_EVENT;
+			if (forwardHealingEvents == true && set.HealingEvents.size() == 0)
+			{
+				set.HealingEvents = BuildHealingFrame(set.EventCount, instanceId, pReceivedEvents);
+			}
+			else if (forwardHealingEvents == false && peerVersion >= MESSAGE_VERSION_COMPRESSED && set.CompressedEvents.size() == 0)
+			{
+				bool reuseReceived = importantOnly == false && pReceivedFormat == Type::CompressedCombatEventBatch;
+				set.CompressedEvents = BuildCompressedFrame(set.Events.begin(), set.EventCount, instanceId, reuseReceived == true ? pReceivedEvents : std::string_view{});
+			}
+
+			std::lock_guard lock(peer.WriteLock);
+
+			// The peer might have been force disconnected by another thread before its route was removed. Its stream
+			// is finished in that case so nothing more can be written to it
+			if (peer.ForceDisconnected == true)
+			{
+				LogD("(client {}) peer {} was disconnected while forwarding", fmt::ptr(pClient.get()), fmt::ptr(&peer));
+				continue;
+			}
+
+			if (peer.InterestedPeers.size() > 0 && std::binary_search(peer.InterestedPeers.begin(), peer.InterestedPeers.end(), instanceId) == false)
+			{
+				filteredEvents += pEventCount;
+				continue;
+			}
+			filteredEvents += pEventCount - set.EventCount;
+
+			// Batches are forwarded as is to clients that understand them, legacy clients get one message per event
+			bool keepPeer = true;
+			if (forwardHealingEvents == true)
+			{
+				keepPeer = QueueEvents(peer, ForwardedEvents{set.HealingEvents, set.EventCount, anyImportant, Type::HealingEventBatch, start});
+			}
+			else if (peerVersion >= MESSAGE_VERSION_COMPRESSED)
+			{
+				keepPeer = QueueEvents(peer, ForwardedEvents{set.CompressedEvents, set.EventCount, anyImportant, Type::CompressedCombatEventBatch, start});
+			}
+			else if (peerVersion >= MESSAGE_VERSION_BATCH)
+			{
+				keepPeer = QueueEvents(peer, ForwardedEvents{set.Events, set.EventCount, anyImportant, Type::CombatEvent, start});
+			}
+			else
+			{
+				for (size_t i = 0; i < set.EventCount && keepPeer == true; i++)
+				{
+					bool important = importantOnly == true || isImportant(i) == true;
+					keepPeer = QueueEvents(peer, ForwardedEvents{set.Events.sub(i * sizeof(CombatEvent), (i + 1) * sizeof(CombatEvent)), 1, important, Type::CombatEvent, start});
+				}
+			}
+
+			if (keepPeer == false)
+			{
+				overflowedPeers.emplace_back(route.Connection);
+				continue;
+			}
+			forwardedEvents += set.EventCount;
+
+			if (peer.WritePending == false && peer.Detached == false && peer.QueuedEvents.Size() > 0)
+			{
+				SendQueuedEvents(new WriteEventCallData(std::shared_ptr<ConnectionContext>(route.Connection)), route.Connection);
+			}
+			else
+			{
+				LogT("(client {}) Queued {} CombatEvents from {}", fmt::ptr(&peer), set.EventCount, fmt::ptr(pClient.get()));
+			}
+		}
+
+		LogD("(client {}) Queued {} CombatEvents to {} peers", fmt::ptr(pClient.get()), pEventCount, pClient->Routes.size());
+	}
+
+	mStatistics->ReadToForward.Observe(std::chrono::steady_clock::now() - pReadTime);
+
+	if (forwardedEvents > 0)
+	{
+		pClient->EventsForwarded.fetch_add(forwardedEvents, std::memory_order_relaxed);
+		pClient->UnreportedEventsForwarded.fetch_add(forwardedEvents, std::memory_order_relaxed);
+		mStatistics->EventsForwarded->Increment(static_cast<double>(forwardedEvents));
+		ReportForwardedEvents(*pClient, pClient->Account.load(std::memory_order_acquire), false);
+	}
+	if (filteredEvents > 0)
+	{
+		mStatistics->EventsFiltered->Increment(static_cast<double>(filteredEvents));
+	}
+
+	for (const auto& peer : overflowedPeers)
+	{
+		ForceDisconnect("outbound queue overflow", peer);
+	}
+
+	return nullptr;
+}
+
+bool evtc_rpc_server::ConsumeRateLimitTokens(ConnectionContext& pClient, uint16_t pEventCount, std::chrono::steady_clock::time_point pNow)
+{
+	double eventsPerSecond = mRateLimitEventsPerSecond.load(std::memory_order_relaxed);
+	if (eventsPerSecond <= 0.0)
+	{
+		return true;
+	}
+
+	// The bucket starts out with RateLimitRefillTime at the epoch, so the first call fills it up to the burst size
+	double burstEvents = static_cast<double>(mRateLimitBurstEvents.load(std::memory_order_relaxed));
+	double elapsedSeconds = std::chrono::duration<double>(pNow - pClient.RateLimitRefillTime).count();
+	pClient.RateLimitTokens = std::min(pClient.RateLimitTokens + std::max(elapsedSeconds, 0.0) * eventsPerSecond, burstEvents);
+	pClient.RateLimitRefillTime = pNow;
+
+	if (pClient.RateLimitTokens < pEventCount)
+	{
+		return false;
+	}
+
+	pClient.RateLimitTokens -= pEventCount;
+	return true;
+}
+
+bool evtc_rpc_server::QueueEvents(ConnectionContext& pPeer, ForwardedEvents&& pEvents)
+{
+	size_t maxQueuedEvents = mMaxQueuedEvents.load(std::memory_order_relaxed);
+	size_t previousCount = pPeer.QueuedEventCount;
+	if (pPeer.QueuedEventCount + pEvents.EventCount > maxQueuedEvents)
+	{
+		QueueOverflowPolicy policy = mQueueOverflowPolicy.load(std::memory_order_relaxed);
+
+		// Only warn once per peer, a peer that is falling behind is likely to keep overflowing
+		if (pPeer.DroppedEventCount == 0)
+		{
+			LogW("(client {}) outbound queue overflow ({} queued, {} new), policy {}",
+				fmt::ptr(&pPeer), pPeer.QueuedEventCount, pEvents.EventCount, static_cast<uint32_t>(policy));
+		}
+
+		size_t droppedEvents = 0;
+		if (policy == QueueOverflowPolicy::Disconnect)
+		{
+			droppedEvents = pPeer.QueuedEventCount + pEvents.EventCount;
+			pPeer.QueuedEvents.Clear();
+			pPeer.QueuedEventCount = 0;
+			pPeer.DroppedEventCount += droppedEvents;
+			mStatistics->DroppedEvents[static_cast<size_t>(policy)]->Increment(static_cast<double>(droppedEvents));
+			UpdateQueuedEventTotal(previousCount, 0);
+			return false;
+		}
 
-	std::string accountName{pAccountName};
-	auto [newEntry, inserted] = pClient->Peers.try_emplace(std::move(accountName), pInstanceId);
-	if (inserted == false)
+		if (policy == QueueOverflowPolicy::DropNonHealing)
+		{
+			pPeer.QueuedEvents.RemoveIf([&pPeer, &droppedEvents, &pEvents, maxQueuedEvents](const ForwardedEvents& pQueued)
+				{
+					if (pQueued.Important == true || pPeer.QueuedEventCount + pEvents.EventCount <= maxQueuedEvents)
+					{
+						return false;
+					}
+
+					pPeer.QueuedEventCount -= pQueued.EventCount;
+					droppedEvents += pQueued.EventCount;
+					return true;
+				});
+
+			if (pPeer.QueuedEventCount + pEvents.EventCount > maxQueuedEvents && pEvents.Important == false)
+			{
+				// Everything left in the queue is more important than the new events
+				droppedEvents += pEvents.EventCount;
+				pPeer.DroppedEventCount += droppedEvents;
+				mStatistics->DroppedEvents[static_cast<size_t>(policy)]->Increment(static_cast<double>(droppedEvents));
+				UpdateQueuedEventTotal(previousCount, pPeer.QueuedEventCount);
+				return true;
+			}
+		}
+
+		// Oldest first. Session tokens are kept, they don't take up any of the limit and the client can't resume its
+		// session without the latest one
+		pPeer.QueuedEvents.RemoveIf([&pPeer, &droppedEvents, &pEvents, maxQueuedEvents](const ForwardedEvents& pQueued)
+			{
+				if (pQueued.Format == evtc_rpc::messages::Type::SessionToken || pPeer.QueuedEventCount + pEvents.EventCount <= maxQueuedEvents)
+				{
+					return false;
+				}
+
+				pPeer.QueuedEventCount -= pQueued.EventCount;
+				droppedEvents += pQueued.EventCount;
+				return true;
+			});
+
+		pPeer.DroppedEventCount += droppedEvents;
+		mStatistics->DroppedEvents[static_cast<size_t>(policy)]->Increment(static_cast<double>(droppedEvents));
+	}
+
+	pPeer.QueuedEventCount += pEvents.EventCount;
+	pPeer.QueuedEventPeak = std::max(pPeer.QueuedEventPeak, pPeer.QueuedEventCount);
+	pPeer.QueuedEvents.PushBack(std::move(pEvents));
+	UpdateQueuedEventTotal(previousCount, pPeer.QueuedEventCount);
+	return true;
+}
+
+grpc::ByteBuffer evtc_rpc_server::EncodeQueuedEvents(ConnectionContext& pClient)
+{
+	using namespace evtc_rpc::messages;
+
+	assert(pClient.QueuedEvents.Size() > 0);
+
+	Type messageType = GetNextMessageType(pClient);
+	Type format = pClient.QueuedEvents.Front().Format;
+	size_t maxWriteBytes = mMaxWriteBytes.load(std::memory_order_relaxed);
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+	// The first slice is the prefix, which can only be built once it's known how many events fit
+	std::vector<grpc::Slice> slices(1);
+	size_t eventCount = 0;
+	size_t payloadSize = 0;
+	while (pClient.QueuedEvents.Size() > 0)
 	{
-		LogW("(client {}) peer {} is already registered (instance id {}, new instance id is {}). Overriding existing peer.", fmt::ptr(pClient.get()), accountName.c_str(), newEntry->second, pInstanceId);
-		newEntry->second = pInstanceId;
+		ForwardedEvents& front = pClient.QueuedEvents.Front();
+		assert((front.EventCount > 0) != (front.Format == Type::SessionToken) && front.EventCount <= MAX_COMBAT_EVENT_BATCH_SIZE);
+		assert(front.Format != Type::CombatEvent || front.Events.size() == front.EventCount * sizeof(CombatEvent));
+
+		// Legacy clients get one event per message, and every SessionToken is a message of its own. The first entry is
+		// always taken, so a single entry exceeding the byte budget is still sent
+		size_t newEventCount = eventCount + front.EventCount;
+		size_t newPayloadSize = payloadSize + front.Events.size();
+		if (slices.size() > 1 && (messageType == Type::CombatEvent || messageType == Type::SessionToken ||
+			front.Format != format || newEventCount > MAX_COMBAT_EVENT_BATCH_SIZE || newPayloadSize > maxWriteBytes))
+		{
+			break;
+		}
+
+		eventCount = newEventCount;
+		payloadSize = newPayloadSize;
+		mStatistics->QueueWait.Observe(now - front.QueueTime);
+		pClient.QueuedEventCount -= front.EventCount;
+		slices.emplace_back(std::move(front.Events));
+		pClient.QueuedEvents.PopFront();
 	}
+	UpdateQueuedEventTotal(pClient.QueuedEventCount + eventCount, pClient.QueuedEventCount);
 
-	LogI("(client {}) added peer {} {}", fmt::ptr(pClient.get()), newEntry->first.c_str(), newEntry->second);
-	return nullptr;
+	Header header;
+	header.MessageType = messageType;
+	CombatEventBatch message{};
+	size_t blobHeaderSize = sizeof(header);
+	if (messageType == Type::CompressedCombatEventBatch)
+	{
+		// Every entry is a complete frame already
+		header.MessageVersion = MESSAGE_VERSION_COMPRESSED;
+	}
+	else if (messageType == Type::HealingEventBatch)
+	{
+		header.MessageVersion = MESSAGE_VERSION_HEALING_EVENT;
+	}
+	else if (messageType == Type::SessionToken)
+	{
+		assert(payloadSize == sizeof(SessionToken));
+		header.MessageVersion = MESSAGE_VERSION_SESSION;
+	}
+	else if (messageType == Type::CombatEventBatch)
+	{
+		header.MessageVersion = MESSAGE_VERSION_BATCH;
+		message.EventCount = static_cast<uint16_t>(eventCount);
+		blobHeaderSize += sizeof(message);
+	}
+	else
+	{
+		assert(eventCount == 1);
+		header.MessageVersion = MESSAGE_VERSION_LEGACY;
+	}
+
+	// The message is encoded by hand as an evtc_rpc::Message - the protobuf key and length of blob followed by the
+	// message headers, and then the shared event buffers. The prefix is small enough to be stored inline in the slice
+	std::array<uint8_t, 16> prefix;
+	size_t prefixSize = 0;
+	prefix[prefixSize++] = MESSAGE_BLOB_KEY;
+	prefixSize += EncodeVarint(blobHeaderSize + payloadSize, prefix.data() + prefixSize);
+	memcpy(prefix.data() + prefixSize, &header, sizeof(header));
+	prefixSize += sizeof(header);
+	if (messageType == Type::CombatEventBatch)
+	{
+		memcpy(prefix.data() + prefixSize, &message, sizeof(message));
+		prefixSize += sizeof(message);
+	}
+	slices[0] = grpc::Slice{prefix.data(), prefixSize};
+
+	return grpc::ByteBuffer{slices.data(), slices.size()};
 }
 
-const char* evtc_rpc_server::HandleRemovePeer(uint16_t pInstanceId, std::shared_ptr<ConnectionContext>& pClient)
+evtc_rpc::messages::Type evtc_rpc_server::GetNextMessageType(ConnectionContext& pClient)
+{
+	using namespace evtc_rpc::messages;
+
+	// Entries are queued in the format the peer asked for at the time, so the first entry decides
+	Type format = pClient.QueuedEvents.Front().Format;
+	if (format != Type::CombatEvent)
+	{
+		return format;
+	}
+	return pClient.MessageVersion.load(std::memory_order_relaxed) >= MESSAGE_VERSION_BATCH ? Type::CombatEventBatch : Type::CombatEvent;
+}
+
+void evtc_rpc_server::SendQueuedEvents(WriteEventCallData* pCallData, const std::shared_ptr<ConnectionContext>& pClient)
 {
-	std::lock_guard lock(mRegisteredAgentsLock);
+	using namespace evtc_rpc::messages;
+
+	assert(pClient->WritePending == false);
+
+	size_t queuedEventCount = pClient->QueuedEventCount;
+	Type messageType = GetNextMessageType(*pClient);
+	grpc::ByteBuffer buffer = EncodeQueuedEvents(*pClient);
+	size_t messageSize = buffer.Length();
+	pClient->BytesSent.fetch_add(messageSize, std::memory_order_relaxed);
+	mStatistics->BytesTransmitted->Increment(static_cast<double>(messageSize));
+
+	pCallData->WriteTime = std::chrono::steady_clock::now();
+	pClient->Stream.Write(buffer, pCallData);
+
+	pClient->WritePending = true;
 
-	// Check this under lock, mRegisteredAgentsLock also guards the ReceivedAccountName flag
-	if (pClient->Iterator == mRegisteredAgents.end())
+	mStatistics->MessageTypeTransmit[static_cast<size_t>(messageType)]->Increment();
+	if (mShutdownState.load(std::memory_order_relaxed) != ShutdownState::Online)
 	{
-		LogE("(client {}) this connection is not registered yet", fmt::ptr(pClient.get()));
-		return "not registered yet";
+		mStatistics->ShutdownEventsFlushed->Increment(static_cast<double>(queuedEventCount - pClient->QueuedEventCount));
 	}
 
-	std::string removed_name = "";
-	for (auto iter = pClient->Peers.begin(); iter != pClient->Peers.end(); iter++)
+	LogT("(client {} tag {}) Sending {} CombatEvents, {} still queued",
+		fmt::ptr(pClient.get()), fmt::ptr(pCallData), queuedEventCount - pClient->QueuedEventCount, pClient->QueuedEventCount);
+}
+
+void evtc_rpc_server::ForceDisconnect(const char* pErrorMessage, const std::shared_ptr<ConnectionContext>& pClient, grpc::StatusCode pStatusCode)
+{
+	bool removedFromTable = false;
+
+	AccountId accountId = pClient->Account.load(std::memory_order_acquire);
+	if (accountId != INVALID_ACCOUNT_ID)
 	{
-		if (iter->second == pInstanceId)
+		AgentShard& shard = GetAgentShard(accountId);
+		std::lock_guard lock(shard.Lock);
+
+		// Another thread might have removed the client from the table (superseded it) while we weren't holding the lock
+		if (pClient->Account.load(std::memory_order_relaxed) == accountId)
 		{
-			removed_name = iter->first;
-			pClient->Peers.erase(iter);
-			break;
+			auto iter = shard.Agents.find(accountId);
+			assert(iter != shard.Agents.end() && iter->second == pClient);
+			shard.Agents.erase(iter);
+			mRegisteredPlayers.fetch_sub(1, std::memory_order_relaxed);
+			mRegisteredPeers.fetch_sub(GetWatcherCount(shard, accountId), std::memory_order_relaxed);
+
+			pClient->Account.store(INVALID_ACCOUNT_ID, std::memory_order_release);
+			removedFromTable = true;
+
+			UpdateWatcherRoutes(shard, accountId, nullptr);
 		}
 	}
-	
-	if (removed_name == "")
+
+	if (removedFromTable == true)
 	{
-		LogI("(client {}) can't find peer with instance id {}", fmt::ptr(pClient.get()), pInstanceId);
-		return nullptr;
+		ReportForwardedEvents(*pClient, accountId, true);
+		mAccountNames.Release(accountId);
 	}
+	ReleasePeers(pClient);
 
-	LogI("(client {}) removed peer {} {}", fmt::ptr(pClient.get()), removed_name.c_str(), pInstanceId);
-	return nullptr;
+	ForceDisconnectInternal(pErrorMessage, pClient, removedFromTable, pStatusCode);
+}
+
+void evtc_rpc_server::ForceDisconnectInternal(const char* pErrorMessage, const std::shared_ptr<ConnectionContext>& pClient, bool pRemovedFromTable, grpc::StatusCode pStatusCode)
+{
+	std::lock_guard lock(pClient->WriteLock);
+
+	if (pClient->ForceDisconnected == true)
+	{
+		LogD("client is already disconnected");
+		return;
+	}
+
+	pClient->ForceDisconnected = true;
+	if (pClient->Admitted == true)
+	{
+		pClient->Admitted = false;
+		mConnectionCount.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	LogI("(client {}) traffic - {} events received, {} events forwarded, {} events throttled, {} bytes received, {} bytes sent, queue peak {}",
+		fmt::ptr(pClient.get()), pClient->EventsReceived.load(std::memory_order_relaxed), pClient->EventsForwarded.load(std::memory_order_relaxed),
+		pClient->EventsThrottled.load(std::memory_order_relaxed), pClient->BytesReceived.load(std::memory_order_relaxed),
+		pClient->BytesSent.load(std::memory_order_relaxed), pClient->QueuedEventPeak);
+
+	// Nothing queued is going to be sent anymore. A pending write (if any) holds its own references to the events
+	if (mShutdownState.load(std::memory_order_relaxed) != ShutdownState::Online)
+	{
+		mStatistics->ShutdownEventsDropped->Increment(static_cast<double>(pClient->QueuedEventCount));
+	}
+	UpdateQueuedEventTotal(pClient->QueuedEventCount, 0);
+	pClient->QueuedEvents.Clear();
+	pClient->QueuedEventCount = 0;
+
+	if (mShutdownState.load(std::memory_order_relaxed) == ShutdownState::ShuttingDown)
+	{
+		LogI("(client {}) force disconnected (removedFromTable={}) - '{}'. Server is shutting down so not queueing a Finish",
+			fmt::ptr(pClient.get()), BOOL_STR(pRemovedFromTable), pErrorMessage);
+		return;
+	}
+
+	if (pClient->Detached == true)
+	{
+		LogI("(client {}) force disconnected (removedFromTable={}) - '{}'. Client is detached so the stream is already finished",
+			fmt::ptr(pClient.get()), BOOL_STR(pRemovedFromTable), pErrorMessage);
+		return;
+	}
+
+	DisconnectCallData* queuedData = new DisconnectCallData{ std::shared_ptr{pClient} };
+	pClient->Stream.Finish(grpc::Status{ pStatusCode, pErrorMessage }, queuedData);
+
+	LogI("(client {} tag {}) force disconnected (removedFromTable={}) - '{}'", fmt::ptr(pClient.get()), fmt::ptr(queuedData), BOOL_STR(pRemovedFromTable), pErrorMessage);
 }
 
-const char* evtc_rpc_server::HandleCombatEvent(const cbtevent& pEvent, std::shared_ptr<ConnectionContext>& pClient)
+void evtc_rpc_server::ReleasePeers(const std::shared_ptr<ConnectionContext>& pClient)
 {
-	uint16_t instanceId = 0;
-	std::vector<std::shared_ptr<ConnectionContext>> peers; 
+	std::unordered_map<AccountId, uint16_t> peers;
+	{
+		std::lock_guard lock(pClient->PeersLock);
+		peers.swap(pClient->Peers);
+	}
+
+	for (const auto& [peerId, peerInstanceId] : peers)
 	{
-		std::lock_guard lock(mRegisteredAgentsLock);
-		// Check this under lock, mRegisteredAgentsLock also guards the ReceivedAccountName flag
-		if (pClient->Iterator == mRegisteredAgents.end())
 		{
-			LogE("(client {}) this connection is not registered yet", fmt::ptr(pClient.get()));
-			return "not registered yet";
+			AgentShard& shard = GetAgentShard(peerId);
+			std::lock_guard lock(shard.Lock);
+			RemoveWatcher(shard, peerId, pClient.get());
 		}
 
-		instanceId = pClient->InstanceId;
+		mAccountNames.Release(peerId);
+	}
+
+	// Peers is empty and this client isn't a watcher anymore, so no routes can be added after this
+	std::lock_guard lock(pClient->RoutesLock);
+	pClient->Routes.clear();
+}
+
+bool evtc_rpc_server::TryDetachSession(const std::shared_ptr<ConnectionContext>& pClient)
+{
+	std::chrono::milliseconds timeout = mSessionResumeTimeout.load(std::memory_order_relaxed);
+	if (timeout.count() == 0 || mShutdownState.load(std::memory_order_relaxed) != ShutdownState::Online ||
+		pClient->SessionToken.load(std::memory_order_relaxed) == 0 || pClient->Account.load(std::memory_order_acquire) == INVALID_ACCOUNT_ID)
+	{
+		return false;
+	}
 
-		for (const auto& [peerName, peerId] : pClient->Peers)
+	{
+		std::lock_guard lock(pClient->WriteLock);
+		if (pClient->ForceDisconnected == true)
 		{
-			auto iter = mRegisteredAgents.find(peerName);
-			if (iter != mRegisteredAgents.end())
-			{
-				if (iter->second->InstanceId != peerId)
-				{
-					LogT("(client {}) peer {} has incorrect instance id (expected {}, found {})", fmt::ptr(pClient.get()), fmt::ptr(iter->second.get()), iter->second->InstanceId, peerId);
-					continue;
-				}
+			return false;
+		}
 
-				peers.emplace_back(std::shared_ptr<ConnectionContext>(iter->second));
-			}
+		// Routes to the client stay in place, so events keep being queued for it until the session is resumed or expires
+		pClient->Detached = true;
+
+		// The session doesn't hold on to a connection anymore, the client that resumes it is admitted like any other.
+		// Otherwise a network blip that detaches everyone would get the reconnects rejected at the connection limit
+		if (pClient->Admitted == true)
+		{
+			pClient->Admitted = false;
+			mConnectionCount.fetch_sub(1, std::memory_order_relaxed);
 		}
+		DisconnectCallData* queuedData = new DisconnectCallData{std::shared_ptr{pClient}};
+		pClient->Stream.Finish(grpc::Status{grpc::StatusCode::UNAVAILABLE, "connection lost"}, queuedData);
 	}
 
-	// We know that all peers are registered at this point since we got them from the registered agents map
-	for (const auto& peer : peers)
+	// Called with mShutdownLock held shared while the server is online, so the alarm is set before StartDrain or the
+	// shutdown get to cancel it
+	WakeUpCallData* calldata = new WakeUpCallData{std::shared_ptr{pClient}};
 	{
-		std::lock_guard lock(peer->WriteLock);
+		std::lock_guard lock(mDetachedSessionsLock);
+		mDetachedSessions.emplace(pClient.get(), calldata);
+		calldata->Alarm->Set(mCompletionQueues[0].get(), std::chrono::system_clock::now() + timeout, calldata);
+	}
 
-		evtc_rpc::messages::CombatEvent message;
-		message.Event = pEvent;
-		message.SenderInstanceId = instanceId;
+	mStatistics->SessionsDetached->Increment();
+	LogI("(client {} tag {}) connection lost, keeping the session for {}ms", fmt::ptr(pClient.get()), fmt::ptr(calldata), timeout.count());
+	return true;
+}
 
-		if (peer->WritePending == false)
+void evtc_rpc_server::HandleSessionExpiry(WakeUpCallData* pCallData, bool pOk)
+{
+	bool expired = false;
+	{
+		std::lock_guard lock(mDetachedSessionsLock);
+		auto iter = mDetachedSessions.find(pCallData->Context.get());
+		if (iter != mDetachedSessions.end() && iter->second == pCallData)
 		{
-			SendEvent(message, new WriteEventCallData(std::shared_ptr<ConnectionContext>(peer)), peer);
+			mDetachedSessions.erase(iter);
+			expired = pOk;
 		}
-		else
+	}
+
+	// A session that was resumed or superseded in the meantime is already disconnected
+	if (expired == true && pCallData->Context->ForceDisconnected == false)
+	{
+		LogI("(client {} tag {}) session expired", fmt::ptr(pCallData->Context.get()), fmt::ptr(pCallData));
+		mStatistics->SessionsExpired->Increment();
+		ForceDisconnect("session expired", pCallData->Context);
+	}
+
+	delete pCallData;
+}
+
+std::vector<std::shared_ptr<evtc_rpc_server::ConnectionContext>> evtc_rpc_server::CancelSessionExpiries()
+{
+	std::vector<std::shared_ptr<ConnectionContext>> sessions;
+
+	std::lock_guard lock(mDetachedSessionsLock);
+	for (const auto& [connection, calldata] : mDetachedSessions)
+	{
+		// The alarm completes as not-ok, which deletes calldata
+		sessions.emplace_back(calldata->Context);
+		calldata->Alarm->Cancel();
+	}
+	mDetachedSessions.clear();
+
+	LogI("Cancelled expiry of {} detached sessions", sessions.size());
+	return sessions;
+}
+
+void evtc_rpc_server::IssueSessionToken(const std::shared_ptr<ConnectionContext>& pClient, bool pResumed)
+{
+	using namespace evtc_rpc::messages;
+
+	if (mSessionResumeTimeout.load(std::memory_order_relaxed).count() == 0 ||
+		pClient->MessageVersion.load(std::memory_order_relaxed) < MESSAGE_VERSION_SESSION)
+	{
+		return;
+	}
+
+	SessionToken message{};
+	{
+		std::lock_guard lock(mSessionTokenLock);
+		while (message.Token == 0)
 		{
-			peer->QueuedEvents.emplace_back(std::move(message));
-			LogT("(client {}) Queued CombatEvent from {}", fmt::ptr(peer.get()), fmt::ptr(pClient.get()));
+			message.Token = (static_cast<uint64_t>(mSessionTokenSource()) << 32) | mSessionTokenSource();
 		}
 	}
+	message.Resumed = pResumed == true ? 1 : 0;
+	pClient->SessionToken.store(message.Token, std::memory_order_relaxed);
 
-	LogD("(client {}) Queued CombatEvents to {} peers", fmt::ptr(pClient.get()), peers.size());
+	// Queued like forwarded events so that it's sent in order with them. It doesn't count against the queue limit
+	std::lock_guard lock(pClient->WriteLock);
+	if (pClient->ForceDisconnected == true)
+	{
+		return;
+	}
 
-	return nullptr;
+	pClient->QueuedEvents.PushBack(ForwardedEvents{grpc::Slice{&message, sizeof(message)}, 0, true, Type::SessionToken, std::chrono::steady_clock::now()});
+	if (pClient->WritePending == false)
+	{
+		SendQueuedEvents(new WriteEventCallData(std::shared_ptr{pClient}), pClient);
+	}
 }
 
-void evtc_rpc_server::SendEvent(const evtc_rpc::messages::CombatEvent& pEvent, WriteEventCallData* pCallData, const std::shared_ptr<ConnectionContext>& pClient)
+void evtc_rpc_server::ReportForwardedEvents(ConnectionContext& pClient, AccountId pAccountId, bool pForce)
 {
-	assert(pClient->WritePending == false);
+	constexpr uint64_t REPORT_THRESHOLD = 1024;
 
-	evtc_rpc::messages::Header header;
-	header.MessageVersion = 1;
-	header.MessageType = evtc_rpc::messages::Type::CombatEvent;
+	if (pAccountId == INVALID_ACCOUNT_ID)
+	{
+		return;
+	}
+
+	if (pForce == false && pClient.UnreportedEventsForwarded.load(std::memory_order_relaxed) < REPORT_THRESHOLD)
+	{
+		return;
+	}
 
-	std::string blob;
-	blob.resize(sizeof(header) + sizeof(pEvent));
-	memcpy(blob.data(), &header, sizeof(header));
-	memcpy(blob.data() + sizeof(header), &pEvent, sizeof(pEvent));
+	uint64_t events = pClient.UnreportedEventsForwarded.exchange(0, std::memory_order_relaxed);
+	if (events == 0)
+	{
+		return;
+	}
 
-	evtc_rpc::Message rpc_message;
-	rpc_message.set_blob(std::move(blob));
-	pClient->Stream.Write(rpc_message, pCallData);
+	// The name is empty if the account was unregistered (and the id released) meanwhile
+	std::string name = mAccountNames.GetName(pAccountId);
+	if (name.empty() == false)
+	{
+		mStatistics->TopSenders.Add(name, events);
+	}
+}
 
-	pClient->WritePending = true;
+std::shared_ptr<evtc_rpc_server::ConnectionContext> evtc_rpc_server::FindRegisteredAgent(AccountId pAccountId)
+{
+	AgentShard& shard = GetAgentShard(pAccountId);
+	std::shared_lock lock(shard.Lock);
 
-	mStatistics->MessageTypeTransmit[static_cast<size_t>(evtc_rpc::messages::Type::CombatEvent)]->Increment();
+	auto iter = shard.Agents.find(pAccountId);
+	if (iter == shard.Agents.end())
+	{
+		return nullptr;
+	}
 
-	LogT("(client {} tag {}) Sending CombatEvent from {} source {} target {} skill {} value {}", fmt::ptr(pClient.get()), fmt::ptr(pCallData), pEvent.SenderInstanceId, pEvent.Event.src_instid, pEvent.Event.dst_instid, pEvent.Event.skillid, pEvent.Event.value);
+	return iter->second;
 }
 
-void evtc_rpc_server::ForceDisconnect(const char* pErrorMessage, const std::shared_ptr<ConnectionContext>& pClient)
+std::shared_ptr<evtc_rpc_server::ConnectionContext> evtc_rpc_server::FindRegisteredAgent(std::string_view pAccountName)
 {
-	std::lock_guard lock(mRegisteredAgentsLock);
+	AccountId accountId = mAccountNames.Find(pAccountName);
+	if (accountId == INVALID_ACCOUNT_ID)
+	{
+		return nullptr;
+	}
 
-	bool removedFromTable = false;
+	return FindRegisteredAgent(accountId);
+}
+
+size_t evtc_rpc_server::GetRegisteredAgentCount()
+{
+	size_t result = 0;
+	for (AgentShard& shard : mAgentShards)
+	{
+		std::shared_lock lock(shard.Lock);
+		result += shard.Agents.size();
+	}
+
+	return result;
+}
+
+std::map<std::string, uint16_t> evtc_rpc_server::GetPeers(ConnectionContext& pClient)
+{
+	std::map<std::string, uint16_t> result;
+
+	std::lock_guard lock(pClient.PeersLock);
+	for (const auto& [peerId, peerInstanceId] : pClient.Peers)
+	{
+		result.emplace(mAccountNames.GetName(peerId), peerInstanceId);
+	}
+
+	return result;
+}
+
+evtc_rpc_server::AgentShard& evtc_rpc_server::GetAgentShard(AccountId pAccountId)
+{
+	return mAgentShards[pAccountId % AGENT_SHARD_COUNT];
+}
+
+void evtc_rpc_server::UpdateRoute(ConnectionContext& pClient, AccountId pPeerId, const std::shared_ptr<ConnectionContext>& pPeer)
+{
+	std::shared_ptr<ConnectionContext> target;
+	auto peer = pClient.Peers.find(pPeerId);
+	if (peer != pClient.Peers.end() && pPeer != nullptr)
 	{
+		uint16_t registeredInstanceId = pPeer->InstanceId.load(std::memory_order_relaxed);
+		if (registeredInstanceId == peer->second)
+		{
+			target = pPeer;
+		}
+		else
+		{
+			LogT("(client {}) peer {} has incorrect instance id (expected {}, found {})", fmt::ptr(&pClient), fmt::ptr(pPeer.get()), peer->second, registeredInstanceId);
+		}
+	}
+
+	std::lock_guard lock(pClient.RoutesLock);
 
-		if (pClient->Iterator != mRegisteredAgents.end())
+	auto route = std::find_if(pClient.Routes.begin(), pClient.Routes.end(), [pPeerId](const Route& pRoute) { return pRoute.Peer == pPeerId; });
+	if (target == nullptr)
+	{
+		if (route != pClient.Routes.end())
 		{
-			mRegisteredAgents.erase(pClient->Iterator);
-			pClient->Iterator = mRegisteredAgents.end();
-			removedFromTable = true;
+			*route = std::move(pClient.Routes.back());
+			pClient.Routes.pop_back();
+			LogD("(client {}) removed route to {}", fmt::ptr(&pClient), pPeerId);
 		}
 	}
-	
-	ForceDisconnectInternal(pErrorMessage, pClient, removedFromTable);
+	else if (route != pClient.Routes.end())
+	{
+		route->Connection = std::move(target);
+	}
+	else
+	{
+		pClient.Routes.emplace_back(Route{pPeerId, std::move(target)});
+		LogD("(client {}) added route to {}", fmt::ptr(&pClient), pPeerId);
+	}
 }
 
-void evtc_rpc_server::ForceDisconnectInternal(const char* pErrorMessage, const std::shared_ptr<ConnectionContext>& pClient, bool pRemovedFromTable)
+void evtc_rpc_server::UpdateWatcherRoutes(AgentShard& pShard, AccountId pAccountId, const std::shared_ptr<ConnectionContext>& pPeer)
 {
-	std::lock_guard lock(pClient->WriteLock);
-
-	if (pClient->ForceDisconnected == true)
+	auto watchers = pShard.Watchers.find(pAccountId);
+	if (watchers == pShard.Watchers.end())
 	{
-		LogD("client is already disconnected");
 		return;
 	}
 
-	pClient->ForceDisconnected = true;
+	for (const auto& watcher : watchers->second)
+	{
+		std::lock_guard lock(watcher->PeersLock);
+		UpdateRoute(*watcher, pAccountId, pPeer);
+	}
+}
 
-	if (mShutdownState.load(std::memory_order_relaxed) == ShutdownState::ShuttingDown)
+void evtc_rpc_server::RemoveWatcher(AgentShard& pShard, AccountId pAccountId, const ConnectionContext* pWatcher)
+{
+	auto watchers = pShard.Watchers.find(pAccountId);
+	if (watchers == pShard.Watchers.end())
 	{
-		LogI("(client {}) force disconnected (removedFromTable={}) - '{}'. Server is shutting down so not queueing a Finish",
-			fmt::ptr(pClient.get()), BOOL_STR(pRemovedFromTable), pErrorMessage);
 		return;
 	}
 
-	DisconnectCallData* queuedData = new DisconnectCallData{ std::shared_ptr{pClient} };
-	pClient->Stream.Finish(grpc::Status{ grpc::StatusCode::INVALID_ARGUMENT, pErrorMessage }, queuedData);
+	auto& list = watchers->second;
+	auto watcher = std::find_if(list.begin(), list.end(), [pWatcher](const auto& pEntry) { return pEntry.get() == pWatcher; });
+	if (watcher != list.end())
+	{
+		*watcher = std::move(list.back());
+		list.pop_back();
 
-	LogI("(client {} tag {}) force disconnected (removedFromTable={}) - '{}'", fmt::ptr(pClient.get()), fmt::ptr(queuedData), BOOL_STR(pRemovedFromTable), pErrorMessage);
+		mKnownPeers.fetch_sub(1, std::memory_order_relaxed);
+		if (pShard.Agents.contains(pAccountId) == true)
+		{
+			mRegisteredPeers.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+
+	if (list.size() == 0)
+	{
+		pShard.Watchers.erase(watchers);
+	}
+}
+
+size_t evtc_rpc_server::GetWatcherCount(AgentShard& pShard, AccountId pAccountId)
+{
+	auto watchers = pShard.Watchers.find(pAccountId);
+	return watchers != pShard.Watchers.end() ? watchers->second.size() : 0;
+}
+
+void evtc_rpc_server::UpdateQueuedEventTotal(size_t pPreviousCount, size_t pNewCount)
+{
+	mQueuedEventTotal.fetch_add(static_cast<int64_t>(pNewCount) - static_cast<int64_t>(pPreviousCount), std::memory_order_relaxed);
+
+	size_t peak = mQueuedEventPeak.load(std::memory_order_relaxed);
+	while (pNewCount > peak && mQueuedEventPeak.compare_exchange_weak(peak, pNewCount, std::memory_order_relaxed) == false)
+	{
+	}
 }
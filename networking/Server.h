@@ -1,4 +1,6 @@
 #pragma once
+#include "AccountNames.h"
+#include "RingQueue.h"
 #include "ServerStatistics.h"
 
 #ifdef __clang__
@@ -17,6 +19,7 @@
 #include <evtc_rpc.grpc.pb.h>
 
 #include <grpc/grpc.h>
+#include <grpc/slice.h>
 #include <grpcpp/alarm.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/server.h>
@@ -24,6 +27,8 @@
 #include <grpcpp/server_context.h>
 #include <grpcpp/security/server_credentials.h>
 #include <grpcpp/security/tls_credentials_options.h>
+#include <grpcpp/support/byte_buffer.h>
+#include <grpcpp/support/slice.h>
 #ifdef __clang__
 #pragma clang diagnostic pop
 #elif _WIN32
@@ -32,28 +37,94 @@
 
 #include "evtc_rpc_messages.h"
 
+#include <array>
 #include <chrono>
-#include <deque>
+#include <map>
+#include <random>
 #include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 class evtc_rpc_server
 {
+	struct ConnectionContext;
+
+	struct Route
+	{
+		AccountId Peer;
+		std::shared_ptr<ConnectionContext> Connection;
+	};
+
+	// Events queued for a peer. Events is a serialized CombatEvent array which is built once per incoming message and
+	// shared (ref-counted) between all peers that the message is forwarded to
+	struct ForwardedEvents
+	{
+		grpc::Slice Events;
+		uint16_t EventCount = 0;
+		bool Important = false; // Contains at least one event that is kept in budget mode (healing, combat enter/exit)
+		// CombatEvent if Events is a CombatEvent array (sent as CombatEvent or CombatEventBatch depending on the peer's
+		// version), CompressedCombatEventBatch or HealingEventBatch if it's a frame of that message instead. SessionToken
+		// if Events is a SessionToken message, EventCount is 0 for those
+		evtc_rpc::messages::Type Format = evtc_rpc::messages::Type::CombatEvent;
+		std::chrono::steady_clock::time_point QueueTime{}; // When the events were queued, for the queue wait statistics
+	};
+
 	struct ConnectionContext
 	{
-		std::map<std::string, std::shared_ptr<ConnectionContext>>::iterator Iterator{}; // Protected by mRegisteredAgentsLock on the server that owns this ConnectionContext
-		uint16_t InstanceId = 0; // Protected by mRegisteredAgentsLock on the server that owns this ConnectionContext
-		std::map<std::string, uint16_t> Peers; // Protected by mRegisteredAgentsLock on the server that owns this ConnectionContext
+		// INVALID_ACCOUNT_ID while the connection is not in the registered agents table. Written under the lock of the
+		// agent shard that the account belongs to, can be read without it. Holds a reference on the id.
+		std::atomic<AccountId> Account = INVALID_ACCOUNT_ID;
+		std::atomic_uint16_t InstanceId = 0;
+
+		std::mutex PeersLock;
+		std::unordered_map<AccountId, uint16_t> Peers; // Protected by PeersLock. Every entry holds a reference on its id
+
+		// The subset of Peers that is registered with the expected instance id, i.e. where events from this client are
+		// forwarded to. Updated whenever Peers or the registration of one of the peers changes
+		std::mutex RoutesLock;
+		std::vector<Route> Routes; // Protected by RoutesLock
 
 		std::atomic<std::chrono::steady_clock::time_point> LastCallTime;
+		std::atomic_uint32_t MessageVersion = evtc_rpc::messages::MESSAGE_VERSION_LEGACY; // Message version the client sent, decides if it can receive batches
+
+		// Which of its peers' events the client wants forwarded, see SetInterest
+		std::atomic<evtc_rpc::messages::InterestedEvents> InterestedEvents = evtc_rpc::messages::InterestedEvents::All;
+		std::vector<uint16_t> InterestedPeers; // Protected by WriteLock. Sorted instance ids, empty means all peers
 
 		grpc::ServerContext ServerContext;
-		// Reads against the stream are protected since they are serialized, writes are protected with WriteLock
-		grpc::ServerAsyncReaderWriter<evtc_rpc::Message, evtc_rpc::Message> Stream{&ServerContext};
+		// Reads against the stream are protected since they are serialized, writes are protected with WriteLock. The
+		// stream is raw so that forwarded events can be written without serializing them again for every peer
+		grpc::ServerAsyncReaderWriter<grpc::ByteBuffer, grpc::ByteBuffer> Stream{&ServerContext};
+
+		// The token that was last sent to the client, 0 if none was. Written by the thread serving this connection, read
+		// under the agent shard lock by a connection that tries to resume the session
+		std::atomic_uint64_t SessionToken = 0;
 
 		std::mutex WriteLock;
-		bool ForceDisconnected = false; // Protected by WriteLock
+		std::atomic_bool ForceDisconnected = false; // Written under WriteLock, can be read without it
+		// The stream is finished but the registration is kept so that the session can be resumed, events are queued
+		// without being sent. Written under WriteLock, can be read without it
+		std::atomic_bool Detached = false;
+		bool Admitted = false; // Protected by WriteLock. Counted in mConnectionCount until it's force disconnected or detached
 		bool WritePending = false; // Protected by WriteLock
-		std::deque<evtc_rpc::messages::CombatEvent> QueuedEvents; // Protected by WriteLock
+		RingQueue<ForwardedEvents> QueuedEvents; // Protected by WriteLock. Every entry is sent as one message
+		size_t QueuedEventCount = 0; // Protected by WriteLock. Sum of EventCount in QueuedEvents, bounded by mMaxQueuedEvents
+		uint64_t DroppedEventCount = 0; // Protected by WriteLock
+		size_t QueuedEventPeak = 0; // Protected by WriteLock. Largest QueuedEventCount over the lifetime of the connection
+
+		// Traffic accounting for this connection. Relaxed counters, they are only read for logging and statistics
+		std::atomic_uint64_t EventsReceived = 0;
+		std::atomic_uint64_t EventsForwarded = 0; // Counted once per peer that an event was queued for
+		std::atomic_uint64_t BytesReceived = 0;
+		std::atomic_uint64_t BytesSent = 0;
+		std::atomic_uint64_t UnreportedEventsForwarded = 0; // Not yet added to ServerStatistics::TopSenders
+		std::atomic_uint64_t EventsThrottled = 0;
+
+		// Token bucket for the events received from the client, see SetRateLimit. Only used while handling reads, which
+		// are serialized
+		double RateLimitTokens = 0.0;
+		std::chrono::steady_clock::time_point RateLimitRefillTime{};
 	};
 
 	struct CallDataBase
@@ -90,7 +161,7 @@ class evtc_rpc_server
 		{
 		}
 
-		evtc_rpc::Message Message;
+		grpc::ByteBuffer Message;
 	};
 
 	struct WriteEventCallData : public CallDataBase
@@ -99,6 +170,8 @@ class evtc_rpc_server
 			: CallDataBase{CallDataType::WriteEvent, std::move(pContext)}
 		{
 		}
+
+		std::chrono::steady_clock::time_point WriteTime; // When the pending write was started
 	};
 
 	struct DisconnectCallData : public CallDataBase
@@ -117,55 +190,198 @@ class evtc_rpc_server
 		{
 		}
 
+		// Expires the detached session pContext when the alarm fires, see TryDetachSession
+		explicit WakeUpCallData(std::shared_ptr<ConnectionContext>&& pContext)
+			: CallDataBase{CallDataType::WakeUp, std::move(pContext)}
+			, Alarm{new grpc::Alarm}
+		{
+		}
+
 		std::unique_ptr<grpc::Alarm> Alarm;
+		bool DrainCheck = false; // Rescheduled every DRAIN_CHECK_INTERVAL until the drain is done, see StartDrain
 	};
 
 	enum class ShutdownState
 	{
 		Online,
+		ShouldDrain,
+		Draining, // New connections are rejected, registered connections are finished once their queue is flushed
 		ShouldShutdown,
 		ShuttingDown
 	};
 
 public:
-	evtc_rpc_server(const char* pListeningEndpoint, const char* pPrometheusEndpoint, const grpc::SslServerCredentialsOptions* pCredentialsOptions);
+	// pCompletionQueueCount is the amount of completion queues (and threads serving them) to use. Connections are
+	// spread across the completion queues, each connection is only ever handled by the queue that accepted it.
+	evtc_rpc_server(const char* pListeningEndpoint, const char* pPrometheusEndpoint, const grpc::SslServerCredentialsOptions* pCredentialsOptions, size_t pCompletionQueueCount = 1);
 	~evtc_rpc_server();
 
+	// Constant time and lock free, the counters are maintained incrementally. Resets the MaxQueuedEvents peak
 	ServerStatisticsSample GetStatistics();
 
 	static void ThreadStartServe(void* pThis);
+	// Serves all completion queues. Spawns one thread per completion queue beyond the first one and returns once all
+	// of them have been shut down
 	void Serve();
+	// Shuts the server down, draining it first if a drain timeout is set (see SetDrainTimeout)
 	void Shutdown();
+	// While draining, new connections are rejected and every registered connection is finished with UNAVAILABLE (which
+	// tells the client to reconnect) as soon as the events queued for it are sent. The server shuts down once all of
+	// them are finished or after pTimeout, whichever comes first, dropping whatever is still queued at that point. A
+	// pTimeout of 0 (the default) shuts down without draining
+	void SetDrainTimeout(std::chrono::milliseconds pTimeout);
+
+	// pMaxQueuedEvents is the maximum amount of events queued for a single peer, it is raised to at least
+	// MAX_COMBAT_EVENT_BATCH_SIZE. pPolicy decides what happens when forwarding events to a peer with a full queue
+	void SetQueueLimit(size_t pMaxQueuedEvents, QueueOverflowPolicy pPolicy);
+	// Upper bound for the event payload of a single message sent to a client. Messages hold at least one queued entry,
+	// even if that exceeds the budget
+	void SetMaxWriteBytes(size_t pMaxWriteBytes);
+	// Limits the events every client can send to pEventsPerSecond on average, with bursts of up to pBurstEvents. Events
+	// above the limit are dropped instead of forwarded. pBurstEvents is raised to at least MAX_COMBAT_EVENT_BATCH_SIZE,
+	// a pEventsPerSecond of 0 disables the limit
+	void SetRateLimit(double pEventsPerSecond, size_t pBurstEvents);
+	// Connections beyond pMaxConnections are rejected with RESOURCE_EXHAUSTED as soon as they are accepted. 0 means
+	// unlimited
+	void SetMaxConnections(size_t pMaxConnections);
+	// While pTimeout is non-zero, clients that send MessageVersion >= 5 get a session token after registering. When
+	// such a client's connection is lost, its registration and peers are kept for pTimeout and events keep being queued
+	// for it, so that the client can take over the session from a new connection with ResumeSession. A pTimeout of 0
+	// (the default) unregisters clients as soon as their connection is lost
+	void SetSessionResumeTimeout(std::chrono::milliseconds pTimeout);
 
 #ifndef TEST
 private:
 #endif
+	void ServeQueue(size_t pQueueIndex);
+	void RequestConnect(ConnectCallData* pCallData, size_t pQueueIndex);
+	// Finishes a connection before anything is read from it. It isn't counted in mConnectionCount
+	void RejectConnection(ConnectCallData* pCallData, grpc::StatusCode pStatusCode, const char* pErrorMessage);
 	void HandleConnect(ConnectCallData* pCallData);
-	void HandleReadMessage(ReadMessageCallData* pCallData);
+	// pReadTime is when the read completed, it's where the read-to-forward latency is measured from
+	void HandleReadMessage(ReadMessageCallData* pCallData, std::chrono::steady_clock::time_point pReadTime);
 	void HandleWriteEvent(WriteEventCallData* pCallData);
 
-	const char* HandleRegisterSelf(uint16_t pInstanceId, std::string_view pAccountName, std::shared_ptr<ConnectionContext>& pClient);
+	// If pSessionToken matches the token of the connection currently registered as pAccountName, that connection is
+	// superseded immediately and the events queued for it are moved to pClient
+	const char* HandleRegisterSelf(uint16_t pInstanceId, std::string_view pAccountName, std::shared_ptr<ConnectionContext>& pClient, uint64_t pSessionToken = 0);
 	const char* HandleSetSelfId(uint16_t pInstanceId, std::shared_ptr<ConnectionContext>& pClient);
 	const char* HandleAddPeer(uint16_t pInstanceId, std::string_view pAccountName, std::shared_ptr<ConnectionContext>& pClient);
 	const char* HandleRemovePeer(uint16_t pInstanceId, std::shared_ptr<ConnectionContext>& pClient);
-	const char* HandleCombatEvent(const cbtevent& pEvent, std::shared_ptr<ConnectionContext>& pClient);
+	// pPeers are instance ids, empty means all peers
+	const char* HandleSetInterest(evtc_rpc::messages::InterestedEvents pEvents, std::vector<uint16_t>&& pPeers, std::shared_ptr<ConnectionContext>& pClient);
+	// pEvents points to pEventCount packed CombatEvent structs. If the client sent them in one of the compact formats,
+	// pReceivedFormat is the message type (CompressedCombatEventBatch or HealingEventBatch) and pReceivedEvents the
+	// content of its frame, which is forwarded as is to peers that accept that format. pReadTime is when the read of the
+	// message completed
+	const char* HandleCombatEvents(const char* pEvents, uint16_t pEventCount, std::shared_ptr<ConnectionContext>& pClient, std::chrono::steady_clock::time_point pReadTime, evtc_rpc::messages::Type pReceivedFormat = evtc_rpc::messages::Type::CombatEvent, std::string_view pReceivedEvents = {});
+
+	// Takes pEventCount tokens from pClient's rate limit bucket after refilling it up to pNow. Returns false (and takes
+	// nothing) if there aren't enough tokens. Has to be called while handling a read of pClient
+	bool ConsumeRateLimitTokens(ConnectionContext& pClient, uint16_t pEventCount, std::chrono::steady_clock::time_point pNow);
+
+	// Queues pEvents for pPeer (with pPeer.WriteLock held), applying the overflow policy if the queue is full. Returns
+	// false if pPeer has to be disconnected
+	bool QueueEvents(ConnectionContext& pPeer, ForwardedEvents&& pEvents);
+	// Takes as many entries from the front of pClient.QueuedEvents as fit in one message and encodes them. Batches are
+	// bounded by MAX_COMBAT_EVENT_BATCH_SIZE events and mMaxWriteBytes, legacy clients get a single event. Entries of
+	// different formats are never mixed in one message. Has to be called with pClient.WriteLock held and at least
+	// one entry queued
+	grpc::ByteBuffer EncodeQueuedEvents(ConnectionContext& pClient);
+	// The type of the message that EncodeQueuedEvents is going to build next. Same requirements as EncodeQueuedEvents
+	evtc_rpc::messages::Type GetNextMessageType(ConnectionContext& pClient);
+	// Writes the next message from pClient's queue (see EncodeQueuedEvents). Has to be called with pClient->WriteLock
+	// held, no write pending and at least one entry queued
+	void SendQueuedEvents(WriteEventCallData* pCallData, const std::shared_ptr<ConnectionContext>& pClient);
+	void ForceDisconnect(const char* pErrorMessage, const std::shared_ptr<ConnectionContext>& pClient, grpc::StatusCode pStatusCode = grpc::StatusCode::INVALID_ARGUMENT);
+	void ForceDisconnectInternal(const char* pErrorMessage, const std::shared_ptr<ConnectionContext>& pClient, bool pRemovedFromTable, grpc::StatusCode pStatusCode = grpc::StatusCode::INVALID_ARGUMENT);
+	// Called with mShutdownLock held exclusively. Finishes all registered connections that have nothing left to send
+	void StartDrain();
+	// Finishes pClient with the drain status if nothing is queued for it and no write is pending. Has to be called
+	// without any of pClient's locks held
+	void FinishIfDrained(const std::shared_ptr<ConnectionContext>& pClient);
+	void ReleasePeers(const std::shared_ptr<ConnectionContext>& pClient);
 
-	void SendEvent(const evtc_rpc::messages::CombatEvent& pEvent, WriteEventCallData* pCallData, const std::shared_ptr<ConnectionContext>& pClient);
-	void ForceDisconnect(const char* pErrorMessage, const std::shared_ptr<ConnectionContext>& pClient);
-	void ForceDisconnectInternal(const char* pErrorMessage, const std::shared_ptr<ConnectionContext>& pClient, bool pRemovedFromTable);
+	// Called when reading from pClient failed. Returns false if the session can't be kept, in which case pClient has to
+	// be disconnected as usual
+	bool TryDetachSession(const std::shared_ptr<ConnectionContext>& pClient);
+	// Handles the expiry alarm of a detached session and deletes pCallData. pOk is false if the alarm was cancelled
+	void HandleSessionExpiry(WakeUpCallData* pCallData, bool pOk);
+	// Cancels the expiry alarms of all detached sessions and returns the sessions
+	std::vector<std::shared_ptr<ConnectionContext>> CancelSessionExpiries();
+	// Queues a new SessionToken message for pClient if it's able to receive one
+	void IssueSessionToken(const std::shared_ptr<ConnectionContext>& pClient, bool pResumed);
+	// Adds the events forwarded on behalf of pClient to the top senders sketch once enough of them accumulated, or
+	// unconditionally if pForce is set. The sketch takes a lock, so it isn't updated for every message
+	void ReportForwardedEvents(ConnectionContext& pClient, AccountId pAccountId, bool pForce);
 
-	std::mutex mRegisteredAgentsLock;
-	std::map<std::string, std::shared_ptr<ConnectionContext>> mRegisteredAgents;
+	std::shared_ptr<ConnectionContext> FindRegisteredAgent(AccountId pAccountId);
+	std::shared_ptr<ConnectionContext> FindRegisteredAgent(std::string_view pAccountName);
+	size_t GetRegisteredAgentCount();
+	std::map<std::string, uint16_t> GetPeers(ConnectionContext& pClient);
+
+	// Registered agents are sharded on their account id so that lookups only contend with registrations of accounts in
+	// the same shard. Lock order is agent shard -> PeersLock -> RoutesLock -> WriteLock, and at most one agent shard is
+	// held at a time.
+	static constexpr size_t AGENT_SHARD_COUNT = 16;
+	struct AgentShard
+	{
+		std::shared_mutex Lock;
+		std::unordered_map<AccountId, std::shared_ptr<ConnectionContext>> Agents;
+		// Connections that have the account as a peer, whether the account is registered or not
+		std::unordered_map<AccountId, std::vector<std::shared_ptr<ConnectionContext>>> Watchers;
+	};
+	AgentShard& GetAgentShard(AccountId pAccountId);
+
+	// Recomputes the route from pClient to pPeerId. pPeer is the connection registered as pPeerId (or nullptr). Has to
+	// be called with the agent shard of pPeerId and pClient.PeersLock held
+	void UpdateRoute(ConnectionContext& pClient, AccountId pPeerId, const std::shared_ptr<ConnectionContext>& pPeer);
+	// Recomputes the routes to pAccountId for everyone that has it as a peer. Has to be called with pShard held
+	void UpdateWatcherRoutes(AgentShard& pShard, AccountId pAccountId, const std::shared_ptr<ConnectionContext>& pPeer);
+	// Also updates the peer statistics, so it has to be called for every watcher that is removed
+	void RemoveWatcher(AgentShard& pShard, AccountId pAccountId, const ConnectionContext* pWatcher);
+	size_t GetWatcherCount(AgentShard& pShard, AccountId pAccountId);
+	// Has to be called whenever a connection's QueuedEventCount changes, with its WriteLock held
+	void UpdateQueuedEventTotal(size_t pPreviousCount, size_t pNewCount);
+
+	AccountNames mAccountNames;
+	std::array<AgentShard, AGENT_SHARD_COUNT> mAgentShards;
 
 	std::shared_ptr<ServerStatistics> mStatistics;
+
+	// Statistics that are maintained incrementally so that GetStatistics doesn't have to walk all connections. The
+	// peer counters are updated under the agent shard lock of the peer
+	std::atomic<size_t> mRegisteredPlayers = 0;
+	std::atomic<size_t> mKnownPeers = 0; // Sum of Peers over all connections
+	std::atomic<size_t> mRegisteredPeers = 0; // Entries of Peers whose account is registered
+	std::atomic<int64_t> mQueuedEventTotal = 0; // Sum of QueuedEventCount over all connections
+	std::atomic<size_t> mQueuedEventPeak = 0; // Largest QueuedEventCount since the previous GetStatistics
+	std::atomic<size_t> mConnectionCount = 0; // Admitted connections that are not force disconnected or detached yet
 	prometheus::Exposer mPrometheusExposer;
 
-	evtc_rpc::evtc_rpc::AsyncService mService;
+	evtc_rpc::evtc_rpc::WithRawMethod_Connect<evtc_rpc::evtc_rpc::Service> mService;
 	std::unique_ptr<grpc::Server> mServer;
-	std::unique_ptr<grpc::ServerCompletionQueue> mCompletionQueue;
+	std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> mCompletionQueues;
 
 	std::shared_mutex mShutdownLock;
 	std::atomic<ShutdownState> mShutdownState = ShutdownState::Online;
+	std::atomic<std::chrono::milliseconds> mDrainTimeout = std::chrono::milliseconds{0};
+	std::atomic<std::chrono::steady_clock::time_point> mDrainDeadline;
+	static constexpr std::chrono::milliseconds DRAIN_CHECK_INTERVAL{100};
+
+	std::atomic<std::chrono::milliseconds> mSessionResumeTimeout = std::chrono::milliseconds{0};
+	std::mutex mDetachedSessionsLock;
+	// Expiry alarm of every detached session. Protected by mDetachedSessionsLock, an alarm can only be cancelled while
+	// it's in here
+	std::unordered_map<ConnectionContext*, WakeUpCallData*> mDetachedSessions;
+	std::mutex mSessionTokenLock;
+	std::random_device mSessionTokenSource; // Protected by mSessionTokenLock
 	
 	std::atomic<uint64_t> mConflictingClientDisconnectThresholdMs = 30000;
+	std::atomic<size_t> mMaxQueuedEvents = 65536;
+	std::atomic<size_t> mMaxWriteBytes = 65536;
+	std::atomic<QueueOverflowPolicy> mQueueOverflowPolicy = QueueOverflowPolicy::DropOldest;
+	std::atomic<double> mRateLimitEventsPerSecond = 0.0;
+	std::atomic<size_t> mRateLimitBurstEvents = evtc_rpc::messages::MAX_COMBAT_EVENT_BATCH_SIZE;
+	std::atomic<size_t> mMaxConnections = 0;
 };
@@ -2,6 +2,10 @@
 #include "Server.h"
 #include "../src/Log.h"
 
+#include <algorithm>
+#include <bit>
+#include <limits>
+
 namespace
 {
 constexpr const char* CallDataTypeToString(CallDataType pType)
@@ -43,12 +47,114 @@ constexpr const char* EvtcRpcMessageTypeToString(evtc_rpc::messages::Type pType)
 		return "RemovePeer";
 	case Type::CombatEvent:
 		return "CombatEvent";
+	case Type::CombatEventBatch:
+		return "CombatEventBatch";
+	case Type::CompressedCombatEventBatch:
+		return "CompressedCombatEventBatch";
+	case Type::HealingEventBatch:
+		return "HealingEventBatch";
+	case Type::SetInterest:
+		return "SetInterest";
+	case Type::SessionToken:
+		return "SessionToken";
+	case Type::ResumeSession:
+		return "ResumeSession";
+	case Type::EndSession:
+		return "EndSession";
+	default:
+		return "<invalid>";
+	};
+}
+
+constexpr const char* QueueOverflowPolicyToString(QueueOverflowPolicy pPolicy)
+{
+	switch (pPolicy)
+	{
+	case QueueOverflowPolicy::DropOldest:
+		return "DropOldest";
+	case QueueOverflowPolicy::DropNonHealing:
+		return "DropNonHealing";
+	case QueueOverflowPolicy::Disconnect:
+		return "Disconnect";
 	default:
 		return "<invalid>";
 	};
 }
 }; // anonymous namespace
 
+void LatencyHistogram::Observe(std::chrono::steady_clock::duration pDuration)
+{
+	int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(pDuration).count();
+	if (ns < 0)
+	{
+		ns = 0;
+	}
+
+	// Smallest i such that the duration fits in 2^i microseconds
+	uint64_t us = (static_cast<uint64_t>(ns) + 999) / 1000;
+	size_t index = us <= 1 ? 0 : std::bit_width(us - 1);
+	if (index > BUCKET_COUNT)
+	{
+		index = BUCKET_COUNT;
+	}
+
+	mBuckets[index].fetch_add(1, std::memory_order_relaxed);
+	mSumNs.fetch_add(static_cast<uint64_t>(ns), std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Collect(prometheus::ClientMetric& pMetric) const
+{
+	uint64_t cumulativeCount = 0;
+	pMetric.histogram.bucket.resize(BUCKET_COUNT + 1);
+	for (size_t i = 0; i <= BUCKET_COUNT; i++)
+	{
+		cumulativeCount += mBuckets[i].load(std::memory_order_relaxed);
+
+		prometheus::ClientMetric::Bucket& bucket = pMetric.histogram.bucket[i];
+		bucket.cumulative_count = cumulativeCount;
+		bucket.upper_bound = i < BUCKET_COUNT ? static_cast<double>(1ULL << i) / 1e6 : std::numeric_limits<double>::infinity();
+	}
+
+	// Not an atomic snapshot together with the buckets, but close enough for monitoring
+	pMetric.histogram.sample_count = cumulativeCount;
+	pMetric.histogram.sample_sum = static_cast<double>(mSumNs.load(std::memory_order_relaxed)) / 1e9;
+}
+
+void TopTalkers::Add(std::string_view pName, uint64_t pWeight)
+{
+	std::lock_guard lock(mLock);
+
+	auto entry = std::find_if(mEntries.begin(), mEntries.end(), [pName](const Entry& pEntry) { return pEntry.Name == pName; });
+	if (entry != mEntries.end())
+	{
+		entry->Count += pWeight;
+		return;
+	}
+
+	if (mEntries.size() < CAPACITY)
+	{
+		mEntries.emplace_back(Entry{std::string{pName}, pWeight, 0});
+		return;
+	}
+
+	Entry& lightest = *std::min_element(mEntries.begin(), mEntries.end(), [](const Entry& pLeft, const Entry& pRight) { return pLeft.Count < pRight.Count; });
+	lightest.Name = pName;
+	lightest.Error = lightest.Count;
+	lightest.Count += pWeight;
+}
+
+std::vector<TopTalkers::Entry> TopTalkers::GetTop() const
+{
+	std::vector<Entry> result;
+	{
+		std::lock_guard lock(mLock);
+		result = mEntries;
+	}
+
+	std::sort(result.begin(), result.end(), [](const Entry& pLeft, const Entry& pRight) { return pLeft.Count > pRight.Count; });
+	return result;
+}
+
 ServerStatistics::ServerStatistics(evtc_rpc_server& pParent)
 	: PrometheusRegistry(std::make_shared<prometheus::Registry>())
 	, mParent(pParent)
@@ -59,6 +165,24 @@ ServerStatistics::ServerStatistics(evtc_rpc_server& pParent)
 	auto& message_type = prometheus::BuildCounter()
 		.Name("evtc_rpc_server_message_type")
 		.Register(*PrometheusRegistry);
+	auto& dropped_events = prometheus::BuildCounter()
+		.Name("evtc_rpc_server_dropped_events")
+		.Register(*PrometheusRegistry);
+	auto& bytes = prometheus::BuildCounter()
+		.Name("evtc_rpc_server_bytes")
+		.Register(*PrometheusRegistry);
+	auto& events = prometheus::BuildCounter()
+		.Name("evtc_rpc_server_events")
+		.Register(*PrometheusRegistry);
+	auto& rejected_connections = prometheus::BuildCounter()
+		.Name("evtc_rpc_server_rejected_connections")
+		.Register(*PrometheusRegistry);
+	auto& shutdown_events = prometheus::BuildCounter()
+		.Name("evtc_rpc_server_shutdown_events")
+		.Register(*PrometheusRegistry);
+	auto& sessions = prometheus::BuildCounter()
+		.Name("evtc_rpc_server_sessions")
+		.Register(*PrometheusRegistry);
 
 	for (size_t i = 0; i < CallData.size(); i++)
 	{
@@ -78,6 +202,25 @@ ServerStatistics::ServerStatistics(evtc_rpc_server& pParent)
 			{"type", EvtcRpcMessageTypeToString(static_cast<evtc_rpc::messages::Type>(i))},
 			{"direction", "transmit"}});
 	}
+
+	for (size_t i = 0; i < DroppedEvents.size(); i++)
+	{
+		DroppedEvents[i] = &dropped_events.Add({{"policy", QueueOverflowPolicyToString(static_cast<QueueOverflowPolicy>(i))}});
+	}
+
+	BytesReceived = &bytes.Add({{"direction", "receive"}});
+	BytesTransmitted = &bytes.Add({{"direction", "transmit"}});
+	EventsReceived = &events.Add({{"direction", "receive"}});
+	EventsForwarded = &events.Add({{"direction", "forward"}});
+	EventsFiltered = &events.Add({{"direction", "filtered"}});
+	EventsThrottled = &events.Add({{"direction", "throttled"}});
+	ConnectionsRejected = &rejected_connections.Add({{"reason", "overloaded"}});
+	ConnectionsRejectedDraining = &rejected_connections.Add({{"reason", "draining"}});
+	ShutdownEventsFlushed = &shutdown_events.Add({{"result", "flushed"}});
+	ShutdownEventsDropped = &shutdown_events.Add({{"result", "dropped"}});
+	SessionsDetached = &sessions.Add({{"result", "detached"}});
+	SessionsResumed = &sessions.Add({{"result", "resumed"}});
+	SessionsExpired = &sessions.Add({{"result", "expired"}});
 }
 
 std::vector<prometheus::MetricFamily> ServerStatistics::Collect() const
@@ -123,6 +266,71 @@ std::vector<prometheus::MetricFamily> ServerStatistics::Collect() const
 		metric.timestamp_ms = now;
 	}
 
+	{
+		auto& family = result.emplace_back();
+		family.name = "evtc_rpc_server_queued_events";
+		family.help = "";
+		family.type = prometheus::MetricType::Gauge;
+
+		auto& metric = family.metric.emplace_back();
+		metric.gauge.value = static_cast<double>(data.QueuedEvents);
+		metric.timestamp_ms = now;
+	}
+
+	{
+		auto& family = result.emplace_back();
+		family.name = "evtc_rpc_server_max_queued_events";
+		family.help = "";
+		family.type = prometheus::MetricType::Gauge;
+
+		auto& metric = family.metric.emplace_back();
+		metric.gauge.value = static_cast<double>(data.MaxQueuedEvents);
+		metric.timestamp_ms = now;
+	}
+
+	{
+		auto& family = result.emplace_back();
+		family.name = "evtc_rpc_server_connections";
+		family.help = "";
+		family.type = prometheus::MetricType::Gauge;
+
+		auto& metric = family.metric.emplace_back();
+		metric.gauge.value = static_cast<double>(data.Connections);
+		metric.timestamp_ms = now;
+	}
+
+	{
+		// Bounded to TopTalkers::CAPACITY label values
+		auto& family = result.emplace_back();
+		family.name = "evtc_rpc_server_top_sender_forwarded_events";
+		family.help = "";
+		family.type = prometheus::MetricType::Gauge;
+
+		for (const TopTalkers::Entry& entry : TopSenders.GetTop())
+		{
+			auto& metric = family.metric.emplace_back();
+			metric.label.emplace_back(prometheus::ClientMetric::Label{"account", entry.Name});
+			metric.gauge.value = static_cast<double>(entry.Count);
+			metric.timestamp_ms = now;
+		}
+	}
+
+	const std::array<std::pair<const char*, const LatencyHistogram*>, 4> histograms = {{
+		{"evtc_rpc_server_read_to_forward_seconds", &ReadToForward},
+		{"evtc_rpc_server_queue_wait_seconds", &QueueWait},
+		{"evtc_rpc_server_write_completion_seconds", &WriteCompletion},
+		{"evtc_rpc_server_loop_iteration_seconds", &LoopIteration}}};
+	for (const auto& [name, histogram] : histograms)
+	{
+		auto& family = result.emplace_back();
+		family.name = name;
+		family.help = "";
+		family.type = prometheus::MetricType::Histogram;
+
+		auto& metric = family.metric.emplace_back();
+		histogram->Collect(metric);
+		metric.timestamp_ms = now;
+	}
 
 	return result;
 }
@@ -6,6 +6,12 @@
 #include <prometheus/registry.h>
 
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
 
 enum class CallDataType : uint32_t
 {
@@ -18,11 +24,86 @@ enum class CallDataType : uint32_t
 	Max,
 };
 
+// What to do when events are forwarded to a peer whose outbound queue is full
+enum class QueueOverflowPolicy : uint32_t
+{
+	DropOldest, // Drop the oldest queued events until the new events fit
+	DropNonHealing, // Drop queued events that are not relevant for healing (see GetEventType), then fall back to DropOldest
+	Disconnect, // Disconnect the peer
+	Max,
+};
+
 struct ServerStatisticsSample
 {
 	size_t RegisteredPlayers;
 	size_t RegisteredPeers;
 	size_t KnownPeers;
+	size_t QueuedEvents; // Sum over all connections
+	size_t MaxQueuedEvents; // Deepest queue of a single connection since the previous sample
+	size_t Connections;
+};
+
+// Histogram of durations with power of two bucket bounds from 1us to ~8s. Observing is a couple of relaxed atomic
+// increments, so it can be used in the hot paths and stay enabled in production. Exported as a prometheus histogram
+// in seconds
+class LatencyHistogram
+{
+public:
+	static constexpr size_t BUCKET_COUNT = 24; // Upper bounds are 2^i microseconds, plus one bucket for everything above
+
+	void Observe(std::chrono::steady_clock::duration pDuration);
+	void Collect(prometheus::ClientMetric& pMetric) const;
+
+private:
+	std::array<std::atomic_uint64_t, BUCKET_COUNT + 1> mBuckets = {};
+	std::atomic_uint64_t mSumNs = 0;
+};
+
+// Observes the time between construction and destruction
+class ScopedLatency
+{
+public:
+	explicit ScopedLatency(LatencyHistogram& pHistogram)
+		: mHistogram{pHistogram}
+		, mStart{std::chrono::steady_clock::now()}
+	{
+	}
+
+	~ScopedLatency()
+	{
+		mHistogram.Observe(std::chrono::steady_clock::now() - mStart);
+	}
+
+	ScopedLatency(const ScopedLatency&) = delete;
+	ScopedLatency& operator=(const ScopedLatency&) = delete;
+
+private:
+	LatencyHistogram& mHistogram;
+	const std::chrono::steady_clock::time_point mStart;
+};
+
+// Space-saving sketch of the accounts with the highest weight. Keeps at most CAPACITY entries, an account that isn't
+// tracked evicts the lightest entry and inherits its count. Counts are therefore overestimates by at most Error, but
+// every account whose true weight is above total / CAPACITY is guaranteed to be tracked
+class TopTalkers
+{
+public:
+	static constexpr size_t CAPACITY = 16;
+
+	struct Entry
+	{
+		std::string Name;
+		uint64_t Count = 0;
+		uint64_t Error = 0;
+	};
+
+	void Add(std::string_view pName, uint64_t pWeight);
+	// Returns the tracked entries, heaviest first
+	std::vector<Entry> GetTop() const;
+
+private:
+	mutable std::mutex mLock;
+	std::vector<Entry> mEntries; // Protected by mLock
 };
 
 class evtc_rpc_server;
@@ -36,6 +117,27 @@ public:
 	std::array<prometheus::Counter*, static_cast<size_t>(CallDataType::Max)> CallData = {};
 	std::array<prometheus::Counter*, static_cast<size_t>(evtc_rpc::messages::Type::Max)> MessageTypeReceive = {};
 	std::array<prometheus::Counter*, static_cast<size_t>(evtc_rpc::messages::Type::Max)> MessageTypeTransmit = {};
+	std::array<prometheus::Counter*, static_cast<size_t>(QueueOverflowPolicy::Max)> DroppedEvents = {};
+	prometheus::Counter* BytesReceived = nullptr;
+	prometheus::Counter* BytesTransmitted = nullptr;
+	prometheus::Counter* EventsReceived = nullptr;
+	prometheus::Counter* EventsForwarded = nullptr;
+	prometheus::Counter* EventsFiltered = nullptr; // Not forwarded to a peer because of its SetInterest
+	prometheus::Counter* EventsThrottled = nullptr; // Dropped because the sender exceeded its rate limit
+	prometheus::Counter* ConnectionsRejected = nullptr; // Rejected because the server was at its connection limit
+	prometheus::Counter* ConnectionsRejectedDraining = nullptr; // Rejected, or refused registration, because the server was draining
+	prometheus::Counter* ShutdownEventsFlushed = nullptr; // Sent to a client after the shutdown started
+	prometheus::Counter* ShutdownEventsDropped = nullptr; // Received after the drain started, or still queued when the client was disconnected during shutdown
+	prometheus::Counter* SessionsDetached = nullptr; // Registration kept after the connection was lost
+	prometheus::Counter* SessionsResumed = nullptr; // Taken over by a new connection with ResumeSession
+	prometheus::Counter* SessionsExpired = nullptr; // Detached for longer than the resume timeout
+
+	TopTalkers TopSenders; // Weighted by the amount of events forwarded on behalf of the account
+
+	LatencyHistogram ReadToForward; // From the read of a combat event message completing until it's queued to all peers
+	LatencyHistogram QueueWait; // Time forwarded events spend in a peer's queue before being written
+	LatencyHistogram WriteCompletion; // From starting a write until its completion
+	LatencyHistogram LoopIteration; // Time spent handling a single completion queue event (excluding the wait for it)
 	std::shared_ptr<prometheus::Registry> PrometheusRegistry;
 
 private:
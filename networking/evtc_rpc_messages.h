@@ -15,9 +15,25 @@ enum class Type : uint32_t
 	AddPeer = 3,
 	RemovePeer = 4,
 	CombatEvent = 5,
+	CombatEventBatch = 6, // Requires MessageVersion >= 2
+	CompressedCombatEventBatch = 7, // Requires MessageVersion >= 3
+	HealingEventBatch = 8, // Requires MessageVersion >= 4
+	SetInterest = 9, // Client to server only. Older servers ignore it, so it doesn't require a specific version
+	SessionToken = 10, // Server to client only. Only sent to clients that send MessageVersion >= 5
+	ResumeSession = 11, // Client to server only. Requires MessageVersion >= 5
+	EndSession = 12, // Client to server only. Requires MessageVersion >= 5. Has no content
 	Max
 };
 
+// Version 1 is the original protocol. Version 2 is identical except that it adds CombatEventBatch - a peer that sends
+// version 2 headers is also able to receive CombatEventBatch messages. Version 3 adds CompressedCombatEventBatch in the
+// same way, version 4 adds HealingEventBatch and version 5 adds SessionToken, ResumeSession and EndSession
+constexpr uint32_t MESSAGE_VERSION_LEGACY = 1;
+constexpr uint32_t MESSAGE_VERSION_BATCH = 2;
+constexpr uint32_t MESSAGE_VERSION_COMPRESSED = 3;
+constexpr uint32_t MESSAGE_VERSION_HEALING_EVENT = 4;
+constexpr uint32_t MESSAGE_VERSION_SESSION = 5;
+
 struct Header
 {
 	uint32_t MessageVersion;
@@ -89,6 +105,121 @@ struct CombatEvent
 };
 static_assert(sizeof(CombatEvent) == 66, "");
 
+constexpr uint16_t MAX_COMBAT_EVENT_BATCH_SIZE = 1024;
+
+struct CombatEventBatch
+{
+	uint16_t EventCount; // 1..MAX_COMBAT_EVENT_BATCH_SIZE
+	// CombatEvent Events[];
+};
+static_assert(sizeof(CombatEventBatch) == 2, "");
+
+// A CompressedCombatEventBatch message is a sequence of frames, each one holding the events of a single sender encoded
+// with EventEncoder (see EventCodec.h). Clients send exactly one frame per message, the server can combine frames from
+// several senders into one message
+struct CompressedCombatEventFrame
+{
+	uint16_t EventCount; // 1..MAX_COMBAT_EVENT_BATCH_SIZE
+	uint16_t SenderInstanceId; // 0 when sent from client
+	uint32_t EncodedSize;
+	// uint8_t EncodedEvents[EncodedSize];
+};
+static_assert(sizeof(CompressedCombatEventFrame) == 8, "");
+
+enum class HealingEventKind : uint8_t
+{
+	Healing = 0, // Healing or barrier generation
+	EnterCombat = 1,
+	ExitCombat = 2,
+};
+
+constexpr uint8_t HEALING_EVENT_KIND_MASK = 0x03; // HealingEventKind
+constexpr uint8_t HEALING_EVENT_FLAG_BUFF = 0x04; // Value is buff_dmg rather than value
+constexpr uint8_t HEALING_EVENT_FLAG_SHIELDS = 0x08;
+constexpr uint8_t HEALING_EVENT_IFF_SHIFT = 4; // 2 bits
+constexpr uint8_t HEALING_EVENT_RESULT_SHIFT = 6; // 2 bits
+
+constexpr uint8_t HEALING_EVENT_STATE_NINETY = 0x01;
+constexpr uint8_t HEALING_EVENT_STATE_FIFTY = 0x02;
+constexpr uint8_t HEALING_EVENT_STATE_FLANKING = 0x04;
+constexpr uint8_t HEALING_EVENT_STATE_MOVING_SHIFT = 3; // 2 bits
+
+// A healing, barrier generation or combat enter/exit event. Peers copy healing events into their evtc log as they are
+// (see EventProcessor::PeerCombat), so the record holds every field of those except the agent ids, which peers replace.
+// Events that have any other field set are sent compressed instead. See ToHealingEvent and FromHealingEvent in
+// EventCodec.h for the conversion
+struct HealingEvent
+{
+	uint32_t Time; // cbtevent::time is a timeGetTime() value, so it fits in 32 bits
+	int32_t Value; // value or buff_dmg for healing, the subgroup for EnterCombat and the last damage event time for ExitCombat
+	uint32_t SkillId;
+	uint16_t SourceInstanceId;
+	uint16_t DestinationInstanceId;
+	uint16_t SourceMasterInstanceId;
+	uint16_t DestinationMasterInstanceId;
+	uint8_t Flags; // HEALING_EVENT_*
+	uint8_t IsOffcycle;
+	uint8_t State; // HEALING_EVENT_STATE_*, is_ninety, is_fifty, is_flanking and is_moving of healing events
+};
+static_assert(sizeof(HealingEvent) == 23, "");
+
+// A HealingEventBatch message is a sequence of frames in the same way as CompressedCombatEventBatch
+struct HealingEventFrame
+{
+	uint16_t EventCount; // 1..MAX_COMBAT_EVENT_BATCH_SIZE
+	uint16_t SenderInstanceId; // 0 when sent from client
+	// HealingEvent Events[EventCount];
+};
+static_assert(sizeof(HealingEventFrame) == 4, "");
+
+enum class InterestedEvents : uint8_t
+{
+	All = 0,
+	Important = 1, // Healing, barrier generation and combat enter/exit, the events that budget mode sends
+	None = 2,
+	Max
+};
+
+constexpr uint16_t MAX_INTERESTED_PEERS = 256;
+
+// Tells the server which of the events that peers send should be forwarded to this client. Replaces the previous
+// SetInterest, a connection starts out interested in all events from all peers
+struct SetInterest
+{
+	InterestedEvents Events;
+	uint16_t PeerCount; // 0..MAX_INTERESTED_PEERS, 0 means all peers
+	// uint16_t PeerIds[PeerCount]; // Instance ids of the peers whose events should be forwarded
+};
+static_assert(sizeof(SetInterest) == 3, "");
+
+// Sent by the server after RegisterSelf and ResumeSession. The token lets the client take over its registration from a
+// new connection if this one is lost. Every SessionToken replaces the previous one, a token can only be used once
+struct SessionToken
+{
+	uint64_t Token;
+	uint8_t Resumed; // 1 if the ResumeSession that this is a reply to found the session, 0 otherwise
+};
+static_assert(sizeof(SessionToken) == 9, "");
+
+constexpr uint16_t MAX_RESUMED_PEERS = 256;
+
+// Sent instead of RegisterSelf and AddPeer on a new connection by a client that holds a session token. If the session
+// is still known to the server, the events that were queued for the old connection are sent on the new one. Otherwise
+// this behaves exactly like RegisterSelf followed by an AddPeer for every peer
+struct ResumeSession
+{
+	uint64_t SessionToken;
+	uint16_t SelfId;
+	uint8_t SelfAccountNameLength;
+	uint16_t PeerCount; // 0..MAX_RESUMED_PEERS
+	// char SelfAccountName[SelfAccountNameLength];
+	// { AddPeer Peer; char PeerAccountName[Peer.PeerAccountNameLength]; } Peers[PeerCount];
+};
+static_assert(sizeof(ResumeSession) == 13, "");
+
+// EndSession has no content. Sent by a client that disconnects on purpose, so that the server forgets the session
+// right away instead of keeping it for the client to resume
+
 };
 };
 #pragma pack(pop)
\ No newline at end of file
@@ -229,9 +229,9 @@ uint64_t AggregatedStats::GetCombatEnd()
 	}
 	else if (endCondition == CombatEndCondition::LastHealEvent)
 	{
-		if (mySourceData.Events.size() != 0)
+		if (mySourceData.Events.Size() != 0)
 		{
-			end = mySourceData.Events.back().Time;
+			end = mySourceData.Events.Back().Time;
 		}
 	}
 	else if (endCondition == CombatEndCondition::LastDamageEvent)
@@ -242,9 +242,9 @@ uint64_t AggregatedStats::GetCombatEnd()
 	{
 		assert(endCondition == CombatEndCondition::LastDamageOrHealEvent);
 
-		if (mySourceData.Events.size() != 0)
+		if (mySourceData.Events.Size() != 0)
 		{
-			end = (std::max)(mySourceData.LastDamageEvent, mySourceData.Events.back().Time);
+			end = (std::max)(mySourceData.LastDamageEvent, mySourceData.Events.Back().Time);
 		}
 		else
 		{
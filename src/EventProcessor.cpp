@@ -678,7 +678,7 @@ std::pair<uintptr_t, std::map<uintptr_t, std::pair<HealedAgent, HealingStats>>>
 			entry->second.first = HealedAgent{"peer (unmapped)"};
 		}
 
-		DEBUGLOG("peer %llu %s, %zu events", uniqueId, entry->second.first.Name.c_str(), entry->second.second.Events.size());
+		DEBUGLOG("peer %llu %s, %zu events", uniqueId, entry->second.first.Name.c_str(), entry->second.second.Events.Size());
 	}
 
 	DEBUGLOG("self %llu, %zu entries", pSelfUniqueId, result.size());
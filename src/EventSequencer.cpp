@@ -1,15 +1,27 @@
 #include "EventSequencer.h"
 #include "Log.h"
 
-#include <cassert>
+#include <algorithm>
+#include <bit>
+#include <cstring>
 
-EventSequencer::EventSequencer(const CombatCallbackSignature pCallback)
+// Threads that store an event and threads that deliver events each write one value and then read the one the other side
+// wrote (Slot::Id and mOverflowEventCount vs mNextId). That only works if neither read can be reordered before the
+// write, so all operations on those are sequentially consistent.
+
+namespace
+{
+std::chrono::steady_clock::rep Now()
+{
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+} // anonymous namespace
+
+EventSequencer::EventSequencer(const CombatCallbackSignature pCallback, uint32_t pCapacity)
 	: mCallback(pCallback)
+	, mCapacity(std::bit_ceil(std::max(pCapacity, 1U)))
+	, mSlots(new Slot[mCapacity])
 {
-	for (uint32_t i = 0; i < MAX_QUEUED_EVENTS; i++)
-	{
-		mQueuedEvents[i].id = 0;
-	}
 }
 
 uintptr_t EventSequencer::ProcessEvent(cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* pSkillname, uint64_t pId, uint64_t pRevision)
@@ -22,272 +34,441 @@ uintptr_t EventSequencer::ProcessEvent(cbtevent* pEvent, ag* pSourceAgent, ag* p
 		return 0;
 	}
 
-	uint64_t current = mHighestId.load(std::memory_order_acquire);
-	while (true)
+	LogT(">> {}", pId);
+
+	uint64_t next = mNextId.load();
+	if (next == 0)
 	{
-		LogT(">> {}", pId);
-		if (current == pId)
-		{
-			//assert(false);
+		bool result = mNextId.compare_exchange_strong(next, pId);
+		DBG_UNREFERENCED_LOCAL_VARIABLE(result);
 
-			LogW("Received event {} twice!", pId);
+		LogD("Registered first event ({}) - result {}", pId, BOOL_STR(result));
 
-			mCallback(pEvent, pSourceAgent, pDestinationAgent, pSkillname, pId, pRevision);
+		next = mNextId.load();
+	}
+
+	if (pId < next) // Duplicate, skipped, or race condition after registering first event
+	{
+		DeliverLate(pEvent, pSourceAgent, pDestinationAgent, pSkillname, pId, pRevision);
+		return 0;
+	}
+
+	if (pId - next >= mCapacity)
+	{
+		if (QueueInOverflow(pEvent, pSourceAgent, pDestinationAgent, pSkillname, pId, pRevision) == false)
+		{
+			DeliverLate(pEvent, pSourceAgent, pDestinationAgent, pSkillname, pId, pRevision);
 			return 0;
 		}
+	}
+	else
+	{
+		Slot& slot = mSlots[pId & (mCapacity - 1)];
 
-		if (current == UINT64_MAX)
+		// Every id from mNextId up to mNextId + capacity has a slot of its own and a slot is freed before mNextId moves
+		// past its id, so the slot can only be taken by an event with the same id (or the placeholder of a skipped id)
+		uint64_t expected = SLOT_EMPTY;
+		if (slot.Id.compare_exchange_strong(expected, SLOT_BUSY) == false)
 		{
-			bool result = mHighestId.compare_exchange_weak(current, pId - 1, std::memory_order_acq_rel);
-			DBG_UNREFERENCED_LOCAL_VARIABLE(result);
-
-			LogD("Registered first event ({}) - result {}", pId, BOOL_STR(result));
-
-			current = mHighestId.load(std::memory_order_acquire);
-			continue;
+			DeliverLate(pEvent, pSourceAgent, pDestinationAgent, pSkillname, pId, pRevision);
+			return 0;
 		}
-		else if (current > (pId - 1)) // Race condition after registering first event
-		{
-			LogD("Got event lower than current highest seen ({} vs {})", pId, current);
 
-			mCallback(pEvent, pSourceAgent, pDestinationAgent, pSkillname, pId, pRevision);
+		// Once the slot is held, mNextId can't move past pId - unless it already had, because pId was skipped or
+		// delivered and its slot freed just before it was claimed here
+		next = mNextId.load();
+		if (pId < next)
+		{
+			slot.Id.store(SLOT_EMPTY);
+			DeliverLate(pEvent, pSourceAgent, pDestinationAgent, pSkillname, pId, pRevision);
 			return 0;
 		}
-		else if (current == (pId - 1)) // Fast path (most common)
+
+		if (pId == next) // Fast path (most common)
 		{
+			// Holding the slot keeps anyone else from delivering or skipping this id, so the event doesn't need to be
+			// stored
 			mCallback(pEvent, pSourceAgent, pDestinationAgent, pSkillname, pId, pRevision);
 
-			if (mHighestId.compare_exchange_strong(current, pId, std::memory_order_acq_rel) == false)
+			slot.Id.store(SLOT_EMPTY);
+			if (Advance(pId) == true)
 			{
-				assert(false);
+				DeliverQueued(pId + 1);
 			}
-
-			TryFlushEvents();
-
 			return 0;
 		}
-		else
+
+		StoreEvent(slot.Data, pEvent, pSourceAgent, pDestinationAgent, pSkillname, pRevision);
+		OnEventQueued(pId);
+		slot.Id.store(pId);
+
+		LogT("Queued {} in slot {}", pId, pId & (mCapacity - 1));
+	}
+
+	// The event before this one might have been delivered while this one was being stored, without the delivering
+	// thread seeing it. In that case it's up to this thread to deliver it
+	next = mNextId.load();
+	if (next == pId)
+	{
+		DeliverQueued(pId);
+	}
+	else if (next > pId)
+	{
+		// Only possible for the overflow map, the id was skipped while the event was being queued
+		if (DeliverFromOverflow(pId) == true)
 		{
-			std::shared_lock lock(mLock);
+			mLateEventCount.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	else
+	{
+		CheckForGaps();
+	}
+	return 0;
+}
 
-			// change if current changed since waiting for lock could potentially take quite long
-			uint64_t current2 = mHighestId.load(std::memory_order_acquire);
-			if (current != current2)
-			{
-				LogD("Race1 current {} current2 {}", current, current2);
+bool EventSequencer::QueueIsEmpty()
+{
+	bool isEmpty = (mQueuedEventCount.load(std::memory_order_acquire) == 0);
 
-				current = current2;
-				continue;
-			}
+	LogD("isEmpty={}, highestQueueSize={} nextId={} queuedEventCount={} overflowedEventCount={} lateEventCount={} skippedIdCount={}",
+		BOOL_STR(isEmpty),
+		mHighestQueueSize.load(std::memory_order_relaxed),
+		mNextId.load(std::memory_order_relaxed),
+		mQueuedEventCount.load(std::memory_order_relaxed),
+		mOverflowedEventCount.load(std::memory_order_relaxed),
+		mLateEventCount.load(std::memory_order_relaxed),
+		mSkippedIdCount.load(std::memory_order_relaxed));
+	return isEmpty;
+}
 
-			// Add first so that another racing thread is sure to read mQueuedLocalEventCount != 0 after changing
-			// the value (or it is not able to change the value).
-			uint32_t index = mQueuedEventCount.fetch_add(1, std::memory_order_acq_rel);
-			if (index >= MAX_QUEUED_EVENTS)
-			{
-				LogD("More than max events queued - {} {} {} {}", index, MAX_QUEUED_EVENTS, pId, current);
-				// Subtracting here has the same issue as described below in Race2
+void EventSequencer::SetGapLimits(std::chrono::milliseconds pTimeout, uint32_t pMaxQueuedEvents)
+{
+	mGapTimeout.store(std::chrono::duration_cast<std::chrono::steady_clock::duration>(pTimeout).count(), std::memory_order_relaxed);
+	mGapMaxQueuedEvents.store(pMaxQueuedEvents, std::memory_order_relaxed);
+}
 
-				assert(false);
+void EventSequencer::CheckForGaps()
+{
+	if (mQueuedEventCount.load() == 0)
+	{
+		return;
+	}
 
-				mCallback(pEvent, pSourceAgent, pDestinationAgent, pSkillname, pId, pRevision);
-				return 0;
-			}
+	std::chrono::steady_clock::rep now = Now();
+	std::chrono::steady_clock::rep gapStart = mGapStartTime.load(std::memory_order_relaxed);
+	if (gapStart == 0 && mGapStartTime.compare_exchange_strong(gapStart, now, std::memory_order_relaxed) == true)
+	{
+		gapStart = now;
+	}
 
-			current2 = mHighestId.load(std::memory_order_acquire);
-			if (current != current2)
-			{
-				// We can't decrement because of the race condition
-				// Thread2: fetch_add (0)
-				// Thread3: fetch_add (1)
-				// Thread3: read mHighestId
-				// Thread1: change mHighestId
-				// Thread2: read mHighestId
-				//
-				// If we were to decrement at that point, then index 1 would be given out twice
-				// So instead, we just add the event as completely empty.
-				mQueuedEvents[index].id = 0;
-
-				LogD("Race2 current {} current2 {} index {}", current, current2, index);
-
-				current = current2;
-				continue;
-			}
+	if (mQueuedEventCount.load(std::memory_order_relaxed) < mGapMaxQueuedEvents.load(std::memory_order_relaxed) &&
+		now - gapStart < mGapTimeout.load(std::memory_order_relaxed))
+	{
+		return;
+	}
 
-			if (pEvent != nullptr)
-			{
-				*static_cast<cbtevent*>(&mQueuedEvents[index].ev) = *pEvent;
-				mQueuedEvents[index].ev.present = true;
-			}
-			else
-			{
-				mQueuedEvents[index].ev.present = false;
-			}
+	SkipGaps();
+}
+
+EventSequencerStatistics EventSequencer::GetStatistics()
+{
+	EventSequencerStatistics result;
+	result.ReorderedEvents = mReorderedEventCount.load(std::memory_order_relaxed);
+	result.LateEvents = mLateEventCount.load(std::memory_order_relaxed);
+	result.SkippedIds = mSkippedIdCount.load(std::memory_order_relaxed);
+	result.OverflowedEvents = mOverflowedEventCount.load(std::memory_order_relaxed);
+	result.QueuedEvents = mQueuedEventCount.load(std::memory_order_relaxed);
+	result.HighestQueuedEvents = mHighestQueueSize.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < mParkedTimeBuckets.size(); i++)
+	{
+		result.ParkedTimeBuckets[i] = mParkedTimeBuckets[i].load(std::memory_order_relaxed);
+	}
+	result.ParkedTimeTotalMicroseconds = mParkedTimeTotal.load(std::memory_order_relaxed);
+	return result;
+}
+
+bool EventSequencer::QueueInOverflow(cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* pSkillname, uint64_t pId, uint64_t pRevision)
+{
+	std::lock_guard lock(mOverflowLock);
+
+	auto [iter, inserted] = mOverflowEvents.try_emplace(pId);
+	if (inserted == false)
+	{
+		return false;
+	}
+
+	StoreEvent(iter->second, pEvent, pSourceAgent, pDestinationAgent, pSkillname, pRevision);
+	OnEventQueued(pId);
+	mOverflowEventCount.fetch_add(1);
+	mOverflowedEventCount.fetch_add(1, std::memory_order_relaxed);
 
-			if (pSourceAgent != nullptr)
+	LogD("Queued {} in overflow map, ring capacity {} next id {}", pId, mCapacity, mNextId.load(std::memory_order_relaxed));
+	return true;
+}
+
+void EventSequencer::DeliverQueued(uint64_t pNextId)
+{
+	// Whoever takes an event out of the ring or the overflow map is the only one that can deliver it, and nothing else
+	// can move mNextId until it's delivered
+	for (uint64_t id = pNextId; ; id++)
+	{
+		Slot& slot = mSlots[id & (mCapacity - 1)];
+		uint64_t expected = id;
+		if (slot.Id.compare_exchange_strong(expected, SLOT_BUSY) == true)
+		{
+			if (slot.Data.skipped == false)
 			{
-				mQueuedEvents[index].source_ag.id = pSourceAgent->id;
-				mQueuedEvents[index].source_ag.prof = pSourceAgent->prof;
-				mQueuedEvents[index].source_ag.elite = pSourceAgent->elite;
-				mQueuedEvents[index].source_ag.self = pSourceAgent->self;
-				mQueuedEvents[index].source_ag.team = pSourceAgent->team;
-
-				if (pSourceAgent->name != nullptr)
-				{
-					mQueuedEvents[index].source_ag.name_storage = pSourceAgent->name;
-					mQueuedEvents[index].source_ag.name = mQueuedEvents[index].source_ag.name_storage.c_str();
-				}
-				else
-				{
-					mQueuedEvents[index].source_ag.name = nullptr;
-				}
-
-				mQueuedEvents[index].source_ag.present = true;
+				LogT(">> Delayed {}", id);
+
+				OnEventUnqueued(slot.Data);
+				Deliver(slot.Data, id);
 			}
-			else
+			else if (DeliverFromOverflow(id) == true)
 			{
-				mQueuedEvents[index].source_ag.present = false;
+				// It did arrive, but so far ahead of time that it went to the overflow map and wasn't seen when skipping
+				mSkippedIdCount.fetch_sub(1, std::memory_order_relaxed);
 			}
 
-			if (pDestinationAgent != nullptr)
+			// The slot has to be free before mNextId moves past it, the next event to use it could be stored right after
+			slot.Id.store(SLOT_EMPTY);
+		}
+		else
+		{
+			// If it arrived at all, it's in the overflow map. Hold its slot while taking it out so it can't be skipped in
+			// the meantime, and check that it's still the next one - this thread may have been preempted since it last
+			// looked at mNextId, in which case the id was skipped or delivered already
+			expected = SLOT_EMPTY;
+			if (slot.Id.compare_exchange_strong(expected, SLOT_BUSY) == false)
 			{
-				mQueuedEvents[index].destination_ag.id = pDestinationAgent->id;
-				mQueuedEvents[index].destination_ag.prof = pDestinationAgent->prof;
-				mQueuedEvents[index].destination_ag.elite = pDestinationAgent->elite;
-				mQueuedEvents[index].destination_ag.self = pDestinationAgent->self;
-				mQueuedEvents[index].destination_ag.team = pDestinationAgent->team;
-
-				if (pDestinationAgent->name != nullptr)
-				{
-					mQueuedEvents[index].destination_ag.name_storage = pDestinationAgent->name;
-					mQueuedEvents[index].destination_ag.name = mQueuedEvents[index].destination_ag.name_storage.c_str();
-				}
-				else
-				{
-					mQueuedEvents[index].destination_ag.name = nullptr;
-				}
-
-				mQueuedEvents[index].destination_ag.present = true;
+				return;
 			}
-			else
+
+			bool delivered = (mNextId.load() == id && DeliverFromOverflow(id) == true);
+			slot.Id.store(SLOT_EMPTY);
+			if (delivered == false)
 			{
-				mQueuedEvents[index].destination_ag.present = false;
+				return;
 			}
+		}
 
-			mQueuedEvents[index].skillname = pSkillname;
-			mQueuedEvents[index].id = pId;
-			mQueuedEvents[index].revision = pRevision;
-
-			LogT("Queued {} at index {}, current {}", pId, index, current);
-			return 0;
+		if (Advance(id) == false)
+		{
+			return;
 		}
 	}
 }
 
-bool EventSequencer::QueueIsEmpty()
+bool EventSequencer::DeliverFromOverflow(uint64_t pId)
 {
-	bool isEmpty = (mQueuedEventCount.load(std::memory_order_acquire) == 0);
+	if (mOverflowEventCount.load() == 0)
+	{
+		return false;
+	}
 
-	LogD("isEmpty={}, highestQueueSize={} highestId={} queuedEventCount={}",
-		BOOL_STR(isEmpty),
-		mHighestQueueSize.load(std::memory_order_relaxed),
-		mHighestId.load(std::memory_order_relaxed),
-		mQueuedEventCount.load(std::memory_order_relaxed));
-	return isEmpty;
+	std::unique_lock lock(mOverflowLock);
+	auto node = mOverflowEvents.extract(pId);
+	if (node.empty() == true)
+	{
+		return false;
+	}
+	mOverflowEventCount.fetch_sub(1);
+	lock.unlock();
+
+	LogT(">> Delayed {} from overflow map", pId);
+
+	OnEventUnqueued(node.mapped());
+	Deliver(node.mapped(), pId);
+	return true;
 }
 
-void EventSequencer::TryFlushEvents()
+void EventSequencer::Deliver(Event& pEvent, uint64_t pId)
 {
-	if (mQueuedEventCount.load(std::memory_order_acquire) == 0)
+	ag source;
+	ag destination;
+
+	ag* source_arg = nullptr;
+	ag* destination_arg = nullptr;
+	cbtevent* ev_arg = nullptr;
+	if (pEvent.source_ag.present == true)
 	{
-		return;
+		source_arg = &source;
+		source = *static_cast<ag*>(&pEvent.source_ag);
 	}
 
-	std::unique_lock lock(mLock);
-
-	uint32_t eventCount = mQueuedEventCount.load(std::memory_order_acquire);
-	if (eventCount > MAX_QUEUED_EVENTS)
+	if (pEvent.destination_ag.present == true)
 	{
-		// This is possible because of Race1 above
-		LogD("Truncating event count {} {}", eventCount, MAX_QUEUED_EVENTS);
-		eventCount = MAX_QUEUED_EVENTS;
+		destination_arg = &destination;
+		destination = *static_cast<ag*>(&pEvent.destination_ag);
 	}
 
-	bool removed = false;
-	size_t nonZeroEvents = 0;
-	do
+	if (pEvent.ev.present == true)
 	{
-		removed = false;
-		nonZeroEvents = 0;
+		ev_arg = &pEvent.ev;
+	}
 
-		for (uint32_t i = 0; i < eventCount; i++)
-		{
-			if (mQueuedEvents[i].id == 0)
-			{
-				continue;
-			}
+	mCallback(ev_arg, source_arg, destination_arg, pEvent.skillname, pId, pEvent.revision);
+}
 
-			uint64_t current = mHighestId.load(std::memory_order_acquire);
-			if (current != (mQueuedEvents[i].id - 1))
-			{
-				nonZeroEvents++;
-				LogT("Skipping {}", mQueuedEvents[i].id);
-				continue;
-			}
+void EventSequencer::DeliverLate(cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* pSkillname, uint64_t pId, uint64_t pRevision)
+{
+	LogD("Got event {} that was already delivered or skipped (next id {})", pId, mNextId.load(std::memory_order_relaxed));
+	mLateEventCount.fetch_add(1, std::memory_order_relaxed);
 
-			LogT(">> Delayed {}", mQueuedEvents[i].id);
+	mCallback(pEvent, pSourceAgent, pDestinationAgent, pSkillname, pId, pRevision);
+}
 
-			ag source;
-			ag destination;
+bool EventSequencer::Advance(uint64_t pDeliveredId)
+{
+	// A late copy of pDeliveredId can claim its slot in the moment between it being freed and mNextId moving on, and
+	// deliver it a second time. Only one of the two gets to move mNextId and carry on delivering
+	uint64_t expected = pDeliveredId;
+	if (mNextId.compare_exchange_strong(expected, pDeliveredId + 1) == false)
+	{
+		LogD("Event {} was delivered twice, next id already moved to {}", pDeliveredId, expected);
+		return false;
+	}
 
-			ag* source_arg = nullptr;
-			ag* destination_arg = nullptr;
-			cbtevent* ev_arg = nullptr;
-			if (mQueuedEvents[i].source_ag.present == true)
-			{
-				source_arg = &source;
-				source = *static_cast<ag*>(&mQueuedEvents[i].source_ag);
-			}
+	if (mGapStartTime.load(std::memory_order_relaxed) != 0)
+	{
+		mGapStartTime.store(0, std::memory_order_relaxed);
+	}
+	return true;
+}
 
-			if (mQueuedEvents[i].destination_ag.present == true)
-			{
-				destination_arg = &destination;
-				destination = *static_cast<ag*>(&mQueuedEvents[i].destination_ag);
-			}
+void EventSequencer::OnEventQueued(uint64_t pId)
+{
+	mReorderedEventCount.fetch_add(1, std::memory_order_relaxed);
+	uint32_t size = mQueuedEventCount.fetch_add(1, std::memory_order_acq_rel) + 1;
 
-			if (mQueuedEvents[i].ev.present == true)
-			{
-				ev_arg = &mQueuedEvents[i].ev;
-			}
+	uint32_t highest = mHighestQueueSize.load(std::memory_order_relaxed);
+	while (size > highest && mHighestQueueSize.compare_exchange_weak(highest, size, std::memory_order_relaxed) == false)
+	{
+	}
+
+	uint64_t highestId = mHighestQueuedId.load(std::memory_order_relaxed);
+	while (pId > highestId && mHighestQueuedId.compare_exchange_weak(highestId, pId, std::memory_order_relaxed) == false)
+	{
+	}
+}
 
-			mCallback(ev_arg, source_arg, destination_arg, mQueuedEvents[i].skillname, mQueuedEvents[i].id, mQueuedEvents[i].revision);
+void EventSequencer::OnEventUnqueued(const Event& pEvent)
+{
+	mQueuedEventCount.fetch_sub(1, std::memory_order_acq_rel);
 
-			if (mHighestId.compare_exchange_strong(current, mQueuedEvents[i].id, std::memory_order_acq_rel) == false)
-			{
-				assert(false);
-			}
+	std::chrono::steady_clock::duration parkedTime{Now() - pEvent.queued_time};
+	uint64_t microseconds = std::chrono::duration_cast<std::chrono::microseconds>(parkedTime).count();
+	size_t bucket = std::min<size_t>(std::bit_width(microseconds), mParkedTimeBuckets.size() - 1);
+	mParkedTimeBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	mParkedTimeTotal.fetch_add(microseconds, std::memory_order_relaxed);
+}
 
-			removed = true;
-			mQueuedEvents[i].id = 0;
-		}
-	} while (removed == true);
+void EventSequencer::SkipGaps()
+{
+	std::unique_lock lock(mSkipLock, std::try_to_lock);
+	if (lock.owns_lock() == false)
+	{
+		return; // Another thread is already at it
+	}
 
-	if (nonZeroEvents == 0)
+	for (uint64_t i = 0; i < mCapacity && mQueuedEventCount.load() != 0; i++)
 	{
-		for (uint32_t i = 0; i < MAX_QUEUED_EVENTS; i++)
+		// The missing event might have arrived since the gap was noticed
+		uint64_t next = mNextId.load();
+		if (next > mHighestQueuedId.load(std::memory_order_relaxed))
 		{
-			assert(mQueuedEvents[i].id == 0);
+			// Nothing queued is waiting on this id (the event that is queued is being delivered or stored right now)
+			return;
 		}
 
-		uint32_t oldSize = mQueuedEventCount.exchange(0, std::memory_order_acq_rel);
+		DeliverQueued(next);
+		if (mNextId.load() != next)
+		{
+			continue;
+		}
 
-		// No need to worry about races here, this is the only place it's written to and that's done under lock
-		if (mHighestQueueSize.load(std::memory_order_relaxed) < oldSize)
+		// Put a placeholder in the missing event's slot, which is then delivered (as nothing) like any other queued event.
+		// If the event arrives after all, it finds the slot taken or mNextId past it and is delivered as a late event
+		Slot& slot = mSlots[next & (mCapacity - 1)];
+		uint64_t expected = SLOT_EMPTY;
+		if (slot.Id.compare_exchange_strong(expected, SLOT_BUSY) == false)
+		{
+			return; // The missing event is being delivered right now
+		}
+		if (mNextId.load() != next)
 		{
-			mHighestQueueSize.store(oldSize, std::memory_order_relaxed);
+			// It was delivered just before the slot was claimed
+			slot.Id.store(SLOT_EMPTY);
+			continue;
 		}
+		slot.Data.skipped = true;
+		slot.Id.store(next);
+
+		mSkippedIdCount.fetch_add(1, std::memory_order_relaxed);
+		LogW("Skipping missing event {}, {} events queued behind it", next, mQueuedEventCount.load(std::memory_order_relaxed));
 
-		LogT("Clearing size {}", oldSize);
+		DeliverQueued(next);
 	}
 }
 
+void EventSequencer::StoreEvent(Event& pTarget, cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* pSkillname, uint64_t pRevision)
+{
+	if (pEvent != nullptr)
+	{
+		*static_cast<cbtevent*>(&pTarget.ev) = *pEvent;
+		pTarget.ev.present = true;
+	}
+	else
+	{
+		pTarget.ev.present = false;
+	}
+
+	StoreAgent(pTarget.source_ag, pSourceAgent);
+	StoreAgent(pTarget.destination_ag, pDestinationAgent);
+
+	pTarget.skillname = pSkillname;
+	pTarget.revision = pRevision;
+	pTarget.queued_time = Now();
+	pTarget.skipped = false;
+}
+
+void EventSequencer::StoreAgent(StoredAgent& pTarget, const ag* pAgent)
+{
+	if (pAgent == nullptr)
+	{
+		pTarget.present = false;
+		return;
+	}
+
+	pTarget.id = pAgent->id;
+	pTarget.prof = pAgent->prof;
+	pTarget.elite = pAgent->elite;
+	pTarget.self = pAgent->self;
+	pTarget.team = pAgent->team;
+
+	if (pAgent->name != nullptr)
+	{
+		size_t length = strnlen(pAgent->name, MAX_AGENT_NAME_LENGTH + 1);
+		if (length > MAX_AGENT_NAME_LENGTH)
+		{
+			// Cut before the character that doesn't fit, rather than in the middle of it
+			length = MAX_AGENT_NAME_LENGTH;
+			while (length > 0 && (static_cast<uint8_t>(pAgent->name[length]) & 0xC0) == 0x80)
+			{
+				length--;
+			}
+
+			LogD("Truncating name of agent {} to {} bytes", pAgent->id, length);
+		}
+
+		memcpy(pTarget.name_storage, pAgent->name, length);
+		pTarget.name_storage[length] = '\0';
+		pTarget.name = pTarget.name_storage;
+	}
+	else
+	{
+		pTarget.name = nullptr;
+	}
+
+	pTarget.present = true;
+}
@@ -2,14 +2,58 @@
 
 #include <ArcdpsExtension/arcdps_structs.h>
 
+#include <array>
 #include <atomic>
-#include <shared_mutex>
-#include <vector>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
 
+struct EventSequencerStatistics
+{
+	static constexpr size_t PARKED_TIME_BUCKET_COUNT = 22;
+
+	uint64_t ReorderedEvents = 0; // Arrived before the event preceding them and had to be queued
+	uint64_t LateEvents = 0; // Arrived after their id was delivered or skipped, and were delivered out of order
+	uint64_t SkippedIds = 0; // Never arrived (in time) and were skipped over by the gap timeout
+	uint64_t OverflowedEvents = 0; // Queued in the overflow map rather than in the ring
+	uint32_t QueuedEvents = 0;
+	uint32_t HighestQueuedEvents = 0;
+
+	// How long queued events waited for the events before them. Bucket i counts events that waited less than 2^i
+	// microseconds (and at least 2^(i-1)), the last bucket counts everything longer than that
+	std::array<uint64_t, PARKED_TIME_BUCKET_COUNT> ParkedTimeBuckets = {};
+	uint64_t ParkedTimeTotalMicroseconds = 0;
+};
+
+// Delivers events to mCallback in id order. arcdps calls the local combat callback from several threads at once, so
+// events can arrive out of order. An event that arrives before the one preceding it is stored in a ring indexed by its
+// id (slot = id mod capacity), and whichever thread delivers the preceding event goes on to deliver it as well. Storing
+// and delivering an event is O(1) and neither takes a lock. Events too far ahead to fit in the ring go to an ordered
+// overflow map under a lock instead, so they are still delivered in order, just slower.
+// If an id never arrives, the events after it would be held forever. Once the oldest gap is older than the gap timeout,
+// or enough events are queued behind it, the missing ids are skipped and the queued events are delivered.
 class EventSequencer
 {
+public:
+	static constexpr uint32_t DEFAULT_CAPACITY = 4096;
+	static constexpr std::chrono::milliseconds DEFAULT_GAP_TIMEOUT{1000};
+	static constexpr uint32_t DEFAULT_GAP_MAX_QUEUED_EVENTS = DEFAULT_CAPACITY / 2;
+
+	// Character names are at most 19 characters (4 bytes each at worst in UTF-8) and account names are shorter.
+	// Some NPC names in some languages are longer, those are truncated when the event is queued
+	static constexpr size_t MAX_AGENT_NAME_LENGTH = 127;
+
 private:
-	const static uint32_t MAX_QUEUED_EVENTS = 256;
+	// Slot::Id values that are not event ids. Id 0 is never queued (it is unordered and delivered immediately)
+	static constexpr uint64_t SLOT_EMPTY = 0;
+	static constexpr uint64_t SLOT_BUSY = UINT64_MAX; // Being written to or delivered from
+
+	struct StoredAgent : ag
+	{
+		char name_storage[MAX_AGENT_NAME_LENGTH + 1]; // Inline so that queueing an event in the ring never allocates
+		bool present;
+	};
 
 	struct Event
 	{
@@ -18,36 +62,89 @@ private:
 			bool present;
 		} ev;
 
-		struct : ag
-		{
-			std::string name_storage;
-			bool present;
-		} source_ag;
-
-		struct : ag
-		{
-			std::string name_storage;
-			bool present;
-		} destination_ag;
+		StoredAgent source_ag;
+		StoredAgent destination_ag;
 
 		const char* skillname; // Skill names are guaranteed to be valid for the lifetime of the process so copying pointer is fine
-		uint64_t id;
 		uint64_t revision;
+
+		int64_t queued_time; // steady_clock ticks
+		bool skipped; // Placeholder for an id that never arrived, nothing is delivered for it
 	};
+
+	struct Slot
+	{
+		std::atomic_uint64_t Id = SLOT_EMPTY; // SLOT_EMPTY, SLOT_BUSY or the id of the event stored in Data
+		Event Data;
+	};
+
 public:
-	EventSequencer(const CombatCallbackSignature pCallback);
+	// pCapacity is rounded up to a power of two. It should cover the highest amount of events arcdps can have in flight
+	// at once, anything beyond that goes through the (slower) overflow map
+	EventSequencer(const CombatCallbackSignature pCallback, uint32_t pCapacity = DEFAULT_CAPACITY);
 
 	uintptr_t ProcessEvent(cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* pSkillname, uint64_t pId, uint64_t pRevision);
 	bool QueueIsEmpty();
 
+	// Missing ids are skipped once the first event queued behind them has waited pTimeout, or once pMaxQueuedEvents
+	// events are queued. Can be called at any time
+	void SetGapLimits(std::chrono::milliseconds pTimeout, uint32_t pMaxQueuedEvents);
+	// Checks the gap timeout. ProcessEvent does this whenever it queues an event, this has to be called periodically so
+	// that events are not held forever when no more events arrive
+	void CheckForGaps();
+
+	EventSequencerStatistics GetStatistics();
+
+#ifndef TEST
 private:
-	void TryFlushEvents();
+#endif
+	// Returns false if an event with the same id is already queued
+	bool QueueInOverflow(cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* pSkillname, uint64_t pId, uint64_t pRevision);
+
+	// Delivers the queued events starting at pNextId, until the first one that hasn't arrived yet. Every id before
+	// pNextId has to have been delivered already
+	void DeliverQueued(uint64_t pNextId);
+	void Deliver(Event& pEvent, uint64_t pId);
+	// Returns false if pId is not in the overflow map
+	bool DeliverFromOverflow(uint64_t pId);
+	// For events that arrive after their id was already delivered or skipped
+	void DeliverLate(cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* pSkillname, uint64_t pId, uint64_t pRevision);
+	// Moves mNextId past pDeliveredId, which ends any gap. Returns false if somebody else already did, in which case
+	// they are the one that delivers the events after it
+	bool Advance(uint64_t pDeliveredId);
+	void OnEventQueued(uint64_t pId);
+	void OnEventUnqueued(const Event& pEvent);
+	// Skips missing ids until the queue is empty (or a gap is filled by the event arriving after all)
+	void SkipGaps();
+
+	static void StoreEvent(Event& pTarget, cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* pSkillname, uint64_t pRevision);
+	static void StoreAgent(StoredAgent& pTarget, const ag* pAgent);
 
 	const CombatCallbackSignature mCallback = nullptr;
+	const uint64_t mCapacity;
+	const std::unique_ptr<Slot[]> mSlots;
 
-	std::shared_mutex mLock;
-	std::atomic_uint64_t mHighestId = UINT64_MAX;
-	std::atomic_uint32_t mQueuedEventCount = 0;
+	// Next id to deliver, 0 until the first event is seen. Only moved by the thread that delivered the id before it
+	std::atomic_uint64_t mNextId = 0;
+	std::atomic_uint32_t mQueuedEventCount = 0; // Ring and overflow map combined
 	std::atomic_uint32_t mHighestQueueSize = 0;
-	Event mQueuedEvents[MAX_QUEUED_EVENTS];
-};
\ No newline at end of file
+	std::atomic_uint64_t mHighestQueuedId = 0; // Gaps are never skipped past this
+
+	std::atomic<std::chrono::steady_clock::rep> mGapTimeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(DEFAULT_GAP_TIMEOUT).count();
+	std::atomic_uint32_t mGapMaxQueuedEvents = DEFAULT_GAP_MAX_QUEUED_EVENTS;
+	// When mNextId stopped moving while events were queued, 0 if it hasn't. Reset whenever mNextId moves and set again
+	// by whoever notices events being queued without it set, so it can be later than the actual start of the gap
+	std::atomic<std::chrono::steady_clock::rep> mGapStartTime = 0;
+	std::mutex mSkipLock; // Only one thread skips at a time
+
+	std::atomic_uint64_t mReorderedEventCount = 0;
+	std::atomic_uint64_t mLateEventCount = 0;
+	std::atomic_uint64_t mSkippedIdCount = 0;
+	std::array<std::atomic_uint64_t, EventSequencerStatistics::PARKED_TIME_BUCKET_COUNT> mParkedTimeBuckets = {};
+	std::atomic_uint64_t mParkedTimeTotal = 0; // Microseconds
+
+	std::mutex mOverflowLock;
+	std::atomic_uint32_t mOverflowEventCount = 0; // Lets the delivering thread skip mOverflowLock when the map is empty
+	std::atomic_uint32_t mOverflowedEventCount = 0; // Total, for diagnostics
+	std::map<uint64_t, Event> mOverflowEvents;
+};
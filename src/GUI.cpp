@@ -1087,6 +1087,16 @@ void Display_GUI(HealTableOptions& pHealingOptions)
 		}
 		ImGui::End();
 	}
+
+	// Peer events are only used for PeersOutgoing windows and for logging to evtc. If neither is in use, ask the server
+	// not to forward them at all. Peer damage events drive combat time, so there is no point in asking for a subset
+	bool peersNeeded = pHealingOptions.EvtcLoggingEnabled;
+	for (uint32_t i = 0; i < HEAL_WINDOW_COUNT && peersNeeded == false; i++)
+	{
+		const HealWindowContext& curWindow = pHealingOptions.Windows[i];
+		peersNeeded = curWindow.Shown == true && curWindow.DataSourceChoice == DataSource::PeersOutgoing;
+	}
+	GlobalObjects::EVTC_RPC_CLIENT->SetInterest(peersNeeded == true ? evtc_rpc::messages::InterestedEvents::All : evtc_rpc::messages::InterestedEvents::None);
 }
 
 static void Display_EvtcRpcStatus(const HealTableOptions& pHealingOptions)
@@ -1112,6 +1122,37 @@ static void Display_EvtcRpcStatus(const HealTableOptions& pHealingOptions)
 	}
 }
 
+static void Display_EventSequencerStatistics()
+{
+	EventSequencerStatistics stats = GlobalObjects::EVENT_SEQUENCER->GetStatistics();
+
+	// Upper bound of the bucket that the given fraction of parked events falls into
+	auto parkedTimePercentile = [&stats](double pFraction) -> uint64_t
+	{
+		uint64_t total = 0;
+		for (uint64_t count : stats.ParkedTimeBuckets)
+		{
+			total += count;
+		}
+
+		uint64_t seen = 0;
+		for (size_t i = 0; i < stats.ParkedTimeBuckets.size(); i++)
+		{
+			seen += stats.ParkedTimeBuckets[i];
+			if (seen > 0 && seen >= total * pFraction)
+			{
+				return 1ULL << i;
+			}
+		}
+		return 0;
+	};
+
+	ImGui::Text("event sequencer: %llu reordered, %llu late, %llu skipped, %u queued (highest %u)",
+		stats.ReorderedEvents, stats.LateEvents, stats.SkippedIds, stats.QueuedEvents, stats.HighestQueuedEvents);
+	ImGui::Text("time parked: p50 < %llu us, p99 < %llu us, total %llu us",
+		parkedTimePercentile(0.5), parkedTimePercentile(0.99), stats.ParkedTimeTotalMicroseconds);
+}
+
 void Display_AddonOptions(HealTableOptions& pHealingOptions)
 {
 	ImGui::TextUnformatted("Heal Stats");
@@ -1232,6 +1273,10 @@ void Display_AddonOptions(HealTableOptions& pHealingOptions)
 		"All local combat events will be sent to this server. Make\n"
 		"sure you trust it.");
 	Display_EvtcRpcStatus(pHealingOptions);
+	if (pHealingOptions.DebugMode == true)
+	{
+		Display_EventSequencerStatistics();
+	}
 
 	ImGui::Separator();
 
@@ -0,0 +1,289 @@
+#include "HealEventStore.h"
+
+#include "Log.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <atomic>
+#include <tuple>
+#include <utility>
+
+HealEvent::HealEvent(uint64_t pTime, uint64_t pSize, uintptr_t pAgentId, uint32_t pSkillId, bool pIsBarrierGeneration, bool pIsAgainstDowned)
+	: Time{pTime}
+	, Size{pSize}
+	, AgentId{pAgentId}
+	, SkillId{pSkillId}
+	, IsBarrierGeneration{pIsBarrierGeneration}
+	, IsAgainstDowned{pIsAgainstDowned}
+{
+}
+
+bool HealEvent::operator==(const HealEvent& pRight) const
+{
+	return std::tie(Time, Size, AgentId, SkillId, IsBarrierGeneration, IsAgainstDowned) == std::tie(pRight.Time, pRight.Size, pRight.AgentId, pRight.SkillId, pRight.IsBarrierGeneration, pRight.IsAgainstDowned);
+}
+
+bool HealEvent::operator!=(const HealEvent& pRight) const
+{
+	return (*this == pRight) == false;
+}
+
+HealEventStore::Iterator::Iterator(const HealEventStore* pStore, size_t pIndex)
+	: mStore{pStore}
+	, mIndex{pIndex}
+{
+}
+
+HealEvent HealEventStore::Iterator::operator*() const
+{
+	return (*mStore)[mIndex];
+}
+
+HealEventStore::Iterator& HealEventStore::Iterator::operator++()
+{
+	mIndex++;
+	return *this;
+}
+
+bool HealEventStore::Iterator::operator==(const Iterator& pRight) const
+{
+	return mStore == pRight.mStore && mIndex == pRight.mIndex;
+}
+
+bool HealEventStore::Iterator::operator!=(const Iterator& pRight) const
+{
+	return (*this == pRight) == false;
+}
+
+HealEventStore::HealEventStore(const HealEventStore& pOther)
+{
+	*this = pOther;
+}
+
+HealEventStore::HealEventStore(HealEventStore&& pOther) noexcept
+{
+	*this = std::move(pOther);
+}
+
+HealEventStore& HealEventStore::operator=(const HealEventStore& pOther)
+{
+	if (this == &pOther)
+	{
+		return *this;
+	}
+
+	mSize = pOther.mSize;
+	mBaseTime = pOther.mBaseTime;
+	mSegments = pOther.mSegments;
+	mOwnsLastSegment = false;
+
+	mAgents = pOther.mAgents;
+	mAgentIndices.clear(); // Rebuilt if events are added to the copy
+
+	return *this;
+}
+
+HealEventStore& HealEventStore::operator=(HealEventStore&& pOther) noexcept
+{
+	if (this == &pOther)
+	{
+		return *this;
+	}
+
+	mSize = std::exchange(pOther.mSize, 0);
+	mBaseTime = std::exchange(pOther.mBaseTime, 0);
+	mSegments = std::move(pOther.mSegments);
+	mOwnsLastSegment = std::exchange(pOther.mOwnsLastSegment, false);
+
+	mAgents = std::move(pOther.mAgents);
+	mAgentIndices = std::move(pOther.mAgentIndices);
+	pOther.mAgentIndices.clear();
+
+	return *this;
+}
+
+void HealEventStore::Add(const HealEvent& pEvent)
+{
+	if (mSize == 0)
+	{
+		mBaseTime = pEvent.Time;
+	}
+
+	PrepareForWrite();
+
+	size_t segmentIndex = mSize / SEGMENT_SIZE;
+	size_t index = mSize % SEGMENT_SIZE;
+	if (index == 0)
+	{
+		// A segment left over from Clear() is reused unless a copy still uses it
+		if (segmentIndex == mSegments->size())
+		{
+			mSegments->emplace_back(std::make_shared<Segment>());
+		}
+		else if (IsUnique((*mSegments)[segmentIndex]) == false)
+		{
+			(*mSegments)[segmentIndex] = std::make_shared<Segment>();
+		}
+		mOwnsLastSegment = true;
+	}
+	Segment& segment = *(*mSegments)[segmentIndex];
+
+	// arcdps timestamps are milliseconds, so this only clamps for events that are weeks apart
+	int64_t relativeTime = static_cast<int64_t>(pEvent.Time - mBaseTime);
+	if (relativeTime < INT32_MIN || relativeTime > INT32_MAX)
+	{
+		LogW("Event time {} is too far from base time {}, clamping", pEvent.Time, mBaseTime);
+		relativeTime = std::clamp<int64_t>(relativeTime, INT32_MIN, INT32_MAX);
+	}
+
+	assert(pEvent.Size <= UINT32_MAX); // Comes from a 32 bit cbtevent field
+
+	// Copies of this store only read the events before their own size, so writing past it doesn't race with them
+	segment.RelativeTime[index] = static_cast<int32_t>(relativeTime);
+	segment.Size[index] = static_cast<uint32_t>(std::min<uint64_t>(pEvent.Size, UINT32_MAX));
+	segment.AgentIndex[index] = InternAgent(pEvent.AgentId);
+	segment.SkillId[index] = pEvent.SkillId;
+	segment.Flags[index] = (pEvent.IsBarrierGeneration == true ? FLAG_BARRIER_GENERATION : 0) | (pEvent.IsAgainstDowned == true ? FLAG_AGAINST_DOWNED : 0);
+
+	mSize++;
+}
+
+void HealEventStore::Clear()
+{
+	mSize = 0;
+	mBaseTime = 0;
+
+	if (mSegments != nullptr && IsUnique(mSegments) == true)
+	{
+		mSegments->resize(std::min<size_t>(mSegments->size(), 1));
+	}
+	else
+	{
+		mSegments.reset();
+	}
+	mOwnsLastSegment = false;
+
+	mAgents.reset();
+	mAgentIndices.clear();
+}
+
+size_t HealEventStore::Size() const
+{
+	return mSize;
+}
+
+HealEvent HealEventStore::operator[](size_t pIndex) const
+{
+	assert(pIndex < mSize);
+
+	const Segment& segment = *(*mSegments)[pIndex / SEGMENT_SIZE];
+	size_t index = pIndex % SEGMENT_SIZE;
+
+	uint16_t agentIndex = segment.AgentIndex[index];
+	uint8_t flags = segment.Flags[index];
+
+	return HealEvent{
+		mBaseTime + static_cast<int64_t>(segment.RelativeTime[index]),
+		segment.Size[index],
+		agentIndex < mAgents->size() ? (*mAgents)[agentIndex] : 0,
+		segment.SkillId[index],
+		(flags & FLAG_BARRIER_GENERATION) != 0,
+		(flags & FLAG_AGAINST_DOWNED) != 0};
+}
+
+HealEvent HealEventStore::Back() const
+{
+	assert(mSize > 0);
+	return (*this)[mSize - 1];
+}
+
+HealEventStore::Iterator HealEventStore::begin() const
+{
+	return Iterator{this, 0};
+}
+
+HealEventStore::Iterator HealEventStore::end() const
+{
+	return Iterator{this, mSize};
+}
+
+void HealEventStore::PrepareForWrite()
+{
+	if (mSegments == nullptr)
+	{
+		mSegments = std::make_shared<std::vector<std::shared_ptr<Segment>>>();
+	}
+	else if (IsUnique(mSegments) == false)
+	{
+		// Segments past the ones in use are left over from Clear(), those stay with the original
+		size_t segmentCount = (mSize + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+		mSegments = std::make_shared<std::vector<std::shared_ptr<Segment>>>(mSegments->begin(), mSegments->begin() + segmentCount);
+	}
+
+	size_t lastSegmentCount = mSize % SEGMENT_SIZE;
+	if (mOwnsLastSegment == false && lastSegmentCount != 0)
+	{
+		std::shared_ptr<Segment>& lastSegment = (*mSegments)[mSize / SEGMENT_SIZE];
+		const Segment& source = *lastSegment;
+		std::shared_ptr<Segment> target = std::make_shared<Segment>();
+		std::copy_n(source.RelativeTime, lastSegmentCount, target->RelativeTime);
+		std::copy_n(source.Size, lastSegmentCount, target->Size);
+		std::copy_n(source.AgentIndex, lastSegmentCount, target->AgentIndex);
+		std::copy_n(source.SkillId, lastSegmentCount, target->SkillId);
+		std::copy_n(source.Flags, lastSegmentCount, target->Flags);
+
+		lastSegment = std::move(target);
+		mOwnsLastSegment = true;
+	}
+
+	if (mAgents == nullptr)
+	{
+		mAgents = std::make_shared<std::vector<uintptr_t>>();
+	}
+	else if (IsUnique(mAgents) == false)
+	{
+		mAgents = std::make_shared<std::vector<uintptr_t>>(*mAgents);
+	}
+
+	if (mAgentIndices.size() != mAgents->size())
+	{
+		mAgentIndices.clear();
+		for (size_t i = 0; i < mAgents->size(); i++)
+		{
+			mAgentIndices.emplace((*mAgents)[i], static_cast<uint16_t>(i));
+		}
+	}
+}
+
+uint16_t HealEventStore::InternAgent(uintptr_t pAgentId)
+{
+	auto [iter, inserted] = mAgentIndices.try_emplace(pAgentId, static_cast<uint16_t>(mAgents->size()));
+	if (inserted == true)
+	{
+		if (mAgents->size() >= MAX_AGENT_COUNT)
+		{
+			mAgentIndices.erase(iter);
+			LogW("Too many agents ({}), storing agent {} as 0", mAgents->size(), pAgentId);
+			return UINT16_MAX;
+		}
+
+		mAgents->push_back(pAgentId);
+	}
+
+	return iter->second;
+}
+
+template <typename T>
+bool HealEventStore::IsUnique(const std::shared_ptr<T>& pPointer)
+{
+	if (pPointer.use_count() != 1)
+	{
+		return false;
+	}
+
+	// Another thread may have just dropped its copy, its reads of the pointed to object have to happen before our
+	// writes. The release that goes with this is in the shared_ptr destructor
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return true;
+}
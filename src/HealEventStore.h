@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <iterator>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+struct HealEvent
+{
+	uint64_t Time = 0;
+	uint64_t Size = 0;
+	uintptr_t AgentId = 0;
+	uint32_t SkillId = 0;
+	bool IsBarrierGeneration = false;
+	bool IsAgainstDowned = false;
+
+	HealEvent(uint64_t pTime, uint64_t pSize, uintptr_t pAgentId, uint32_t pSkillId, bool pIsBarrierGeneration, bool pIsAgainstDowned);
+
+	bool operator==(const HealEvent& pRight) const;
+	bool operator!=(const HealEvent& pRight) const;
+};
+
+// Append-only list of HealEvent, stored as a structure of arrays in fixed size segments. An event takes 15 bytes
+// instead of the 40 a HealEvent takes - time is stored relative to the first event, agent ids are interned into a 16 bit
+// index and the bools are packed into a flags byte. Appending never moves existing events, and scanning the events
+// reads each array front to back.
+// Events are returned by value, so `for (const HealEvent& event : store)` works like it does for a vector.
+//
+// Copies share the segments with the original instead of copying the events, so copying is O(1). Events that are in the
+// store never change, a store only appends past its own size - a copy just has a smaller size than the original once
+// the original has more events added to it. Only one store writes to a segment, any other store that adds events (a
+// copy) copies the partially filled segment first. Lists that are shared with a copy are copied before they are
+// modified, and Clear() drops the shared state rather than overwriting it. So a copy can be read from another thread
+// while the original keeps adding events, the original itself needs the usual synchronization.
+class HealEventStore
+{
+public:
+	static constexpr size_t SEGMENT_SIZE = 1024;
+	static constexpr size_t MAX_AGENT_COUNT = UINT16_MAX; // Agents past this are all stored as AgentId 0
+
+	class Iterator
+	{
+	public:
+		using iterator_category = std::input_iterator_tag;
+		using value_type = HealEvent;
+		using difference_type = ptrdiff_t;
+		using pointer = void;
+		using reference = HealEvent;
+
+		Iterator(const HealEventStore* pStore, size_t pIndex);
+
+		HealEvent operator*() const;
+		Iterator& operator++();
+		bool operator==(const Iterator& pRight) const;
+		bool operator!=(const Iterator& pRight) const;
+
+	private:
+		const HealEventStore* mStore;
+		size_t mIndex;
+	};
+
+	HealEventStore() = default;
+	HealEventStore(const HealEventStore& pOther);
+	HealEventStore(HealEventStore&& pOther) noexcept;
+	HealEventStore& operator=(const HealEventStore& pOther);
+	HealEventStore& operator=(HealEventStore&& pOther) noexcept;
+
+	void Add(const HealEvent& pEvent);
+	void Clear(); // Keeps the first segment allocated (if no copy uses it) so that the next fight doesn't have to allocate it again
+
+	size_t Size() const;
+	HealEvent operator[](size_t pIndex) const;
+	HealEvent Back() const;
+
+	Iterator begin() const;
+	Iterator end() const;
+
+#ifndef TEST
+private:
+#endif
+	static constexpr uint8_t FLAG_BARRIER_GENERATION = 1 << 0;
+	static constexpr uint8_t FLAG_AGAINST_DOWNED = 1 << 1;
+
+	struct Segment
+	{
+		int32_t RelativeTime[SEGMENT_SIZE]; // Milliseconds from mBaseTime, events can be (slightly) older than the first one
+		uint32_t Size[SEGMENT_SIZE];
+		uint16_t AgentIndex[SEGMENT_SIZE]; // Index into mAgents
+		uint32_t SkillId[SEGMENT_SIZE];
+		uint8_t Flags[SEGMENT_SIZE];
+	};
+
+	// Makes sure this store is the only user of the segment list and the agent list, and the only writer of the last
+	// segment, copying whatever is shared
+	void PrepareForWrite();
+	uint16_t InternAgent(uintptr_t pAgentId);
+
+	template <typename T>
+	static bool IsUnique(const std::shared_ptr<T>& pPointer);
+
+	size_t mSize = 0;
+	uint64_t mBaseTime = 0; // Time of the first event added since the last Clear()
+	std::shared_ptr<std::vector<std::shared_ptr<Segment>>> mSegments;
+	bool mOwnsLastSegment = false; // False in copies, until they add an event
+
+	std::shared_ptr<std::vector<uintptr_t>> mAgents;
+	std::unordered_map<uintptr_t, uint16_t> mAgentIndices; // Only kept up to date by the store that adds the events
+};
@@ -6,26 +6,6 @@
 #include <assert.h>
 #include <Windows.h>
 
-HealEvent::HealEvent(uint64_t pTime, uint64_t pSize, uintptr_t pAgentId, uint32_t pSkillId, bool pIsBarrierGeneration, bool pIsAgainstDowned)
-	: Time{pTime}
-	, Size{pSize}
-	, AgentId{pAgentId}
-	, SkillId{pSkillId}
-	, IsBarrierGeneration{pIsBarrierGeneration}
-	, IsAgainstDowned{pIsAgainstDowned}
-{
-}
-
-bool HealEvent::operator==(const HealEvent& pRight) const
-{
-	return std::tie(Time, Size, AgentId, SkillId, IsBarrierGeneration, IsAgainstDowned) == std::tie(pRight.Time, pRight.Size, pRight.AgentId, pRight.SkillId, pRight.IsBarrierGeneration, pRight.IsAgainstDowned);
-}
-
-bool HealEvent::operator!=(const HealEvent& pRight) const
-{
-	return (*this == pRight) == false;
-}
-
 bool HealingStatsSlim::IsOutOfCombat()
 {
 	return EnteredCombatTime == 0 || ExitedCombatTime != 0;
@@ -41,7 +21,7 @@ void PlayerStats::EnteredCombat(uint64_t pTime, uint16_t pSubGroup)
 		myStats.ExitedCombatTime = 0;
 		myStats.LastDamageEvent = 0;
 
-		myStats.Events.clear();
+		myStats.Events.Clear();
 		myStats.SubGroup = pSubGroup;
 
 		LOG("Entered combat, time is %llu, subgroup is %hu", pTime, pSubGroup);
@@ -72,7 +52,7 @@ uint64_t PlayerStats::ExitedCombat(uint64_t pTime, uint64_t pLastDamageEventTime
 	myStats.LastDamageEvent = std::max(myStats.LastDamageEvent, pLastDamageEventTime);
 
 	LogI("EnteredCombatTime={} ExitedCombatTime={} LastDamageEvent={} EventCount={} pLastDamageEventTime={}",
-		myStats.EnteredCombatTime, myStats.ExitedCombatTime, myStats.LastDamageEvent, myStats.Events.size(), pLastDamageEventTime);
+		myStats.EnteredCombatTime, myStats.ExitedCombatTime, myStats.LastDamageEvent, myStats.Events.Size(), pLastDamageEventTime);
 
 	return myStats.LastDamageEvent;
 }
@@ -87,7 +67,7 @@ bool PlayerStats::ResetIfNotInCombat()
 		myStats.EnteredCombatTime = 0;
 		myStats.ExitedCombatTime = 0;
 		myStats.LastDamageEvent = 0;
-		myStats.Events.clear();
+		myStats.Events.Clear();
 
 		return true;
 	}
@@ -129,7 +109,7 @@ void PlayerStats::HealingEvent(cbtevent* pEvent, uintptr_t pDestinationAgentId)
 			return;
 		}
 
-		myStats.Events.emplace_back(pEvent->time, healedAmount, pDestinationAgentId, pEvent->skillid, false, isAgainstDowned);
+		myStats.Events.Add(HealEvent{pEvent->time, healedAmount, pDestinationAgentId, pEvent->skillid, false, isAgainstDowned});
 	}
 }
 
@@ -153,7 +133,7 @@ void PlayerStats::BarrierGenerationEvent(cbtevent* pEvent, uintptr_t pDestinatio
 			return;
 		}
 
-		myStats.Events.emplace_back(pEvent->time, barrierGenerationAmount, pDestinationAgentId, pEvent->skillid, true, isAgainstDowned);
+		myStats.Events.Add(HealEvent{pEvent->time, barrierGenerationAmount, pDestinationAgentId, pEvent->skillid, true, isAgainstDowned});
 	}
 }
 
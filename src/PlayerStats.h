@@ -1,5 +1,7 @@
 #pragma once
 
+#include "HealEventStore.h"
+
 #include <ArcdpsExtension/arcdps_structs.h>
 
 #include <stdint.h>
@@ -7,22 +9,6 @@
 #include <map>
 #include <mutex>
 #include <string>
-#include <vector>
-
-struct HealEvent
-{
-	const uint64_t Time = 0;
-	const uint64_t Size = 0;
-	const uintptr_t AgentId = 0;
-	const uint32_t SkillId = 0;
-	const bool IsBarrierGeneration = false;
-	const bool IsAgainstDowned = false;
-
-	HealEvent(uint64_t pTime, uint64_t pSize, uintptr_t pAgentId, uint32_t pSkillId, bool pIsBarrierGeneration, bool pIsAgainstDowned);
-
-	bool operator==(const HealEvent& pRight) const;
-	bool operator!=(const HealEvent& pRight) const;
-};
 
 struct HealingStatsSlim
 {
@@ -31,7 +17,7 @@ struct HealingStatsSlim
 	uint64_t LastDamageEvent = 0;
 	uint16_t SubGroup = 0;
 
-	std::vector<HealEvent> Events; // Really this should be some segmented vector, will probably write one if it becomes a pain point
+	HealEventStore Events;
 
 	bool IsOutOfCombat();
 };
@@ -51,6 +37,7 @@ public:
 	void HealingEvent(cbtevent* pEvent, uintptr_t pDestinationAgentId);
 	void BarrierGenerationEvent(cbtevent* pEvent, uintptr_t pDestinationAgentId);
 
+	// Cheap, the returned events share their storage with this object rather than being copied
 	HealingStatsSlim GetState();
 
 private:
@@ -323,6 +323,15 @@ uintptr_t mod_release()
 	GlobalObjects::EVTC_RPC_CLIENT_THREAD = nullptr;
 	GlobalObjects::EVTC_RPC_CLIENT = nullptr;
 	GlobalObjects::EVENT_PROCESSOR = nullptr;
+
+	EventSequencerStatistics sequencerStats = GlobalObjects::EVENT_SEQUENCER->GetStatistics();
+	LogI("Event sequencer statistics: reordered={} late={} skipped={} overflowed={} highest_queued={} total_parked_us={}",
+		sequencerStats.ReorderedEvents,
+		sequencerStats.LateEvents,
+		sequencerStats.SkippedIds,
+		sequencerStats.OverflowedEvents,
+		sequencerStats.HighestQueuedEvents,
+		sequencerStats.ParkedTimeTotalMicroseconds);
 	GlobalObjects::EVENT_SEQUENCER = nullptr;
 
 	LogI("Shutdown completed");
@@ -346,6 +355,9 @@ void mod_imgui(uint32_t pNotCharSelectionOrLoading, uint32_t pHideIfCombatOrOoc)
 		return;
 	}
 
+	// Called every frame, so events held back by a missing id are released even if no more events arrive
+	GlobalObjects::EVENT_SEQUENCER->CheckForGaps();
+
 	if (pNotCharSelectionOrLoading == 0 || pHideIfCombatOrOoc != 0)
 	{
 		return;
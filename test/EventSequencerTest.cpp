@@ -0,0 +1,322 @@
+#pragma warning(push, 0)
+#pragma warning(disable : 4005)
+#pragma warning(disable : 4389)
+#pragma warning(disable : 26439)
+#pragma warning(disable : 26495)
+#include <gtest/gtest.h>
+#pragma warning(pop)
+
+#include "EventSequencer.h"
+#include "Log.h"
+
+#include <ArcdpsMock/arcdps_mock/CombatMock.h>
+
+#ifdef _DEBUG
+#include <crtdbg.h>
+#endif
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+// Set while the current thread is inside EventSequencer::ProcessEvent, allocations made while it's set are counted
+thread_local bool IN_SEQUENCER = false;
+std::atomic_uint64_t SEQUENCER_ALLOCATIONS = 0;
+
+#ifdef _DEBUG
+// Installed by EventSequencerTestFixture for the duration of a test. Only the debug CRT calls allocation hooks, so
+// allocations can't be counted in release builds
+int CountSequencerAllocations(int pAllocationType, void* /*pUserData*/, size_t /*pSize*/, int /*pBlockType*/, long /*pRequestNumber*/, const unsigned char* /*pFilename*/, int /*pLineNumber*/)
+{
+	if (IN_SEQUENCER == true && (pAllocationType == _HOOK_ALLOC || pAllocationType == _HOOK_REALLOC))
+	{
+		SEQUENCER_ALLOCATIONS.fetch_add(1, std::memory_order_relaxed);
+	}
+	return 1; // Let the allocation go ahead
+}
+#endif
+
+EventSequencer* SEQUENCER = nullptr;
+
+void AreaCombat(cbtevent* /*pEvent*/, ag* /*pSourceAgent*/, ag* /*pDestinationAgent*/, const char* /*pSkillname*/, uint64_t /*pId*/, uint64_t /*pRevision*/)
+{
+}
+
+void LocalCombat(cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* pSkillname, uint64_t pId, uint64_t pRevision)
+{
+	IN_SEQUENCER = true;
+	SEQUENCER->ProcessEvent(pEvent, pSourceAgent, pDestinationAgent, pSkillname, pId, pRevision);
+	IN_SEQUENCER = false;
+}
+
+// Highest id delivered so far, and how many delivered ids were not higher than that. Only late events (see
+// EventSequencerStatistics::LateEvents) are allowed to go backwards, though a late event can also happen to arrive in
+// order
+std::atomic_uint64_t HIGHEST_DELIVERED_ID = 0;
+std::atomic_uint64_t BACKWARDS_DELIVERIES = 0;
+std::atomic_uint64_t DELIVERY_COUNT = 0;
+
+// Runs inside ProcessEvent, so it must not allocate itself. Late events can be delivered while another thread delivers
+// the events in order, so everything is atomic
+void SequencedEvent(cbtevent* /*pEvent*/, ag* /*pSourceAgent*/, ag* /*pDestinationAgent*/, const char* /*pSkillname*/, uint64_t pId, uint64_t /*pRevision*/)
+{
+	if (pId == 0) // Unordered
+	{
+		return;
+	}
+
+	DELIVERY_COUNT.fetch_add(1);
+	uint64_t highest = HIGHEST_DELIVERED_ID.load();
+	while (pId > highest && HIGHEST_DELIVERED_ID.compare_exchange_weak(highest, pId) == false)
+	{
+	}
+	if (pId <= highest)
+	{
+		BACKWARDS_DELIVERIES.fetch_add(1);
+	}
+}
+
+void ResetDeliveries()
+{
+	HIGHEST_DELIVERED_ID = 0;
+	BACKWARDS_DELIVERIES = 0;
+	DELIVERY_COUNT = 0;
+}
+
+std::string LAST_SOURCE_NAME;
+void SaveSourceName(cbtevent* /*pEvent*/, ag* pSourceAgent, ag* /*pDestinationAgent*/, const char* /*pSkillname*/, uint64_t /*pId*/, uint64_t /*pRevision*/)
+{
+	LAST_SOURCE_NAME = pSourceAgent->name;
+}
+
+std::vector<uint64_t> DELIVERED_IDS;
+void SaveId(cbtevent* /*pEvent*/, ag* /*pSourceAgent*/, ag* /*pDestinationAgent*/, const char* /*pSkillname*/, uint64_t pId, uint64_t /*pRevision*/)
+{
+	DELIVERED_IDS.push_back(pId);
+}
+
+// parameters are <max parallel callbacks, max fuzz width>
+class EventSequencerTestFixture : public ::testing::TestWithParam<std::pair<uint32_t, uint32_t>>
+{
+protected:
+	arcdps_exports Exports{};
+	CombatMock Mock{&Exports};
+	EventSequencer Sequencer{SequencedEvent};
+
+	void SetUp() override
+	{
+		Exports.combat = AreaCombat;
+		Exports.combat_local = LocalCombat;
+
+		SEQUENCER = &Sequencer;
+		SEQUENCER_ALLOCATIONS = 0;
+		ResetDeliveries();
+
+		// Logging can allocate, and it's not what's being tested here
+		Log_::SetLevel(spdlog::level::warn);
+
+#ifdef _DEBUG
+		mPreviousAllocHook = _CrtSetAllocHook(CountSequencerAllocations);
+#endif
+	}
+
+	void TearDown() override
+	{
+#ifdef _DEBUG
+		_CrtSetAllocHook(mPreviousAllocHook);
+#endif
+
+		Log_::SetLevel(spdlog::level::trace);
+		SEQUENCER = nullptr;
+	}
+
+private:
+#ifdef _DEBUG
+	_CRT_ALLOC_HOOK mPreviousAllocHook = nullptr;
+#endif
+};
+} // anonymous namespace
+
+TEST_P(EventSequencerTestFixture, druid_MO_no_allocations)
+{
+	auto [parallelCallbacks, fuzzWidth] = GetParam();
+
+	uint32_t result = Mock.ExecuteFromXevtc("xevtc_logs\\druid_MO.xevtc", parallelCallbacks, fuzzWidth);
+	ASSERT_EQ(result, 0U);
+	ASSERT_TRUE(Sequencer.QueueIsEmpty());
+
+	EXPECT_GT(Sequencer.mHighestQueueSize.load(), 0U); // Make sure the out of order path was actually taken
+	EXPECT_EQ(Sequencer.mOverflowedEventCount.load(), 0U);
+#ifdef _DEBUG
+	EXPECT_EQ(SEQUENCER_ALLOCATIONS.load(), 0U);
+#endif
+	EXPECT_GT(DELIVERY_COUNT.load(), 0U);
+	EXPECT_LE(BACKWARDS_DELIVERIES.load(), Sequencer.GetStatistics().LateEvents);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+	Fuzz,
+	EventSequencerTestFixture,
+	::testing::Values(std::make_pair(0, 16), std::make_pair(0, 64)));
+
+INSTANTIATE_TEST_SUITE_P(
+	MultiThreaded,
+	EventSequencerTestFixture,
+	::testing::Values(std::make_pair(16, 16), std::make_pair(128, 64)));
+
+TEST(EventSequencer, LongNamesAreTruncated)
+{
+	EventSequencer sequencer{SaveSourceName};
+
+	// Every character is 2 bytes, so the cut falls in the middle of one
+	std::string name;
+	while (name.size() <= EventSequencer::MAX_AGENT_NAME_LENGTH)
+	{
+		name += "\xC3\xA4";
+	}
+
+	ag source{};
+	source.name = name.c_str();
+	cbtevent event{};
+
+	sequencer.ProcessEvent(&event, &source, nullptr, nullptr, 1, 1);
+	EXPECT_EQ(LAST_SOURCE_NAME, name);
+
+	// Event 3 has to be queued until event 2 arrives
+	sequencer.ProcessEvent(&event, &source, nullptr, nullptr, 3, 1);
+	sequencer.ProcessEvent(&event, &source, nullptr, nullptr, 2, 1);
+	EXPECT_EQ(LAST_SOURCE_NAME, name.substr(0, EventSequencer::MAX_AGENT_NAME_LENGTH - 1));
+	EXPECT_TRUE(sequencer.QueueIsEmpty());
+}
+
+TEST(EventSequencer, GapSkippedWhenTooManyEventsQueued)
+{
+	DELIVERED_IDS.clear();
+	EventSequencer sequencer{SaveId};
+	sequencer.SetGapLimits(std::chrono::hours{1}, 3);
+
+	cbtevent event{};
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 1, 1);
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 3, 1);
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 4, 1);
+	EXPECT_EQ(DELIVERED_IDS, std::vector<uint64_t>({1}));
+
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 5, 1);
+	EXPECT_EQ(DELIVERED_IDS, std::vector<uint64_t>({1, 3, 4, 5}));
+	EXPECT_TRUE(sequencer.QueueIsEmpty());
+
+	// The missing event arriving after all is delivered as a late event
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 2, 1);
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 6, 1);
+	EXPECT_EQ(DELIVERED_IDS, std::vector<uint64_t>({1, 3, 4, 5, 2, 6}));
+
+	EventSequencerStatistics stats = sequencer.GetStatistics();
+	EXPECT_EQ(stats.ReorderedEvents, 3U);
+	EXPECT_EQ(stats.LateEvents, 1U);
+	EXPECT_EQ(stats.SkippedIds, 1U);
+	EXPECT_EQ(stats.QueuedEvents, 0U);
+	EXPECT_EQ(stats.HighestQueuedEvents, 3U);
+
+	uint64_t parkedEvents = 0;
+	for (uint64_t count : stats.ParkedTimeBuckets)
+	{
+		parkedEvents += count;
+	}
+	EXPECT_EQ(parkedEvents, 3U);
+}
+
+TEST(EventSequencer, GapSkippedAfterTimeout)
+{
+	DELIVERED_IDS.clear();
+	EventSequencer sequencer{SaveId};
+	sequencer.SetGapLimits(std::chrono::milliseconds{10}, 1000);
+
+	cbtevent event{};
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 1, 1);
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 3, 1);
+	sequencer.CheckForGaps();
+	EXPECT_EQ(DELIVERED_IDS, std::vector<uint64_t>({1}));
+
+	// No more events arrive, the periodic check has to release the queued one
+	std::this_thread::sleep_for(std::chrono::milliseconds{20});
+	sequencer.CheckForGaps();
+	EXPECT_EQ(DELIVERED_IDS, std::vector<uint64_t>({1, 3}));
+	EXPECT_TRUE(sequencer.QueueIsEmpty());
+	EXPECT_EQ(sequencer.GetStatistics().SkippedIds, 1U);
+}
+
+TEST(EventSequencer, DuplicateId)
+{
+	DELIVERED_IDS.clear();
+	EventSequencer sequencer{SaveId};
+
+	cbtevent event{};
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 1, 1);
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 3, 1);
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 3, 1); // Queued already
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 1, 1); // Delivered already
+	EXPECT_EQ(DELIVERED_IDS, std::vector<uint64_t>({1, 3, 1}));
+
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 2, 1);
+	EXPECT_EQ(DELIVERED_IDS, std::vector<uint64_t>({1, 3, 1, 2, 3}));
+	EXPECT_TRUE(sequencer.QueueIsEmpty());
+	EXPECT_EQ(sequencer.GetStatistics().LateEvents, 2U);
+}
+
+TEST(EventSequencer, SmallCapacity)
+{
+	// Only one slot, everything that arrives more than one id early goes through the overflow map
+	DELIVERED_IDS.clear();
+	EventSequencer sequencer{SaveId, 1};
+
+	cbtevent event{};
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 1, 1);
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 5, 1);
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 3, 1);
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 4, 1);
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 4, 1); // Duplicate in the overflow map
+	EXPECT_EQ(DELIVERED_IDS, std::vector<uint64_t>({1, 4}));
+
+	sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, 2, 1);
+	EXPECT_EQ(DELIVERED_IDS, std::vector<uint64_t>({1, 4, 2, 3, 4, 5}));
+	EXPECT_TRUE(sequencer.QueueIsEmpty());
+	EXPECT_EQ(sequencer.GetStatistics().OverflowedEvents, 3U);
+}
+
+TEST(EventSequencer, SmallCapacityMultiThreaded)
+{
+	constexpr uint32_t THREAD_COUNT = 8;
+	constexpr uint64_t EVENTS_PER_THREAD = 20000;
+
+	ResetDeliveries();
+	EventSequencer sequencer{SequencedEvent, 1};
+
+	// Ids are handed out in order, but the threads race each other to ProcessEvent
+	std::atomic_uint64_t nextId = 1;
+	std::vector<std::thread> threads;
+	for (uint32_t i = 0; i < THREAD_COUNT; i++)
+	{
+		threads.emplace_back([&sequencer, &nextId]()
+			{
+				cbtevent event{};
+				for (uint64_t j = 0; j < EVENTS_PER_THREAD; j++)
+				{
+					sequencer.ProcessEvent(&event, nullptr, nullptr, nullptr, nextId.fetch_add(1), 1);
+				}
+			});
+	}
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+	sequencer.CheckForGaps();
+
+	EXPECT_TRUE(sequencer.QueueIsEmpty());
+	EXPECT_EQ(DELIVERY_COUNT.load(), THREAD_COUNT * EVENTS_PER_THREAD);
+	EXPECT_EQ(HIGHEST_DELIVERED_ID.load(), THREAD_COUNT * EVENTS_PER_THREAD);
+	EXPECT_LE(BACKWARDS_DELIVERIES.load(), sequencer.GetStatistics().LateEvents);
+}
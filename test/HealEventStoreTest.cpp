@@ -0,0 +1,131 @@
+#pragma warning(push, 0)
+#pragma warning(disable : 4005)
+#pragma warning(disable : 4389)
+#pragma warning(disable : 26439)
+#pragma warning(disable : 26495)
+#include <gtest/gtest.h>
+#pragma warning(pop)
+
+#include "HealEventStore.h"
+
+#include <vector>
+
+namespace
+{
+std::vector<HealEvent> MakeEvents(size_t pCount)
+{
+	std::vector<HealEvent> result;
+	for (size_t i = 0; i < pCount; i++)
+	{
+		result.emplace_back(100000 + i * 7, 1000 + i, 0x1000 + i % 13, static_cast<uint32_t>(i % 31), i % 3 == 0, i % 5 == 0);
+	}
+	return result;
+}
+
+std::vector<HealEvent> ToVector(const HealEventStore& pStore)
+{
+	std::vector<HealEvent> result;
+	for (const HealEvent& event : pStore)
+	{
+		result.push_back(event);
+	}
+	return result;
+}
+} // anonymous namespace
+
+TEST(HealEventStore, AddAndRead)
+{
+	std::vector<HealEvent> expected = MakeEvents(HealEventStore::SEGMENT_SIZE * 2 + 5);
+
+	HealEventStore store;
+	for (const HealEvent& event : expected)
+	{
+		store.Add(event);
+	}
+
+	ASSERT_EQ(store.Size(), expected.size());
+	EXPECT_EQ(store.mSegments->size(), 3U);
+	EXPECT_EQ(store.mAgents->size(), 13U);
+	EXPECT_EQ(store[HealEventStore::SEGMENT_SIZE], expected[HealEventStore::SEGMENT_SIZE]);
+	EXPECT_EQ(store.Back(), expected.back());
+	EXPECT_EQ(ToVector(store), expected);
+}
+
+TEST(HealEventStore, EventOlderThanFirst)
+{
+	HealEventStore store;
+	store.Add(HealEvent{5000, 1, 2, 3, false, false});
+	store.Add(HealEvent{4000, 4, 5, 6, true, true});
+
+	EXPECT_EQ(ToVector(store), std::vector<HealEvent>({HealEvent{5000, 1, 2, 3, false, false}, HealEvent{4000, 4, 5, 6, true, true}}));
+}
+
+TEST(HealEventStore, CopyAndClear)
+{
+	std::vector<HealEvent> expected = MakeEvents(HealEventStore::SEGMENT_SIZE + 1);
+
+	HealEventStore store;
+	for (const HealEvent& event : expected)
+	{
+		store.Add(event);
+	}
+
+	HealEventStore copy{store};
+	store.Clear();
+	EXPECT_EQ(store.Size(), 0U);
+	EXPECT_EQ(ToVector(copy), expected);
+
+	// The base time and the agent table start over after a clear
+	store.Add(HealEvent{1, 2, 3, 4, false, false});
+	EXPECT_EQ(ToVector(store), std::vector<HealEvent>({HealEvent{1, 2, 3, 4, false, false}}));
+	EXPECT_EQ(store.mAgents->size(), 1U);
+
+	copy = store;
+	EXPECT_EQ(ToVector(copy), ToVector(store));
+
+	// Without any copies around, the first segment is kept for reuse
+	copy = HealEventStore{};
+	HealEventStore::Segment* firstSegment = store.mSegments->front().get();
+	store.Clear();
+	store.Add(HealEvent{1, 2, 3, 4, false, false});
+	EXPECT_EQ(store.mSegments->front().get(), firstSegment);
+}
+
+TEST(HealEventStore, CopiesShareSegments)
+{
+	std::vector<HealEvent> expected = MakeEvents(HealEventStore::SEGMENT_SIZE + 10);
+
+	HealEventStore store;
+	for (size_t i = 0; i < HealEventStore::SEGMENT_SIZE + 5; i++)
+	{
+		store.Add(expected[i]);
+	}
+
+	HealEventStore snapshot{store};
+	EXPECT_EQ(snapshot.mSegments, store.mSegments);
+
+	// Adding to the original doesn't change the snapshot
+	for (size_t i = HealEventStore::SEGMENT_SIZE + 5; i < expected.size(); i++)
+	{
+		store.Add(expected[i]);
+	}
+	EXPECT_EQ(ToVector(store), expected);
+	EXPECT_EQ(ToVector(snapshot), std::vector<HealEvent>(expected.begin(), expected.begin() + HealEventStore::SEGMENT_SIZE + 5));
+	EXPECT_EQ((*snapshot.mSegments)[1], (*store.mSegments)[1]); // The partially filled segment is still shared
+
+	// Adding to the snapshot copies the partially filled segment instead of overwriting the original's events
+	snapshot.Add(HealEvent{1, 2, 3, 4, true, false});
+	EXPECT_NE((*snapshot.mSegments)[1], (*store.mSegments)[1]);
+	EXPECT_EQ((*snapshot.mSegments)[0], (*store.mSegments)[0]);
+	EXPECT_EQ(snapshot.Back(), (HealEvent{1, 2, 3, 4, true, false}));
+	EXPECT_EQ(ToVector(store), expected);
+
+	// Clearing the original doesn't reuse segments that the snapshot still uses
+	HealEventStore emptySnapshot;
+	store.Clear();
+	emptySnapshot = store;
+	store.Add(HealEvent{5, 6, 7, 8, false, true});
+	EXPECT_EQ(snapshot[0], expected[0]);
+	EXPECT_EQ(emptySnapshot.Size(), 0U);
+	EXPECT_EQ(ToVector(store), std::vector<HealEvent>({HealEvent{5, 6, 7, 8, false, true}}));
+}
@@ -11,9 +11,15 @@
 #include "Log.h"
 #include "Options.h"
 #include "../networking/Client.h"
+#include "../networking/EventCodec.h"
 #include "../networking/Server.h"
 
 #include <ArcdpsMock/arcdps_mock/CombatMock.h>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <random>
 #include <utility>
 
 namespace
@@ -144,6 +150,19 @@ void FillRandomData(void* pBuffer, size_t pBufferSize)
 		static_cast<char*>(pBuffer)[i] = rand() % 256;
 	}
 }
+
+// A healing event that only has the fields that HealingEvent carries set, so it survives being sent in that format
+cbtevent MakeHealingEvent(uint64_t pTime, uint16_t pSourceInstanceId, uint16_t pDestinationInstanceId, int32_t pValue)
+{
+	cbtevent event{};
+	event.time = pTime;
+	event.src_instid = pSourceInstanceId;
+	event.dst_instid = pDestinationInstanceId;
+	event.skillid = 1234;
+	event.value = pValue;
+	event.result = CBTR_STRIKE_DAMAGECRIT;
+	return event;
+}
 } // anonymous namespace
 
 bool operator==(const cbtevent& pLeft, const cbtevent& pRight)
@@ -162,7 +181,7 @@ protected:
 		grpc::SslServerCredentialsOptions server_credentials_options;
 		server_credentials_options.pem_root_certs = UNIT_TEST_CA;
 		server_credentials_options.pem_key_cert_pairs.push_back(UNIT_TEST_CERT_PAIR);
-		Server = std::make_unique<evtc_rpc_server>("localhost:50051", "localhost:50052", &server_credentials_options);
+		Server = std::make_unique<evtc_rpc_server>("localhost:50051", "localhost:50052", &server_credentials_options, mCompletionQueueCount);
 		mServerThread = std::make_unique<std::thread>(evtc_rpc_server::ThreadStartServe, Server.get());
 	}
 
@@ -184,11 +203,23 @@ protected:
 	{
 		std::unique_ptr<evtc_rpc_client> Client;
 		std::vector<cbtevent> ReceivedEvents;
+		std::mutex ReceivedEventsLock;
+		std::condition_variable ReceivedEventsCondition;
 
 		evtc_rpc_client* operator->()
 		{
 			return Client.get();
 		}
+
+		// Returns false if fewer than pCount events were received within pTimeout
+		bool WaitForReceivedEvents(size_t pCount, std::chrono::milliseconds pTimeout = std::chrono::seconds{2})
+		{
+			std::unique_lock lock(ReceivedEventsLock);
+			return ReceivedEventsCondition.wait_for(lock, pTimeout, [this, pCount]()
+				{
+					return ReceivedEvents.size() >= pCount;
+				});
+		}
 	};
 
 	void FlushEvents()
@@ -204,7 +235,11 @@ protected:
 		std::unique_ptr<ClientInstance>& newClient = mClients.emplace_back(std::make_unique<ClientInstance>());
 		auto eventhandler = [client = newClient.get()](cbtevent* pEvent, uint16_t /*pInstanceId*/)
 			{
-				client->ReceivedEvents.push_back(*pEvent);
+				{
+					std::lock_guard lock(client->ReceivedEventsLock);
+					client->ReceivedEvents.push_back(*pEvent);
+				}
+				client->ReceivedEventsCondition.notify_all();
 			};
 		auto getEndpoint = []() -> std::string
 			{
@@ -229,11 +264,23 @@ private:
 public:
 	std::unique_ptr<evtc_rpc_server> Server;
 
+protected:
+	size_t mCompletionQueueCount = 1;
+
 private:
 	std::unique_ptr<std::thread> mServerThread;
 	std::vector<std::thread> mClientThreads;
 };
 
+class MultiQueueNetworkTestFixture : public SimpleNetworkTestFixture
+{
+protected:
+	MultiQueueNetworkTestFixture()
+	{
+		mCompletionQueueCount = 4;
+	}
+};
+
 // Parameters are <register before disabling>
 class DisableClientTestFixture : public SimpleNetworkTestFixture, public testing::WithParamInterface<bool>
 {
@@ -278,7 +325,7 @@ protected:
 		grpc::SslServerCredentialsOptions server_credentials_options;
 		server_credentials_options.pem_root_certs = UNIT_TEST_CA;
 		server_credentials_options.pem_key_cert_pairs.push_back(UNIT_TEST_CERT_PAIR);
-		Server = std::make_unique<evtc_rpc_server>("localhost:50051", "localhost:50052", &server_credentials_options);
+		Server = std::make_unique<evtc_rpc_server>("localhost:50051", "localhost:50052", &server_credentials_options, mCompletionQueueCount);
 
 		auto eventhandler = [](cbtevent* /*pEvent*/, uint16_t /*pInstanceId*/)
 		{
@@ -360,11 +407,10 @@ protected:
 		while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(200))
 		{
 			{
-				std::lock_guard lock(Server->mRegisteredAgentsLock);
-				if (Server->mRegisteredAgents.size() >= 1)
+				if (Server->GetRegisteredAgentCount() >= 1)
 				{
-					auto iter = Server->mRegisteredAgents.find(":FakePeer.1234");
-					if (iter != Server->mRegisteredAgents.end())
+					auto agent = Server->FindRegisteredAgent(":FakePeer.1234");
+					if (agent != nullptr)
 					{
 						completed = true;
 						break;
@@ -419,9 +465,9 @@ protected:
 
 				ASSERT_NE(localState, peerState);
 				ASSERT_EQ(states.size(), 2U);
-				if (localState->Events.size() == peerState->Events.size() && localState->LastDamageEvent == peerState->LastDamageEvent)
+				if (localState->Events.Size() == peerState->Events.Size() && localState->LastDamageEvent == peerState->LastDamageEvent)
 				{
-					for (size_t i = 0; i < localState->Events.size(); i++)
+					for (size_t i = 0; i < localState->Events.Size(); i++)
 					{
 						if (localState->Events[i] != peerState->Events[i])
 						{
@@ -449,7 +495,7 @@ protected:
 				"EventCount: local {} peer {} - "
 				"ExitedCombatTime: local {} peer {} - "
 				"LastDamageEvent: local {} peer {}",
-				localState->Events.size(), peerState->Events.size(),
+				localState->Events.Size(), peerState->Events.Size(),
 				localState->ExitedCombatTime, peerState->ExitedCombatTime,
 				localState->LastDamageEvent, peerState->LastDamageEvent);
 			GTEST_FAIL();
@@ -500,11 +546,10 @@ TEST_F(SimpleNetworkTestFixture, RegisterSelf)
 		while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(1000))
 		{
 			{
-				std::lock_guard lock(Server->mRegisteredAgentsLock);
-				if (Server->mRegisteredAgents.size() >= 1)
+				if (Server->GetRegisteredAgentCount() >= 1)
 				{
-					auto iter = Server->mRegisteredAgents.find("testagent.1234");
-					if (iter != Server->mRegisteredAgents.end() && iter->second->InstanceId == instid)
+					auto agent = Server->FindRegisteredAgent("testagent.1234");
+					if (agent != nullptr && agent->InstanceId.load() == instid)
 					{
 						completed = true;
 						break;
@@ -516,15 +561,13 @@ TEST_F(SimpleNetworkTestFixture, RegisterSelf)
 		}
 		EXPECT_TRUE(completed);
 		{
-			std::lock_guard lock(Server->mRegisteredAgentsLock);
-
-			EXPECT_EQ(Server->mRegisteredAgents.size(), 1U);
-			auto iter = Server->mRegisteredAgents.find("testagent.1234");
-			ASSERT_NE(iter, Server->mRegisteredAgents.end());
-			EXPECT_EQ(iter->first, "testagent.1234");
-			EXPECT_EQ(iter->second->Iterator, iter);
-			EXPECT_EQ(iter->second->InstanceId, instid);
-			EXPECT_EQ(iter->second->Peers.size(), 0);
+			EXPECT_EQ(Server->GetRegisteredAgentCount(), 1U);
+			auto agent = Server->FindRegisteredAgent("testagent.1234");
+			ASSERT_NE(agent, nullptr);
+			EXPECT_EQ(Server->mAccountNames.GetName(agent->Account), "testagent.1234");
+			EXPECT_EQ(Server->FindRegisteredAgent(agent->Account.load()), agent);
+			EXPECT_EQ(agent->InstanceId.load(), instid);
+			EXPECT_EQ(Server->GetPeers(*agent).size(), 0);
 		}
 	}
 }
@@ -553,11 +596,10 @@ TEST_F(SimpleNetworkTestFixture, RegisterSelfDuplicate)
 		while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(1000))
 		{
 			{
-				std::lock_guard lock(Server->mRegisteredAgentsLock);
-				if (Server->mRegisteredAgents.size() >= 1)
+				if (Server->GetRegisteredAgentCount() >= 1)
 				{
-					auto iter = Server->mRegisteredAgents.find("testagent.1234");
-					if (iter != Server->mRegisteredAgents.end() && iter->second->InstanceId == 13)
+					auto agent = Server->FindRegisteredAgent("testagent.1234");
+					if (agent != nullptr && agent->InstanceId.load() == 13)
 					{
 						completed = true;
 						break;
@@ -601,15 +643,13 @@ TEST_F(SimpleNetworkTestFixture, RegisterSelfDuplicate)
 		EXPECT_LE(status.ConnectTime, beforeConflictingEvent);
 	}
 	{
-		std::lock_guard lock(Server->mRegisteredAgentsLock);
-
-		EXPECT_EQ(Server->mRegisteredAgents.size(), 1U);
-		auto iter = Server->mRegisteredAgents.find("testagent.1234");
-		ASSERT_NE(iter, Server->mRegisteredAgents.end());
-		EXPECT_EQ(iter->first, "testagent.1234");
-		EXPECT_EQ(iter->second->Iterator, iter);
-		EXPECT_EQ(iter->second->InstanceId, 13);
-		EXPECT_EQ(iter->second->Peers.size(), 0);
+		EXPECT_EQ(Server->GetRegisteredAgentCount(), 1U);
+		auto agent = Server->FindRegisteredAgent("testagent.1234");
+		ASSERT_NE(agent, nullptr);
+		EXPECT_EQ(Server->mAccountNames.GetName(agent->Account), "testagent.1234");
+		EXPECT_EQ(Server->FindRegisteredAgent(agent->Account.load()), agent);
+		EXPECT_EQ(agent->InstanceId.load(), 13);
+		EXPECT_EQ(Server->GetPeers(*agent).size(), 0);
 	}
 }
 
@@ -638,11 +678,10 @@ TEST_F(SimpleNetworkTestFixture, RegisterSelfDuplicateTimeout)
 		while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(1000))
 		{
 			{
-				std::lock_guard lock(Server->mRegisteredAgentsLock);
-				if (Server->mRegisteredAgents.size() >= 1)
+				if (Server->GetRegisteredAgentCount() >= 1)
 				{
-					auto iter = Server->mRegisteredAgents.find("testagent.1234");
-					if (iter != Server->mRegisteredAgents.end() && iter->second->InstanceId == 13)
+					auto agent = Server->FindRegisteredAgent("testagent.1234");
+					if (agent != nullptr && agent->InstanceId.load() == 13)
 					{
 						completed = true;
 						break;
@@ -689,15 +728,13 @@ TEST_F(SimpleNetworkTestFixture, RegisterSelfDuplicateTimeout)
 		EXPECT_LE(status.ConnectTime, beforeConflictingEvent);
 	}
 	{
-		std::lock_guard lock(Server->mRegisteredAgentsLock);
-
-		EXPECT_EQ(Server->mRegisteredAgents.size(), 1U);
-		auto iter = Server->mRegisteredAgents.find("testagent.1234");
-		ASSERT_NE(iter, Server->mRegisteredAgents.end());
-		EXPECT_EQ(iter->first, "testagent.1234");
-		EXPECT_EQ(iter->second->Iterator, iter);
-		EXPECT_EQ(iter->second->InstanceId, 13);
-		EXPECT_EQ(iter->second->Peers.size(), 0);
+		EXPECT_EQ(Server->GetRegisteredAgentCount(), 1U);
+		auto agent = Server->FindRegisteredAgent("testagent.1234");
+		ASSERT_NE(agent, nullptr);
+		EXPECT_EQ(Server->mAccountNames.GetName(agent->Account), "testagent.1234");
+		EXPECT_EQ(Server->FindRegisteredAgent(agent->Account.load()), agent);
+		EXPECT_EQ(agent->InstanceId.load(), 13);
+		EXPECT_EQ(Server->GetPeers(*agent).size(), 0);
 	}
 }
 
@@ -728,11 +765,10 @@ TEST_F(SimpleNetworkTestFixture, RegisterPeer)
 	while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
 	{
 		{
-			std::lock_guard lock(Server->mRegisteredAgentsLock);
-			auto iter = Server->mRegisteredAgents.find("testagent.1234");
-			if (iter != Server->mRegisteredAgents.end())
+			auto agent = Server->FindRegisteredAgent("testagent.1234");
+			if (agent != nullptr)
 			{
-				if (iter->second->Peers.size() > 0)
+				if (Server->GetPeers(*agent).size() > 0)
 				{
 					completed = true;
 					break;
@@ -744,17 +780,15 @@ TEST_F(SimpleNetworkTestFixture, RegisterPeer)
 	}
 	ASSERT_TRUE(completed);
 	{
-		std::lock_guard lock(Server->mRegisteredAgentsLock);
-
-		EXPECT_EQ(Server->mRegisteredAgents.size(), 1);
-		auto iter = Server->mRegisteredAgents.find("testagent.1234");
-		ASSERT_NE(iter, Server->mRegisteredAgents.end());
-		EXPECT_EQ(iter->first, "testagent.1234");
-		EXPECT_EQ(iter->second->Iterator, iter);
-		EXPECT_EQ(iter->second->InstanceId, 10);
+		EXPECT_EQ(Server->GetRegisteredAgentCount(), 1);
+		auto agent = Server->FindRegisteredAgent("testagent.1234");
+		ASSERT_NE(agent, nullptr);
+		EXPECT_EQ(Server->mAccountNames.GetName(agent->Account), "testagent.1234");
+		EXPECT_EQ(Server->FindRegisteredAgent(agent->Account.load()), agent);
+		EXPECT_EQ(agent->InstanceId.load(), 10);
 
 		auto expected_map = std::map<std::string, uint16_t>({{"testagent2.1234", static_cast<uint16_t>(11)}});
-		EXPECT_EQ(iter->second->Peers, expected_map);
+		EXPECT_EQ(Server->GetPeers(*agent), expected_map);
 	}
 
 	// Deregister the non-self agent
@@ -771,11 +805,10 @@ TEST_F(SimpleNetworkTestFixture, RegisterPeer)
 	while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
 	{
 		{
-			std::lock_guard lock(Server->mRegisteredAgentsLock);
-			auto iter = Server->mRegisteredAgents.find("testagent.1234");
-			if (iter != Server->mRegisteredAgents.end())
+			auto agent = Server->FindRegisteredAgent("testagent.1234");
+			if (agent != nullptr)
 			{
-				if (iter->second->Peers.size() == 0)
+				if (Server->GetPeers(*agent).size() == 0)
 				{
 					completed = true;
 					break;
@@ -787,26 +820,46 @@ TEST_F(SimpleNetworkTestFixture, RegisterPeer)
 	}
 	ASSERT_TRUE(completed);
 	{
-		std::lock_guard lock(Server->mRegisteredAgentsLock);
-
-		EXPECT_EQ(Server->mRegisteredAgents.size(), 1);
-		auto iter = Server->mRegisteredAgents.find("testagent.1234");
-		ASSERT_NE(iter, Server->mRegisteredAgents.end());
-		EXPECT_EQ(iter->first, "testagent.1234");
-		EXPECT_EQ(iter->second->Iterator, iter);
-		EXPECT_EQ(iter->second->InstanceId, 10);
+		EXPECT_EQ(Server->GetRegisteredAgentCount(), 1);
+		auto agent = Server->FindRegisteredAgent("testagent.1234");
+		ASSERT_NE(agent, nullptr);
+		EXPECT_EQ(Server->mAccountNames.GetName(agent->Account), "testagent.1234");
+		EXPECT_EQ(Server->FindRegisteredAgent(agent->Account.load()), agent);
+		EXPECT_EQ(agent->InstanceId.load(), 10);
 
 		auto expected_map = std::map<std::string, uint16_t>({});
-		EXPECT_EQ(iter->second->Peers, expected_map);
+		EXPECT_EQ(Server->GetPeers(*agent), expected_map);
 	}
 }
 
-TEST_F(SimpleNetworkTestFixture, CombatEvent)
+TEST_F(SimpleNetworkTestFixture, RoutesFollowRegistration)
 {
 	ClientInstance& client1 = NewClient();
+	ClientInstance& client2 = NewClient();
+
+	auto getRoutes = [](auto& pClient)
+	{
+		std::lock_guard lock(pClient.RoutesLock);
+		return pClient.Routes;
+	};
+
+	// Waits until client1 has exactly pExpectedCount routes or the timeout passes
+	auto waitForRoutes = [this, &getRoutes](size_t pExpectedCount)
+	{
+		auto start = std::chrono::system_clock::now();
+		while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
+		{
+			auto agent = Server->FindRegisteredAgent("testagent.1234");
+			if (agent != nullptr && Server->GetPeers(*agent).size() > 0 && getRoutes(*agent).size() == pExpectedCount)
+			{
+				return true;
+			}
+
+			Sleep(1);
+		}
+		return false;
+	};
 
-	// Send a self agent registration event followed by a non-self agent registration event followed by a combat event
-	// This should not result in any events sent to peer
 	ag ag1{};
 	ag ag2{};
 	ag1.elite = 0;
@@ -821,95 +874,257 @@ TEST_F(SimpleNetworkTestFixture, CombatEvent)
 	ag2.name = "testagent2.1234";
 	client1->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
 
-	cbtevent ev;
-	FillRandomData(&ev, sizeof(ev));
-	client1->ProcessLocalEvent(&ev, nullptr, nullptr, nullptr, 0, 0);
+	// client2 registers with a different instance id than what client1 expects, so there should be no route
+	ag2.self = 1;
+	ag2.id = 12;
+	ag2.name = "testagent2.1234";
+	client2->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
 
 	FlushEvents();
-
 	auto start = std::chrono::system_clock::now();
-	bool completed = false;
-	while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
+	while (Server->GetRegisteredAgentCount() < 2 && (std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
 	{
-		{
-			std::lock_guard lock(Server->mRegisteredAgentsLock);
-			auto iter = Server->mRegisteredAgents.find("testagent.1234");
-			if (iter != Server->mRegisteredAgents.end())
-			{
-				if (iter->second->Peers.size() > 0)
-				{
-					completed = true;
-					break;
-				}
-			}
-		}
-
 		Sleep(1);
 	}
-	ASSERT_TRUE(completed);
-
-	// Start a new client that registers itself and the first client as a peer. Then resend the same event again.
-	// It should now be received
-	ClientInstance& client2 = NewClient();
+	ASSERT_EQ(Server->GetRegisteredAgentCount(), 2);
+	ASSERT_TRUE(waitForRoutes(0));
+	{
+		// client1 knows client2, which is registered (even though it's not routed to)
+		ServerStatisticsSample statistics = Server->GetStatistics();
+		EXPECT_EQ(statistics.RegisteredPlayers, 2);
+		EXPECT_EQ(statistics.KnownPeers, 1);
+		EXPECT_EQ(statistics.RegisteredPeers, 1);
+	}
 
-	ag2.self = 1;
+	// Fixing the instance id should add the route
 	ag2.id = 11;
-	ag2.name = "testagent2.1234";
 	client2->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+	FlushEvents();
+	ASSERT_TRUE(waitForRoutes(1));
+	{
+		auto agent1 = Server->FindRegisteredAgent("testagent.1234");
+		auto agent2 = Server->FindRegisteredAgent("testagent2.1234");
+		ASSERT_NE(agent1, nullptr);
+		ASSERT_NE(agent2, nullptr);
+
+		auto routes = getRoutes(*agent1);
+		ASSERT_EQ(routes.size(), 1);
+		EXPECT_EQ(routes[0].Peer, agent2->Account.load());
+		EXPECT_EQ(routes[0].Connection, agent2);
+		EXPECT_EQ(getRoutes(*agent2).size(), 0);
+	}
 
-	ag2.self = 0;
-	ag2.id = 10;
-	ag2.name = "testagent.1234";
-	client2->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+	// Disconnecting client2 should remove the route again
+	client2->SetEnabledStatus(false);
+	ASSERT_TRUE(waitForRoutes(0));
+	EXPECT_EQ(Server->GetRegisteredAgentCount(), 1);
 
-	FlushEvents();
+	ServerStatisticsSample statistics = Server->GetStatistics();
+	EXPECT_EQ(statistics.RegisteredPlayers, 1);
+	EXPECT_EQ(statistics.KnownPeers, 1);
+	EXPECT_EQ(statistics.RegisteredPeers, 0);
+	EXPECT_EQ(statistics.QueuedEvents, 0);
+}
 
-	start = std::chrono::system_clock::now();
-	completed = false;
-	while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
+TEST_F(SimpleNetworkTestFixture, QueueOverflowPolicies)
+{
+	using ConnectionContext = decltype(Server->FindRegisteredAgent(AccountId{}))::element_type;
+	using ForwardedEvents = std::remove_reference_t<decltype(std::declval<ConnectionContext>().QueuedEvents.Front())>;
+	constexpr size_t QUEUE_LIMIT = evtc_rpc::messages::MAX_COMBAT_EVENT_BATCH_SIZE;
+
+	// Single event with the value set to pValue so that entries can be told apart
+	auto makeEvent = [](int32_t pValue, bool pImportant)
 	{
+		evtc_rpc::messages::CombatEvent event{};
+		event.Event.value = pValue;
+		return ForwardedEvents{grpc::Slice{&event, sizeof(event)}, 1, pImportant};
+	};
+	auto frontValue = [](ConnectionContext& pPeer)
+	{
+		evtc_rpc::messages::CombatEvent event;
+		memcpy(&event, pPeer.QueuedEvents.Front().Events.begin(), sizeof(event));
+		return event.Event.value;
+	};
+
+	{
+		Server->SetQueueLimit(0, QueueOverflowPolicy::DropOldest); // Raised to QUEUE_LIMIT
+		ConnectionContext peer;
+		for (size_t i = 0; i < QUEUE_LIMIT; i++)
 		{
-			std::lock_guard lock(Server->mRegisteredAgentsLock);
-			auto iter = Server->mRegisteredAgents.find("testagent2.1234");
-			if (iter != Server->mRegisteredAgents.end())
-			{
-				if (iter->second->Peers.size() > 0)
-				{
-					completed = true;
-					break;
-				}
-			}
+			EXPECT_TRUE(Server->QueueEvents(peer, makeEvent(static_cast<int32_t>(i), true)));
 		}
+		EXPECT_EQ(peer.QueuedEventCount, QUEUE_LIMIT);
 
-		Sleep(1);
+		EXPECT_TRUE(Server->QueueEvents(peer, makeEvent(-1, false)));
+		EXPECT_EQ(peer.QueuedEventCount, QUEUE_LIMIT);
+		EXPECT_EQ(peer.QueuedEvents.Size(), QUEUE_LIMIT);
+		EXPECT_EQ(peer.DroppedEventCount, 1);
+		EXPECT_EQ(frontValue(peer), 1);
 	}
-	ASSERT_TRUE(completed);
 
-	client1->ProcessLocalEvent(&ev, nullptr, nullptr, nullptr, 0, 0);
+	{
+		// Session tokens are never dropped
+		Server->SetQueueLimit(QUEUE_LIMIT, QueueOverflowPolicy::DropOldest);
+		ConnectionContext peer;
+		evtc_rpc::messages::SessionToken token{};
+		peer.QueuedEvents.PushBack(ForwardedEvents{grpc::Slice{&token, sizeof(token)}, 0, true, evtc_rpc::messages::Type::SessionToken});
+		for (size_t i = 0; i < QUEUE_LIMIT; i++)
+		{
+			EXPECT_TRUE(Server->QueueEvents(peer, makeEvent(static_cast<int32_t>(i), true)));
+		}
 
-	FlushEvents();
+		EXPECT_TRUE(Server->QueueEvents(peer, makeEvent(-1, true)));
+		EXPECT_EQ(peer.QueuedEventCount, QUEUE_LIMIT);
+		EXPECT_EQ(peer.QueuedEvents.Size(), QUEUE_LIMIT + 1);
+		EXPECT_EQ(peer.DroppedEventCount, 1);
+		EXPECT_EQ(peer.QueuedEvents.Front().Format, evtc_rpc::messages::Type::SessionToken);
+		peer.QueuedEvents.PopFront();
+		EXPECT_EQ(frontValue(peer), 1);
+	}
 
-	Sleep(100); // TODO: get rid of this ugly sleep
+	{
+		Server->SetQueueLimit(QUEUE_LIMIT, QueueOverflowPolicy::DropNonHealing);
+		ConnectionContext peer;
+		for (size_t i = 0; i < QUEUE_LIMIT; i++)
+		{
+			// Only the event at index 1 is unimportant
+			EXPECT_TRUE(Server->QueueEvents(peer, makeEvent(static_cast<int32_t>(i), i != 1)));
+		}
 
-	std::vector<cbtevent> expectedEvents{ev};
-	EXPECT_EQ(client2.ReceivedEvents, expectedEvents);
+		// The unimportant event is dropped first
+		EXPECT_TRUE(Server->QueueEvents(peer, makeEvent(-1, true)));
+		EXPECT_EQ(peer.QueuedEventCount, QUEUE_LIMIT);
+		EXPECT_EQ(peer.DroppedEventCount, 1);
+		EXPECT_EQ(frontValue(peer), 0);
+		peer.QueuedEvents.PopFront();
+		peer.QueuedEventCount -= 1;
+		EXPECT_EQ(frontValue(peer), 2);
+
+		// Everything queued is important now, so new unimportant events are dropped
+		EXPECT_TRUE(Server->QueueEvents(peer, makeEvent(0, true)));
+		EXPECT_TRUE(Server->QueueEvents(peer, makeEvent(-2, false)));
+		EXPECT_EQ(peer.DroppedEventCount, 2);
+		EXPECT_EQ(frontValue(peer), 2);
+
+		// And important events fall back to dropping the oldest
+		EXPECT_TRUE(Server->QueueEvents(peer, makeEvent(-3, true)));
+		EXPECT_EQ(peer.DroppedEventCount, 3);
+		EXPECT_EQ(frontValue(peer), 3);
+		EXPECT_EQ(peer.QueuedEvents.Size(), QUEUE_LIMIT);
+	}
+
+	{
+		Server->SetQueueLimit(QUEUE_LIMIT, QueueOverflowPolicy::Disconnect);
+		ConnectionContext peer;
+		for (size_t i = 0; i < QUEUE_LIMIT; i++)
+		{
+			EXPECT_TRUE(Server->QueueEvents(peer, makeEvent(static_cast<int32_t>(i), true)));
+		}
+
+		EXPECT_FALSE(Server->QueueEvents(peer, makeEvent(-1, true)));
+		EXPECT_EQ(peer.QueuedEventCount, 0);
+		EXPECT_EQ(peer.QueuedEvents.Size(), 0);
+		EXPECT_EQ(peer.DroppedEventCount, QUEUE_LIMIT + 1);
+	}
 }
 
+TEST_F(SimpleNetworkTestFixture, RateLimit)
+{
+	using ConnectionContext = decltype(Server->FindRegisteredAgent(AccountId{}))::element_type;
+	constexpr uint16_t BURST = evtc_rpc::messages::MAX_COMBAT_EVENT_BATCH_SIZE;
+
+	ConnectionContext client;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
 
-TEST_P(DisableClientTestFixture, DisableClient)
+	// Unlimited by default
+	for (size_t i = 0; i < 10; i++)
+	{
+		EXPECT_TRUE(Server->ConsumeRateLimitTokens(client, BURST, now));
+	}
+
+	Server->SetRateLimit(100.0, 0); // Burst is raised to BURST
+
+	// The bucket starts out full
+	EXPECT_TRUE(Server->ConsumeRateLimitTokens(client, BURST - 1, now));
+	EXPECT_TRUE(Server->ConsumeRateLimitTokens(client, 1, now));
+	EXPECT_FALSE(Server->ConsumeRateLimitTokens(client, 1, now));
+
+	// 100 events per second refill 5 tokens in 50ms. A message that doesn't fit takes nothing
+	now += std::chrono::milliseconds(50);
+	EXPECT_FALSE(Server->ConsumeRateLimitTokens(client, 6, now));
+	EXPECT_TRUE(Server->ConsumeRateLimitTokens(client, 5, now));
+	EXPECT_FALSE(Server->ConsumeRateLimitTokens(client, 1, now));
+
+	// The bucket never holds more than the burst size
+	now += std::chrono::hours(1);
+	EXPECT_TRUE(Server->ConsumeRateLimitTokens(client, BURST, now));
+	EXPECT_FALSE(Server->ConsumeRateLimitTokens(client, 1, now));
+
+	Server->SetRateLimit(0.0, 0);
+	EXPECT_TRUE(Server->ConsumeRateLimitTokens(client, BURST, now));
+}
+
+TEST_F(SimpleNetworkTestFixture, MaxConnections)
 {
+	Server->SetMaxConnections(1);
+
+	// The clients only connect once they have something to send
+	ag ag1{};
+	ag ag2{};
+	ag1.elite = 0;
+	ag1.prof = static_cast<Prof>(1);
+	ag2.self = 1;
+	ag2.id = 10;
+	ag2.name = "testagent.1234";
+
 	ClientInstance& client1 = NewClient();
+	client1->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+	FlushEvents();
 
-	if (GetParam() == true)
+	auto start = std::chrono::system_clock::now();
+	while (Server->GetRegisteredAgentCount() < 1 && (std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
 	{
-		LogD("RegisterBeforeDisabling is true, sending events");
+		Sleep(1);
 	}
-	else
+	ASSERT_EQ(Server->GetRegisteredAgentCount(), 1);
+
+	ag2.id = 11;
+	ag2.name = "testagent2.1234";
+	ClientInstance& client2 = NewClient();
+	client2->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+	FlushEvents();
+
+	start = std::chrono::system_clock::now();
+	while (Server->mStatistics->ConnectionsRejected->Value() < 1 && (std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
 	{
-		client1->SetEnabledStatus(false);
+		Sleep(1);
 	}
+	EXPECT_GE(Server->mStatistics->ConnectionsRejected->Value(), 1);
+	EXPECT_EQ(Server->GetRegisteredAgentCount(), 1);
+	EXPECT_EQ(Server->GetStatistics().Connections, 1);
+
+	// The slot is freed once the first client disconnects
+	client1->SetEnabledStatus(false);
+	start = std::chrono::system_clock::now();
+	while (Server->GetRegisteredAgentCount() < 1 || Server->FindRegisteredAgent("testagent2.1234") == nullptr)
+	{
+		if ((std::chrono::system_clock::now() - start) > std::chrono::seconds(10))
+		{
+			break;
+		}
+		Sleep(10);
+	}
+	EXPECT_NE(Server->FindRegisteredAgent("testagent2.1234"), nullptr);
+	EXPECT_EQ(Server->GetStatistics().Connections, 1);
+}
+
+TEST_F(SimpleNetworkTestFixture, DrainOnShutdown)
+{
+	Server->SetDrainTimeout(std::chrono::seconds{10});
+
+	ClientInstance& client1 = NewClient();
+	ClientInstance& client2 = NewClient();
 
-	// Send a self agent registration event followed by a non-self agent registration event followed by a combat event
 	ag ag1{};
 	ag ag2{};
 	ag1.elite = 0;
@@ -918,97 +1133,1003 @@ TEST_P(DisableClientTestFixture, DisableClient)
 	ag2.id = 10;
 	ag2.name = "testagent.1234";
 	client1->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
-
 	ag2.self = 0;
 	ag2.id = 11;
 	ag2.name = "testagent2.1234";
 	client1->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
 
-	cbtevent ev;
-	FillRandomData(&ev, sizeof(ev));
-	client1->ProcessLocalEvent(&ev, nullptr, nullptr, nullptr, 0, 0);
+	ag2.self = 1;
+	client2->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
 
-	if (GetParam() == true)
+	FlushEvents();
+
+	auto start = std::chrono::system_clock::now();
+	while ((Server->GetRegisteredAgentCount() < 2 || Server->GetStatistics().RegisteredPeers < 1) && (std::chrono::system_clock::now() - start) < std::chrono::seconds(1))
 	{
-		FlushEvents();
+		Sleep(1);
+	}
+	ASSERT_EQ(Server->GetRegisteredAgentCount(), 2);
 
-		std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
-		bool completed = false;
-		while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
-		{
-			{
-				std::lock_guard lock(Server->mRegisteredAgentsLock);
-				auto iter = Server->mRegisteredAgents.find("testagent.1234");
-				if (iter != Server->mRegisteredAgents.end())
-				{
-					if (iter->second->Peers.size() > 0)
-					{
-						completed = true;
-						break;
-					}
-				}
-			}
+	std::vector<cbtevent> expectedEvents;
+	for (uint64_t i = 0; i < 100; i++)
+	{
+		expectedEvents.push_back(MakeHealingEvent(1000 + i, 10, 11, 500));
+		client1->ProcessLocalEvent(&expectedEvents.back(), nullptr, nullptr, nullptr, 0, 0);
+	}
+	FlushEvents();
+	Sleep(100);
 
-			Sleep(1);
-		}
-		ASSERT_TRUE(completed);
+	// Both clients are finished once they have nothing left to receive, long before the drain timeout
+	Server->Shutdown();
+	start = std::chrono::system_clock::now();
+	while (Server->GetRegisteredAgentCount() > 0 && (std::chrono::system_clock::now() - start) < std::chrono::seconds(2))
+	{
+		Sleep(1);
+	}
+	EXPECT_EQ(Server->GetRegisteredAgentCount(), 0);
+	EXPECT_EQ(Server->mStatistics->ShutdownEventsDropped->Value(), 0);
+	EXPECT_EQ(client2.ReceivedEvents, expectedEvents);
+}
 
-		LogD("Waiting for client to be registered took {}ms", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start).count());
+TEST_F(SimpleNetworkTestFixture, DrainWhileSending)
+{
+	Server->SetDrainTimeout(std::chrono::seconds{10});
 
-		client1->SetEnabledStatus(false);
-	}
+	ClientInstance& client1 = NewClient();
+	ClientInstance& client2 = NewClient();
 
-	Sleep(200);
+	ag ag1{};
+	ag ag2{};
+	ag1.elite = 0;
+	ag1.prof = static_cast<Prof>(1);
+	ag2.self = 1;
+	ag2.id = 10;
+	ag2.name = "testagent.1234";
+	client1->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+	ag2.self = 0;
+	ag2.id = 11;
+	ag2.name = "testagent2.1234";
+	client1->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	ag2.self = 1;
+	ag2.id = 11;
+	ag2.name = "testagent2.1234";
+	client2->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+	ag2.self = 0;
+	ag2.id = 10;
+	ag2.name = "testagent.1234";
+	client2->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	FlushEvents();
 
+	auto start = std::chrono::system_clock::now();
+	while ((Server->GetRegisteredAgentCount() < 2 || Server->GetStatistics().RegisteredPeers < 2) && (std::chrono::system_clock::now() - start) < std::chrono::seconds(1))
 	{
-		std::lock_guard lock(Server->mRegisteredAgentsLock);
-		EXPECT_EQ(Server->mRegisteredAgents.size(), 0);
+		Sleep(1);
 	}
+	ASSERT_EQ(Server->GetRegisteredAgentCount(), 2);
 
-	// Not thread safe, but shouldn't be an issue because nothing else should be writing when the client is disabled
-	client1->mLastConnectionAttempt = std::chrono::steady_clock::time_point(std::chrono::seconds(0));
-	// Now enable the client - the peer should be registered again
-	client1->SetEnabledStatus(true);
-
-	std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
-	bool completed = false;
-	while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
+	// Both clients keep sending to each other throughout the drain, their queues would keep refilling if the server kept
+	// forwarding them
+	struct Sender
+	{
+		std::vector<cbtevent> SentEvents;
+		std::atomic_size_t SentCount = 0; // Counted before the event is handed to the client
+	};
+	std::atomic_bool stopSending = false;
+	auto sendEvents = [&stopSending](ClientInstance& pClient, Sender& pSender, uint16_t pSourceId, uint16_t pDestinationId)
 	{
+		for (uint64_t i = 0; stopSending.load() == false; i++)
 		{
-			std::lock_guard lock(Server->mRegisteredAgentsLock);
-			auto iter = Server->mRegisteredAgents.find("testagent.1234");
-			if (iter != Server->mRegisteredAgents.end())
+			pSender.SentEvents.push_back(MakeHealingEvent(1000 + i, pSourceId, pDestinationId, 500));
+			pSender.SentCount.fetch_add(1);
+			pClient->ProcessLocalEvent(&pSender.SentEvents.back(), nullptr, nullptr, nullptr, 0, 0);
+			if (i % 100 == 0)
 			{
-				if (iter->second->Peers.size() > 0)
-				{
-					completed = true;
-					break;
-				}
+				Sleep(1);
 			}
 		}
+	};
+	Sender sender1;
+	Sender sender2;
+	std::thread senderThread1{sendEvents, std::ref(client1), std::ref(sender1), uint16_t{10}, uint16_t{11}};
+	std::thread senderThread2{sendEvents, std::ref(client2), std::ref(sender2), uint16_t{11}, uint16_t{10}};
 
-		Sleep(1);
-	}
+	Sleep(100);
+	Server->Shutdown();
+	size_t sentBeforeShutdown1 = sender1.SentCount.load();
+	size_t sentBeforeShutdown2 = sender2.SentCount.load();
 
-	EXPECT_TRUE(completed);
+	start = std::chrono::system_clock::now();
+	while (Server->GetRegisteredAgentCount() > 0 && (std::chrono::system_clock::now() - start) < std::chrono::seconds(2))
 	{
-		std::lock_guard lock(Server->mRegisteredAgentsLock);
-
-		EXPECT_EQ(Server->mRegisteredAgents.size(), 1U);
-		auto iter = Server->mRegisteredAgents.find("testagent.1234");
-		ASSERT_NE(iter, Server->mRegisteredAgents.end());
-		EXPECT_EQ(iter->first, "testagent.1234");
-		EXPECT_EQ(iter->second->Iterator, iter);
-		EXPECT_EQ(iter->second->InstanceId, 10);
-
-		auto expected_map = std::map<std::string, uint16_t>({ {"testagent2.1234", static_cast<uint16_t>(11)} });
-		EXPECT_EQ(iter->second->Peers, expected_map);
+		Sleep(1);
 	}
+	Sleep(20);
+	stopSending.store(true);
+	senderThread1.join();
+	senderThread2.join();
+
+	// Finished long before the drain timeout. Events sent after the drain started are dropped, what was received is an
+	// uninterrupted prefix of what was sent before that
+	EXPECT_EQ(Server->GetRegisteredAgentCount(), 0);
+	EXPECT_GT(sender1.SentEvents.size(), sentBeforeShutdown1);
+	EXPECT_GT(sender2.SentEvents.size(), sentBeforeShutdown2);
+	ASSERT_GT(client2.ReceivedEvents.size(), 0U);
+	ASSERT_LE(client2.ReceivedEvents.size(), sentBeforeShutdown1);
+	EXPECT_EQ(client2.ReceivedEvents, std::vector<cbtevent>(sender1.SentEvents.begin(), sender1.SentEvents.begin() + client2.ReceivedEvents.size()));
+	ASSERT_GT(client1.ReceivedEvents.size(), 0U);
+	ASSERT_LE(client1.ReceivedEvents.size(), sentBeforeShutdown2);
+	EXPECT_EQ(client1.ReceivedEvents, std::vector<cbtevent>(sender2.SentEvents.begin(), sender2.SentEvents.begin() + client1.ReceivedEvents.size()));
 }
 
-INSTANTIATE_TEST_SUITE_P(
-	Normal,
-	DisableClientTestFixture,
+TEST_F(SimpleNetworkTestFixture, SessionResume)
+{
+	Server->SetSessionResumeTimeout(std::chrono::seconds{10});
+	Server->SetMaxConnections(2); // The detached session doesn't count against the limit, so the resuming client fits
+
+	ClientInstance& client1 = NewClient();
+	ClientInstance& client2 = NewClient();
+
+	ag ag1{};
+	ag ag2{};
+	ag1.elite = 0;
+	ag1.prof = static_cast<Prof>(1);
+	ag2.self = 1;
+	ag2.id = 10;
+	ag2.name = "testagent.1234";
+	client1->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+	ag2.self = 0;
+	ag2.id = 11;
+	ag2.name = "testagent2.1234";
+	client1->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	ag2.self = 1;
+	client2->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	FlushEvents();
+
+	auto start = std::chrono::system_clock::now();
+	while (Server->GetStatistics().RegisteredPeers < 1 && (std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
+	{
+		Sleep(1);
+	}
+	ASSERT_EQ(Server->GetRegisteredAgentCount(), 2);
+	{
+		auto agent2 = Server->FindRegisteredAgent("testagent2.1234");
+		ASSERT_NE(agent2, nullptr);
+		EXPECT_NE(agent2->SessionToken.load(), 0);
+	}
+	// Give client2 the chance to receive its token
+	Sleep(100);
+
+	// Losing the connection keeps client2 registered, so events for it are queued. Disabling the client would end the
+	// session, so the call is cancelled directly instead
+	client2->mConnectionContext->ClientContext.TryCancel();
+	start = std::chrono::system_clock::now();
+	while (Server->mStatistics->SessionsDetached->Value() < 1 && (std::chrono::system_clock::now() - start) < std::chrono::seconds(2))
+	{
+		Sleep(1);
+	}
+	ASSERT_EQ(Server->mStatistics->SessionsDetached->Value(), 1);
+	EXPECT_EQ(Server->GetRegisteredAgentCount(), 2);
+	EXPECT_EQ(Server->GetStatistics().RegisteredPeers, 1);
+	EXPECT_EQ(Server->GetStatistics().Connections, 1);
+
+	std::vector<cbtevent> expectedEvents;
+	for (uint64_t i = 0; i < 100; i++)
+	{
+		expectedEvents.push_back(MakeHealingEvent(1000 + i, 10, 11, 500));
+		client1->ProcessLocalEvent(&expectedEvents.back(), nullptr, nullptr, nullptr, 0, 0);
+	}
+	FlushEvents();
+
+	start = std::chrono::system_clock::now();
+	while (Server->GetStatistics().QueuedEvents < expectedEvents.size() && (std::chrono::system_clock::now() - start) < std::chrono::seconds(2))
+	{
+		Sleep(1);
+	}
+	EXPECT_EQ(Server->GetStatistics().QueuedEvents, expectedEvents.size());
+	EXPECT_EQ(client2.ReceivedEvents.size(), 0);
+
+	// Reconnecting resumes the session and replays the queued events
+	client2->mNextConnectionAttempt = std::chrono::steady_clock::time_point{};
+	client2->WakeUp();
+	start = std::chrono::system_clock::now();
+	while ((Server->mStatistics->SessionsResumed->Value() < 1 || Server->GetStatistics().QueuedEvents > 0) &&
+		(std::chrono::system_clock::now() - start) < std::chrono::seconds(2))
+	{
+		Sleep(1);
+	}
+	Sleep(100);
+
+	EXPECT_EQ(Server->mStatistics->SessionsResumed->Value(), 1);
+	EXPECT_EQ(Server->mStatistics->SessionsExpired->Value(), 0);
+	EXPECT_EQ(Server->mStatistics->ConnectionsRejected->Value(), 0);
+	EXPECT_EQ(Server->GetRegisteredAgentCount(), 2);
+	EXPECT_EQ(Server->GetStatistics().RegisteredPeers, 1);
+	EXPECT_EQ(Server->GetStatistics().Connections, 2);
+	EXPECT_EQ(client2.ReceivedEvents, expectedEvents);
+}
+
+TEST_F(SimpleNetworkTestFixture, EndSession)
+{
+	Server->SetSessionResumeTimeout(std::chrono::seconds{10});
+
+	ClientInstance& client1 = NewClient();
+	ClientInstance& client2 = NewClient();
+
+	ag ag1{};
+	ag ag2{};
+	ag1.elite = 0;
+	ag1.prof = static_cast<Prof>(1);
+	ag2.self = 1;
+	ag2.id = 10;
+	ag2.name = "testagent.1234";
+	client1->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+	ag2.self = 0;
+	ag2.id = 11;
+	ag2.name = "testagent2.1234";
+	client1->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	ag2.self = 1;
+	client2->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	FlushEvents();
+
+	auto start = std::chrono::system_clock::now();
+	while ((Server->GetRegisteredAgentCount() < 2 || Server->GetStatistics().RegisteredPeers < 1) && (std::chrono::system_clock::now() - start) < std::chrono::seconds(1))
+	{
+		Sleep(1);
+	}
+	ASSERT_EQ(Server->GetRegisteredAgentCount(), 2);
+	// Give client2 the chance to receive its token
+	Sleep(100);
+
+	// Disabling the client ends the session instead of leaving it detached until it expires
+	client2->SetEnabledStatus(false);
+	start = std::chrono::system_clock::now();
+	while (Server->GetRegisteredAgentCount() > 1 && (std::chrono::system_clock::now() - start) < std::chrono::seconds(2))
+	{
+		Sleep(1);
+	}
+	EXPECT_EQ(Server->GetRegisteredAgentCount(), 1);
+	EXPECT_EQ(Server->FindRegisteredAgent("testagent2.1234"), nullptr);
+	EXPECT_EQ(Server->GetStatistics().RegisteredPeers, 0);
+	EXPECT_EQ(Server->mStatistics->SessionsDetached->Value(), 0);
+
+	// Enabling it again registers from scratch
+	client2->mNextConnectionAttempt = std::chrono::steady_clock::time_point{};
+	client2->SetEnabledStatus(true);
+	start = std::chrono::system_clock::now();
+	while (Server->GetRegisteredAgentCount() < 2 && (std::chrono::system_clock::now() - start) < std::chrono::seconds(2))
+	{
+		Sleep(1);
+	}
+	EXPECT_EQ(Server->GetRegisteredAgentCount(), 2);
+	EXPECT_EQ(Server->mStatistics->SessionsResumed->Value(), 0);
+	// Give client2 the chance to receive its new token
+	Sleep(100);
+
+	// Shutting the client down ends the session as well
+	client2->Shutdown();
+	start = std::chrono::system_clock::now();
+	while (Server->GetRegisteredAgentCount() > 1 && (std::chrono::system_clock::now() - start) < std::chrono::seconds(2))
+	{
+		Sleep(1);
+	}
+	EXPECT_EQ(Server->GetRegisteredAgentCount(), 1);
+	EXPECT_EQ(Server->FindRegisteredAgent("testagent2.1234"), nullptr);
+	EXPECT_EQ(Server->mStatistics->SessionsDetached->Value(), 0);
+}
+
+TEST_F(SimpleNetworkTestFixture, ReconnectDelay)
+{
+	ClientInstance& client = NewClient();
+
+	for (uint32_t attempts = 0; attempts < 40; attempts++)
+	{
+		std::chrono::milliseconds expected = std::min(std::chrono::milliseconds{1000 << std::min(attempts, 6U)}, std::chrono::milliseconds{60000});
+		for (size_t i = 0; i < 100; i++)
+		{
+			std::chrono::milliseconds delay = client->GetReconnectDelay(attempts);
+			EXPECT_GE(delay, expected / 2);
+			EXPECT_LE(delay, expected);
+		}
+	}
+}
+
+TEST_F(SimpleNetworkTestFixture, EncodeQueuedEvents)
+{
+	using namespace evtc_rpc::messages;
+	using ConnectionContext = decltype(Server->FindRegisteredAgent(AccountId{}))::element_type;
+	using ForwardedEvents = std::remove_reference_t<decltype(std::declval<ConnectionContext>().QueuedEvents.Front())>;
+	constexpr size_t ENTRY_COUNT = 100;
+	constexpr size_t EVENTS_PER_ENTRY = 20;
+
+	// Queues ENTRY_COUNT entries with EVENTS_PER_ENTRY events each, event values are increasing
+	auto fillQueue = [](ConnectionContext& pPeer)
+	{
+		for (size_t i = 0; i < ENTRY_COUNT; i++)
+		{
+			std::vector<CombatEvent> events(EVENTS_PER_ENTRY);
+			for (size_t j = 0; j < events.size(); j++)
+			{
+				events[j].Event.value = static_cast<int32_t>(i * EVENTS_PER_ENTRY + j);
+			}
+			pPeer.QueuedEvents.PushBack(ForwardedEvents{grpc::Slice{events.data(), events.size() * sizeof(CombatEvent)}, EVENTS_PER_ENTRY, false});
+			pPeer.QueuedEventCount += EVENTS_PER_ENTRY;
+		}
+	};
+
+	// Decodes pBuffer and checks that it contains the events with the values [pFirstValue, pFirstValue + result)
+	auto decode = [](grpc::ByteBuffer& pBuffer, uint32_t pExpectedVersion, int32_t pFirstValue) -> size_t
+	{
+		evtc_rpc::Message message;
+		EXPECT_TRUE(grpc::SerializationTraits<evtc_rpc::Message>::Deserialize(&pBuffer, &message).ok());
+		const std::string& blob = message.blob();
+
+		Header header;
+		memcpy(&header, blob.data(), sizeof(header));
+		EXPECT_EQ(header.MessageVersion, pExpectedVersion);
+
+		size_t offset = sizeof(header);
+		size_t eventCount = 1;
+		if (header.MessageType == Type::CombatEventBatch)
+		{
+			CombatEventBatch batch;
+			memcpy(&batch, blob.data() + offset, sizeof(batch));
+			offset += sizeof(batch);
+			eventCount = batch.EventCount;
+		}
+		else
+		{
+			EXPECT_EQ(header.MessageType, Type::CombatEvent);
+		}
+		EXPECT_EQ(blob.size(), offset + eventCount * sizeof(CombatEvent));
+
+		for (size_t i = 0; i < eventCount; i++)
+		{
+			CombatEvent event;
+			memcpy(&event, blob.data() + offset + i * sizeof(CombatEvent), sizeof(event));
+			EXPECT_EQ(event.Event.value, pFirstValue + static_cast<int32_t>(i));
+		}
+		return eventCount;
+	};
+
+	{
+		// Entries are coalesced up to the byte budget
+		Server->SetMaxWriteBytes(10 * EVENTS_PER_ENTRY * sizeof(CombatEvent));
+		ConnectionContext peer;
+		peer.MessageVersion = MESSAGE_VERSION_BATCH;
+		fillQueue(peer);
+
+		int32_t nextValue = 0;
+		size_t messageCount = 0;
+		while (peer.QueuedEvents.Size() > 0)
+		{
+			grpc::ByteBuffer buffer = Server->EncodeQueuedEvents(peer);
+			size_t eventCount = decode(buffer, MESSAGE_VERSION_BATCH, nextValue);
+			EXPECT_EQ(eventCount, 10 * EVENTS_PER_ENTRY);
+			nextValue += static_cast<int32_t>(eventCount);
+			messageCount++;
+		}
+		EXPECT_EQ(messageCount, ENTRY_COUNT / 10);
+		EXPECT_EQ(peer.QueuedEventCount, 0);
+	}
+
+	{
+		// Batches never exceed MAX_COMBAT_EVENT_BATCH_SIZE, and a budget smaller than one entry still sends the entry
+		ConnectionContext peer;
+		peer.MessageVersion = MESSAGE_VERSION_BATCH;
+		fillQueue(peer);
+
+		Server->SetMaxWriteBytes(SIZE_MAX);
+		grpc::ByteBuffer buffer = Server->EncodeQueuedEvents(peer);
+		EXPECT_EQ(decode(buffer, MESSAGE_VERSION_BATCH, 0), (MAX_COMBAT_EVENT_BATCH_SIZE / EVENTS_PER_ENTRY) * EVENTS_PER_ENTRY);
+
+		Server->SetMaxWriteBytes(1);
+		size_t sent = ENTRY_COUNT * EVENTS_PER_ENTRY - peer.QueuedEventCount;
+		buffer = Server->EncodeQueuedEvents(peer);
+		EXPECT_EQ(decode(buffer, MESSAGE_VERSION_BATCH, static_cast<int32_t>(sent)), EVENTS_PER_ENTRY);
+	}
+
+	{
+		// Legacy clients get one event per message
+		Server->SetMaxWriteBytes(SIZE_MAX);
+		ConnectionContext peer;
+		peer.MessageVersion = MESSAGE_VERSION_LEGACY;
+		for (int32_t i = 0; i < 3; i++)
+		{
+			CombatEvent event{};
+			event.Event.value = i;
+			peer.QueuedEvents.PushBack(ForwardedEvents{grpc::Slice{&event, sizeof(event)}, 1, false});
+			peer.QueuedEventCount += 1;
+		}
+
+		for (int32_t i = 0; i < 3; i++)
+		{
+			grpc::ByteBuffer buffer = Server->EncodeQueuedEvents(peer);
+			EXPECT_EQ(decode(buffer, MESSAGE_VERSION_LEGACY, i), 1);
+		}
+		EXPECT_EQ(peer.QueuedEvents.Size(), 0);
+	}
+}
+
+TEST_F(SimpleNetworkTestFixture, FlushEventsTimeout)
+{
+	ClientInstance& client1 = NewClient();
+
+	// Combat events are not sent until the client is registered, so flushing has to time out
+	cbtevent ev;
+	FillRandomData(&ev, sizeof(ev));
+	client1->ProcessLocalEvent(&ev, nullptr, nullptr, nullptr, 0, 0);
+	client1->ProcessLocalEvent(&ev, nullptr, nullptr, nullptr, 0, 0);
+
+	auto start = std::chrono::steady_clock::now();
+	EXPECT_FALSE(client1->FlushEvents(0, std::chrono::milliseconds(50)));
+	EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(50));
+	EXPECT_TRUE(client1->FlushEvents(2, std::chrono::milliseconds(0)));
+
+	// Once registered the events are sent and flushing completes
+	ag ag1{};
+	ag ag2{};
+	ag1.elite = 0;
+	ag1.prof = static_cast<Prof>(1);
+	ag2.self = 1;
+	ag2.id = 10;
+	ag2.name = "testagent.1234";
+	client1->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	EXPECT_TRUE(client1->FlushEvents(0, std::chrono::milliseconds(5000)));
+}
+
+TEST_F(SimpleNetworkTestFixture, CombatEvent)
+{
+	ClientInstance& client1 = NewClient();
+
+	// Send a self agent registration event followed by a non-self agent registration event followed by a combat event
+	// This should not result in any events sent to peer
+	ag ag1{};
+	ag ag2{};
+	ag1.elite = 0;
+	ag1.prof = static_cast<Prof>(1);
+	ag2.self = 1;
+	ag2.id = 10;
+	ag2.name = "testagent.1234";
+	client1->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	ag2.self = 0;
+	ag2.id = 11;
+	ag2.name = "testagent2.1234";
+	client1->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	cbtevent ev;
+	FillRandomData(&ev, sizeof(ev));
+	client1->ProcessLocalEvent(&ev, nullptr, nullptr, nullptr, 0, 0);
+
+	FlushEvents();
+
+	auto start = std::chrono::system_clock::now();
+	bool completed = false;
+	while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
+	{
+		{
+			auto agent = Server->FindRegisteredAgent("testagent.1234");
+			if (agent != nullptr)
+			{
+				if (Server->GetPeers(*agent).size() > 0)
+				{
+					completed = true;
+					break;
+				}
+			}
+		}
+
+		Sleep(1);
+	}
+	ASSERT_TRUE(completed);
+
+	// Start a new client that registers itself and the first client as a peer. Then resend the same event again.
+	// It should now be received
+	ClientInstance& client2 = NewClient();
+
+	ag2.self = 1;
+	ag2.id = 11;
+	ag2.name = "testagent2.1234";
+	client2->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	ag2.self = 0;
+	ag2.id = 10;
+	ag2.name = "testagent.1234";
+	client2->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	FlushEvents();
+
+	start = std::chrono::system_clock::now();
+	completed = false;
+	while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
+	{
+		{
+			auto agent = Server->FindRegisteredAgent("testagent2.1234");
+			if (agent != nullptr)
+			{
+				if (Server->GetPeers(*agent).size() > 0)
+				{
+					completed = true;
+					break;
+				}
+			}
+		}
+
+		Sleep(1);
+	}
+	ASSERT_TRUE(completed);
+
+	client1->ProcessLocalEvent(&ev, nullptr, nullptr, nullptr, 0, 0);
+
+	FlushEvents();
+
+	// Healing events are sent and forwarded as HealingEvent records
+	cbtevent heal = MakeHealingEvent(1000, 10, 11, 500);
+	client1->ProcessLocalEvent(&heal, nullptr, nullptr, nullptr, 0, 0);
+
+	FlushEvents();
+
+	Sleep(100); // TODO: get rid of this ugly sleep
+
+	std::vector<cbtevent> expectedEvents{ev, heal};
+	EXPECT_EQ(client2.ReceivedEvents, expectedEvents);
+}
+
+
+TEST_F(SimpleNetworkTestFixture, SetInterest)
+{
+	using namespace evtc_rpc::messages;
+
+	// Register two clients as each other's peers
+	ClientInstance& client1 = NewClient();
+	ClientInstance& client2 = NewClient();
+
+	ag ag1{};
+	ag ag2{};
+	ag1.elite = 0;
+	ag1.prof = static_cast<Prof>(1);
+	ag2.self = 1;
+	ag2.id = 10;
+	ag2.name = "testagent.1234";
+	client1->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+	ag2.self = 0;
+	ag2.id = 11;
+	ag2.name = "testagent2.1234";
+	client1->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	ag2.self = 1;
+	ag2.id = 11;
+	ag2.name = "testagent2.1234";
+	client2->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+	ag2.self = 0;
+	ag2.id = 10;
+	ag2.name = "testagent.1234";
+	client2->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	FlushEvents();
+
+	auto start = std::chrono::system_clock::now();
+	bool completed = false;
+	while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
+	{
+		{
+			auto agent = Server->FindRegisteredAgent("testagent2.1234");
+			if (agent != nullptr)
+			{
+				if (Server->GetPeers(*agent).size() > 0)
+				{
+					completed = true;
+					break;
+				}
+			}
+		}
+
+		Sleep(1);
+	}
+	ASSERT_TRUE(completed);
+
+	auto getServerCounter = [](prometheus::Counter* pCounter)
+	{
+		return static_cast<uint64_t>(pCounter->Value());
+	};
+	auto waitUntil = [](auto pCondition)
+	{
+		auto start = std::chrono::system_clock::now();
+		while (pCondition() == false && (std::chrono::system_clock::now() - start) < std::chrono::seconds(2))
+		{
+			Sleep(1);
+		}
+		return pCondition();
+	};
+
+	// Waits for the server to have read the SetInterest message, it's applied right after
+	prometheus::Counter* setInterestCounter = Server->mStatistics->MessageTypeReceive[static_cast<size_t>(Type::SetInterest)];
+	auto setInterest = [&](InterestedEvents pEvents, std::vector<uint16_t> pPeers = {})
+	{
+		uint64_t setInterestCount = getServerCounter(setInterestCounter);
+		client2->SetInterest(pEvents, std::move(pPeers));
+		FlushEvents();
+		ASSERT_TRUE(waitUntil([&]() { return getServerCounter(setInterestCounter) > setInterestCount; }));
+	};
+
+	// Waits until the server forwarded or filtered both events, and until client2 received the forwarded ones. Events
+	// from client1 reach client2 in the order they were sent, so whatever is received later also shows that nothing
+	// filtered here arrived in the meantime
+	auto getHandledCount = [&]()
+	{
+		return getServerCounter(Server->mStatistics->EventsForwarded) + getServerCounter(Server->mStatistics->EventsFiltered);
+	};
+	cbtevent damage = MakeHealingEvent(1000, 10, 11, -500);
+	cbtevent heal = MakeHealingEvent(1001, 10, 11, 500);
+	auto sendEvents = [&](size_t pExpectedReceivedCount)
+	{
+		uint64_t handledCount = getHandledCount();
+		client1->ProcessLocalEvent(&damage, nullptr, nullptr, nullptr, 0, 0);
+		client1->ProcessLocalEvent(&heal, nullptr, nullptr, nullptr, 0, 0);
+		FlushEvents();
+
+		ASSERT_TRUE(waitUntil([&]() { return getHandledCount() >= handledCount + 2; }));
+		ASSERT_TRUE(client2.WaitForReceivedEvents(pExpectedReceivedCount));
+	};
+
+	// Nothing is forwarded to a client that isn't interested in anything
+	uint64_t filteredCount = getServerCounter(Server->mStatistics->EventsFiltered);
+	setInterest(InterestedEvents::None);
+	sendEvents(0);
+	EXPECT_EQ(getServerCounter(Server->mStatistics->EventsFiltered), filteredCount + 2);
+
+	// Only the heal is forwarded to a client that is interested in important events. The heal is sent after the damage,
+	// so once it arrived the damage can't show up anymore
+	setInterest(InterestedEvents::Important);
+	sendEvents(1);
+	EXPECT_EQ(client2.ReceivedEvents, std::vector<cbtevent>{heal});
+
+	// Nothing is forwarded to a client that is only interested in other peers
+	filteredCount = getServerCounter(Server->mStatistics->EventsFiltered);
+	setInterest(InterestedEvents::All, {12});
+	sendEvents(1);
+	EXPECT_EQ(getServerCounter(Server->mStatistics->EventsFiltered), filteredCount + 2);
+
+	// Everything is forwarded again once the filter is removed. These arrive after anything sent before, so they are the
+	// sentinel for the steps above
+	setInterest(InterestedEvents::All);
+	sendEvents(3);
+	std::vector<cbtevent> expectedEvents{heal, damage, heal};
+	EXPECT_EQ(client2.ReceivedEvents, expectedEvents);
+}
+
+TEST_F(SimpleNetworkTestFixture, CombatEventLegacyPeer)
+{
+	using namespace evtc_rpc::messages;
+
+	// A client speaking version 1 of the protocol, like clients from before CombatEventBatch existed
+	auto writeLegacyMessage = [](grpc::ClientReaderWriter<evtc_rpc::Message, evtc_rpc::Message>& pStream, Type pType, const void* pMessage, size_t pMessageSize, std::string_view pName)
+		{
+			Header header;
+			header.MessageVersion = MESSAGE_VERSION_LEGACY;
+			header.MessageType = pType;
+
+			std::string blob;
+			blob.append(reinterpret_cast<const char*>(&header), sizeof(header));
+			blob.append(static_cast<const char*>(pMessage), pMessageSize);
+			blob.append(pName);
+
+			evtc_rpc::Message message;
+			message.set_blob(std::move(blob));
+			return pStream.Write(message);
+		};
+
+	grpc::SslCredentialsOptions options;
+	options.pem_root_certs = UNIT_TEST_CA;
+	std::unique_ptr<evtc_rpc::evtc_rpc::Stub> legacyStub = evtc_rpc::evtc_rpc::NewStub(grpc::CreateChannel("localhost:50051", grpc::SslCredentials(options)));
+	grpc::ClientContext legacyContext;
+	legacyContext.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(10));
+	std::unique_ptr<grpc::ClientReaderWriter<evtc_rpc::Message, evtc_rpc::Message>> legacyStream = legacyStub->Connect(&legacyContext);
+
+	RegisterSelf registerSelf;
+	registerSelf.SelfId = 11;
+	registerSelf.SelfAccountNameLength = static_cast<uint8_t>(strlen("legacyagent.1234"));
+	ASSERT_TRUE(writeLegacyMessage(*legacyStream, Type::RegisterSelf, &registerSelf, sizeof(registerSelf), "legacyagent.1234"));
+
+	AddPeer addPeer;
+	addPeer.PeerId = 10;
+	addPeer.PeerAccountNameLength = static_cast<uint8_t>(strlen("testagent.1234"));
+	ASSERT_TRUE(writeLegacyMessage(*legacyStream, Type::AddPeer, &addPeer, sizeof(addPeer), "testagent.1234"));
+
+	ClientInstance& client1 = NewClient();
+
+	ag ag1{};
+	ag ag2{};
+	ag1.elite = 0;
+	ag1.prof = static_cast<Prof>(1);
+	ag2.self = 1;
+	ag2.id = 10;
+	ag2.name = "testagent.1234";
+	client1->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	ag2.self = 0;
+	ag2.id = 11;
+	ag2.name = "legacyagent.1234";
+	client1->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	FlushEvents();
+
+	auto start = std::chrono::system_clock::now();
+	bool completed = false;
+	while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(1000) && completed == false)
+	{
+		{
+			auto agent1 = Server->FindRegisteredAgent("testagent.1234");
+			auto agent2 = Server->FindRegisteredAgent("legacyagent.1234");
+			completed = agent1 != nullptr && Server->GetPeers(*agent1).size() > 0 &&
+				agent2 != nullptr && Server->GetPeers(*agent2).size() > 0;
+		}
+
+		Sleep(1);
+	}
+	ASSERT_TRUE(completed);
+
+	// Events sent from the new client are sent as a batch but should be split up for the legacy client
+	std::vector<cbtevent> sentEvents(3);
+	for (cbtevent& ev : sentEvents)
+	{
+		FillRandomData(&ev, sizeof(ev));
+		client1->ProcessLocalEvent(&ev, nullptr, nullptr, nullptr, 0, 0);
+	}
+	FlushEvents();
+
+	std::vector<cbtevent> legacyReceivedEvents;
+	for (size_t i = 0; i < sentEvents.size(); i++)
+	{
+		evtc_rpc::Message message;
+		ASSERT_TRUE(legacyStream->Read(&message));
+		ASSERT_EQ(message.blob().size(), sizeof(Header) + sizeof(CombatEvent));
+
+		Header header;
+		memcpy(&header, message.blob().data(), sizeof(header));
+		EXPECT_EQ(header.MessageVersion, MESSAGE_VERSION_LEGACY);
+		EXPECT_EQ(header.MessageType, Type::CombatEvent);
+
+		CombatEvent event;
+		memcpy(&event, message.blob().data() + sizeof(header), sizeof(event));
+		EXPECT_EQ(event.SenderInstanceId, 10);
+		legacyReceivedEvents.push_back(event.Event);
+	}
+	EXPECT_EQ(legacyReceivedEvents, sentEvents);
+
+	// Healing events that the new client sends as HealingEvent records are rebuilt for the legacy client
+	cbtevent heal = MakeHealingEvent(1000, 10, 11, 500);
+	client1->ProcessLocalEvent(&heal, nullptr, nullptr, nullptr, 0, 0);
+	FlushEvents();
+	{
+		evtc_rpc::Message message;
+		ASSERT_TRUE(legacyStream->Read(&message));
+		ASSERT_EQ(message.blob().size(), sizeof(Header) + sizeof(CombatEvent));
+
+		CombatEvent event;
+		memcpy(&event, message.blob().data() + sizeof(Header), sizeof(event));
+		EXPECT_EQ(event.SenderInstanceId, 10);
+		EXPECT_EQ(event.Event, heal);
+	}
+
+	// Events sent from the legacy client should reach the new client
+	CombatEvent legacyEvent;
+	FillRandomData(&legacyEvent.Event, sizeof(legacyEvent.Event));
+	legacyEvent.SenderInstanceId = 0;
+	ASSERT_TRUE(writeLegacyMessage(*legacyStream, Type::CombatEvent, &legacyEvent, sizeof(legacyEvent), ""));
+
+	ASSERT_TRUE(client1.WaitForReceivedEvents(1));
+	std::vector<cbtevent> expectedEvents{legacyEvent.Event};
+	EXPECT_EQ(client1.ReceivedEvents, expectedEvents);
+
+	legacyContext.TryCancel();
+	legacyStream->Finish();
+}
+
+
+TEST_F(MultiQueueNetworkTestFixture, CombatEventAllToAll)
+{
+	constexpr size_t CLIENT_COUNT = 8;
+	constexpr size_t EVENTS_PER_CLIENT = 100;
+
+	ag ag1{};
+	ag1.elite = 0;
+	ag1.prof = static_cast<Prof>(1);
+
+	std::vector<std::string> names;
+	for (size_t i = 0; i < CLIENT_COUNT; i++)
+	{
+		names.emplace_back(std::string{"testagent"} + std::to_string(i) + ".1234");
+	}
+
+	// Every client registers itself and all other clients as peers. With 4 completion queues the connections end up
+	// spread over multiple server threads
+	std::vector<ClientInstance*> clients;
+	for (size_t i = 0; i < CLIENT_COUNT; i++)
+	{
+		ClientInstance& client = NewClient();
+		clients.push_back(&client);
+
+		ag ag2{};
+		ag2.self = 1;
+		ag2.id = 10 + i;
+		ag2.name = names[i].c_str();
+		client->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+		for (size_t j = 0; j < CLIENT_COUNT; j++)
+		{
+			if (j == i)
+			{
+				continue;
+			}
+
+			// Peers are tracked by the id of the source agent, so it has to be unique per peer
+			ag1.id = 1000 + j;
+			ag2.self = 0;
+			ag2.id = 10 + j;
+			ag2.name = names[j].c_str();
+			client->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+		}
+	}
+
+	FlushEvents();
+
+	auto start = std::chrono::system_clock::now();
+	bool completed = false;
+	while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(1000) && completed == false)
+	{
+		{
+			completed = true;
+			for (const std::string& name : names)
+			{
+				auto agent = Server->FindRegisteredAgent(name);
+				if (agent == nullptr || Server->GetPeers(*agent).size() != CLIENT_COUNT - 1)
+				{
+					completed = false;
+					break;
+				}
+			}
+		}
+
+		Sleep(1);
+	}
+	ASSERT_TRUE(completed);
+
+	for (ClientInstance* client : clients)
+	{
+		for (size_t i = 0; i < EVENTS_PER_CLIENT; i++)
+		{
+			cbtevent ev;
+			FillRandomData(&ev, sizeof(ev));
+			(*client)->ProcessLocalEvent(&ev, nullptr, nullptr, nullptr, 0, 0);
+		}
+	}
+
+	FlushEvents();
+
+	for (ClientInstance* client : clients)
+	{
+		EXPECT_TRUE(client->WaitForReceivedEvents((CLIENT_COUNT - 1) * EVENTS_PER_CLIENT, std::chrono::seconds{5}));
+		EXPECT_EQ(client->ReceivedEvents.size(), (CLIENT_COUNT - 1) * EVENTS_PER_CLIENT);
+	}
+}
+
+
+TEST_P(DisableClientTestFixture, DisableClient)
+{
+	ClientInstance& client1 = NewClient();
+
+	if (GetParam() == true)
+	{
+		LogD("RegisterBeforeDisabling is true, sending events");
+	}
+	else
+	{
+		client1->SetEnabledStatus(false);
+	}
+
+	// Send a self agent registration event followed by a non-self agent registration event followed by a combat event
+	ag ag1{};
+	ag ag2{};
+	ag1.elite = 0;
+	ag1.prof = static_cast<Prof>(1);
+	ag2.self = 1;
+	ag2.id = 10;
+	ag2.name = "testagent.1234";
+	client1->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	ag2.self = 0;
+	ag2.id = 11;
+	ag2.name = "testagent2.1234";
+	client1->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+
+	cbtevent ev;
+	FillRandomData(&ev, sizeof(ev));
+	client1->ProcessLocalEvent(&ev, nullptr, nullptr, nullptr, 0, 0);
+
+	if (GetParam() == true)
+	{
+		FlushEvents();
+
+		std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
+		bool completed = false;
+		while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
+		{
+			{
+				auto agent = Server->FindRegisteredAgent("testagent.1234");
+				if (agent != nullptr)
+				{
+					if (Server->GetPeers(*agent).size() > 0)
+					{
+						completed = true;
+						break;
+					}
+				}
+			}
+
+			Sleep(1);
+		}
+		ASSERT_TRUE(completed);
+
+		LogD("Waiting for client to be registered took {}ms", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - start).count());
+
+		client1->SetEnabledStatus(false);
+	}
+
+	Sleep(200);
+
+	{
+		EXPECT_EQ(Server->GetRegisteredAgentCount(), 0);
+	}
+
+	// Not thread safe, but shouldn't be an issue because nothing else should be writing when the client is disabled
+	client1->mNextConnectionAttempt = std::chrono::steady_clock::time_point{};
+	// Now enable the client - the peer should be registered again
+	client1->SetEnabledStatus(true);
+
+	std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
+	bool completed = false;
+	while ((std::chrono::system_clock::now() - start) < std::chrono::milliseconds(100))
+	{
+		{
+			auto agent = Server->FindRegisteredAgent("testagent.1234");
+			if (agent != nullptr)
+			{
+				if (Server->GetPeers(*agent).size() > 0)
+				{
+					completed = true;
+					break;
+				}
+			}
+		}
+
+		Sleep(1);
+	}
+
+	EXPECT_TRUE(completed);
+	{
+		EXPECT_EQ(Server->GetRegisteredAgentCount(), 1U);
+		auto agent = Server->FindRegisteredAgent("testagent.1234");
+		ASSERT_NE(agent, nullptr);
+		EXPECT_EQ(Server->mAccountNames.GetName(agent->Account), "testagent.1234");
+		EXPECT_EQ(Server->FindRegisteredAgent(agent->Account.load()), agent);
+		EXPECT_EQ(agent->InstanceId.load(), 10);
+
+		auto expected_map = std::map<std::string, uint16_t>({ {"testagent2.1234", static_cast<uint16_t>(11)} });
+		EXPECT_EQ(Server->GetPeers(*agent), expected_map);
+	}
+}
+
+INSTANTIATE_TEST_SUITE_P(
+	Normal,
+	DisableClientTestFixture,
 	::testing::Values(false, true));
 
 TEST_P(NetworkXevtcTestFixture, druid_MO)
@@ -1269,3 +2390,396 @@ INSTANTIATE_TEST_SUITE_P(
 	Normal,
 	NetworkXevtcTestFixture,
 	::testing::Values(false, true));
+
+TEST(AccountNames, InternAndRelease)
+{
+	AccountNames names;
+
+	AccountId id1 = names.Intern("testagent.1234");
+	AccountId id2 = names.Intern("testagent2.1234");
+	EXPECT_NE(id1, INVALID_ACCOUNT_ID);
+	EXPECT_NE(id2, INVALID_ACCOUNT_ID);
+	EXPECT_NE(id1, id2);
+	EXPECT_EQ(names.Intern("testagent.1234"), id1);
+	EXPECT_EQ(names.Find("testagent.1234"), id1);
+	EXPECT_EQ(names.Find("unknown.1234"), INVALID_ACCOUNT_ID);
+	EXPECT_EQ(names.GetName(id1), "testagent.1234");
+	EXPECT_EQ(names.GetName(id2), "testagent2.1234");
+	EXPECT_EQ(names.GetCount(), 2U);
+
+	// id1 has two references, the name should stay until both are released
+	names.Release(id1);
+	EXPECT_EQ(names.Find("testagent.1234"), id1);
+	names.Release(id1);
+	EXPECT_EQ(names.Find("testagent.1234"), INVALID_ACCOUNT_ID);
+	EXPECT_EQ(names.GetName(id1), "");
+
+	names.Release(id2);
+	EXPECT_EQ(names.GetName(id2), "");
+	EXPECT_EQ(names.GetCount(), 0U);
+}
+
+TEST(AccountNames, ManyNames)
+{
+	AccountNames names;
+
+	std::vector<AccountId> ids;
+	for (size_t i = 0; i < 1000; i++)
+	{
+		ids.push_back(names.Intern(fmt::format("testagent{}.1234", i)));
+	}
+
+	std::vector<AccountId> sortedIds = ids;
+	std::sort(sortedIds.begin(), sortedIds.end());
+	EXPECT_EQ(std::unique(sortedIds.begin(), sortedIds.end()), sortedIds.end());
+
+	for (size_t i = 0; i < ids.size(); i++)
+	{
+		EXPECT_EQ(names.GetName(ids[i]), fmt::format("testagent{}.1234", i));
+		names.Release(ids[i]);
+	}
+	EXPECT_EQ(names.GetCount(), 0U);
+}
+
+TEST(RingQueue, Fifo)
+{
+	RingQueue<int> queue;
+	EXPECT_EQ(queue.Size(), 0);
+
+	// Interleave pushes and pops so that the ring wraps around while growing
+	int next = 0;
+	int expected = 0;
+	for (size_t round = 0; round < 100; round++)
+	{
+		for (size_t i = 0; i < 7; i++)
+		{
+			queue.PushBack(next++);
+		}
+		for (size_t i = 0; i < 5; i++)
+		{
+			ASSERT_EQ(queue.Front(), expected++);
+			queue.PopFront();
+		}
+	}
+	EXPECT_EQ(queue.Size(), 200);
+
+	while (queue.Size() > 0)
+	{
+		ASSERT_EQ(queue.Front(), expected++);
+		queue.PopFront();
+	}
+	EXPECT_EQ(expected, next);
+}
+
+TEST(RingQueue, RemoveIf)
+{
+	RingQueue<std::string> queue;
+	for (size_t i = 0; i < 10; i++)
+	{
+		queue.PushBack(std::to_string(i));
+	}
+	queue.PopFront();
+	queue.PopFront();
+
+	std::vector<std::string> visited;
+	size_t removed = queue.RemoveIf([&visited](const std::string& pEntry)
+		{
+			visited.push_back(pEntry);
+			return (std::stoi(pEntry) % 3) == 0;
+		});
+	EXPECT_EQ(removed, 3);
+	EXPECT_EQ(visited, std::vector<std::string>({"2", "3", "4", "5", "6", "7", "8", "9"}));
+
+	std::vector<std::string> remaining;
+	while (queue.Size() > 0)
+	{
+		remaining.push_back(queue.Front());
+		queue.PopFront();
+	}
+	EXPECT_EQ(remaining, std::vector<std::string>({"2", "4", "5", "7", "8"}));
+}
+
+TEST(MpscRing, FullAndEmpty)
+{
+	MpscRing<uint64_t, 8> ring;
+	uint64_t value = 0;
+	EXPECT_FALSE(ring.TryPop(value));
+
+	// Go around the ring a few times, filling it completely every time
+	uint64_t next = 0;
+	uint64_t expected = 0;
+	for (size_t round = 0; round < 5; round++)
+	{
+		for (size_t i = 0; i < ring.GetCapacity(); i++)
+		{
+			ASSERT_TRUE(ring.TryPush(next++));
+		}
+		EXPECT_FALSE(ring.TryPush(next));
+		EXPECT_EQ(ring.Size(), ring.GetCapacity());
+
+		for (size_t i = 0; i < 5; i++)
+		{
+			ASSERT_TRUE(ring.TryPop(value));
+			ASSERT_EQ(value, expected++);
+		}
+		while (ring.TryPop(value) == true)
+		{
+			ASSERT_EQ(value, expected++);
+		}
+		EXPECT_EQ(ring.Size(), 0);
+	}
+	EXPECT_EQ(expected, next);
+}
+
+TEST(MpscRing, MultipleProducers)
+{
+	constexpr static uint64_t PRODUCER_COUNT = 4;
+	constexpr static uint64_t EVENT_COUNT = 100'000;
+
+	MpscRing<uint64_t, 1024> ring;
+	std::vector<std::thread> producers;
+	for (uint64_t i = 0; i < PRODUCER_COUNT; i++)
+	{
+		producers.emplace_back([&ring, i]()
+			{
+				for (uint64_t j = 0; j < EVENT_COUNT; j++)
+				{
+					while (ring.TryPush((i << 32) | j) == false)
+					{
+						std::this_thread::yield();
+					}
+				}
+			});
+	}
+
+	// Every producer's values have to arrive complete and in order
+	std::array<uint64_t, PRODUCER_COUNT> nextValue = {};
+	uint64_t received = 0;
+	while (received < PRODUCER_COUNT * EVENT_COUNT)
+	{
+		uint64_t value;
+		if (ring.TryPop(value) == false)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		uint64_t producer = value >> 32;
+		ASSERT_LT(producer, PRODUCER_COUNT);
+		ASSERT_EQ(value & 0xFFFFFFFF, nextValue[producer]);
+		nextValue[producer]++;
+		received++;
+	}
+
+	for (std::thread& producer : producers)
+	{
+		producer.join();
+	}
+	EXPECT_EQ(ring.Size(), 0);
+}
+
+TEST(LatencyHistogram, Buckets)
+{
+	using namespace std::chrono_literals;
+
+	LatencyHistogram histogram;
+	histogram.Observe(0ns); // <= 1us
+	histogram.Observe(1us); // <= 1us
+	histogram.Observe(1001ns); // <= 2us
+	histogram.Observe(3us); // <= 4us
+	histogram.Observe(4us); // <= 4us
+	histogram.Observe(1h); // +Inf
+
+	prometheus::ClientMetric metric;
+	histogram.Collect(metric);
+
+	ASSERT_EQ(metric.histogram.bucket.size(), LatencyHistogram::BUCKET_COUNT + 1);
+	EXPECT_EQ(metric.histogram.sample_count, 6);
+	EXPECT_DOUBLE_EQ(metric.histogram.bucket[0].upper_bound, 1e-6);
+	EXPECT_EQ(metric.histogram.bucket[0].cumulative_count, 2);
+	EXPECT_DOUBLE_EQ(metric.histogram.bucket[1].upper_bound, 2e-6);
+	EXPECT_EQ(metric.histogram.bucket[1].cumulative_count, 3);
+	EXPECT_EQ(metric.histogram.bucket[2].cumulative_count, 5);
+	EXPECT_EQ(metric.histogram.bucket[LatencyHistogram::BUCKET_COUNT - 1].cumulative_count, 5);
+	EXPECT_EQ(metric.histogram.bucket[LatencyHistogram::BUCKET_COUNT].cumulative_count, 6);
+	EXPECT_TRUE(std::isinf(metric.histogram.bucket[LatencyHistogram::BUCKET_COUNT].upper_bound));
+	EXPECT_NEAR(metric.histogram.sample_sum, 3600.0 + 9.001e-6, 1e-9);
+}
+
+TEST(TopTalkers, HeavyHittersAreTracked)
+{
+	TopTalkers topTalkers;
+
+	// Many light accounts interleaved with a few heavy ones. Every heavy account carries more than total / CAPACITY, so
+	// all of them have to be tracked no matter how often the light ones evict each other
+	for (uint32_t i = 0; i < 1000; i++)
+	{
+		topTalkers.Add("light." + std::to_string(i), 1);
+		if (i % 10 == 0)
+		{
+			topTalkers.Add("heavy.1", 100);
+			topTalkers.Add("heavy.2", 50);
+			topTalkers.Add("heavy.3", 25);
+		}
+	}
+
+	std::vector<TopTalkers::Entry> top = topTalkers.GetTop();
+	ASSERT_EQ(top.size(), TopTalkers::CAPACITY);
+	EXPECT_EQ(top[0].Name, "heavy.1");
+	EXPECT_EQ(top[1].Name, "heavy.2");
+	EXPECT_EQ(top[2].Name, "heavy.3");
+	EXPECT_EQ(top[0].Count, 10000);
+	EXPECT_EQ(top[0].Error, 0);
+	for (size_t i = 1; i < top.size(); i++)
+	{
+		EXPECT_GE(top[i - 1].Count, top[i].Count);
+	}
+}
+
+TEST(EventCodec, RoundTrip)
+{
+	std::mt19937_64 random{1234};
+	std::vector<cbtevent> events(2000);
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		cbtevent& event = events[i];
+		memset(&event, 0, sizeof(event));
+
+		// Mostly realistic events (increasing time, a handful of agents and skills), with every few events using
+		// values that don't fit any of the shortcuts
+		bool extreme = (i % 7) == 0;
+		event.time = extreme == true ? random() : 1000 + i * 3;
+		event.src_agent = extreme == true ? UINT64_MAX - (random() % 4) : 2000 + random() % 5;
+		event.dst_agent = (i % 3) == 0 ? 0 : 2000 + random() % 5;
+		event.value = extreme == true ? INT32_MIN + static_cast<int32_t>(i) : static_cast<int32_t>(random() % 2000) - 1000;
+		event.buff_dmg = (i % 5) == 0 ? INT32_MAX : 0;
+		event.overstack_value = extreme == true ? UINT32_MAX : 0;
+		event.skillid = extreme == true ? static_cast<uint32_t>(random()) : 1000 + static_cast<uint32_t>(random() % 10);
+		event.src_instid = static_cast<uint16_t>(1 + random() % 10);
+		event.dst_instid = extreme == true ? UINT16_MAX : static_cast<uint16_t>(1 + random() % 10);
+		event.src_master_instid = (i % 11) == 0 ? 5 : 0;
+		event.is_statechange = (i % 13) == 0 ? 36 : 0;
+		event.buff = (i % 2) == 0 ? 1 : 0;
+		event.pad64 = extreme == true ? 0xFF : 0;
+	}
+
+	std::vector<uint8_t> buffer(events.size() * EventEncoder::MAX_ENCODED_EVENT_SIZE);
+	EventEncoder encoder{buffer.data()};
+	for (const cbtevent& event : events)
+	{
+		encoder.Encode(event);
+	}
+	EXPECT_LT(encoder.GetSize(), events.size() * sizeof(cbtevent) / 2);
+
+	EventDecoder decoder{buffer.data(), encoder.GetSize()};
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		cbtevent event;
+		ASSERT_TRUE(decoder.Decode(event));
+		ASSERT_EQ(memcmp(&event, &events[i], sizeof(event)), 0) << i;
+	}
+	EXPECT_TRUE(decoder.IsAtEnd());
+
+	// Decoding any truncated prefix has to fail cleanly
+	for (size_t size = 0; size < 200; size++)
+	{
+		EventDecoder truncated{buffer.data(), size};
+		bool decodedAll = true;
+		for (size_t i = 0; i < events.size() && decodedAll == true; i++)
+		{
+			cbtevent event;
+			decodedAll = truncated.Decode(event);
+		}
+		EXPECT_FALSE(decodedAll) << size;
+	}
+}
+
+TEST(EventCodec, HealingEvent)
+{
+	using evtc_rpc::messages::HealingEvent;
+
+	std::vector<cbtevent> events;
+	events.push_back(MakeHealingEvent(1000, 10, 11, 500));
+
+	cbtevent buffHeal = MakeHealingEvent(UINT32_MAX, 10, 12, 0);
+	buffHeal.buff = 1;
+	buffHeal.buff_dmg = 250;
+	buffHeal.result = 0;
+	buffHeal.is_offcycle = 1;
+	buffHeal.src_master_instid = 10;
+	buffHeal.dst_master_instid = 13;
+	events.push_back(buffHeal);
+
+	cbtevent barrier = MakeHealingEvent(1001, 10, 11, 100);
+	barrier.is_shields = 1;
+	barrier.iff = IFF_FRIEND;
+	events.push_back(barrier);
+
+	cbtevent stateHeal = MakeHealingEvent(1002, 10, 11, 300);
+	stateHeal.is_ninety = 1;
+	stateHeal.is_fifty = 1;
+	stateHeal.is_flanking = 1;
+	stateHeal.is_moving = 3;
+	events.push_back(stateHeal);
+
+	cbtevent enterCombat{};
+	enterCombat.time = 999;
+	enterCombat.src_instid = 10;
+	enterCombat.dst_agent = 3; // Subgroup
+	enterCombat.is_statechange = CBTS_ENTERCOMBAT;
+	events.push_back(enterCombat);
+
+	cbtevent exitCombat{};
+	exitCombat.time = 2000;
+	exitCombat.src_instid = 10;
+	exitCombat.is_statechange = CBTS_EXITCOMBAT;
+	uint64_t lastDamageEventTime = 1500;
+	memcpy(&exitCombat.iff, &lastDamageEventTime, sizeof(lastDamageEventTime));
+	events.push_back(exitCombat);
+
+	for (const cbtevent& event : events)
+	{
+		HealingEvent record;
+		ASSERT_TRUE(ToHealingEvent(event, record));
+
+		cbtevent rebuilt;
+		FromHealingEvent(record, rebuilt);
+		EXPECT_EQ(rebuilt, event);
+	}
+
+	// Events that peers need more of, or that don't fit
+	std::vector<cbtevent> rejectedEvents;
+	rejectedEvents.push_back(MakeHealingEvent(1000, 10, 11, -500)); // Damage
+
+	cbtevent activation = MakeHealingEvent(1000, 10, 11, 500);
+	activation.is_activation = 1;
+	rejectedEvents.push_back(activation);
+
+	// Peers log healing events as they are, so fields that the record doesn't carry have to be zero
+	for (auto field : {&cbtevent::is_buffremove, &cbtevent::pad61, &cbtevent::pad62, &cbtevent::pad63, &cbtevent::pad64})
+	{
+		cbtevent event = MakeHealingEvent(1000, 10, 11, 500);
+		event.*field = 1;
+		rejectedEvents.push_back(event);
+	}
+
+	cbtevent overstack = MakeHealingEvent(1000, 10, 11, 500);
+	overstack.overstack_value = 100;
+	rejectedEvents.push_back(overstack);
+
+	cbtevent moving = MakeHealingEvent(1000, 10, 11, 500);
+	moving.is_moving = 4;
+	rejectedEvents.push_back(moving);
+
+	rejectedEvents.push_back(MakeHealingEvent(static_cast<uint64_t>(UINT32_MAX) + 1, 10, 11, 500));
+
+	cbtevent lateExitCombat = exitCombat;
+	lateExitCombat.time = UINT64_MAX; // See NetworkXevtcTestFixture
+	rejectedEvents.push_back(lateExitCombat);
+
+	for (const cbtevent& event : rejectedEvents)
+	{
+		HealingEvent record;
+		EXPECT_FALSE(ToHealingEvent(event, record));
+	}
+}
@@ -6,12 +6,16 @@
 #include <gtest/gtest.h>
 #pragma warning(pop)
 
+#include "EventSequencer.h"
 #include "Exports.h"
 #include "Log.h"
+#include "../networking/Server.h"
 
 #include "spdlog/stopwatch.h"
 
+#include <algorithm>
 #include <numeric>
+#include <ArcdpsMock/arcdps_mock/CombatMock.h>
 
 TEST(Stress, DISABLED_Stress)
 {
@@ -203,4 +207,261 @@ TEST(Stress, DISABLED_Stress)
 			}
 		}
 	}
+}
+
+// Measures the cost of routing a single combat event on the server as a function of squad size. The connections are
+// never actually connected, so every event ends up in the peers' write queues instead of being written
+TEST(Stress, DISABLED_RoutingCost)
+{
+	constexpr static std::array<size_t, 4> SQUAD_SIZES = {5, 10, 20, 50};
+	constexpr static uint64_t EVENT_COUNT = 10'000;
+
+	auto server = std::make_unique<evtc_rpc_server>("localhost:50061", "localhost:50062", nullptr);
+	std::thread serverThread{evtc_rpc_server::ThreadStartServe, server.get()};
+	using ConnectionContext = decltype(server->FindRegisteredAgent(AccountId{}))::element_type;
+
+	// Trace logging in the routing path would dominate the measurement
+	Log_::SetLevel(spdlog::level::warn);
+
+	std::vector<std::shared_ptr<ConnectionContext>> allClients;
+	for (size_t squadSize : SQUAD_SIZES)
+	{
+		std::vector<std::string> names;
+		std::vector<std::shared_ptr<ConnectionContext>> clients;
+		for (size_t i = 0; i < squadSize; i++)
+		{
+			names.emplace_back(std::string{"routing"} + std::to_string(squadSize) + "agent" + std::to_string(i) + ".1234");
+
+			std::shared_ptr<ConnectionContext>& client = clients.emplace_back(std::make_shared<ConnectionContext>());
+			client->MessageVersion = evtc_rpc::messages::MESSAGE_VERSION_BATCH;
+			client->WritePending = true;
+			ASSERT_EQ(server->HandleRegisterSelf(static_cast<uint16_t>(i + 1), names[i], client), nullptr);
+		}
+
+		for (size_t i = 0; i < squadSize; i++)
+		{
+			for (size_t j = 0; j < squadSize; j++)
+			{
+				if (j != i)
+				{
+					ASSERT_EQ(server->HandleAddPeer(static_cast<uint16_t>(j + 1), names[j], clients[i]), nullptr);
+				}
+			}
+		}
+
+		evtc_rpc::messages::CombatEvent event{};
+		spdlog::stopwatch timer;
+		for (uint64_t i = 0; i < EVENT_COUNT; i++)
+		{
+			ASSERT_EQ(server->HandleCombatEvents(reinterpret_cast<const char*>(&event), 1, clients[i % squadSize], std::chrono::steady_clock::now()), nullptr);
+		}
+		double elapsed = timer.elapsed().count();
+
+		for (const auto& client : clients)
+		{
+			std::lock_guard lock(client->WriteLock);
+			EXPECT_EQ(client->QueuedEventCount, EVENT_COUNT * (squadSize - 1) / squadSize);
+			client->QueuedEvents.Clear();
+			client->QueuedEventCount = 0;
+		}
+
+		printf("squad size %zu: %.1f ns per event (%.1f ns per routed copy)\n",
+			squadSize, elapsed * 1e9 / EVENT_COUNT, elapsed * 1e9 / (EVENT_COUNT * (squadSize - 1)));
+
+		allClients.insert(allClients.end(), clients.begin(), clients.end());
+	}
+
+	Log_::SetLevel(spdlog::level::trace);
+
+	// Once the server is shut down force disconnecting doesn't try to finish the (never started) streams
+	server->Shutdown();
+	serverThread.join();
+	for (const auto& client : allClients)
+	{
+		server->ForceDisconnect("benchmark done", client);
+	}
+	EXPECT_EQ(server->GetRegisteredAgentCount(), 0);
+	EXPECT_EQ(server->mAccountNames.GetCount(), 0);
+}
+
+// Measures the latency from queueing a combat event on one client until it is delivered to a peer, through a local
+// server. Events are sent one at a time with a pause in between so that the measurement is of an idle client loop
+// rather than of throughput
+TEST(Stress, DISABLED_EventLatency)
+{
+	constexpr static size_t EVENT_COUNT = 2'000;
+
+	auto server = std::make_unique<evtc_rpc_server>("localhost:50063", "localhost:50064", nullptr);
+	std::thread serverThread{evtc_rpc_server::ThreadStartServe, server.get()};
+
+	Log_::SetLevel(spdlog::level::warn);
+
+	std::mutex latenciesLock;
+	std::vector<int64_t> latencies;
+	latencies.reserve(EVENT_COUNT);
+
+	auto getEndpoint = []() -> std::string
+	{
+		return std::string{"localhost:50063"};
+	};
+	auto getCertificates = []() -> std::string
+	{
+		return std::string{};
+	};
+	auto receiveHandler = [&latenciesLock, &latencies](cbtevent* pEvent, uint16_t /*pInstanceId*/)
+	{
+		int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+		int64_t sent;
+		memcpy(&sent, pEvent, sizeof(sent));
+
+		std::lock_guard lock(latenciesLock);
+		latencies.push_back(now - sent);
+	};
+
+	evtc_rpc_client sender{std::function{getEndpoint}, std::function{getCertificates}, [](cbtevent*, uint16_t) {}};
+	evtc_rpc_client receiver{std::function{getEndpoint}, std::function{getCertificates}, std::move(receiveHandler)};
+	std::array<evtc_rpc_client*, 2> clients = {&sender, &receiver};
+	std::array<std::thread, 2> clientThreads;
+	for (size_t i = 0; i < clients.size(); i++)
+	{
+		clients[i]->SetDisableEncryption(true);
+		clientThreads[i] = std::thread{evtc_rpc_client::ThreadStartServe, clients[i]};
+
+		for (size_t j = 0; j < clients.size(); j++)
+		{
+			char nameBuffer[128];
+			snprintf(nameBuffer, sizeof(nameBuffer), "latencyagent%zu.1234", j);
+
+			ag ag1{};
+			ag ag2{};
+			ag1.prof = static_cast<Prof>(1);
+			ag1.id = 1000ULL + j;
+			ag2.id = 100ULL + j;
+			ag2.name = nameBuffer;
+			ag2.self = (i == j) ? 1 : 0;
+
+			if (i == j)
+			{
+				clients[i]->ProcessLocalEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+			}
+			else
+			{
+				clients[i]->ProcessAreaEvent(nullptr, &ag1, &ag2, nullptr, 0, 0);
+			}
+		}
+	}
+
+	// Wait for both clients to be registered with each other
+	while (server->FindRegisteredAgent("latencyagent0.1234") == nullptr || server->FindRegisteredAgent("latencyagent1.1234") == nullptr)
+	{
+		Sleep(1);
+	}
+	Sleep(100);
+
+	cbtevent event{};
+	for (size_t i = 0; i < EVENT_COUNT; i++)
+	{
+		int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+		memcpy(&event, &now, sizeof(now));
+		sender.ProcessLocalEvent(&event, nullptr, nullptr, nullptr, 0, 0);
+
+		Sleep(1);
+	}
+	sender.FlushEvents(0);
+	Sleep(100);
+
+	{
+		std::lock_guard lock(latenciesLock);
+		ASSERT_EQ(latencies.size(), EVENT_COUNT);
+
+		std::sort(latencies.begin(), latencies.end());
+		auto percentile = [&latencies](size_t pPercentile)
+		{
+			std::chrono::steady_clock::duration latency{latencies[(latencies.size() - 1) * pPercentile / 100]};
+			return std::chrono::duration<double, std::micro>(latency).count();
+		};
+		printf("enqueue to delivery latency: p50 %.1f us, p99 %.1f us, max %.1f us\n", percentile(50), percentile(99), percentile(100));
+	}
+
+	for (size_t i = 0; i < clients.size(); i++)
+	{
+		clients[i]->Shutdown();
+		clientThreads[i].join();
+	}
+
+	Log_::SetLevel(spdlog::level::trace);
+
+	server->Shutdown();
+	serverThread.join();
+}
+
+namespace
+{
+EventSequencer* BENCHMARK_SEQUENCER = nullptr;
+std::atomic_uint64_t BENCHMARK_LAST_ID = 0;
+std::atomic_uint64_t BENCHMARK_DELIVERED = 0;
+std::atomic_uint64_t BENCHMARK_OUT_OF_ORDER = 0;
+
+void BenchmarkAreaCombat(cbtevent* /*pEvent*/, ag* /*pSourceAgent*/, ag* /*pDestinationAgent*/, const char* /*pSkillname*/, uint64_t /*pId*/, uint64_t /*pRevision*/)
+{
+}
+
+void BenchmarkLocalCombat(cbtevent* pEvent, ag* pSourceAgent, ag* pDestinationAgent, const char* pSkillname, uint64_t pId, uint64_t pRevision)
+{
+	BENCHMARK_SEQUENCER->ProcessEvent(pEvent, pSourceAgent, pDestinationAgent, pSkillname, pId, pRevision);
+}
+
+void BenchmarkSequencedEvent(cbtevent* /*pEvent*/, ag* /*pSourceAgent*/, ag* /*pDestinationAgent*/, const char* /*pSkillname*/, uint64_t pId, uint64_t /*pRevision*/)
+{
+	BENCHMARK_DELIVERED.fetch_add(1, std::memory_order_relaxed);
+	if (pId != 0 && BENCHMARK_LAST_ID.exchange(pId, std::memory_order_relaxed) > pId)
+	{
+		BENCHMARK_OUT_OF_ORDER.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+} // anonymous namespace
+
+// Measures the cost of sequencing local combat events replayed from a log, with increasingly many callbacks in flight
+// at once and increasingly shuffled ids. Only the sequencer is measured, the callback just counts events and checks
+// their order
+TEST(Stress, DISABLED_EventSequencer)
+{
+	constexpr static std::array<std::pair<uint32_t, uint32_t>, 4> PARAMETERS = {{{0, 0}, {16, 64}, {128, 64}, {128, 256}}};
+	constexpr static size_t REPEAT_COUNT = 20;
+
+	Log_::SetLevel(spdlog::level::warn);
+
+	arcdps_exports exports{};
+	exports.combat = BenchmarkAreaCombat;
+	exports.combat_local = BenchmarkLocalCombat;
+
+	for (const auto& [parallelCallbacks, fuzzWidth] : PARAMETERS)
+	{
+		BENCHMARK_DELIVERED = 0;
+		BENCHMARK_OUT_OF_ORDER = 0;
+
+		double elapsed = 0;
+		for (size_t i = 0; i < REPEAT_COUNT; i++)
+		{
+			// Every replay starts its ids over, so every replay needs a fresh sequencer
+			EventSequencer sequencer{BenchmarkSequencedEvent};
+			BENCHMARK_SEQUENCER = &sequencer;
+			BENCHMARK_LAST_ID = 0;
+
+			CombatMock mock{&exports};
+			spdlog::stopwatch timer;
+			uint32_t result = mock.ExecuteFromXevtc("xevtc_logs\\druid_MO.xevtc", parallelCallbacks, fuzzWidth);
+			elapsed += timer.elapsed().count();
+
+			ASSERT_EQ(result, 0U);
+			ASSERT_TRUE(sequencer.QueueIsEmpty());
+		}
+
+		uint64_t delivered = BENCHMARK_DELIVERED.load();
+		printf("parallel callbacks %u, fuzz width %u: %.1f ns per event, %llu of %llu events out of order\n",
+			parallelCallbacks, fuzzWidth, elapsed * 1e9 / delivered, BENCHMARK_OUT_OF_ORDER.load(), delivered);
+	}
+
+	BENCHMARK_SEQUENCER = nullptr;
+	Log_::SetLevel(spdlog::level::trace);
 }
\ No newline at end of file
@@ -67,7 +67,9 @@ rule("protobuf")
 		--batchcmds:show("depcache "..depcache.." mtime "..lowest_mtime)
 	end)
 
-target("evtc_rpc_server")
+-- Settings shared by all targets that are built from the networking code. Has to be called from inside a target scope.
+-- Sets compilerflags, which has to be passed to the target specific add_files calls
+function add_evtc_rpc_settings()
 	add_rules("protobuf")
 
 	set_kind("binary")
@@ -248,7 +250,6 @@ target("evtc_rpc_server")
 		{name = "others", group = false, static = true})
 
 	add_files("src/Log.cpp", {cxxflags = compilerflags})
-	add_files("evtc_rpc_server/**.cpp", {cxxflags = compilerflags})
 	add_files("networking/**.cpp", {cxxflags = compilerflags})
 	add_files("networking/**.proto")
 
@@ -264,3 +265,13 @@ target("evtc_rpc_server")
 	add_cxxflags("-Wno-format") -- unsigned long long vs unsigned long issues (linux is stupid...)
 	add_cxxflags("-Wno-gnu-zero-variadic-macro-arguments", "-Wno-format-pedantic")
 	add_ldflags("-fuse-ld=lld")
+end
+
+target("evtc_rpc_server")
+	add_evtc_rpc_settings()
+	add_files("evtc_rpc_server/**.cpp", {cxxflags = compilerflags})
+
+-- In-process load generator and latency benchmark for evtc_rpc_server, see evtc_rpc_bench/main.cpp
+target("evtc_rpc_bench")
+	add_evtc_rpc_settings()
+	add_files("evtc_rpc_bench/**.cpp", {cxxflags = compilerflags})